@@ -0,0 +1,236 @@
+/*
+ * Several ADC capture devices served by one thread (adccap.h)
+ *
+ * Each device has two consumers of the same zero-copy periods : a callback
+ * measuring the wake-up latency (capture of the last frame -> consumer) and,
+ * with C++20, a coroutine computing the level of each channel (a callback
+ * otherwise). Every -s seconds one JSON line per device goes to stdout :
+ *
+ *   {"device":"hw:mcp3002","position":80000,"periods":1000,"xruns":0,"lost":0,
+ *    "latency_ms":{"mean":0.41,"max":1.20},"channels":[{"min":..,"max":..,"mean":..},..]}
+ *
+ * The report and duration timers are timerfds watched by the same loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "adccap.h"
+
+#define MAX_DEVICES 8
+#define MAX_CHANNELS 8
+
+static AdcLoop *loop = NULL;
+
+static void sighandler(int sig)
+{
+	if (loop)
+		loop->stop();
+}
+
+// =======================================================================
+// statistics of a device over a report interval
+// =======================================================================
+struct Stats
+{
+	uint64_t frames;
+	uint64_t lost;
+	int min[MAX_CHANNELS];
+	int max[MAX_CHANNELS];
+	int64_t sum[MAX_CHANNELS];
+	uint64_t wakeups;
+	double latency_sum;
+	double latency_max;
+
+	Stats() { reset(); }
+
+	void reset()
+	{
+		frames = lost = wakeups = 0;
+		latency_sum = latency_max = 0;
+		for (int c = 0; c < MAX_CHANNELS; c++)
+		{
+			min[c] = 1 << 30;
+			max[c] = -(1 << 30);
+			sum[c] = 0;
+		}
+	}
+
+	// straight from the mmap ring
+	void level(const AdcPeriod & p)
+	{
+		for (snd_pcm_uframes_t f = 0; f < p.frames; f++)
+		{
+			for (unsigned int c = 0; c < p.channels; c++)
+			{
+				int v = p.sample(f, c);
+				if (v < min[c])
+					min[c] = v;
+				if (v > max[c])
+					max[c] = v;
+				sum[c] += v;
+			}
+		}
+		frames += p.frames;
+		lost += p.lost;
+	}
+
+	void latency(const AdcPeriod & p)
+	{
+		struct timespec now;
+		double ms;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		ms = (now.tv_sec - p.time.tv_sec) * 1e3 + (now.tv_nsec - p.time.tv_nsec) / 1e6 - p.frames * 1e3 / p.rate;
+		latency_sum += ms;
+		if (ms > latency_max)
+			latency_max = ms;
+		wakeups++;
+	}
+
+	void report(const AdcDevice & dev)
+	{
+		printf("{\"device\":\"%s\",\"position\":%llu,\"periods\":%llu,\"xruns\":%llu,\"lost\":%llu,"
+		       "\"latency_ms\":{\"mean\":%.2f,\"max\":%.2f},\"channels\":[",
+		       dev.name().c_str(), (unsigned long long)dev.position(), (unsigned long long)dev.periods(),
+		       (unsigned long long)dev.xruns(), (unsigned long long)lost,
+		       wakeups ? latency_sum / wakeups : 0.0, latency_max);
+		for (unsigned int c = 0; c < dev.channels(); c++)
+		{
+			if (frames)
+				printf("%s{\"min\":%d,\"max\":%d,\"mean\":%.1f}", c ? "," : "", min[c], max[c], (double)sum[c] / frames);
+			else
+				printf("%s{}", c ? "," : "");
+		}
+		printf("]}\n");
+		fflush(stdout);
+		reset();
+	}
+};
+
+#ifdef ADCCAP_COROUTINES
+static AdcTask levels(AdcDevice & dev, Stats & stats)
+{
+	while (AdcPeriod p = co_await dev.next())
+		stats.level(p);
+	fprintf(stderr, "%s closed\n", dev.name().c_str());
+}
+#endif
+
+static int timer(unsigned int seconds, bool repeat)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = seconds;
+	if (repeat)
+		its.it_interval.tv_sec = seconds;
+	if (fd >= 0)
+		timerfd_settime(fd, 0, &its, NULL);
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-D device]... [-r rate] [-c channels] [-P ms] [-t seconds] [-s seconds]\n"
+			"\t-D : ALSA capture device, repeated for several devices (default hw:0)\n"
+			"\t-P : period in ms (default 10)\n"
+			"\t-t : stop after the given duration\n"
+			"\t-s : report period in seconds (default 1)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *names[MAX_DEVICES];
+	unsigned int rate = 8000, channels = 1, period_ms = 10;
+	int ndevices = 0;
+	int duration = 0;
+	int period = 1;
+	AdcDevice devices[MAX_DEVICES];
+	Stats stats[MAX_DEVICES];
+	int report_fd, stop_fd = -1;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "D:r:c:P:t:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'D':
+				if (ndevices < MAX_DEVICES)
+					names[ndevices++] = optarg;
+				break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'P': period_ms = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 's': period = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (channels < 1 || channels > MAX_CHANNELS || period_ms < 1 || period < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	if (ndevices == 0)
+		names[ndevices++] = "hw:0";
+
+	AdcLoop adcloop;
+	loop = &adcloop;
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	for (i = 0; i < ndevices; i++)
+	{
+		AdcDevice & dev = devices[i];
+		Stats & s = stats[i];
+
+		if (dev.open(names[i], rate, channels, period_ms) < 0)
+			return -1;
+		fprintf(stderr, "%s %s %uHz %uch period:%lu buffer:%lu\n", names[i], snd_pcm_format_name(dev.format()),
+			dev.rate(), dev.channels(), dev.periodFrames(), dev.bufferFrames());
+		dev.subscribe([&s](const AdcPeriod & p) { s.latency(p); });
+#ifdef ADCCAP_COROUTINES
+		levels(dev, s);
+#else
+		dev.subscribe([&s](const AdcPeriod & p) { s.level(p); });
+#endif
+		if (adcloop.add(dev) < 0)
+			return -1;
+	}
+
+	report_fd = timer(period, true);
+	adcloop.watch(report_fd, EPOLLIN, [&](uint32_t) {
+		uint64_t expirations;
+		if (read(report_fd, &expirations, sizeof(expirations)) < 0)
+			return;
+		for (int d = 0; d < ndevices; d++)
+			if (devices[d].isOpen())
+				stats[d].report(devices[d]);
+	});
+	if (duration)
+	{
+		stop_fd = timer(duration, false);
+		adcloop.watch(stop_fd, EPOLLIN, [&](uint32_t) { adcloop.stop(); });
+	}
+
+	adcloop.run();
+
+	loop = NULL;
+	for (i = 0; i < ndevices; i++)
+	{
+		fprintf(stderr, "%s periods:%llu xruns:%llu\n", names[i],
+			(unsigned long long)devices[i].periods(), (unsigned long long)devices[i].xruns());
+		devices[i].close();
+	}
+	close(report_fd);
+	if (stop_fd >= 0)
+		close(stop_fd);
+	return 0;
+}
@@ -0,0 +1,406 @@
+/*
+ * Capture benchmark for the ADC cards (spi-mcp3002, snd-pcf8591, snd-adc-sync)
+ *
+ * Reads the capture one period at a time for the given duration, after a
+ * warm-up, and reports :
+ *
+ *   rate   : frames received over the time between the first and the last period
+ *   cpu    : CPU time per frame of the named kernel threads (/proc/<pid>/schedstat),
+ *            of this reader and of the whole system (/proc/stat, all CPUs)
+ *   jitter : standard deviation and worst deviation of the period wake-ups
+ *            against their mean interval
+ *   bus    : counters of a simulated bus (kmodule/spi-sim, i2c-sim) per frame
+ *
+ * A summary goes to stderr, the results as one JSON line to stdout.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <alsa/asoundlib.h>
+
+#define MAX_CHANNELS 8
+#define MAX_THREADS 32
+#define MAX_PREFIXES 8
+
+static const char *bus_counters[] = { "messages", "transfers", "conversions", "transactions", "bytes", "nacks" };
+#define NB_BUS_COUNTERS (sizeof(bus_counters) / sizeof(bus_counters[0]))
+
+struct sample
+{
+	uint64_t threads_ns;	// on CPU, named kernel threads
+	uint64_t self_ns;	// on CPU, this process
+	uint64_t busy_ticks;	// /proc/stat, all CPUs except idle and iowait
+	long long bus[NB_BUS_COUNTERS];
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// =======================================================================
+// CPU accounting
+// =======================================================================
+// pids of the threads whose name starts with one of the prefixes
+static int find_threads(const char **prefixes, int nprefixes, pid_t *pids, int max)
+{
+	DIR *dir = opendir("/proc");
+	struct dirent *d;
+	int n = 0;
+
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir)) != NULL && n < max)
+	{
+		char path[64], comm[32];
+		FILE *f;
+		int i;
+
+		if (d->d_name[0] < '0' || d->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/comm", d->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(comm, sizeof(comm), f))
+		{
+			comm[strcspn(comm, "\n")] = 0;
+			for (i = 0; i < nprefixes; i++)
+			{
+				if (strncmp(comm, prefixes[i], strlen(prefixes[i])) == 0)
+				{
+					fprintf(stderr, "thread %s pid:%s\n", comm, d->d_name);
+					pids[n++] = atoi(d->d_name);
+					break;
+				}
+			}
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return n;
+}
+
+static uint64_t threads_ns(const pid_t *pids, int n)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		char path[64];
+		unsigned long long ns;
+		FILE *f;
+
+		snprintf(path, sizeof(path), "/proc/%d/schedstat", pids[i]);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%llu", &ns) == 1)
+			total += ns;
+		fclose(f);
+	}
+	return total;
+}
+
+static uint64_t busy_ticks(void)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8)
+		memset(v, 0, sizeof(v));
+	fclose(f);
+	// user nice system [idle iowait] irq softirq steal
+	return v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+}
+
+// =======================================================================
+// bus counters
+// =======================================================================
+static long long read_counter(const char *dir, const char *name)
+{
+	char path[256];
+	long long value = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lld", &value) != 1)
+		value = -1;
+	fclose(f);
+	return value;
+}
+
+static void take_sample(struct sample *s, const pid_t *pids, int npids, const char *bus)
+{
+	unsigned int i;
+
+	s->threads_ns = threads_ns(pids, npids);
+	s->self_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+	s->busy_ticks = busy_ticks();
+	for (i = 0; i < NB_BUS_COUNTERS; i++)
+		s->bus[i] = bus ? read_counter(bus, bus_counters[i]) : -1;
+}
+
+// =======================================================================
+// capture
+// =======================================================================
+static snd_pcm_t *capture_open(const char *device, unsigned int *rate, unsigned int channels,
+			       snd_pcm_format_t *format, snd_pcm_uframes_t *period)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_uframes_t buffer;
+	snd_pcm_t *pcm;
+	int err;
+
+	err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE, 0);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_open %s failed:%s\n", device, snd_strerror(err));
+		return NULL;
+	}
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(pcm, hw);
+	snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
+	*format = SND_PCM_FORMAT_S16_LE;
+	if (snd_pcm_hw_params_set_format(pcm, hw, *format) < 0)
+	{
+		*format = SND_PCM_FORMAT_U8;
+		err = snd_pcm_hw_params_set_format(pcm, hw, *format);
+		if (err < 0)
+		{
+			fprintf(stderr, "no S16_LE or U8 format:%s\n", snd_strerror(err));
+			goto out;
+		}
+	}
+	err = snd_pcm_hw_params_set_channels(pcm, hw, channels);
+	if (err < 0)
+	{
+		fprintf(stderr, "%u channels not supported:%s\n", channels, snd_strerror(err));
+		goto out;
+	}
+	err = snd_pcm_hw_params_set_rate_near(pcm, hw, rate, NULL);
+	if (err < 0)
+	{
+		fprintf(stderr, "rate %u not supported:%s\n", *rate, snd_strerror(err));
+		goto out;
+	}
+	snd_pcm_hw_params_set_period_size_near(pcm, hw, period, NULL);
+	buffer = *period * 8;
+	snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer);
+	err = snd_pcm_hw_params(pcm, hw);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_hw_params failed:%s\n", snd_strerror(err));
+		goto out;
+	}
+	snd_pcm_hw_params_get_period_size(hw, period, NULL);
+	return pcm;
+out:
+	snd_pcm_close(pcm);
+	return NULL;
+}
+
+// =======================================================================
+// main
+// =======================================================================
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-D device] [-r rate] [-c channels] [-p period] [-t seconds] [-w seconds] [-k thread]... [-b dir]\n"
+			"\t-D : ALSA capture device (default hw:0)\n"
+			"\t-p : period in frames (default 256)\n"
+			"\t-t : measured duration (default 10 s), after -w seconds of warm-up (default 1 s)\n"
+			"\t-k : kernel threads accounted, by name prefix (mcp3002-, pcf8591-, spi9)\n"
+			"\t-b : directory of the simulated bus counters (/sys/devices/platform/spi-sim)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "hw:0";
+	const char *bus = NULL;
+	const char *prefixes[MAX_PREFIXES];
+	int nprefixes = 0;
+	unsigned int rate = 8000, channels = 2;
+	snd_pcm_uframes_t period = 256;
+	int seconds = 10, warmup = 1;
+	snd_pcm_format_t format;
+	snd_pcm_t *pcm;
+	pid_t pids[MAX_THREADS];
+	int npids;
+	struct sample start, end;
+	int min[MAX_CHANNELS], max[MAX_CHANNELS];
+	uint8_t *buf;
+	uint64_t t, t0 = 0, prev = 0, first = 0, last = 0, frames = 0, xruns = 0;
+	double sum = 0, sum2 = 0, worst = 0, mean, stddev, achieved, tick_ns;
+	uint64_t *wakeups = NULL;
+	size_t nwakeups = 0, maxwakeups;
+	unsigned int c, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "D:r:c:p:t:w:k:b:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'D': device = optarg; break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'p': period = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'k': if (nprefixes < MAX_PREFIXES) prefixes[nprefixes++] = optarg; break;
+			case 'b': bus = optarg; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (channels < 1 || channels > MAX_CHANNELS || period < 1 || seconds < 1 || warmup < 0)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	pcm = capture_open(device, &rate, channels, &format, &period);
+	if (!pcm)
+		return -1;
+	npids = find_threads(prefixes, nprefixes, pids, MAX_THREADS);
+	buf = malloc(snd_pcm_frames_to_bytes(pcm, period));
+	maxwakeups = (size_t)seconds * rate / period + 16;
+	wakeups = malloc(maxwakeups * sizeof(*wakeups));
+	if (!buf || !wakeups)
+		return -1;
+	for (c = 0; c < channels; c++)
+	{
+		min[c] = INT32_MAX;
+		max[c] = INT32_MIN;
+	}
+	fprintf(stderr, "%s %s %uHz %uch period:%lu frames measuring %d s after %d s\n", device,
+		snd_pcm_format_name(format), rate, channels, period, seconds, warmup);
+
+	t0 = now_ns(CLOCK_MONOTONIC);
+	while (!quit)
+	{
+		snd_pcm_sframes_t n = snd_pcm_readi(pcm, buf, period);
+		t = now_ns(CLOCK_MONOTONIC);
+		if (n < 0)
+		{
+			xruns++;
+			fprintf(stderr, "capture xrun:%s\n", snd_strerror(n));
+			if (snd_pcm_recover(pcm, n, 1) < 0)
+				break;
+			// the intervals around an xrun are not periods
+			prev = 0;
+			continue;
+		}
+		if (t - t0 < (uint64_t)warmup * 1000000000ULL)
+			continue;
+
+		if (!first)
+		{
+			// the measure starts at this wake-up
+			first = t;
+			take_sample(&start, pids, npids, bus);
+		}
+		else
+		{
+			frames += n;
+			if (prev && nwakeups < maxwakeups)
+				wakeups[nwakeups++] = t - prev;
+		}
+		prev = t;
+		last = t;
+
+		for (i = 0; i < (unsigned int)n; i++)
+		{
+			for (c = 0; c < channels; c++)
+			{
+				int v = (format == SND_PCM_FORMAT_S16_LE) ? ((int16_t *)buf)[i * channels + c]
+									  : buf[i * channels + c] - 128;
+				if (v < min[c]) min[c] = v;
+				if (v > max[c]) max[c] = v;
+			}
+		}
+		if (last - first >= (uint64_t)seconds * 1000000000ULL)
+			break;
+	}
+	take_sample(&end, pids, npids, bus);
+	snd_pcm_close(pcm);
+
+	if (frames == 0 || nwakeups == 0)
+	{
+		fprintf(stderr, "no frame captured\n");
+		return -1;
+	}
+
+	achieved = frames * 1e9 / (last - first);
+	for (i = 0; i < nwakeups; i++)
+		sum += wakeups[i];
+	mean = sum / nwakeups;
+	for (i = 0; i < nwakeups; i++)
+	{
+		double d = wakeups[i] - mean;
+		sum2 += d * d;
+		if (fabs(d) > worst)
+			worst = fabs(d);
+	}
+	stddev = sqrt(sum2 / nwakeups);
+	tick_ns = 1e9 / sysconf(_SC_CLK_TCK);
+
+	fprintf(stderr, "rate:%.1f Hz (%+.0f ppm) frames:%llu xruns:%llu\n", achieved, (achieved / rate - 1) * 1e6,
+		(unsigned long long)frames, (unsigned long long)xruns);
+	fprintf(stderr, "cpu/frame threads:%.0f ns reader:%.0f ns system:%.0f ns\n",
+		(end.threads_ns - start.threads_ns) / (double)frames,
+		(end.self_ns - start.self_ns) / (double)frames,
+		(end.busy_ticks - start.busy_ticks) * tick_ns / frames);
+	fprintf(stderr, "period:%.1f us jitter:%.1f us max:%.1f us\n", mean / 1e3, stddev / 1e3, worst / 1e3);
+	for (i = 0; i < NB_BUS_COUNTERS; i++)
+	{
+		if (start.bus[i] >= 0 && end.bus[i] >= 0)
+			fprintf(stderr, "bus %s/frame:%.3f\n", bus_counters[i], (end.bus[i] - start.bus[i]) / (double)frames);
+	}
+	for (c = 0; c < channels; c++)
+		fprintf(stderr, "channel %u min:%d max:%d\n", c, min[c], max[c]);
+
+	printf("{\"device\":\"%s\",\"format\":\"%s\",\"rate\":%u,\"channels\":%u,\"period\":%lu,\"frames\":%llu,\"xruns\":%llu,"
+	       "\"achieved_rate\":%.3f,\"cpu_threads_ns\":%.1f,\"cpu_reader_ns\":%.1f,\"cpu_system_ns\":%.1f,"
+	       "\"period_us\":%.3f,\"jitter_us\":%.3f,\"jitter_max_us\":%.3f",
+	       device, snd_pcm_format_name(format), rate, channels, period, (unsigned long long)frames,
+	       (unsigned long long)xruns, achieved,
+	       (end.threads_ns - start.threads_ns) / (double)frames,
+	       (end.self_ns - start.self_ns) / (double)frames,
+	       (end.busy_ticks - start.busy_ticks) * tick_ns / frames,
+	       mean / 1e3, stddev / 1e3, worst / 1e3);
+	for (i = 0; i < NB_BUS_COUNTERS; i++)
+	{
+		if (start.bus[i] >= 0 && end.bus[i] >= 0)
+			printf(",\"bus_%s_per_frame\":%.4f", bus_counters[i], (end.bus[i] - start.bus[i]) / (double)frames);
+	}
+	printf("}\n");
+
+	free(wakeups);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Reads a time window back from a recording of adc_record
+ *
+ * The index is bisected for the first chunk of the window, only the chunks
+ * covering it are decoded from the mapped recording. The frames come out as
+ * WAV S16 (the codes shifted back to the 16 bits scale) or as CSV lines with
+ * the time of each frame. -i summarizes the recording : chunks, gaps, bytes
+ * per frame and the ratio to S16.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "adcrec.h"
+
+static size_t wav_header(uint8_t *h, unsigned int rate, unsigned int channels, uint32_t data_bytes)
+{
+	uint32_t v[] = { 36 + data_bytes, 16, rate, rate * channels * 2, data_bytes };
+
+	memcpy(h, "RIFF", 4);
+	memcpy(h + 4, &v[0], 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	memcpy(h + 16, &v[1], 4);
+	h[20] = 1; h[21] = 0;
+	h[22] = channels; h[23] = 0;
+	memcpy(h + 24, &v[2], 4);
+	memcpy(h + 28, &v[3], 4);
+	h[32] = channels * 2; h[33] = 0;
+	h[34] = 16; h[35] = 0;
+	memcpy(h + 36, "data", 4);
+	memcpy(h + 40, &v[4], 4);
+	return 44;
+}
+
+static int64_t frame_time(const struct adcrec *rec, const struct adcrec_index *e, uint64_t i)
+{
+	return e->time_ns + (int64_t)(i * 1000000000ULL / rec->header.rate);
+}
+
+// first frame of the chunk at or after 'time_ns'
+static uint64_t frame_at(const struct adcrec *rec, const struct adcrec_index *e, int64_t time_ns)
+{
+	if (time_ns <= e->time_ns)
+		return 0;
+	if (time_ns >= frame_time(rec, e, e->frames))
+		return e->frames;
+	return ((uint64_t)(time_ns - e->time_ns) * rec->header.rate + 999999999ULL) / 1000000000ULL;
+}
+
+static void info(const struct adcrec *rec)
+{
+	const struct adcrec_header *h = &rec->header;
+	uint64_t bytes = 0, gaps = 0;
+	size_t i;
+
+	for (i = 0; i < rec->nindex; i++)
+	{
+		bytes += rec->index[i].size;
+		if (i && llabs(rec->index[i].time_ns - frame_time(rec, &rec->index[i - 1], rec->index[i - 1].frames))
+			 > 1000000000LL / h->rate)
+			gaps++;
+	}
+	printf("device:%s rate:%u channels:%u bits:%u chunk:%u frames\n", h->device, h->rate, h->channels, h->bits,
+	       h->chunk_frames);
+	printf("chunks:%zu frames:%llu duration:%.1f s gaps:%llu\n", rec->nindex, (unsigned long long)rec->frames,
+	       (double)rec->frames / h->rate, (unsigned long long)gaps);
+	if (rec->nindex)
+	{
+		const struct adcrec_index *last = &rec->index[rec->nindex - 1];
+		time_t first_s = rec->index[0].time_ns / 1000000000LL;
+		time_t last_s = frame_time(rec, last, last->frames) / 1000000000LL;
+		char first_str[32], last_str[32];
+
+		strftime(first_str, sizeof(first_str), "%F %T", localtime(&first_s));
+		strftime(last_str, sizeof(last_str), "%F %T", localtime(&last_s));
+		printf("from %s to %s\n", first_str, last_str);
+	}
+	if (rec->frames)
+		printf("data:%llu bytes, %.2f bytes/frame, %.1fx smaller than S16\n", (unsigned long long)bytes,
+		       (double)bytes / rec->frames, (double)rec->frames * h->channels * 2 / bytes);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-i] [-s start] [-d seconds] [-f wav|csv] [-o file] name\n", name);
+	fprintf(stderr, "  start in seconds since the epoch, or +seconds from the beginning of the recording\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = "-", *start_arg = NULL;
+	double duration = 0;
+	int csv = 0, show_info = 0;
+	struct adcrec rec;
+	int64_t start_ns, end_ns;
+	uint64_t total = 0, shift;
+	int16_t *codes;
+	size_t first, n;
+	FILE *out;
+	uint8_t header[44];
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "is:d:f:o:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'i': show_info = 1; break;
+			case 's': start_arg = optarg; break;
+			case 'd': duration = atof(optarg); break;
+			case 'f': csv = (strcmp(optarg, "csv") == 0); break;
+			case 'o': output = optarg; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (optind >= argc)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	if (adcrec_open(&rec, argv[optind]) < 0)
+		return -1;
+	if (show_info)
+	{
+		info(&rec);
+		adcrec_close(&rec);
+		return 0;
+	}
+	if (rec.nindex == 0)
+	{
+		fprintf(stderr, "%s is empty\n", argv[optind]);
+		adcrec_close(&rec);
+		return -1;
+	}
+
+	start_ns = rec.index[0].time_ns;
+	if (start_arg && start_arg[0] == '+')
+		start_ns += (int64_t)(atof(start_arg + 1) * 1e9);
+	else if (start_arg)
+		start_ns = (int64_t)(atof(start_arg) * 1e9);
+	end_ns = duration > 0 ? start_ns + (int64_t)(duration * 1e9) : INT64_MAX;
+
+	// the window in frames, from the index alone
+	first = adcrec_find_time(&rec, start_ns);
+	for (n = first; n < rec.nindex && rec.index[n].time_ns < end_ns; n++)
+	{
+		const struct adcrec_index *e = &rec.index[n];
+		uint64_t from = frame_at(&rec, e, start_ns);
+		uint64_t to = frame_at(&rec, e, end_ns);
+
+		if (to > from)
+			total += to - from;
+	}
+	fprintf(stderr, "%llu frames in %zu chunks from chunk %zu\n", (unsigned long long)total, n - first, first);
+
+	out = strcmp(output, "-") ? fopen(output, "wb") : stdout;
+	if (!out)
+	{
+		fprintf(stderr, "can't open %s:%s\n", output, strerror(errno));
+		adcrec_close(&rec);
+		return -1;
+	}
+	if (!csv)
+		fwrite(header, 1, wav_header(header, rec.header.rate, rec.header.channels,
+					     total * rec.header.channels * 2), out);
+
+	codes = malloc((size_t)rec.header.chunk_frames * rec.header.channels * sizeof(int16_t));
+	shift = 16 - rec.header.bits;
+	for (; first < n && codes; first++)
+	{
+		const struct adcrec_index *e = &rec.index[first];
+		uint64_t from = frame_at(&rec, e, start_ns);
+		uint64_t to = frame_at(&rec, e, end_ns);
+		uint64_t i;
+		unsigned int c;
+
+		err = adcrec_decode(&rec, first, codes);
+		if (err < 0)
+		{
+			fprintf(stderr, "chunk %zu at %llu is corrupted\n", first, (unsigned long long)e->offset);
+			break;
+		}
+		for (i = from; i < to; i++)
+		{
+			if (csv)
+			{
+				int64_t t = frame_time(&rec, e, i);
+				fprintf(out, "%lld.%09lld", (long long)(t / 1000000000LL), (long long)(t % 1000000000LL));
+				for (c = 0; c < rec.header.channels; c++)
+					fprintf(out, ",%d", codes[c * e->frames + i]);
+				fprintf(out, "\n");
+			}
+			else
+			{
+				for (c = 0; c < rec.header.channels; c++)
+				{
+					int16_t s = (uint16_t)codes[c * e->frames + i] << shift;
+					fwrite(&s, sizeof(s), 1, out);
+				}
+			}
+		}
+	}
+
+	free(codes);
+	if (out != stdout)
+		fclose(out);
+	adcrec_close(&rec);
+	return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Long-term recorder of an ADC capture card (spi-mcp3002, snd-pcf8591)
+ *
+ * Captures one period at a time and appends the frames to a recording
+ * (adcrec.h) : chunks of compressed codes written in one go and synced only
+ * at their end, with a time index to read any range back (adc_extract).
+ *
+ * The samples keep their significant bits only (-b) : 10 for the MCP3002
+ * codes, 8 for the PCF8591, 16 with the decimation or the calibration. Each
+ * chunk is stamped with the CLOCK_REALTIME of its first frame from the ALSA
+ * hw pointer timestamp, an overrun closes the chunk so the next one carries
+ * the time after the gap.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#include "adcrec.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// =======================================================================
+// capture
+// =======================================================================
+static snd_pcm_t *capture_open(const char *device, unsigned int *rate, unsigned int channels,
+			       snd_pcm_format_t *format, snd_pcm_uframes_t *period)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t buffer;
+	snd_pcm_t *pcm;
+	int err;
+
+	err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE, 0);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_open %s failed:%s\n", device, snd_strerror(err));
+		return NULL;
+	}
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(pcm, hw);
+	snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
+	// spi-mcp3002 delivers S16_LE, snd-pcf8591 U8 without decimation or calibration
+	*format = SND_PCM_FORMAT_S16_LE;
+	if (snd_pcm_hw_params_set_format(pcm, hw, *format) < 0)
+	{
+		*format = SND_PCM_FORMAT_U8;
+		err = snd_pcm_hw_params_set_format(pcm, hw, *format);
+		if (err < 0)
+		{
+			fprintf(stderr, "no S16_LE or U8 format:%s\n", snd_strerror(err));
+			goto out;
+		}
+	}
+	err = snd_pcm_hw_params_set_channels(pcm, hw, channels);
+	if (err < 0)
+	{
+		fprintf(stderr, "%u channels not supported:%s\n", channels, snd_strerror(err));
+		goto out;
+	}
+	err = snd_pcm_hw_params_set_rate_near(pcm, hw, rate, NULL);
+	if (err < 0)
+	{
+		fprintf(stderr, "rate %u not supported:%s\n", *rate, snd_strerror(err));
+		goto out;
+	}
+	// large periods, the recorder only needs to keep up
+	*period = *rate / 4;
+	snd_pcm_hw_params_set_period_size_near(pcm, hw, period, NULL);
+	buffer = *period * 8;
+	snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer);
+	err = snd_pcm_hw_params(pcm, hw);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_hw_params failed:%s\n", snd_strerror(err));
+		goto out;
+	}
+	snd_pcm_hw_params_get_period_size(hw, period, NULL);
+
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(pcm, sw);
+	snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(pcm, sw, SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY);
+	err = snd_pcm_sw_params(pcm, sw);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_sw_params failed:%s\n", snd_strerror(err));
+		goto out;
+	}
+	return pcm;
+
+out:
+	snd_pcm_close(pcm);
+	return NULL;
+}
+
+// CLOCK_REALTIME of the first of the 'n' frames just read
+static int64_t capture_time(snd_pcm_t *pcm, unsigned int rate, snd_pcm_uframes_t n)
+{
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t ts;
+	struct timespec now;
+
+	if (snd_pcm_htimestamp(pcm, &avail, &ts) < 0 || (ts.tv_sec == 0 && ts.tv_nsec == 0))
+	{
+		clock_gettime(CLOCK_REALTIME, &now);
+		avail = 0;
+		ts = now;
+	}
+	return timespec_ns(&ts) - (int64_t)(avail + n) * 1000000000LL / rate;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-D device] [-r rate] [-c channels] [-b bits] [-C chunk frames] [-a] [-t seconds] [-s stats period] name\n", name);
+	fprintf(stderr, "  records to name.adc and name.idx, -a appends to an existing recording\n");
+	fprintf(stderr, "  -b significant bits of the samples : 10 MCP3002, 8 PCF8591, 16 decimated or calibrated\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "hw:mcp3002";
+	unsigned int rate = 8000, channels = 2, bits = 10, chunk_frames = 65536;
+	int append = 0, duration = 0, period_s = 60;
+	snd_pcm_format_t format;
+	snd_pcm_uframes_t period;
+	snd_pcm_t *pcm;
+	struct adcrec rec;
+	int16_t *frames;
+	uint8_t *raw;
+	uint64_t xruns = 0, frames_at_start, bytes_at_start;
+	time_t start, report;
+	int gap = 1;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "D:r:c:b:C:at:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'D': device = optarg; break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'b': bits = atoi(optarg); break;
+			case 'C': chunk_frames = atoi(optarg); break;
+			case 'a': append = 1; break;
+			case 't': duration = atoi(optarg); break;
+			case 's': period_s = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (optind >= argc || channels < 1 || channels > ADCREC_MAX_CHANNELS || bits < 2 || bits > 16 || chunk_frames < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	pcm = capture_open(device, &rate, channels, &format, &period);
+	if (!pcm)
+		return -1;
+	if (format == SND_PCM_FORMAT_U8 && bits > 8)
+		bits = 8;
+
+	err = adcrec_create(&rec, argv[optind], rate, channels, bits, chunk_frames, device, append);
+	if (err < 0)
+	{
+		fprintf(stderr, "can't record to %s:%s\n", argv[optind], strerror(-err));
+		snd_pcm_close(pcm);
+		return -1;
+	}
+	fprintf(stderr, "%s %s %uHz %uch %u bits, period:%lu chunk:%u frames, %llu frames already recorded\n",
+		device, snd_pcm_format_name(format), rate, channels, bits, period, rec.header.chunk_frames,
+		(unsigned long long)rec.frames);
+
+	frames = malloc(period * channels * sizeof(int16_t));
+	raw = malloc(snd_pcm_frames_to_bytes(pcm, period));
+	if (!frames || !raw)
+		return -1;
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	frames_at_start = rec.frames;
+	bytes_at_start = rec.bytes;
+	start = report = time(NULL);
+	while (!quit && (!duration || time(NULL) - start < duration))
+	{
+		snd_pcm_sframes_t n = snd_pcm_readi(pcm, raw, period);
+		snd_pcm_sframes_t i;
+
+		if (n < 0)
+		{
+			if (n == -EPIPE)
+				xruns++;
+			if (snd_pcm_recover(pcm, n, 1) < 0)
+			{
+				fprintf(stderr, "snd_pcm_readi failed:%s\n", snd_strerror(n));
+				break;
+			}
+			gap = 1;
+			continue;
+		}
+		if (format == SND_PCM_FORMAT_U8)
+		{
+			for (i = 0; i < n * channels; i++)
+				frames[i] = (raw[i] - 128) << 8;
+		}
+		else
+		{
+			memcpy(frames, raw, n * channels * sizeof(int16_t));
+		}
+		err = adcrec_write(&rec, frames, n, capture_time(pcm, rate, n), gap);
+		if (err < 0)
+		{
+			fprintf(stderr, "write failed:%s\n", strerror(-err));
+			break;
+		}
+		gap = 0;
+
+		if (period_s && time(NULL) - report >= period_s)
+		{
+			// the frames of the chunk being filled are not written yet
+			uint64_t recorded = rec.frames - frames_at_start;
+			uint64_t written = rec.bytes - bytes_at_start;
+			fprintf(stderr, "frames:%llu chunks:%llu written:%llu bytes (%.2f bytes/frame, %.1fx smaller than S16) xruns:%llu\n",
+				(unsigned long long)recorded, (unsigned long long)rec.chunks, (unsigned long long)written,
+				recorded ? (double)written / recorded : 0.0,
+				written ? (double)recorded * channels * 2 / written : 0.0, (unsigned long long)xruns);
+			report = time(NULL);
+		}
+	}
+
+	// the partial chunk is written by the close
+	adcrec_close(&rec);
+	snd_pcm_close(pcm);
+	free(frames);
+	free(raw);
+	return 0;
+}
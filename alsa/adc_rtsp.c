@@ -0,0 +1,747 @@
+/*
+ * RTSP server streaming an ALSA capture device (spi-mcp3002, snd-pcf8591) as RTP L16
+ *
+ * The capture runs continuously in mmap mode, a timer at the packet time
+ * drains the ring : each packet is converted to network order straight from
+ * the mmap area into the payload, which is shared by all the sessions, only
+ * the 12 bytes RTP header differs per session.
+ *
+ * The RTP timestamp is the sample counter of the ADC. The capture wallclock of
+ * the first sample, derived from the ALSA hw pointer timestamp, is sent in an
+ * RFC 6051 header extension (64 bits NTP format) so that a client measures the
+ * end-to-end latency.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <alsa/asoundlib.h>
+
+#define MAX_CLIENTS 16
+#define MAX_CHANNELS 4
+#define MAX_PACKET_FRAMES 480
+#define PAYLOAD_TYPE 97
+#define EXT_ID 1
+#define SESSION_TIMEOUT 60
+#define NTP_OFFSET 2208988800ULL
+
+struct client
+{
+	int fd;
+	char in[2048];
+	size_t inlen;
+	struct sockaddr_in peer;
+
+	uint32_t session;
+	int playing;
+	int rtp_fd;
+	uint16_t seq;
+	uint32_t ssrc;
+	uint32_t rtp_offset;
+	uint64_t packets;
+	uint64_t dropped;
+};
+
+struct capture
+{
+	snd_pcm_t *pcm;
+	snd_pcm_format_t format;
+	unsigned int rate;
+	unsigned int channels;
+	snd_pcm_uframes_t period;
+	snd_pcm_uframes_t buffer;
+	unsigned int packet_frames;
+
+	uint64_t position;	// frames consumed since the start
+	uint64_t xruns;
+	uint64_t packets;
+	snd_pcm_sframes_t max_delay;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+// =======================================================================
+// capture
+// =======================================================================
+static int capture_open(struct capture *cap, const char *device, unsigned int rate, unsigned int channels, unsigned int ptime_ms)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t period;
+	int err;
+
+	err = snd_pcm_open(&cap->pcm, device, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_open %s failed:%s\n", device, snd_strerror(err));
+		return -1;
+	}
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(cap->pcm, hw);
+	err = snd_pcm_hw_params_set_access(cap->pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	if (err < 0)
+	{
+		fprintf(stderr, "mmap access not supported:%s\n", snd_strerror(err));
+		goto out;
+	}
+	// spi-mcp3002 delivers S16_LE, snd-pcf8591 U8
+	cap->format = SND_PCM_FORMAT_S16_LE;
+	if (snd_pcm_hw_params_set_format(cap->pcm, hw, cap->format) < 0)
+	{
+		cap->format = SND_PCM_FORMAT_U8;
+		err = snd_pcm_hw_params_set_format(cap->pcm, hw, cap->format);
+		if (err < 0)
+		{
+			fprintf(stderr, "no S16_LE or U8 format:%s\n", snd_strerror(err));
+			goto out;
+		}
+	}
+	cap->channels = channels;
+	err = snd_pcm_hw_params_set_channels(cap->pcm, hw, cap->channels);
+	if (err < 0)
+	{
+		fprintf(stderr, "%u channels not supported:%s\n", channels, snd_strerror(err));
+		goto out;
+	}
+	cap->rate = rate;
+	err = snd_pcm_hw_params_set_rate_near(cap->pcm, hw, &cap->rate, NULL);
+	if (err < 0)
+	{
+		fprintf(stderr, "rate %u not supported:%s\n", rate, snd_strerror(err));
+		goto out;
+	}
+
+	cap->packet_frames = cap->rate * ptime_ms / 1000;
+	if (cap->packet_frames == 0)
+		cap->packet_frames = 1;
+	if (cap->packet_frames > MAX_PACKET_FRAMES)
+		cap->packet_frames = MAX_PACKET_FRAMES;
+
+	// the smallest period the driver accepts, the timer drains the packets in between
+	period = cap->packet_frames;
+	snd_pcm_hw_params_set_period_size_near(cap->pcm, hw, &period, NULL);
+	cap->buffer = period * 8;
+	if (cap->buffer < (snd_pcm_uframes_t)cap->rate / 5)
+		cap->buffer = cap->rate / 5;
+	snd_pcm_hw_params_set_buffer_size_near(cap->pcm, hw, &cap->buffer);
+	err = snd_pcm_hw_params(cap->pcm, hw);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_hw_params failed:%s\n", snd_strerror(err));
+		goto out;
+	}
+	snd_pcm_hw_params_get_period_size(hw, &cap->period, NULL);
+	snd_pcm_hw_params_get_buffer_size(hw, &cap->buffer);
+
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(cap->pcm, sw);
+	snd_pcm_sw_params_set_tstamp_mode(cap->pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(cap->pcm, sw, SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY);
+	snd_pcm_sw_params_set_avail_min(cap->pcm, sw, cap->period);
+	snd_pcm_sw_params_set_start_threshold(cap->pcm, sw, 1);
+	err = snd_pcm_sw_params(cap->pcm, sw);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_sw_params failed:%s\n", snd_strerror(err));
+		goto out;
+	}
+
+	err = snd_pcm_start(cap->pcm);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_start failed:%s\n", snd_strerror(err));
+		goto out;
+	}
+	return 0;
+out:
+	snd_pcm_close(cap->pcm);
+	cap->pcm = NULL;
+	return -1;
+}
+
+static int capture_recover(struct capture *cap, int err)
+{
+	cap->xruns++;
+	// at least the whole ring was lost, keep the RTP timestamps on the sample clock
+	cap->position += cap->buffer;
+	fprintf(stderr, "capture xrun:%s\n", snd_strerror(err));
+	err = snd_pcm_prepare(cap->pcm);
+	if (err == 0)
+		err = snd_pcm_start(cap->pcm);
+	return err;
+}
+
+// convert frames of the mmap area to L16 (signed 16 bits big endian)
+static uint8_t *capture_convert(const struct capture *cap, const snd_pcm_channel_area_t *areas,
+				snd_pcm_uframes_t offset, snd_pcm_uframes_t frames, uint8_t *out)
+{
+	unsigned int n = frames * cap->channels;
+	unsigned int i;
+
+	if (cap->format == SND_PCM_FORMAT_S16_LE)
+	{
+		const uint8_t *in = (const uint8_t *)areas[0].addr + offset * cap->channels * 2;
+		for (i = 0; i < n; i++, in += 2)
+		{
+			*out++ = in[1];
+			*out++ = in[0];
+		}
+	}
+	else
+	{
+		const uint8_t *in = (const uint8_t *)areas[0].addr + offset * cap->channels;
+		for (i = 0; i < n; i++)
+		{
+			*out++ = in[i] ^ 0x80;
+			*out++ = 0;
+		}
+	}
+	return out;
+}
+
+// =======================================================================
+// RTP
+// =======================================================================
+struct packet
+{
+	uint32_t timestamp;
+	uint8_t ext[16];
+	uint8_t payload[MAX_PACKET_FRAMES * MAX_CHANNELS * 2];
+	size_t size;
+};
+
+static void ntp64(const struct timespec *ts, uint8_t *out)
+{
+	uint64_t sec = ts->tv_sec + NTP_OFFSET;
+	uint64_t frac = ((uint64_t)ts->tv_nsec << 32) / 1000000000;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		out[i] = sec >> (24 - 8 * i);
+		out[4 + i] = frac >> (24 - 8 * i);
+	}
+}
+
+// one-byte header extension (RFC 8285) carrying the capture time (RFC 6051)
+static void packet_set_time(struct packet *pkt, const struct timespec *ts)
+{
+	pkt->ext[0] = 0xbe;
+	pkt->ext[1] = 0xde;
+	pkt->ext[2] = 0;
+	pkt->ext[3] = 3;
+	pkt->ext[4] = (EXT_ID << 4) | 7;
+	ntp64(ts, pkt->ext + 5);
+}
+
+static void packet_send(struct client **clients, const struct packet *pkt)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		struct client *c = clients[i];
+		uint8_t hdr[12];
+		struct iovec iov[3];
+		struct msghdr msg;
+		uint32_t ts;
+
+		if (c == NULL || !c->playing)
+			continue;
+		ts = pkt->timestamp + c->rtp_offset;
+		hdr[0] = 0x90;	// version 2, extension
+		hdr[1] = PAYLOAD_TYPE;
+		hdr[2] = c->seq >> 8;
+		hdr[3] = c->seq;
+		hdr[4] = ts >> 24;
+		hdr[5] = ts >> 16;
+		hdr[6] = ts >> 8;
+		hdr[7] = ts;
+		hdr[8] = c->ssrc >> 24;
+		hdr[9] = c->ssrc >> 16;
+		hdr[10] = c->ssrc >> 8;
+		hdr[11] = c->ssrc;
+		c->seq++;
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *)pkt->ext;
+		iov[1].iov_len = sizeof(pkt->ext);
+		iov[2].iov_base = (void *)pkt->payload;
+		iov[2].iov_len = pkt->size;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 3;
+		if (sendmsg(c->rtp_fd, &msg, MSG_DONTWAIT) < 0)
+			c->dropped++;
+		else
+			c->packets++;
+	}
+}
+
+// send every complete packet available in the ring
+static int capture_drain(struct capture *cap, struct client **clients, struct packet *pkt)
+{
+	snd_pcm_sframes_t avail;
+	snd_pcm_uframes_t havail;
+	snd_htimestamp_t tstamp;
+	int err;
+
+	avail = snd_pcm_avail(cap->pcm);
+	if (avail < 0)
+		return capture_recover(cap, avail);
+	err = snd_pcm_htimestamp(cap->pcm, &havail, &tstamp);
+	if (err < 0 || (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0))
+	{
+		havail = avail;
+		clock_gettime(CLOCK_REALTIME, &tstamp);
+	}
+	if (avail > cap->max_delay)
+		cap->max_delay = avail;
+
+	while (avail >= (snd_pcm_sframes_t)cap->packet_frames)
+	{
+		snd_pcm_uframes_t done = 0;
+		uint8_t *out = pkt->payload;
+		// the last sample counted in havail was captured at tstamp
+		int64_t age_ns = (int64_t)(havail - done) * 1000000000 / cap->rate;
+		struct timespec ts = tstamp;
+
+		while (done < cap->packet_frames)
+		{
+			const snd_pcm_channel_area_t *areas;
+			snd_pcm_uframes_t offset, frames = cap->packet_frames - done;
+
+			err = snd_pcm_mmap_begin(cap->pcm, &areas, &offset, &frames);
+			if (err < 0)
+				return capture_recover(cap, err);
+			out = capture_convert(cap, areas, offset, frames, out);
+			err = snd_pcm_mmap_commit(cap->pcm, offset, frames);
+			if (err < 0)
+				return capture_recover(cap, err);
+			done += frames;
+		}
+
+		ts.tv_sec -= age_ns / 1000000000;
+		ts.tv_nsec -= age_ns % 1000000000;
+		if (ts.tv_nsec < 0)
+		{
+			ts.tv_nsec += 1000000000;
+			ts.tv_sec--;
+		}
+		pkt->timestamp = (uint32_t)cap->position;
+		pkt->size = out - pkt->payload;
+		packet_set_time(pkt, &ts);
+		packet_send(clients, pkt);
+
+		cap->position += cap->packet_frames;
+		cap->packets++;
+		avail -= cap->packet_frames;
+		havail -= cap->packet_frames;
+	}
+	return 0;
+}
+
+// =======================================================================
+// RTSP
+// =======================================================================
+static const char *header_value(const char *headers, const char *name, char *out, size_t size)
+{
+	size_t len = strlen(name);
+	const char *line = headers;
+
+	while (line && *line)
+	{
+		if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+		{
+			const char *value = line + len + 1;
+			size_t n = 0;
+			while (*value == ' ')
+				value++;
+			while (value[n] && value[n] != '\r' && value[n] != '\n' && n + 1 < size)
+			{
+				out[n] = value[n];
+				n++;
+			}
+			out[n] = '\0';
+			return out;
+		}
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	return NULL;
+}
+
+static void reply(struct client *c, const char *cseq, const char *status, const char *headers, const char *body)
+{
+	char buf[2048];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "RTSP/1.0 %s\r\nCSeq: %s\r\nServer: rpi adc_rtsp\r\n%s", status, cseq ? cseq : "0", headers ? headers : "");
+	if (body)
+		len += snprintf(buf + len, sizeof(buf) - len, "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+	else
+		len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+	if (len > (int)sizeof(buf))
+		len = sizeof(buf);
+	if (send(c->fd, buf, len, MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "reply failed:%s\n", strerror(errno));
+}
+
+static int match_path(const char *url, const char *path)
+{
+	size_t len = strlen(path);
+
+	if (strncmp(url, "rtsp://", 7) == 0)
+	{
+		url = strchr(url + 7, '/');
+		if (url == NULL)
+			return 0;
+	}
+	return strncmp(url, path, len) == 0 && (url[len] == '\0' || url[len] == '/');
+}
+
+static void describe(struct client *c, const struct capture *cap, const char *url, const char *cseq, unsigned int ptime_ms)
+{
+	struct sockaddr_in local;
+	socklen_t locallen = sizeof(local);
+	char sdp[1024], headers[512];
+
+	getsockname(c->fd, (struct sockaddr *)&local, &locallen);
+	snprintf(sdp, sizeof(sdp),
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 %s\r\n"
+		"s=adc\r\n"
+		"c=IN IP4 0.0.0.0\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"m=audio 0 RTP/AVP %d\r\n"
+		"a=rtpmap:%d L16/%u/%u\r\n"
+		"a=ptime:%u\r\n"
+		"a=extmap:%d urn:ietf:params:rtp-hdrext:ntp-64\r\n"
+		"a=recvonly\r\n"
+		"a=control:track0\r\n",
+		(unsigned int)time(NULL), inet_ntoa(local.sin_addr),
+		PAYLOAD_TYPE, PAYLOAD_TYPE, cap->rate, cap->channels, ptime_ms, EXT_ID);
+	snprintf(headers, sizeof(headers), "Content-Type: application/sdp\r\nContent-Base: %s/\r\n", url);
+	reply(c, cseq, "200 OK", headers, sdp);
+}
+
+static void setup(struct client *c, const char *cseq, const char *transport)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	const char *port;
+	char headers[512];
+	int rtp_port;
+
+	if (c->rtp_fd >= 0)
+	{
+		reply(c, cseq, "459 Aggregate Operation Not Allowed", NULL, NULL);
+		return;
+	}
+	port = transport ? strstr(transport, "client_port=") : NULL;
+	if (port == NULL || strstr(transport, "RTP/AVP/TCP"))
+	{
+		reply(c, cseq, "461 Unsupported Transport", NULL, NULL);
+		return;
+	}
+	rtp_port = atoi(port + 12);
+
+	c->rtp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	addr = c->peer;
+	addr.sin_port = htons(rtp_port);
+	if (c->rtp_fd < 0 || connect(c->rtp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		if (c->rtp_fd >= 0)
+			close(c->rtp_fd);
+		c->rtp_fd = -1;
+		reply(c, cseq, "500 Internal Server Error", NULL, NULL);
+		return;
+	}
+	getsockname(c->rtp_fd, (struct sockaddr *)&addr, &addrlen);
+	c->session = random();
+	c->ssrc = random();
+	c->seq = random();
+	c->rtp_offset = random();
+
+	snprintf(headers, sizeof(headers),
+		"Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\nSession: %08X;timeout=%d\r\n",
+		rtp_port, rtp_port + 1, ntohs(addr.sin_port), ntohs(addr.sin_port) + 1, c->ssrc, c->session, SESSION_TIMEOUT);
+	reply(c, cseq, "200 OK", headers, NULL);
+}
+
+static int check_session(struct client *c, const char *cseq, const char *session)
+{
+	if (c->rtp_fd < 0 || session == NULL || strtoul(session, NULL, 16) != c->session)
+	{
+		reply(c, cseq, "454 Session Not Found", NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static int handle_requests(struct client *c, const struct capture *cap, const char *path, unsigned int ptime_ms)
+{
+	for (;;)
+	{
+		char method[32], url[256], cseq[16], session[32], transport[256], length[16], headers[512];
+		const char *cs, *sess;
+		char *end, *lines;
+		size_t consumed = 0;
+
+		c->in[c->inlen] = '\0';
+		end = strstr(c->in, "\r\n\r\n");
+		if (end == NULL)
+			return (c->inlen >= sizeof(c->in) - 1) ? -1 : 0;
+		if (header_value(c->in, "Content-Length", length, sizeof(length)))
+			consumed = strtoul(length, NULL, 10);
+		consumed += end + 4 - c->in;
+		if (consumed > sizeof(c->in) - 1)
+			return -1;
+		if (consumed > c->inlen)
+			return 0;
+
+		*end = '\0';
+		lines = strchr(c->in, '\n');
+		if (sscanf(c->in, "%31s %255s", method, url) != 2 || lines == NULL)
+			return -1;
+		cs = header_value(lines, "CSeq", cseq, sizeof(cseq));
+		sess = header_value(lines, "Session", session, sizeof(session));
+
+		if (strcmp(method, "OPTIONS") == 0)
+			reply(c, cs, "200 OK", "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER\r\n", NULL);
+		else if (strcmp(method, "GET_PARAMETER") == 0)
+			reply(c, cs, "200 OK", NULL, NULL);
+		else if (!match_path(url, path) && strcmp(url, "*") != 0)
+			reply(c, cs, "404 Not Found", NULL, NULL);
+		else if (strcmp(method, "DESCRIBE") == 0)
+			describe(c, cap, url, cs, ptime_ms);
+		else if (strcmp(method, "SETUP") == 0)
+			setup(c, cs, header_value(lines, "Transport", transport, sizeof(transport)));
+		else if (strcmp(method, "PLAY") == 0)
+		{
+			if (check_session(c, cs, sess) == 0)
+			{
+				c->playing = 1;
+				// the next packet carries the frames following the current position
+				snprintf(headers, sizeof(headers), "Session: %08X\r\nRange: npt=0.000-\r\nRTP-Info: url=%s;seq=%u;rtptime=%u\r\n",
+					c->session, url, c->seq, (uint32_t)cap->position + c->rtp_offset);
+				reply(c, cs, "200 OK", headers, NULL);
+			}
+		}
+		else if (strcmp(method, "PAUSE") == 0 || strcmp(method, "TEARDOWN") == 0)
+		{
+			if (check_session(c, cs, sess) == 0)
+			{
+				c->playing = 0;
+				reply(c, cs, "200 OK", NULL, NULL);
+				if (strcmp(method, "TEARDOWN") == 0)
+					return -1;
+			}
+		}
+		else
+			reply(c, cs, "501 Not Implemented", NULL, NULL);
+
+		memmove(c->in, c->in + consumed, c->inlen - consumed);
+		c->inlen -= consumed;
+	}
+}
+
+static void close_client(struct client **clients, int i)
+{
+	struct client *c = clients[i];
+
+	if (c->session)
+		fprintf(stderr, "session %08X closed packets:%llu dropped:%llu\n", c->session,
+			(unsigned long long)c->packets, (unsigned long long)c->dropped);
+	if (c->rtp_fd >= 0)
+		close(c->rtp_fd);
+	close(c->fd);
+	free(c);
+	clients[i] = NULL;
+}
+
+// =======================================================================
+// main
+// =======================================================================
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-D device] [-r rate] [-c channels] [-P ptime] [-p port] [-u path] [-s seconds]\n"
+			"\t-D : ALSA capture device (default hw:0)\n"
+			"\t-P : packet duration in ms (default 5)\n"
+			"\t-s : print statistics every given seconds\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	static struct packet pkt;
+	struct client *clients[MAX_CLIENTS];
+	struct capture cap;
+	const char *device = "hw:0";
+	const char *path = "/adc";
+	unsigned int rate = 8000, channels = 1, ptime_ms = 5;
+	int port = 8554;
+	int period = 0;
+	int listen_fd, timer_fd;
+	struct sockaddr_in addr;
+	struct itimerspec its;
+	time_t report;
+	int opt, i, one = 1;
+
+	while ((opt = getopt(argc, argv, "D:r:c:P:p:u:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'D': device = optarg; break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'P': ptime_ms = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			case 'u': path = optarg; break;
+			case 's': period = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (channels < 1 || channels > MAX_CHANNELS || ptime_ms < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	memset(clients, 0, sizeof(clients));
+	memset(&cap, 0, sizeof(cap));
+	srandom(time(NULL) ^ getpid());
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0)
+	{
+		fprintf(stderr, "can't listen on %d:%s\n", port, strerror(errno));
+		return -1;
+	}
+
+	if (capture_open(&cap, device, rate, channels, ptime_ms) < 0)
+		return -1;
+	ptime_ms = cap.packet_frames * 1000 / cap.rate;
+	fprintf(stderr, "rtsp://0.0.0.0:%d%s %s %s %uHz %uch packet:%u frames period:%lu buffer:%lu\n", port, path, device,
+		snd_pcm_format_name(cap.format), cap.rate, cap.channels, cap.packet_frames, cap.period, cap.buffer);
+
+	// the driver period may be larger than a packet, the timer wakes up at the packet rate
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = (long)cap.packet_frames * 1000000000 / cap.rate;
+	its.it_value = its.it_interval;
+	timerfd_settime(timer_fd, 0, &its, NULL);
+
+	report = time(NULL);
+	while (!quit)
+	{
+		struct pollfd pfd[MAX_CLIENTS + 3];
+		int index[MAX_CLIENTS + 3];
+		int n = 0, npcm;
+
+		pfd[n].fd = listen_fd;
+		pfd[n++].events = POLLIN;
+		pfd[n].fd = timer_fd;
+		pfd[n++].events = POLLIN;
+		npcm = snd_pcm_poll_descriptors(cap.pcm, &pfd[n], 1);
+		n += npcm;
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i])
+			{
+				index[n] = i;
+				pfd[n].fd = clients[i]->fd;
+				pfd[n++].events = POLLIN;
+			}
+		}
+
+		if (poll(pfd, n, 1000) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[1].revents & POLLIN)
+		{
+			uint64_t expirations;
+			if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				break;
+		}
+		if (capture_drain(&cap, clients, &pkt) < 0)
+			break;
+
+		for (i = 2 + npcm; i < n; i++)
+		{
+			struct client *c = clients[index[i]];
+			ssize_t len;
+
+			if (!(pfd[i].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			len = recv(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen, 0);
+			if (len <= 0 || (c->inlen += len, handle_requests(c, &cap, path, ptime_ms) < 0))
+				close_client(clients, index[i]);
+		}
+		if (pfd[0].revents & POLLIN)
+		{
+			socklen_t len = sizeof(addr);
+			int fd = accept4(listen_fd, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
+			for (i = 0; i < MAX_CLIENTS && clients[i]; i++);
+			if (fd >= 0 && i < MAX_CLIENTS && (clients[i] = calloc(1, sizeof(struct client))) != NULL)
+			{
+				clients[i]->fd = fd;
+				clients[i]->rtp_fd = -1;
+				clients[i]->peer = addr;
+			}
+			else if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+
+		if (period && time(NULL) - report >= period)
+		{
+			int playing = 0;
+			for (i = 0; i < MAX_CLIENTS; i++)
+				playing += clients[i] && clients[i]->playing;
+			fprintf(stderr, "packets:%llu xruns:%llu max queued:%.1f ms sessions:%d\n",
+				(unsigned long long)cap.packets, (unsigned long long)cap.xruns,
+				cap.max_delay * 1000.0 / cap.rate, playing);
+			cap.max_delay = 0;
+			report = time(NULL);
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+			close_client(clients, i);
+	}
+	snd_pcm_close(cap.pcm);
+	close(timer_fd);
+	close(listen_fd);
+	return 0;
+}
@@ -0,0 +1,417 @@
+/*
+ * RTSP L16 client : receive the ADC stream of adc_rtsp, optionally record it
+ * as WAV, and measure the end-to-end latency (capture time carried in the
+ * RFC 6051 header extension against the arrival time) and the RFC 3550
+ * interarrival jitter.
+ *
+ * On loopback, or with both hosts NTP synchronized, the latency is the capture
+ * ring + packetization + network delay of each packet.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define NTP_OFFSET 2208988800ULL
+#define HIST_BINS 10000		// 100us bins, up to 1s
+
+struct session
+{
+	int fd;
+	int rtp_fd;
+	int cseq;
+	char id[32];
+	unsigned int rate;
+	unsigned int channels;
+	int ext_id;
+};
+
+struct stats
+{
+	int started;
+	uint16_t last_seq;
+	uint32_t cycles;
+	uint32_t base_seq;
+	uint64_t packets;
+	uint64_t bytes;
+	int64_t transit;
+	double jitter;
+	uint64_t timed;
+	double latency_min;
+	double latency_max;
+	double latency_sum;
+	unsigned int hist[HIST_BINS + 1];
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static int request(struct session *s, const char *method, const char *url, const char *headers, char *answer, size_t size)
+{
+	char buf[1024];
+	size_t len;
+	int status = -1;
+
+	len = snprintf(buf, sizeof(buf), "%s %s RTSP/1.0\r\nCSeq: %d\r\nUser-Agent: rpi adc_rtsp_client\r\n%s%s%s%s\r\n",
+		method, url, ++s->cseq, s->id[0] ? "Session: " : "", s->id, s->id[0] ? "\r\n" : "", headers ? headers : "");
+	if (send(s->fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+		return -1;
+
+	len = 0;
+	for (;;)
+	{
+		char *end;
+		ssize_t n = recv(s->fd, answer + len, size - 1 - len, 0);
+		if (n <= 0)
+			return -1;
+		len += n;
+		answer[len] = '\0';
+		end = strstr(answer, "\r\n\r\n");
+		if (end)
+		{
+			char *cl = strcasestr(answer, "Content-Length:");
+			size_t body_len = cl ? strtoul(cl + 15, NULL, 10) : 0;
+			if ((size_t)(end + 4 - answer) + body_len <= len || len == size - 1)
+				break;
+		}
+	}
+	sscanf(answer, "RTSP/1.0 %d", &status);
+	return status;
+}
+
+static int session_open(struct session *s, const struct sockaddr_in *server, const char *url)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char answer[4096], headers[256], track[512];
+	char *p;
+	int status, rcvbuf = 1 << 18;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	s->rtp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (s->fd < 0 || s->rtp_fd < 0)
+		return -1;
+	if (connect(s->fd, (const struct sockaddr *)server, sizeof(*server)) < 0)
+	{
+		fprintf(stderr, "connect failed:%s\n", strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	bind(s->rtp_fd, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(s->rtp_fd, (struct sockaddr *)&addr, &addrlen);
+	setsockopt(s->rtp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	status = request(s, "DESCRIBE", url, "Accept: application/sdp\r\n", answer, sizeof(answer));
+	p = strstr(answer, " L16/");
+	if (status != 200 || p == NULL || sscanf(p, " L16/%u/%u", &s->rate, &s->channels) < 1)
+	{
+		fprintf(stderr, "DESCRIBE %s failed:%d\n", url, status);
+		return -1;
+	}
+	if (s->channels == 0)
+		s->channels = 1;
+	p = strstr(answer, "a=extmap:");
+	if (p && strstr(p, "ntp-64"))
+		s->ext_id = atoi(p + 9);
+
+	snprintf(track, sizeof(track), "%s/track0", url);
+	snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n", ntohs(addr.sin_port), ntohs(addr.sin_port) + 1);
+	status = request(s, "SETUP", track, headers, answer, sizeof(answer));
+	p = strcasestr(answer, "\nSession:");
+	if (status != 200 || p == NULL)
+	{
+		fprintf(stderr, "SETUP %s failed:%d\n", track, status);
+		return -1;
+	}
+	sscanf(p + 9, " %31[0-9A-Fa-f]", s->id);
+	return 0;
+}
+
+// capture time of the first sample from the one-byte header extension, 0 if missing
+static double capture_time(const struct session *s, const uint8_t *ext, size_t len)
+{
+	size_t i = 0;
+
+	if (len < 4 || ext[0] != 0xbe || ext[1] != 0xde)
+		return 0;
+	ext += 4;
+	len -= 4;
+	while (i < len)
+	{
+		int id = ext[i] >> 4;
+		int l = (ext[i] & 0x0f) + 1;
+
+		if (id == 0)
+		{
+			i++;
+			continue;
+		}
+		if (id == s->ext_id && l == 8 && i + 9 <= len)
+		{
+			const uint8_t *p = ext + i + 1;
+			uint32_t sec = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			uint32_t frac = ((uint32_t)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+			return (sec - NTP_OFFSET) + frac / 4294967296.0;
+		}
+		i += 1 + l;
+	}
+	return 0;
+}
+
+static size_t wav_header(uint8_t *h, unsigned int rate, unsigned int channels, uint32_t data_bytes)
+{
+	uint32_t v[] = { 36 + data_bytes, 16, rate, rate * channels * 2, data_bytes };
+
+	memcpy(h, "RIFF", 4);
+	memcpy(h + 4, &v[0], 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	memcpy(h + 16, &v[1], 4);
+	h[20] = 1; h[21] = 0;
+	h[22] = channels; h[23] = 0;
+	memcpy(h + 24, &v[2], 4);
+	memcpy(h + 28, &v[3], 4);
+	h[32] = channels * 2; h[33] = 0;
+	h[34] = 16; h[35] = 0;
+	memcpy(h + 36, "data", 4);
+	memcpy(h + 40, &v[4], 4);
+	return 44;
+}
+
+static void receive(struct session *s, struct stats *st, FILE *wav, uint32_t *wav_bytes)
+{
+	uint8_t pkt[2048];
+	ssize_t len;
+
+	while ((len = recv(s->rtp_fd, pkt, sizeof(pkt), MSG_DONTWAIT)) >= 12)
+	{
+		struct timespec now;
+		uint16_t seq = (pkt[2] << 8) | pkt[3];
+		uint32_t rtptime = ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+		size_t hdr = 12 + (pkt[0] & 0x0f) * 4;
+		double arrival, captured;
+		int64_t transit;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		arrival = now.tv_sec + now.tv_nsec / 1e9;
+		if ((pkt[0] & 0x10) && hdr + 4 <= (size_t)len)
+		{
+			size_t ext_len = 4 + (((pkt[hdr + 2] << 8) | pkt[hdr + 3]) * 4);
+			captured = (hdr + ext_len <= (size_t)len) ? capture_time(s, pkt + hdr, ext_len) : 0;
+			hdr += ext_len;
+		}
+		else
+		{
+			captured = 0;
+		}
+		if (hdr > (size_t)len)
+			continue;
+
+		transit = (int64_t)(arrival * s->rate) - rtptime;
+		if (!st->started)
+		{
+			st->started = 1;
+			st->base_seq = seq;
+			st->last_seq = seq - 1;
+			st->transit = transit;
+		}
+		else
+		{
+			int64_t d = transit - st->transit;
+			st->transit = transit;
+			if (d < 0)
+				d = -d;
+			st->jitter += (d - st->jitter) / 16;
+		}
+		// fill the lost packets with silence to keep the recording on time
+		if (wav && (uint16_t)(seq - st->last_seq) > 1 && (uint16_t)(seq - st->last_seq) < 0x8000)
+		{
+			static const uint8_t silence[1024];
+			size_t missing = ((uint16_t)(seq - st->last_seq) - 1) * (len - hdr);
+			while (missing)
+			{
+				size_t n = missing < sizeof(silence) ? missing : sizeof(silence);
+				fwrite(silence, 1, n, wav);
+				*wav_bytes += n;
+				missing -= n;
+			}
+		}
+		if (seq < st->last_seq && (uint16_t)(st->last_seq - seq) > 0x8000)
+			st->cycles += 0x10000;
+		if ((uint16_t)(seq - st->last_seq) < 0x8000)
+			st->last_seq = seq;
+		st->packets++;
+		st->bytes += len - hdr;
+
+		if (captured > 0)
+		{
+			double latency = (arrival - captured) * 1000;
+			unsigned int bin = latency < 0 ? 0 : (unsigned int)(latency * 10);
+			if (st->timed == 0 || latency < st->latency_min)
+				st->latency_min = latency;
+			if (st->timed == 0 || latency > st->latency_max)
+				st->latency_max = latency;
+			st->latency_sum += latency;
+			st->timed++;
+			st->hist[bin < HIST_BINS ? bin : HIST_BINS]++;
+		}
+
+		if (wav)
+		{
+			size_t i;
+			// L16 is big endian, WAV little endian
+			for (i = hdr; i + 1 < (size_t)len; i += 2)
+			{
+				uint8_t tmp = pkt[i];
+				pkt[i] = pkt[i + 1];
+				pkt[i + 1] = tmp;
+			}
+			fwrite(pkt + hdr, 1, len - hdr, wav);
+			*wav_bytes += len - hdr;
+		}
+	}
+}
+
+static double percentile(const struct stats *st, double p)
+{
+	uint64_t target = st->timed * p, count = 0;
+	unsigned int i;
+
+	for (i = 0; i <= HIST_BINS; i++)
+	{
+		count += st->hist[i];
+		if (count > target)
+			return i / 10.0;
+	}
+	return HIST_BINS / 10.0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t seconds] [-o file.wav] url\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	static struct stats st;
+	struct session s;
+	struct sockaddr_in server;
+	struct addrinfo hints, *res;
+	char host[256], answer[2048];
+	const char *url, *output = NULL;
+	FILE *wav = NULL;
+	uint32_t wav_bytes = 0;
+	uint8_t header[44];
+	int port = 554;
+	int duration = 10;
+	time_t start;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:o:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': duration = atoi(optarg); break;
+			case 'o': output = optarg; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (optind >= argc)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	url = argv[optind];
+	if (sscanf(url, "rtsp://%255[^:/]:%d", host, &port) < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0)
+	{
+		fprintf(stderr, "can't resolve %s\n", host);
+		return -1;
+	}
+	server = *(struct sockaddr_in *)res->ai_addr;
+	server.sin_port = htons(port);
+	freeaddrinfo(res);
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	if (session_open(&s, &server, url) < 0)
+		return -1;
+	if (output)
+	{
+		wav = fopen(output, "wb");
+		if (wav == NULL)
+		{
+			fprintf(stderr, "can't open %s\n", output);
+			return -1;
+		}
+		fwrite(header, 1, wav_header(header, s.rate, s.channels, 0), wav);
+	}
+	if (request(&s, "PLAY", url, "Range: npt=0.000-\r\n", answer, sizeof(answer)) != 200)
+	{
+		fprintf(stderr, "PLAY failed\n");
+		return -1;
+	}
+	fprintf(stderr, "%s L16 %uHz %uch\n", url, s.rate, s.channels);
+
+	start = time(NULL);
+	while (!quit && (duration == 0 || time(NULL) - start < duration))
+	{
+		struct pollfd pfd = { s.rtp_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+			break;
+		if (pfd.revents & POLLIN)
+			receive(&s, &st, wav, &wav_bytes);
+	}
+	request(&s, "TEARDOWN", url, NULL, answer, sizeof(answer));
+
+	{
+		uint64_t expected = st.started ? st.cycles + st.last_seq - st.base_seq + 1 : 0;
+		double elapsed = difftime(time(NULL), start);
+
+		printf("packets:%llu lost:%llu kbps:%.0f jitter:%.3f ms\n",
+			(unsigned long long)st.packets,
+			(unsigned long long)(expected > st.packets ? expected - st.packets : 0),
+			elapsed > 0 ? st.bytes * 8 / elapsed / 1000 : 0, st.jitter * 1000 / s.rate);
+		if (st.timed)
+			printf("latency min:%.2f avg:%.2f max:%.2f p50:%.1f p99:%.1f ms\n",
+				st.latency_min, st.latency_sum / st.timed, st.latency_max,
+				percentile(&st, 0.5), percentile(&st, 0.99));
+		else
+			printf("latency : no capture time in the stream\n");
+	}
+
+	if (wav)
+	{
+		fseek(wav, 0, SEEK_SET);
+		fwrite(header, 1, wav_header(header, s.rate, s.channels, wav_bytes), wav);
+		fclose(wav);
+	}
+	close(s.rtp_fd);
+	close(s.fd);
+	return 0;
+}
@@ -0,0 +1,502 @@
+/*
+ * ADC capture : ALSA capture devices in mmap mode served by one event loop thread
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#include "adccap.h"
+
+#define MAX_EVENTS 16
+#define BUFFER_PERIODS 8
+
+static int64_t timespec_ns(const struct timespec & ts)
+{
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec ns_timespec(int64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	return ts;
+}
+
+// =======================================================================
+// capture device
+// =======================================================================
+AdcDevice::AdcDevice()
+	: m_pcm(NULL), m_format(SND_PCM_FORMAT_S16_LE), m_rate(0), m_channels(0), m_period(0), m_buffer(0), m_frameBytes(0),
+	  m_position(0), m_lost(0), m_periods(0), m_xruns(0), m_resync(false), m_current(), m_nextId(1),
+	  m_dispatching(false), m_closeRequested(false), m_loop(NULL), m_ready(false)
+{
+	memset(&m_nextTime, 0, sizeof(m_nextTime));
+}
+
+AdcDevice::~AdcDevice()
+{
+	close();
+}
+
+int AdcDevice::open(const char *device, unsigned int rate, unsigned int channels, unsigned int period_ms)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t period;
+	int err, count;
+
+	if (m_pcm)
+		return -1;
+	err = snd_pcm_open(&m_pcm, device, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+	if (err < 0)
+	{
+		fprintf(stderr, "snd_pcm_open %s failed:%s\n", device, snd_strerror(err));
+		m_pcm = NULL;
+		return -1;
+	}
+	m_name = device;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(m_pcm, hw);
+	err = snd_pcm_hw_params_set_access(m_pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s no mmap access:%s\n", device, snd_strerror(err));
+		goto out;
+	}
+	m_format = SND_PCM_FORMAT_S16_LE;
+	if (snd_pcm_hw_params_set_format(m_pcm, hw, m_format) < 0)
+	{
+		m_format = SND_PCM_FORMAT_U8;
+		err = snd_pcm_hw_params_set_format(m_pcm, hw, m_format);
+		if (err < 0)
+		{
+			fprintf(stderr, "%s no S16_LE or U8 format:%s\n", device, snd_strerror(err));
+			goto out;
+		}
+	}
+	m_channels = channels;
+	err = snd_pcm_hw_params_set_channels(m_pcm, hw, channels);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s %u channels not supported:%s\n", device, channels, snd_strerror(err));
+		goto out;
+	}
+	m_rate = rate;
+	err = snd_pcm_hw_params_set_rate_near(m_pcm, hw, &m_rate, NULL);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s rate %u not supported:%s\n", device, rate, snd_strerror(err));
+		goto out;
+	}
+
+	// whole periods in the ring (the ADC drivers require it), a view never wraps
+	period = m_rate * period_ms / 1000;
+	if (period == 0)
+		period = 1;
+	snd_pcm_hw_params_set_period_size_near(m_pcm, hw, &period, NULL);
+	m_buffer = period * BUFFER_PERIODS;
+	if (m_buffer < (snd_pcm_uframes_t)m_rate / 5)
+		m_buffer = (m_rate / 5 + period - 1) / period * period;
+	snd_pcm_hw_params_set_buffer_size_near(m_pcm, hw, &m_buffer);
+	err = snd_pcm_hw_params(m_pcm, hw);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s snd_pcm_hw_params failed:%s\n", device, snd_strerror(err));
+		goto out;
+	}
+	snd_pcm_hw_params_get_period_size(hw, &m_period, NULL);
+	snd_pcm_hw_params_get_buffer_size(hw, &m_buffer);
+	m_frameBytes = snd_pcm_frames_to_bytes(m_pcm, 1);
+
+	// started by AdcLoop::add(), woken up at each period
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(m_pcm, sw);
+	snd_pcm_sw_params_set_tstamp_mode(m_pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(m_pcm, sw, SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY);
+	snd_pcm_sw_params_set_avail_min(m_pcm, sw, m_period);
+	snd_pcm_sw_params_set_start_threshold(m_pcm, sw, m_buffer * 2);
+	err = snd_pcm_sw_params(m_pcm, sw);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s snd_pcm_sw_params failed:%s\n", device, snd_strerror(err));
+		goto out;
+	}
+
+	count = snd_pcm_poll_descriptors_count(m_pcm);
+	if (count <= 0)
+	{
+		fprintf(stderr, "%s no poll descriptor\n", device);
+		goto out;
+	}
+	m_pfds.resize(count);
+	snd_pcm_poll_descriptors(m_pcm, &m_pfds[0], count);
+
+	m_position = m_lost = m_periods = m_xruns = 0;
+	m_resync = false;
+	return 0;
+out:
+	snd_pcm_close(m_pcm);
+	m_pcm = NULL;
+	return -1;
+}
+
+void AdcDevice::close()
+{
+	if (!m_pcm)
+		return;
+	// a consumer closing its own device, done once the period is committed
+	if (m_dispatching)
+	{
+		m_closeRequested = true;
+		return;
+	}
+	if (m_loop)
+		m_loop->remove(*this);
+	snd_pcm_close(m_pcm);
+	m_pcm = NULL;
+	m_pfds.clear();
+	m_closeRequested = false;
+
+	m_current = AdcPeriod();
+	m_waking.swap(m_waiters);
+	for (size_t i = 0; i < m_waking.size(); i++)
+		m_waking[i].first(m_waking[i].second);
+	m_waking.clear();
+}
+
+int AdcDevice::subscribe(Handler handler)
+{
+	m_handlers.push_back(std::make_pair(m_nextId, handler));
+	return m_nextId++;
+}
+
+void AdcDevice::unsubscribe(int id)
+{
+	for (std::list<std::pair<int, Handler> >::iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+	{
+		if (it->first != id)
+			continue;
+		// may be the handler running, erased after the period
+		if (m_dispatching)
+			it->first = 0;
+		else
+			m_handlers.erase(it);
+		return;
+	}
+}
+
+void AdcDevice::notifyOnce(void (*resume)(void *), void *arg)
+{
+	m_waiters.push_back(std::make_pair(resume, arg));
+}
+
+int AdcDevice::start()
+{
+	int err = snd_pcm_start(m_pcm);
+	if (err < 0)
+		fprintf(stderr, "%s snd_pcm_start failed:%s\n", m_name.c_str(), snd_strerror(err));
+	return err;
+}
+
+int AdcDevice::recover(int err)
+{
+	m_xruns++;
+	m_resync = true;
+	fprintf(stderr, "%s xrun:%s\n", m_name.c_str(), snd_strerror(err));
+	// overrun : prepare, suspend : resume or prepare
+	err = snd_pcm_recover(m_pcm, err, 1);
+	if (err == 0)
+		err = snd_pcm_start(m_pcm);
+	if (err < 0)
+		fprintf(stderr, "%s recover failed:%s\n", m_name.c_str(), snd_strerror(err));
+	return err;
+}
+
+void AdcDevice::deliver()
+{
+	std::list<std::pair<int, Handler> >::iterator it;
+	size_t i;
+
+	for (it = m_handlers.begin(); it != m_handlers.end(); ++it)
+		if (it->first)
+			it->second(m_current);
+
+	// a coroutine runs up to its next co_await, normally on this device again
+	m_waking.swap(m_waiters);
+	for (i = 0; i < m_waking.size(); i++)
+		m_waking[i].first(m_waking[i].second);
+	m_waking.clear();
+}
+
+// hand every complete period of the ring to the consumers
+int AdcDevice::dispatch()
+{
+	unsigned short revents = 0;
+	snd_pcm_sframes_t avail, committed;
+	snd_pcm_uframes_t havail;
+	snd_htimestamp_t tstamp;
+	int err = 0;
+	size_t i;
+
+	// plugins (dsnoop, ...) consume their wake-up here
+	snd_pcm_poll_descriptors_revents(m_pcm, &m_pfds[0], m_pfds.size(), &revents);
+	for (i = 0; i < m_pfds.size(); i++)
+		m_pfds[i].revents = 0;
+
+	avail = snd_pcm_avail(m_pcm);
+	if (avail < 0)
+		return recover(avail);
+	err = snd_pcm_htimestamp(m_pcm, &havail, &tstamp);
+	if (err < 0 || (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0))
+	{
+		havail = avail;
+		clock_gettime(CLOCK_REALTIME, &tstamp);
+	}
+	err = 0;
+
+	m_dispatching = true;
+	while (avail >= (snd_pcm_sframes_t)m_period && !m_closeRequested)
+	{
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, frames = m_period;
+		// the last frame counted in havail was captured at tstamp
+		int64_t first_ns = timespec_ns(tstamp) - (int64_t)havail * 1000000000 / m_rate;
+
+		err = snd_pcm_mmap_begin(m_pcm, &areas, &offset, &frames);
+		if (err < 0)
+			break;
+
+		if (m_resync)
+		{
+			// the frames between the last period and this one, the whole ring without a previous period
+			int64_t gap_ns = first_ns - timespec_ns(m_nextTime);
+
+			m_lost = m_buffer;
+			if (m_periods && gap_ns > 0)
+				m_lost = (gap_ns * m_rate + 500000000) / 1000000000;
+			else if (m_periods)
+				m_lost = 0;
+			m_position += m_lost;
+			m_resync = false;
+		}
+
+		m_current.data = (const uint8_t *)areas[0].addr + areas[0].first / 8 + offset * m_frameBytes;
+		m_current.frames = frames;
+		m_current.channels = m_channels;
+		m_current.rate = m_rate;
+		m_current.format = m_format;
+		m_current.position = m_position;
+		m_current.lost = m_lost;
+		m_current.time = ns_timespec(first_ns);
+		deliver();
+
+		committed = snd_pcm_mmap_commit(m_pcm, offset, frames);
+		if (committed < 0 || (snd_pcm_uframes_t)committed != frames)
+		{
+			err = committed < 0 ? committed : -EPIPE;
+			break;
+		}
+		m_nextTime = ns_timespec(first_ns + (int64_t)frames * 1000000000 / m_rate);
+		m_position += frames;
+		m_periods++;
+		m_lost = 0;
+		avail -= frames;
+		havail -= frames;
+	}
+	m_dispatching = false;
+	m_current = AdcPeriod();
+	m_handlers.remove_if([](const std::pair<int, Handler> & h) { return h.first == 0; });
+
+	if (m_closeRequested)
+	{
+		close();
+		return 0;
+	}
+	if (err < 0)
+		return recover(err);
+	return 0;
+}
+
+// =======================================================================
+// event loop
+// =======================================================================
+AdcLoop::AdcLoop() : m_quit(false)
+{
+	Source src = { -1, NULL, 0, Callback(), false };
+
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0)
+		fprintf(stderr, "epoll_create1 failed:%s\n", strerror(errno));
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	src.fd = m_wakeFd;
+	src.callback = [this](uint32_t) {
+		uint64_t count;
+		if (read(m_wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			fprintf(stderr, "eventfd read failed:%s\n", strerror(errno));
+	};
+	if (m_epfd >= 0 && m_wakeFd >= 0)
+		addSource(src, EPOLLIN);
+}
+
+AdcLoop::~AdcLoop()
+{
+	while (!m_devices.empty())
+		remove(*m_devices.back());
+	if (m_wakeFd >= 0)
+		::close(m_wakeFd);
+	if (m_epfd >= 0)
+		::close(m_epfd);
+}
+
+int AdcLoop::addSource(const Source & src, uint32_t events)
+{
+	struct epoll_event ev;
+
+	m_sources.push_back(src);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = &m_sources.back();
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, src.fd, &ev) < 0)
+	{
+		fprintf(stderr, "epoll_ctl fd:%d failed:%s\n", src.fd, strerror(errno));
+		m_sources.pop_back();
+		return -1;
+	}
+	return 0;
+}
+
+// the sources of a device, or the watch of a descriptor
+void AdcLoop::removeSources(AdcDevice *dev, int fd)
+{
+	for (std::list<Source>::iterator it = m_sources.begin(); it != m_sources.end(); ++it)
+	{
+		if (it->dead || it->dev != dev || (!dev && it->fd != fd))
+			continue;
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, it->fd, NULL);
+		it->dead = true;
+	}
+}
+
+int AdcLoop::add(AdcDevice & dev)
+{
+	size_t i;
+
+	if (!dev.isOpen() || dev.m_loop)
+		return -1;
+	for (i = 0; i < dev.m_pfds.size(); i++)
+	{
+		// poll and epoll share the values of POLLIN, POLLERR, ...
+		Source src = { dev.m_pfds[i].fd, &dev, i, Callback(), false };
+
+		if (addSource(src, dev.m_pfds[i].events) < 0)
+		{
+			removeSources(&dev, -1);
+			return -1;
+		}
+	}
+	dev.m_loop = this;
+	m_devices.push_back(&dev);
+	if (dev.start() < 0)
+	{
+		remove(dev);
+		return -1;
+	}
+	return 0;
+}
+
+void AdcLoop::remove(AdcDevice & dev)
+{
+	if (dev.m_loop != this)
+		return;
+	removeSources(&dev, -1);
+	m_devices.erase(std::remove(m_devices.begin(), m_devices.end(), &dev), m_devices.end());
+	dev.m_loop = NULL;
+	if (dev.m_pcm)
+		snd_pcm_drop(dev.m_pcm);
+}
+
+int AdcLoop::watch(int fd, uint32_t events, Callback callback)
+{
+	Source src = { fd, NULL, 0, callback, false };
+
+	return addSource(src, events);
+}
+
+void AdcLoop::unwatch(int fd)
+{
+	removeSources(NULL, fd);
+}
+
+void AdcLoop::stop()
+{
+	uint64_t one = 1;
+
+	m_quit = true;
+	if (write(m_wakeFd, &one, sizeof(one)) < 0)
+		return;
+}
+
+int AdcLoop::runOnce(int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int n, i;
+	size_t d;
+
+	n = epoll_wait(m_epfd, events, MAX_EVENTS, timeout_ms);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "epoll_wait failed:%s\n", strerror(errno));
+		return -1;
+	}
+
+	// the descriptors of a device are gathered, it is dispatched once
+	for (i = 0; i < n; i++)
+	{
+		Source *src = (Source *)events[i].data.ptr;
+
+		if (src->dead)
+			continue;
+		if (src->dev)
+		{
+			src->dev->m_pfds[src->index].revents = events[i].events;
+			if (!src->dev->m_ready)
+			{
+				src->dev->m_ready = true;
+				m_ready.push_back(src->dev);
+			}
+		}
+		else
+			src->callback(events[i].events);
+	}
+	for (d = 0; d < m_ready.size(); d++)
+	{
+		AdcDevice *dev = m_ready[d];
+
+		dev->m_ready = false;
+		// removed by a consumer meanwhile
+		if (dev->m_loop != this || !dev->isOpen())
+			continue;
+		if (dev->dispatch() < 0)
+			dev->close();
+	}
+	m_ready.clear();
+	m_sources.remove_if([](const Source & src) { return src.dead; });
+	return n;
+}
+
+int AdcLoop::run()
+{
+	while (!m_quit && !m_devices.empty())
+		if (runOnce(-1) < 0)
+			return -1;
+	return 0;
+}
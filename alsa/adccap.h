@@ -0,0 +1,238 @@
+/*
+ * ADC capture : ALSA capture devices (spi-mcp3002, snd-pcf8591) in mmap mode
+ * served by one event loop thread
+ *
+ * An AdcLoop is an epoll set holding the poll descriptors of its devices, and
+ * any other descriptor of the application (watch()). Its own descriptor is
+ * readable when something is ready, so the loop runs either on its own (run())
+ * or nested in another loop calling runOnce(0).
+ *
+ * Each complete period of a device is handed to its consumers as an AdcPeriod,
+ * a view of the frames in the mmap ring : nothing is copied and the period is
+ * committed back to the driver once every consumer has returned. A consumer
+ * is a callback (subscribe()) or, with C++20, a coroutine awaiting next() :
+ *
+ *	AdcTask level(AdcDevice &dev)
+ *	{
+ *		while (AdcPeriod p = co_await dev.next())
+ *			use(p.s16(), p.frames);
+ *	}
+ *
+ * The view is valid until the callback returns or the coroutine suspends
+ * again, it must be copied to be kept longer. An overrun (or a suspend) is
+ * recovered in place : the ring is restarted, the sample counter skips the
+ * lost frames and the next period reports them in 'lost'. A device failing to
+ * recover is closed, the coroutines awaiting it get an empty period.
+ *
+ * Everything runs in the loop thread, AdcLoop::stop() is the only call safe
+ * from another thread or a signal handler.
+ */
+#ifndef ADCCAP_H
+#define ADCCAP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define ADCCAP_COROUTINES 1
+#endif
+#endif
+
+class AdcLoop;
+
+// =======================================================================
+// period view
+// =======================================================================
+struct AdcPeriod
+{
+	const uint8_t *data;	// interleaved frames in the mmap ring
+	snd_pcm_uframes_t frames;
+	unsigned int channels;
+	unsigned int rate;
+	snd_pcm_format_t format;
+	uint64_t position;	// sample counter of the first frame, lost frames included
+	uint64_t lost;		// frames lost by an xrun just before this period
+	struct timespec time;	// capture time of the first frame (CLOCK_REALTIME)
+
+	explicit operator bool() const { return frames != 0; }
+
+	const int16_t *s16() const { return (const int16_t *)data; }
+	const uint8_t *u8() const { return data; }
+
+	// raw code of a sample whatever the format
+	int sample(snd_pcm_uframes_t frame, unsigned int channel) const
+	{
+		size_t i = frame * channels + channel;
+		return format == SND_PCM_FORMAT_U8 ? data[i] : s16()[i];
+	}
+};
+
+// =======================================================================
+// capture device
+// =======================================================================
+class AdcDevice
+{
+	public:
+		typedef std::function<void(const AdcPeriod &)> Handler;
+
+		AdcDevice();
+		~AdcDevice();
+		AdcDevice(const AdcDevice &) = delete;
+		AdcDevice & operator=(const AdcDevice &) = delete;
+
+		// S16_LE or else U8, the capture starts when added to a loop
+		int open(const char *device, unsigned int rate, unsigned int channels, unsigned int period_ms);
+		// wakes up the waiting coroutines with an empty period
+		void close();
+		bool isOpen() const { return m_pcm != NULL; }
+
+		// called for each period, in subscription order, before the coroutines
+		int subscribe(Handler handler);
+		void unsubscribe(int id);
+		// one-shot : resume(arg) at the next period, or at close() with an empty current()
+		void notifyOnce(void (*resume)(void *), void *arg);
+		const AdcPeriod & current() const { return m_current; }
+
+		const std::string & name() const { return m_name; }
+		snd_pcm_format_t format() const { return m_format; }
+		unsigned int rate() const { return m_rate; }
+		unsigned int channels() const { return m_channels; }
+		snd_pcm_uframes_t periodFrames() const { return m_period; }
+		snd_pcm_uframes_t bufferFrames() const { return m_buffer; }
+		uint64_t position() const { return m_position; }
+		uint64_t periods() const { return m_periods; }
+		uint64_t xruns() const { return m_xruns; }
+
+#ifdef ADCCAP_COROUTINES
+		class PeriodAwaiter
+		{
+			public:
+				PeriodAwaiter(AdcDevice & dev) : m_dev(dev) {}
+				bool await_ready() const { return !m_dev.isOpen(); }
+				void await_suspend(std::coroutine_handle<> handle) { m_dev.notifyOnce(resume, handle.address()); }
+				AdcPeriod await_resume() const { return m_dev.isOpen() ? m_dev.m_current : AdcPeriod(); }
+
+			private:
+				static void resume(void *address) { std::coroutine_handle<>::from_address(address).resume(); }
+				AdcDevice & m_dev;
+		};
+
+		PeriodAwaiter next() { return PeriodAwaiter(*this); }
+#endif
+
+	private:
+		friend class AdcLoop;
+
+		int start();
+		int recover(int err);
+		int dispatch();
+		void deliver();
+
+		snd_pcm_t *m_pcm;
+		std::string m_name;
+		snd_pcm_format_t m_format;
+		unsigned int m_rate;
+		unsigned int m_channels;
+		snd_pcm_uframes_t m_period;
+		snd_pcm_uframes_t m_buffer;
+		size_t m_frameBytes;
+
+		uint64_t m_position;
+		uint64_t m_lost;
+		uint64_t m_periods;
+		uint64_t m_xruns;
+		bool m_resync;			// first period after an xrun
+		struct timespec m_nextTime;	// expected capture time of the next frame
+
+		AdcPeriod m_current;
+		std::list<std::pair<int, Handler> > m_handlers;
+		int m_nextId;
+		// swapped at each period so that a waiter can wait again while it runs
+		std::vector<std::pair<void (*)(void *), void *> > m_waiters;
+		std::vector<std::pair<void (*)(void *), void *> > m_waking;
+		bool m_dispatching;
+		bool m_closeRequested;
+
+		AdcLoop *m_loop;
+		std::vector<struct pollfd> m_pfds;
+		bool m_ready;
+};
+
+// =======================================================================
+// event loop
+// =======================================================================
+class AdcLoop
+{
+	public:
+		typedef std::function<void(uint32_t)> Callback;
+
+		AdcLoop();
+		~AdcLoop();
+		AdcLoop(const AdcLoop &) = delete;
+		AdcLoop & operator=(const AdcLoop &) = delete;
+
+		// registers the poll descriptors of an open device and starts it
+		int add(AdcDevice & dev);
+		void remove(AdcDevice & dev);
+		// any other descriptor, callback(epoll events) from the loop thread
+		int watch(int fd, uint32_t events, Callback callback);
+		void unwatch(int fd);
+
+		// epoll descriptor, readable when runOnce() has something to do
+		int fd() const { return m_epfd; }
+		// waits at most timeout_ms (-1 forever), number of events handled or -1
+		int runOnce(int timeout_ms);
+		// until stop() or no device left
+		int run();
+		void stop();
+
+	private:
+		struct Source
+		{
+			int fd;
+			AdcDevice *dev;		// NULL for watch()
+			size_t index;		// in dev->m_pfds
+			Callback callback;
+			bool dead;		// removed, erased after the events in hand
+		};
+
+		int addSource(const Source & src, uint32_t events);
+		void removeSources(AdcDevice *dev, int fd);
+
+		int m_epfd;
+		int m_wakeFd;		// eventfd written by stop()
+		std::list<Source> m_sources;
+		std::vector<AdcDevice *> m_devices;
+		std::vector<AdcDevice *> m_ready;
+		std::atomic<bool> m_quit;
+};
+
+#ifdef ADCCAP_COROUTINES
+// =======================================================================
+// fire and forget coroutine, runs up to its first co_await when called
+// =======================================================================
+struct AdcTask
+{
+	struct promise_type
+	{
+		AdcTask get_return_object() { return AdcTask(); }
+		std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+#endif
+
+#endif
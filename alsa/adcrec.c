@@ -0,0 +1,653 @@
+/*
+ * ADC recording : compressed chunks of a capture with a time index
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "adcrec.h"
+
+static uint32_t crc_table[256];
+
+static uint32_t adcrec_crc(const uint8_t *data, size_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+
+	if (crc_table[1] == 0)
+	{
+		uint32_t c, n, k;
+		for (n = 0; n < 256; n++)
+		{
+			for (c = n, k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			crc_table[n] = c;
+		}
+	}
+	for (i = 0; i < size; i++)
+		crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+static size_t adcrec_align(size_t size)
+{
+	return (size + ADCREC_ALIGN - 1) & ~(size_t)(ADCREC_ALIGN - 1);
+}
+
+static int64_t adcrec_frames_ns(const struct adcrec_header *h, uint64_t frames)
+{
+	return (int64_t)(frames * 1000000000ULL / h->rate);
+}
+
+// =======================
+// codecs
+// =======================
+static uint32_t zigzag(int32_t d)
+{
+	return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static int32_t unzigzag(uint32_t z)
+{
+	return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+size_t adcrec_pack(const int16_t *codes, unsigned int n, unsigned int bits, uint8_t *out)
+{
+	uint32_t offset = 1U << (bits - 1);
+	uint32_t mask = (1U << bits) - 1;
+	uint64_t acc = 0;
+	unsigned int nacc = 0;
+	size_t size = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+	{
+		acc |= (uint64_t)(((uint32_t)(codes[i] + offset)) & mask) << nacc;
+		nacc += bits;
+		while (nacc >= 8)
+		{
+			out[size++] = acc & 0xFF;
+			acc >>= 8;
+			nacc -= 8;
+		}
+	}
+	if (nacc)
+		out[size++] = acc & 0xFF;
+	return size;
+}
+
+int adcrec_unpack(const uint8_t *in, size_t size, unsigned int n, unsigned int bits, int16_t *codes)
+{
+	uint32_t offset = 1U << (bits - 1);
+	uint32_t mask = (1U << bits) - 1;
+	uint64_t acc = 0;
+	unsigned int nacc = 0;
+	size_t pos = 0;
+	unsigned int i;
+
+	if (size < ((size_t)n * bits + 7) / 8)
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+	{
+		while (nacc < bits)
+		{
+			acc |= (uint64_t)in[pos++] << nacc;
+			nacc += 8;
+		}
+		codes[i] = (int16_t)((int32_t)(acc & mask) - (int32_t)offset);
+		acc >>= bits;
+		nacc -= bits;
+	}
+	return 0;
+}
+
+size_t adcrec_delta(const int16_t *codes, unsigned int n, uint8_t *out)
+{
+	int32_t prev = 0;
+	size_t size = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+	{
+		uint32_t z = zigzag(codes[i] - prev);
+
+		while (z >= 0x80)
+		{
+			out[size++] = (z & 0x7F) | 0x80;
+			z >>= 7;
+		}
+		out[size++] = z;
+		prev = codes[i];
+	}
+	return size;
+}
+
+int adcrec_undelta(const uint8_t *in, size_t size, unsigned int n, int16_t *codes)
+{
+	int32_t prev = 0;
+	size_t pos = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+	{
+		uint32_t z = 0;
+		int shift = 0;
+
+		do
+		{
+			if (pos >= size || shift > 21)
+				return -EINVAL;
+			z |= (uint32_t)(in[pos] & 0x7F) << shift;
+			shift += 7;
+		} while (in[pos++] & 0x80);
+		prev += unzigzag(z);
+		codes[i] = prev;
+	}
+	return 0;
+}
+
+size_t adcrec_delta_pack(const int16_t *codes, unsigned int n, uint8_t *out)
+{
+	uint32_t z[ADCREC_BLOCK];
+	int32_t prev = 0;
+	size_t size = 0;
+	unsigned int i, j, len;
+
+	for (i = 0; i < n; i += len)
+	{
+		uint32_t max = 0;
+		unsigned int width = 0;
+		uint64_t acc = 0;
+		unsigned int nacc = 0;
+
+		len = (n - i < ADCREC_BLOCK) ? n - i : ADCREC_BLOCK;
+		for (j = 0; j < len; j++)
+		{
+			z[j] = zigzag(codes[i + j] - prev);
+			prev = codes[i + j];
+			max |= z[j];
+		}
+		while (max >> width)
+			width++;
+		out[size++] = width;
+		for (j = 0; j < len; j++)
+		{
+			acc |= (uint64_t)z[j] << nacc;
+			nacc += width;
+			while (nacc >= 8)
+			{
+				out[size++] = acc & 0xFF;
+				acc >>= 8;
+				nacc -= 8;
+			}
+		}
+		if (nacc)
+			out[size++] = acc & 0xFF;
+	}
+	return size;
+}
+
+int adcrec_delta_unpack(const uint8_t *in, size_t size, unsigned int n, int16_t *codes)
+{
+	int32_t prev = 0;
+	size_t pos = 0;
+	unsigned int i, j, len;
+
+	for (i = 0; i < n; i += len)
+	{
+		unsigned int width;
+		uint64_t acc = 0;
+		unsigned int nacc = 0;
+
+		len = (n - i < ADCREC_BLOCK) ? n - i : ADCREC_BLOCK;
+		if (pos >= size || in[pos] > 17 || pos + 1 + (len * in[pos] + 7) / 8 > size)
+			return -EINVAL;
+		width = in[pos++];
+		for (j = 0; j < len; j++)
+		{
+			while (nacc < width)
+			{
+				acc |= (uint64_t)in[pos++] << nacc;
+				nacc += 8;
+			}
+			prev += unzigzag(acc & ((1U << width) - 1));
+			codes[i + j] = prev;
+			acc >>= width;
+			nacc -= width;
+		}
+	}
+	return 0;
+}
+
+// =======================
+// writer
+// =======================
+static int write_all(int fd, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	while (size)
+	{
+		ssize_t n = write(fd, p, size);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+// chunk at 'offset' complete and intact, returns its aligned size or 0
+static size_t check_chunk(int fd, const struct adcrec_header *h, uint64_t offset, struct adcrec_chunk *chunk)
+{
+	uint8_t *payload;
+	size_t size;
+	int ok;
+
+	if (pread(fd, chunk, sizeof(*chunk), offset) != sizeof(*chunk) || chunk->magic != ADCREC_CHUNK_MAGIC ||
+	    chunk->frames == 0 || chunk->frames > h->chunk_frames ||
+	    chunk->size > (size_t)h->channels * chunk->frames * 3)
+		return 0;
+	payload = malloc(chunk->size);
+	if (!payload)
+		return 0;
+	size = adcrec_align(sizeof(*chunk) + chunk->size);
+	ok = pread(fd, payload, chunk->size, offset + sizeof(*chunk)) == chunk->size &&
+	     adcrec_crc(payload, chunk->size) == chunk->crc;
+	free(payload);
+	return ok ? size : 0;
+}
+
+// the index up to the last complete chunk, the data truncated after it
+static int recover(struct adcrec *rec)
+{
+	struct adcrec_header *h = &rec->header;
+	struct adcrec_index entry;
+	struct adcrec_chunk chunk;
+	struct stat st;
+	size_t size;
+	int err;
+
+	if (fstat(rec->idx_fd, &st) < 0)
+		return -errno;
+	rec->chunks = st.st_size / sizeof(entry);
+	rec->offset = adcrec_align(sizeof(*h));
+	if (rec->chunks)
+	{
+		if (pread(rec->idx_fd, &entry, sizeof(entry), (rec->chunks - 1) * sizeof(entry)) != sizeof(entry))
+			return -EIO;
+		rec->offset = entry.offset + entry.size;
+		rec->frames = entry.first_frame + entry.frames;
+	}
+	if (ftruncate(rec->idx_fd, rec->chunks * sizeof(entry)) < 0)
+		return -errno;
+
+	// chunks synced before their index entry
+	while ((size = check_chunk(rec->fd, h, rec->offset, &chunk)) != 0)
+	{
+		entry.first_frame = rec->frames;
+		entry.time_ns = chunk.time_ns;
+		entry.offset = rec->offset;
+		entry.frames = chunk.frames;
+		entry.size = size;
+		if (pwrite(rec->idx_fd, &entry, sizeof(entry), rec->chunks * sizeof(entry)) != sizeof(entry))
+			return -EIO;
+		fprintf(stderr, "indexed chunk %llu at %llu\n", (unsigned long long)rec->chunks,
+			(unsigned long long)rec->offset);
+		rec->chunks++;
+		rec->offset += size;
+		rec->frames += chunk.frames;
+	}
+	if (ftruncate(rec->fd, rec->offset) < 0)
+		return -errno;
+	err = (fdatasync(rec->fd) < 0 || fdatasync(rec->idx_fd) < 0) ? -errno : 0;
+	if (lseek(rec->fd, rec->offset, SEEK_SET) < 0 || lseek(rec->idx_fd, 0, SEEK_END) < 0)
+		return -errno;
+	return err;
+}
+
+int adcrec_create(struct adcrec *rec, const char *name, unsigned int rate, unsigned int channels,
+		  unsigned int bits, unsigned int chunk_frames, const char *device, int append)
+{
+	struct adcrec_header *h = &rec->header;
+	char path[256];
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+	int err;
+
+	if (rate == 0 || channels == 0 || channels > ADCREC_MAX_CHANNELS || bits < 2 || bits > 16 || chunk_frames == 0)
+		return -EINVAL;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->idx_fd = -1;
+	snprintf(path, sizeof(path), "%s.adc", name);
+	rec->fd = open(path, flags, 0644);
+	if (rec->fd < 0)
+	{
+		err = -errno;
+		fprintf(stderr, "can't open %s:%s\n", path, strerror(-err));
+		return err;
+	}
+	snprintf(path, sizeof(path), "%s.idx", name);
+	rec->idx_fd = open(path, flags, 0644);
+	if (rec->idx_fd < 0)
+	{
+		err = -errno;
+		fprintf(stderr, "can't open %s:%s\n", path, strerror(-err));
+		goto out;
+	}
+
+	if (append && pread(rec->fd, h, sizeof(*h), 0) == sizeof(*h) && h->magic == ADCREC_MAGIC)
+	{
+		if (h->version != ADCREC_VERSION || h->rate != rate || h->channels != channels || h->bits != bits)
+		{
+			fprintf(stderr, "%s.adc is %uHz %uch %u bits\n", name, h->rate, h->channels, h->bits);
+			err = -EINVAL;
+			goto out;
+		}
+		// the chunks keep the size of the recording
+		chunk_frames = h->chunk_frames;
+		err = recover(rec);
+		if (err < 0)
+			goto out;
+	}
+	else
+	{
+		uint8_t page[ADCREC_ALIGN];
+
+		memset(page, 0, sizeof(page));
+		h = (struct adcrec_header *)page;
+		h->magic = ADCREC_MAGIC;
+		h->version = ADCREC_VERSION;
+		h->rate = rate;
+		h->channels = channels;
+		h->bits = bits;
+		h->chunk_frames = chunk_frames;
+		h->start_ns = 0;	// set by the first chunk
+		snprintf(h->device, sizeof(h->device), "%s", device ? device : "");
+		rec->header = *h;
+		if (ftruncate(rec->fd, 0) < 0 || ftruncate(rec->idx_fd, 0) < 0)
+		{
+			err = -errno;
+			goto out;
+		}
+		err = write_all(rec->fd, page, sizeof(page));
+		if (err < 0)
+			goto out;
+		rec->offset = sizeof(page);
+	}
+
+	rec->codes = malloc((size_t)channels * chunk_frames * sizeof(int16_t));
+	// a delta takes 3 bytes at most
+	rec->buffer = malloc(adcrec_align(sizeof(struct adcrec_chunk) + (size_t)channels * chunk_frames * 3));
+	rec->scratch = malloc((size_t)chunk_frames * 3);
+	if (!rec->codes || !rec->buffer || !rec->scratch)
+	{
+		err = -ENOMEM;
+		goto out;
+	}
+	return 0;
+
+out:
+	adcrec_close(rec);
+	return err;
+}
+
+int adcrec_flush(struct adcrec *rec)
+{
+	struct adcrec_header *h = &rec->header;
+	struct adcrec_chunk *chunk = (struct adcrec_chunk *)rec->buffer;
+	uint8_t *payload = rec->buffer + sizeof(*chunk);
+	struct adcrec_index entry;
+	size_t size = 0, total;
+	unsigned int c;
+	int err;
+
+	if (rec->fill == 0)
+		return 0;
+
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->magic = ADCREC_CHUNK_MAGIC;
+	chunk->frames = rec->fill;
+	chunk->first_frame = rec->frames;
+	chunk->time_ns = rec->fill_time_ns;
+	for (c = 0; c < h->channels; c++)
+	{
+		const int16_t *codes = rec->codes + (size_t)c * h->chunk_frames;
+		size_t packed = ((size_t)rec->fill * h->bits + 7) / 8;
+		size_t best, delta;
+
+		chunk->codec[c] = ADCREC_DELTA_PACK;
+		best = adcrec_delta_pack(codes, rec->fill, payload + size);
+		delta = adcrec_delta(codes, rec->fill, rec->scratch);
+		if (delta < best)
+		{
+			chunk->codec[c] = ADCREC_DELTA;
+			best = delta;
+			memcpy(payload + size, rec->scratch, delta);
+		}
+		if (packed <= best)
+		{
+			chunk->codec[c] = ADCREC_PACK;
+			best = adcrec_pack(codes, rec->fill, h->bits, payload + size);
+		}
+		chunk->chan_size[c] = best;
+		size += best;
+	}
+	chunk->size = size;
+	chunk->crc = adcrec_crc(payload, size);
+	total = adcrec_align(sizeof(*chunk) + size);
+	memset(payload + size, 0, total - sizeof(*chunk) - size);
+
+	// the chunk on the medium before the index points to it
+	err = write_all(rec->fd, rec->buffer, total);
+	if (err == 0 && fdatasync(rec->fd) < 0)
+		err = -errno;
+	if (err < 0)
+		return err;
+
+	entry.first_frame = rec->frames;
+	entry.time_ns = chunk->time_ns;
+	entry.offset = rec->offset;
+	entry.frames = chunk->frames;
+	entry.size = total;
+	err = write_all(rec->idx_fd, &entry, sizeof(entry));
+	if (err == 0 && fdatasync(rec->idx_fd) < 0)
+		err = -errno;
+	if (err < 0)
+		return err;
+
+	if (h->start_ns == 0)
+	{
+		h->start_ns = chunk->time_ns;
+		if (pwrite(rec->fd, h, sizeof(*h), 0) != sizeof(*h))
+			return -EIO;
+	}
+
+	rec->offset += total;
+	rec->bytes += total + sizeof(entry);
+	rec->frames += rec->fill;
+	rec->chunks++;
+	rec->fill = 0;
+	return 0;
+}
+
+int adcrec_write(struct adcrec *rec, const int16_t *frames, unsigned int n, int64_t time_ns, int gap)
+{
+	struct adcrec_header *h = &rec->header;
+	int shift = 16 - h->bits;
+	unsigned int i, c;
+	int err;
+
+	if (gap && (err = adcrec_flush(rec)) < 0)
+		return err;
+	for (i = 0; i < n; i++)
+	{
+		if (rec->fill == 0)
+			rec->fill_time_ns = time_ns + adcrec_frames_ns(h, i);
+		for (c = 0; c < h->channels; c++)
+			rec->codes[(size_t)c * h->chunk_frames + rec->fill] = frames[i * h->channels + c] >> shift;
+		if (++rec->fill == h->chunk_frames && (err = adcrec_flush(rec)) < 0)
+			return err;
+	}
+	return 0;
+}
+
+// =======================
+// reader
+// =======================
+int adcrec_open(struct adcrec *rec, const char *name)
+{
+	char path[256];
+	struct stat st;
+	void *addr;
+	int fd;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->fd = rec->idx_fd = -1;
+
+	snprintf(path, sizeof(path), "%s.adc", name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(rec->header))
+	{
+		fprintf(stderr, "can't open %s:%s\n", path, strerror(errno ? errno : EINVAL));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return -errno;
+	rec->map = addr;
+	rec->map_size = st.st_size;
+	memcpy(&rec->header, rec->map, sizeof(rec->header));
+	if (rec->header.magic != ADCREC_MAGIC || rec->header.version != ADCREC_VERSION ||
+	    rec->header.channels == 0 || rec->header.channels > ADCREC_MAX_CHANNELS || rec->header.rate == 0)
+	{
+		fprintf(stderr, "%s is not a recording\n", path);
+		adcrec_close(rec);
+		return -EINVAL;
+	}
+
+	snprintf(path, sizeof(path), "%s.idx", name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		fprintf(stderr, "can't open %s:%s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		adcrec_close(rec);
+		return -1;
+	}
+	rec->nindex = st.st_size / sizeof(struct adcrec_index);
+	if (rec->nindex)
+	{
+		addr = mmap(NULL, rec->nindex * sizeof(struct adcrec_index), PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED)
+		{
+			close(fd);
+			adcrec_close(rec);
+			return -errno;
+		}
+		rec->index = addr;
+		rec->frames = rec->index[rec->nindex - 1].first_frame + rec->index[rec->nindex - 1].frames;
+	}
+	close(fd);
+	rec->chunks = rec->nindex;
+	return 0;
+}
+
+size_t adcrec_find_time(const struct adcrec *rec, int64_t time_ns)
+{
+	size_t lo = 0, hi = rec->nindex;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		const struct adcrec_index *e = &rec->index[mid];
+
+		if (e->time_ns + adcrec_frames_ns(&rec->header, e->frames) <= time_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int adcrec_decode(const struct adcrec *rec, size_t n, int16_t *codes)
+{
+	const struct adcrec_header *h = &rec->header;
+	const struct adcrec_index *e;
+	const struct adcrec_chunk *chunk;
+	const uint8_t *payload;
+	size_t pos = 0;
+	unsigned int c;
+	int err;
+
+	if (n >= rec->nindex)
+		return -EINVAL;
+	e = &rec->index[n];
+	if (e->offset + sizeof(*chunk) > rec->map_size)
+		return -EINVAL;
+	chunk = (const struct adcrec_chunk *)(rec->map + e->offset);
+	payload = (const uint8_t *)(chunk + 1);
+	if (chunk->magic != ADCREC_CHUNK_MAGIC || chunk->frames != e->frames ||
+	    e->offset + sizeof(*chunk) + chunk->size > rec->map_size || adcrec_crc(payload, chunk->size) != chunk->crc)
+		return -EIO;
+
+	for (c = 0; c < h->channels; c++)
+	{
+		int16_t *out = codes + (size_t)c * chunk->frames;
+
+		if (pos + chunk->chan_size[c] > chunk->size)
+			return -EIO;
+		switch (chunk->codec[c])
+		{
+			case ADCREC_PACK:
+				err = adcrec_unpack(payload + pos, chunk->chan_size[c], chunk->frames, h->bits, out);
+				break;
+			case ADCREC_DELTA:
+				err = adcrec_undelta(payload + pos, chunk->chan_size[c], chunk->frames, out);
+				break;
+			case ADCREC_DELTA_PACK:
+				err = adcrec_delta_unpack(payload + pos, chunk->chan_size[c], chunk->frames, out);
+				break;
+			default:
+				err = -EINVAL;
+		}
+		if (err < 0)
+			return -EIO;
+		pos += chunk->chan_size[c];
+	}
+	return 0;
+}
+
+void adcrec_close(struct adcrec *rec)
+{
+	if (rec->codes && rec->fill)
+		adcrec_flush(rec);
+	free(rec->codes);
+	free(rec->buffer);
+	free(rec->scratch);
+	if (rec->map)
+		munmap((void *)rec->map, rec->map_size);
+	if (rec->index)
+		munmap((void *)rec->index, rec->nindex * sizeof(struct adcrec_index));
+	if (rec->fd >= 0)
+		close(rec->fd);
+	if (rec->idx_fd >= 0)
+		close(rec->idx_fd);
+	memset(rec, 0, sizeof(*rec));
+	rec->fd = rec->idx_fd = -1;
+}
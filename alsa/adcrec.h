@@ -0,0 +1,122 @@
+/*
+ * ADC recording : compressed chunks of a capture with a time index
+ *
+ * <name>.adc holds a header then the chunks, each one a header and the codes
+ * of its channels one after the other. Each channel of a chunk takes the
+ * smallest of three codings : the codes bit-packed at their resolution, the
+ * zigzag deltas as varints, or the zigzag deltas bit-packed by blocks of
+ * ADCREC_BLOCK at the width of the largest one (a slow 10 bits sensor with a
+ * few codes of noise packs in 3 or 4 bits). A chunk is padded to ADCREC_ALIGN
+ * so that appending never rewrites a page already written.
+ *
+ * <name>.idx holds one fixed size entry per chunk (first frame, time, offset),
+ * a time or frame is found by bisection in the mapped index and only the
+ * chunks covering it are mapped and decoded.
+ *
+ * The index entry of a chunk is written after the chunk is synced, an index
+ * never points to a partial chunk. adcrec_open() in append mode drops a torn
+ * tail and indexes the complete chunks the index missed.
+ */
+#ifndef ADCREC_H
+#define ADCREC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADCREC_MAGIC		0x52434441	/* "ADCR" */
+#define ADCREC_CHUNK_MAGIC	0x4B4E4843	/* "CHNK" */
+#define ADCREC_VERSION		1
+#define ADCREC_MAX_CHANNELS	8
+#define ADCREC_ALIGN		4096
+#define ADCREC_BLOCK		64	/* deltas sharing a width */
+
+enum adcrec_codec
+{
+	ADCREC_PACK,		/* bits per code, offset binary */
+	ADCREC_DELTA,		/* zigzag delta from the previous code, LEB128 */
+	ADCREC_DELTA_PACK,	/* zigzag deltas, a width byte then the block packed */
+};
+
+struct adcrec_header
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	rate;
+	uint16_t	channels;
+	uint16_t	bits;		/* significant bits of the S16 samples */
+	uint32_t	chunk_frames;	/* nominal, a chunk closes early at a gap */
+	uint32_t	pad;
+	int64_t		start_ns;	/* CLOCK_REALTIME of the first frame */
+	char		device[32];
+};
+
+struct adcrec_chunk
+{
+	uint32_t	magic;
+	uint32_t	frames;
+	uint64_t	first_frame;	/* since the start of the recording */
+	int64_t		time_ns;	/* CLOCK_REALTIME of the first frame */
+	uint32_t	size;		/* payload bytes, without the padding */
+	uint32_t	crc;		/* of the payload */
+	uint8_t		codec[ADCREC_MAX_CHANNELS];
+	uint32_t	chan_size[ADCREC_MAX_CHANNELS];
+};
+
+struct adcrec_index
+{
+	uint64_t	first_frame;
+	int64_t		time_ns;
+	uint64_t	offset;		/* of the chunk header in the data file */
+	uint32_t	frames;
+	uint32_t	size;		/* chunk header, payload and padding */
+};
+
+struct adcrec
+{
+	int			fd;
+	int			idx_fd;
+	struct adcrec_header	header;
+	uint64_t		frames;		/* recorded */
+	uint64_t		offset;		/* end of the data file */
+	uint64_t		chunks;
+	uint64_t		bytes;		/* written, data and index */
+
+	/* writer, the chunk being filled, planar */
+	int16_t			*codes;
+	uint32_t		fill;
+	int64_t			fill_time_ns;
+	uint8_t			*buffer;
+	uint8_t			*scratch;
+
+	/* reader */
+	const uint8_t		*map;
+	size_t			map_size;
+	const struct adcrec_index *index;
+	size_t			nindex;
+};
+
+/* writer, 'append' continues an existing recording of the same format */
+int  adcrec_create(struct adcrec *rec, const char *name, unsigned int rate, unsigned int channels,
+		   unsigned int bits, unsigned int chunk_frames, const char *device, int append);
+/* interleaved S16 frames, 'time_ns' of the first one, a new chunk starts at a gap */
+int  adcrec_write(struct adcrec *rec, const int16_t *frames, unsigned int n, int64_t time_ns, int gap);
+int  adcrec_flush(struct adcrec *rec);
+
+/* reader, the data and the index mapped read only */
+int  adcrec_open(struct adcrec *rec, const char *name);
+/* first chunk ending after 'time_ns' */
+size_t adcrec_find_time(const struct adcrec *rec, int64_t time_ns);
+/* codes of a chunk, planar, codes[c * frames + i] */
+int  adcrec_decode(const struct adcrec *rec, size_t chunk, int16_t *codes);
+
+void adcrec_close(struct adcrec *rec);
+
+/* codecs, 'bits' per code for the packing */
+size_t adcrec_pack(const int16_t *codes, unsigned int n, unsigned int bits, uint8_t *out);
+int    adcrec_unpack(const uint8_t *in, size_t size, unsigned int n, unsigned int bits, int16_t *codes);
+size_t adcrec_delta(const int16_t *codes, unsigned int n, uint8_t *out);
+int    adcrec_undelta(const uint8_t *in, size_t size, unsigned int n, int16_t *codes);
+size_t adcrec_delta_pack(const int16_t *codes, unsigned int n, uint8_t *out);
+int    adcrec_delta_unpack(const uint8_t *in, size_t size, unsigned int n, int16_t *codes);
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * ADC sample bus : single producer/multiple consumers ring in shared memory
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "adcbus.h"
+
+static size_t adcbus_header_size(void)
+{
+	return (sizeof(struct adcbus_shm) + 63) & ~63UL;
+}
+
+static struct adcbus_block *adcbus_slot(struct adcbus *bus, uint64_t seq)
+{
+	return (struct adcbus_block *)(bus->slots + (seq & (bus->shm->nblocks - 1)) * bus->shm->block_size);
+}
+
+static int futex_wait(uint32_t *addr, uint32_t val, int timeout_ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+}
+
+static int futex_wake(uint32_t *addr)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// =======================
+// producer
+// =======================
+int adcbus_create(struct adcbus *bus, const char *name, unsigned int nblocks, unsigned int max_samples,
+		  unsigned int nchan, unsigned int bits, const char *source)
+{
+	size_t block_size = (sizeof(struct adcbus_block) + max_samples * sizeof(uint16_t) + 63) & ~63UL;
+	struct adcbus_shm *shm;
+	void *addr;
+	unsigned int i;
+
+	if (nblocks == 0 || (nblocks & (nblocks - 1)))
+		return -EINVAL;
+
+	memset(bus, 0, sizeof(*bus));
+	bus->size = adcbus_header_size() + nblocks * block_size;
+	bus->owner = 1;
+
+	if (name)
+	{
+		int fd;
+
+		snprintf(bus->name, sizeof(bus->name), "/%s", name);
+		fd = shm_open(bus->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			fprintf(stderr, "can't create %s:%s\n", bus->name, strerror(errno));
+			return -errno;
+		}
+		if (ftruncate(fd, bus->size) < 0)
+		{
+			int err = -errno;
+			close(fd);
+			shm_unlink(bus->name);
+			return err;
+		}
+		addr = mmap(NULL, bus->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	else
+	{
+		addr = mmap(NULL, bus->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	}
+	if (addr == MAP_FAILED)
+	{
+		if (name)
+			shm_unlink(bus->name);
+		return -errno;
+	}
+
+	shm = addr;
+	memset(shm, 0, adcbus_header_size());
+	shm->version = ADCBUS_VERSION;
+	shm->nblocks = nblocks;
+	shm->block_size = block_size;
+	shm->max_samples = max_samples;
+	shm->nchan = nchan;
+	shm->bits = bits;
+	snprintf(shm->source, sizeof(shm->source), "%s", source);
+	shm->writer_pid = getpid();
+
+	bus->shm = shm;
+	bus->slots = (uint8_t *)addr + adcbus_header_size();
+	for (i = 0; i < nblocks; i++)
+		adcbus_slot(bus, i)->seq = ADCBUS_WRITING;
+
+	/* readers check the magic last */
+	__atomic_store_n(&shm->magic, ADCBUS_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* the slot of the next block, readers see it as being written */
+struct adcbus_block *adcbus_claim(struct adcbus *bus)
+{
+	struct adcbus_block *block = adcbus_slot(bus, bus->shm->head);
+
+	__atomic_store_n(&block->seq, ADCBUS_WRITING, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return block;
+}
+
+void adcbus_publish(struct adcbus *bus, struct adcbus_block *block)
+{
+	struct adcbus_shm *shm = bus->shm;
+	uint64_t head = shm->head;
+
+	__atomic_store_n(&block->seq, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&shm->futex, 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&shm->waiters, __ATOMIC_ACQUIRE))
+		futex_wake(&shm->futex);
+}
+
+// =======================
+// consumers
+// =======================
+int adcbus_attach(struct adcbus *bus, const char *name)
+{
+	struct adcbus_shm *shm;
+	struct stat st;
+	void *addr;
+	int fd;
+
+	memset(bus, 0, sizeof(*bus));
+	snprintf(bus->name, sizeof(bus->name), "/%s", name);
+	fd = shm_open(bus->name, O_RDWR, 0);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < adcbus_header_size())
+	{
+		close(fd);
+		return -EINVAL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	shm = addr;
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != ADCBUS_MAGIC
+	    || shm->version != ADCBUS_VERSION
+	    || adcbus_header_size() + (size_t)shm->nblocks * shm->block_size > (size_t)st.st_size)
+	{
+		munmap(addr, st.st_size);
+		return -EINVAL;
+	}
+
+	bus->shm = shm;
+	bus->slots = (uint8_t *)addr + adcbus_header_size();
+	bus->size = st.st_size;
+	return 0;
+}
+
+/* take a reader slot, slots of dead processes are reclaimed */
+int adcbus_reader_open(struct adcbus_reader *reader, struct adcbus *bus)
+{
+	int32_t pid = getpid();
+	unsigned int i;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->bus = bus;
+	reader->cursor = __atomic_load_n(&bus->shm->head, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < ADCBUS_MAX_READERS; i++)
+	{
+		struct adcbus_reader_slot *slot = &bus->shm->readers[i];
+		int32_t owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+
+		if (owner && kill(owner, 0) == 0)
+			continue;
+		if (__atomic_compare_exchange_n(&slot->pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			slot->cursor = reader->cursor;
+			slot->lost = 0;
+			reader->slot = slot;
+			return 0;
+		}
+	}
+	/* reading works without a slot, it is only used to monitor the readers */
+	return 0;
+}
+
+void adcbus_reader_close(struct adcbus_reader *reader)
+{
+	if (reader->slot)
+		__atomic_store_n(&reader->slot->pid, 0, __ATOMIC_RELEASE);
+	reader->slot = NULL;
+}
+
+static void adcbus_reader_update(struct adcbus_reader *reader)
+{
+	if (reader->slot)
+	{
+		__atomic_store_n(&reader->slot->cursor, reader->cursor, __ATOMIC_RELAXED);
+		__atomic_store_n(&reader->slot->lost, reader->lost, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Next block in place, NULL on timeout. The block stays valid until
+ * adcbus_release that tells if the producer overwrote it meanwhile.
+ */
+const struct adcbus_block *adcbus_next(struct adcbus_reader *reader, int timeout_ms)
+{
+	struct adcbus_shm *shm = reader->bus->shm;
+
+	for (;;)
+	{
+		uint32_t futex = __atomic_load_n(&shm->futex, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+		const struct adcbus_block *block;
+
+		if (reader->cursor == head)
+		{
+			int ret;
+
+			__atomic_add_fetch(&shm->waiters, 1, __ATOMIC_ACQ_REL);
+			ret = futex_wait(&shm->futex, futex, timeout_ms);
+			__atomic_sub_fetch(&shm->waiters, 1, __ATOMIC_ACQ_REL);
+			if (ret < 0 && errno == ETIMEDOUT)
+				return NULL;
+			if (ret < 0 && errno == EINTR)
+				return NULL;
+			continue;
+		}
+
+		/* overrun : jump to the oldest block that can't be under write */
+		if (head - reader->cursor >= shm->nblocks)
+		{
+			uint64_t oldest = head - shm->nblocks + 1;
+			reader->lost += oldest - reader->cursor;
+			reader->cursor = oldest;
+			adcbus_reader_update(reader);
+		}
+
+		block = adcbus_slot(reader->bus, reader->cursor);
+		if (__atomic_load_n(&block->seq, __ATOMIC_ACQUIRE) != reader->cursor)
+		{
+			reader->lost++;
+			reader->cursor++;
+			adcbus_reader_update(reader);
+			continue;
+		}
+		return block;
+	}
+}
+
+int adcbus_release(struct adcbus_reader *reader, const struct adcbus_block *block)
+{
+	int ret = 0;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&block->seq, __ATOMIC_RELAXED) != reader->cursor)
+	{
+		reader->lost++;
+		ret = -EOVERFLOW;
+	}
+	reader->cursor++;
+	adcbus_reader_update(reader);
+	return ret;
+}
+
+void adcbus_close(struct adcbus *bus)
+{
+	if (!bus->shm)
+		return;
+	munmap(bus->shm, bus->size);
+	if (bus->owner && bus->name[0])
+		shm_unlink(bus->name);
+	bus->shm = NULL;
+}
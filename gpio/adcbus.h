@@ -0,0 +1,90 @@
+/*
+ * ADC sample bus : single producer/multiple consumers ring in shared memory
+ *
+ * The acquisition service publishes blocks in /dev/shm/<name>, readers map
+ * the same memory and read the blocks in place. Each reader owns its cursor,
+ * a reader too slow is detected and skips the overwritten blocks, the
+ * producer never waits for the readers.
+ */
+#ifndef ADCBUS_H
+#define ADCBUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADCBUS_MAGIC		0x42434441	/* "ADCB" */
+#define ADCBUS_VERSION		1
+#define ADCBUS_MAX_READERS	16
+#define ADCBUS_WRITING		UINT64_MAX
+
+struct adcbus_block
+{
+	uint64_t	seq;		/* block number, ADCBUS_WRITING while updated */
+	uint64_t	ts_ns;		/* CLOCK_MONOTONIC of the first conversion */
+	uint64_t	duration_ns;
+	uint32_t	nsamples;	/* interleaved samples */
+	uint16_t	nchan;
+	uint16_t	bits;
+	uint16_t	data[];
+};
+
+struct adcbus_reader_slot
+{
+	int32_t		pid;		/* 0 when free */
+	uint32_t	pad;
+	uint64_t	cursor;
+	uint64_t	lost;
+};
+
+struct adcbus_shm
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nblocks;	/* power of 2 */
+	uint32_t	block_size;	/* bytes per slot */
+	uint32_t	max_samples;
+	uint32_t	nchan;
+	uint32_t	bits;
+	uint32_t	rate;		/* measured frames per second */
+	char		source[32];
+	int32_t		writer_pid;
+	uint32_t	futex;		/* incremented on each publish */
+	uint32_t	waiters;
+	uint32_t	pad;
+	uint64_t	head;		/* number of published blocks */
+	struct adcbus_reader_slot readers[ADCBUS_MAX_READERS];
+};
+
+struct adcbus
+{
+	struct adcbus_shm	*shm;
+	uint8_t			*slots;
+	size_t			size;
+	char			name[64];
+	int			owner;
+};
+
+struct adcbus_reader
+{
+	struct adcbus			*bus;
+	struct adcbus_reader_slot	*slot;
+	uint64_t			cursor;
+	uint64_t			lost;
+};
+
+/* producer, a NULL name creates a bus private to the process */
+int  adcbus_create(struct adcbus *bus, const char *name, unsigned int nblocks, unsigned int max_samples,
+		   unsigned int nchan, unsigned int bits, const char *source);
+struct adcbus_block *adcbus_claim(struct adcbus *bus);
+void adcbus_publish(struct adcbus *bus, struct adcbus_block *block);
+
+/* consumers */
+int  adcbus_attach(struct adcbus *bus, const char *name);
+int  adcbus_reader_open(struct adcbus_reader *reader, struct adcbus *bus);
+void adcbus_reader_close(struct adcbus_reader *reader);
+const struct adcbus_block *adcbus_next(struct adcbus_reader *reader, int timeout_ms);
+int  adcbus_release(struct adcbus_reader *reader, const struct adcbus_block *block);
+
+void adcbus_close(struct adcbus *bus);
+
+#endif
@@ -0,0 +1,59 @@
+#!/usr/bin/python
+# Reader of the ADC sample bus published by adcd (see adcbus.h)
+
+import mmap
+import os
+import struct
+
+SHM_FORMAT = "=8I32siIIIQ"
+BLOCK_FORMAT = "=QQQIHH"
+MAGIC = 0x42434441
+VERSION = 1
+MAX_READERS = 16
+READER_SIZE = 24
+
+class AdcBus:
+    def __init__(self, name):
+        fd = os.open("/dev/shm/" + name, os.O_RDONLY)
+        try:
+            self.mem = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+        finally:
+            os.close(fd)
+        (magic, version, self.nblocks, self.block_size, self.max_samples,
+         self.nchan, self.bits, self.rate, source, self.writer_pid,
+         _futex, _waiters, _pad, _head) = struct.unpack_from(SHM_FORMAT, self.mem, 0)
+        if magic != MAGIC or version != VERSION:
+            raise IOError("not an adcbus")
+        self.source = source.split(b"\0")[0].decode()
+        header = struct.calcsize(SHM_FORMAT) + MAX_READERS * READER_SIZE
+        self.slots = (header + 63) & ~63
+        self.head_offset = struct.calcsize(SHM_FORMAT) - 8
+
+    def head(self):
+        return struct.unpack_from("=Q", self.mem, self.head_offset)[0]
+
+    def latest(self):
+        """ last frame of the last published block, one code per channel """
+        while True:
+            head = self.head()
+            if head == 0:
+                return None
+            seq = head - 1
+            offset = self.slots + (seq % self.nblocks) * self.block_size
+            (bseq, ts, duration, nsamples, nchan, bits) = struct.unpack_from(BLOCK_FORMAT, self.mem, offset)
+            if bseq != seq:
+                continue
+            frame = struct.unpack_from("=%dH" % nchan, self.mem, offset + struct.calcsize(BLOCK_FORMAT) + 2 * (nsamples - nchan))
+            # block overwritten while reading, take the next one
+            if struct.unpack_from("=Q", self.mem, offset)[0] == seq:
+                return frame
+
+    def close(self):
+        self.mem.close()
+
+if __name__ == '__main__':
+    import sys
+    bus = AdcBus(sys.argv[1] if len(sys.argv) > 1 else "adc0")
+    print("source:%s nchan:%d bits:%d rate:%d" % (bus.source, bus.nchan, bus.bits, bus.rate))
+    print(bus.latest())
+    bus.close()
@@ -0,0 +1,144 @@
+/*
+ * adcbus reader : dump, benchmark or monitor a bus published by adcd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "adcbus.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void list_readers(struct adcbus *bus)
+{
+	struct adcbus_shm *shm = bus->shm;
+	uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	unsigned int i;
+
+	printf("source:%s writer:%d nchan:%u bits:%u rate:%u Hz blocks:%u x %u samples head:%llu\n",
+	       shm->source, shm->writer_pid, shm->nchan, shm->bits, shm->rate,
+	       shm->nblocks, shm->max_samples, (unsigned long long)head);
+	for (i = 0; i < ADCBUS_MAX_READERS; i++)
+	{
+		struct adcbus_reader_slot *slot = &shm->readers[i];
+		if (slot->pid)
+			printf("reader pid:%d behind:%llu lost:%llu\n", slot->pid,
+			       (unsigned long long)(head - slot->cursor), (unsigned long long)slot->lost);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t] [-b seconds] [-l] name\n"
+			"\t-t : text output (one line per frame), binary blocks otherwise\n"
+			"\t-b : benchmark, report rates after the given duration\n"
+			"\t-l : list the bus readers\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct adcbus bus;
+	struct adcbus_reader reader;
+	int text = 0;
+	int bench = 0;
+	int list = 0;
+	uint64_t start, samples = 0, blocks = 0, latency = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "tb:lh")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': text = 1; break;
+			case 'b': bench = atoi(optarg); break;
+			case 'l': list = 1; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (optind >= argc)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	ret = adcbus_attach(&bus, argv[optind]);
+	if (ret < 0)
+	{
+		fprintf(stderr, "can't attach %s:%s\n", argv[optind], strerror(-ret));
+		return -1;
+	}
+	if (list)
+	{
+		list_readers(&bus);
+		adcbus_close(&bus);
+		return 0;
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	adcbus_reader_open(&reader, &bus);
+	start = now_ns();
+	while (!quit)
+	{
+		const struct adcbus_block *block = adcbus_next(&reader, 1000);
+
+		if (block)
+		{
+			blocks++;
+			samples += block->nsamples;
+			latency += now_ns() - block->ts_ns;
+			if (text)
+			{
+				unsigned int i;
+				for (i = 0; i < block->nsamples; i += block->nchan)
+				{
+					unsigned int c;
+					printf("%llu", (unsigned long long)(block->ts_ns + block->duration_ns * i / block->nsamples));
+					for (c = 0; c < block->nchan; c++)
+						printf(" %u", block->data[i + c]);
+					printf("\n");
+				}
+			}
+			else if (!bench)
+			{
+				fwrite(block, sizeof(*block) + block->nsamples * sizeof(uint16_t), 1, stdout);
+			}
+			if (adcbus_release(&reader, block) < 0 && text)
+				fprintf(stderr, "block overwritten while reading\n");
+		}
+
+		if (bench && now_ns() - start >= (uint64_t)bench * 1000000000ULL)
+			break;
+	}
+
+	if (bench)
+	{
+		double elapsed = (now_ns() - start) / 1e9;
+		printf("elapsed:%.3f s samples:%llu rate:%.0f samples/s blocks:%llu lost:%llu latency:%.1f us\n",
+		       elapsed, (unsigned long long)samples, samples / elapsed,
+		       (unsigned long long)blocks, (unsigned long long)reader.lost,
+		       blocks ? latency / blocks / 1e3 : 0.0);
+	}
+
+	adcbus_reader_close(&reader);
+	adcbus_close(&bus);
+	return 0;
+}
@@ -0,0 +1,544 @@
+/*
+ * ADC acquisition service (MCP3002 on SPI, PCF8591 on I2C)
+ *
+ * A real-time thread converts one block per bus transaction, from
+ * preallocated transfers, directly into the slots of an adcbus ring.
+ * Published with -P, any number of readers can map the ring from
+ * /dev/shm without adding bus transfers. Without -P the ring is private
+ * and the main thread writes the blocks to the output.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "spibus.h"
+#include "adcbus.h"
+
+#define PCF8591_ADDR		0x48
+#define PCF8591_CONTROL		0x44	/* analog output enable (keeps oscillator on), auto-increment, channel 0 */
+#define PCF8591_NB_CHAN		4
+#define PCF8591_I2C_SPEED	100000
+
+#define ACQ_MAX_ERRORS		100		/* consecutive conversion failures before giving up */
+#define ACQ_RETRY_NS		10000000ULL	/* wait before a retry while the block period is unknown */
+
+struct acquisition;
+
+struct adc_source
+{
+	const char	*name;
+	unsigned int	nchan_max;
+	unsigned int	bits;
+	int		(*open)(struct acquisition *acq, const char *device, const char *backend);
+	/* convert acq->batch interleaved samples */
+	int		(*convert)(struct acquisition *acq, uint16_t *data);
+	void		(*close)(struct acquisition *acq);
+};
+
+struct acquisition
+{
+	const struct adc_source	*source;
+	unsigned int		nchan;
+	unsigned int		batch;		/* samples per bus transaction */
+	uint32_t		speed_hz;
+
+	/* MCP3002 : preallocated message */
+	struct spibus		bus;
+	struct spi_ioc_transfer	*tr;
+	uint8_t			*tx;
+	uint8_t			*rx;
+
+	/* PCF8591 : i2c-dev or simulation */
+	int			i2c_fd;
+	int			i2c_addr;
+	int			i2c_sim;
+	uint64_t		i2c_sim_phase;
+	struct i2c_msg		msgs[2];
+	uint8_t			control;
+
+	struct adcbus		ring;
+	uint64_t		errors;
+
+	int			priority;
+	int			cpu;
+	volatile int		stop;
+	volatile int		failed;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// =======================
+// MCP3002 source
+// =======================
+static int mcp3002_open(struct acquisition *acq, const char *device, const char *backend)
+{
+	const struct spibus_ops *ops;
+	unsigned int i;
+	int ret;
+
+	if (strcmp(backend, "sim") == 0)
+		backend = "sim-mcp3002";
+	ops = spibus_lookup(backend);
+	if (!ops)
+	{
+		fprintf(stderr, "unknown backend %s\n", backend);
+		return -EINVAL;
+	}
+	ret = spibus_open(&acq->bus, ops, device ? device : "/dev/spidev0.0", acq->speed_hz);
+	if (ret < 0)
+		return ret;
+
+	acq->tr = calloc(acq->batch, sizeof(*acq->tr));
+	acq->tx = calloc(acq->batch, 2);
+	acq->rx = calloc(acq->batch, 2);
+	if (!acq->tr || !acq->tx || !acq->rx)
+		return -ENOMEM;
+
+	/* channels are interleaved, chip select toggles between conversions */
+	for (i = 0; i < acq->batch; i++)
+	{
+		acq->tx[2*i] = mcp3002_cmd(i % acq->nchan);
+		acq->tr[i].tx_buf = (unsigned long)&acq->tx[2*i];
+		acq->tr[i].rx_buf = (unsigned long)&acq->rx[2*i];
+		acq->tr[i].len = 2;
+		acq->tr[i].speed_hz = acq->speed_hz;
+		acq->tr[i].bits_per_word = 8;
+		acq->tr[i].cs_change = (i != acq->batch - 1);
+	}
+	return 0;
+}
+
+static int mcp3002_convert(struct acquisition *acq, uint16_t *data)
+{
+	unsigned int i;
+	int ret = spibus_transfer(&acq->bus, acq->tr, acq->batch);
+
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < acq->batch; i++)
+		data[i] = mcp3002_decode(&acq->rx[2*i]);
+	return 0;
+}
+
+static void mcp3002_close(struct acquisition *acq)
+{
+	spibus_close(&acq->bus);
+	free(acq->rx);
+	free(acq->tx);
+	free(acq->tr);
+}
+
+static const struct adc_source adc_source_mcp3002 = {
+	.name		= "mcp3002",
+	.nchan_max	= 2,
+	.bits		= 10,
+	.open		= mcp3002_open,
+	.convert	= mcp3002_convert,
+	.close		= mcp3002_close,
+};
+
+// =======================
+// PCF8591 source
+// =======================
+static int pcf8591_open(struct acquisition *acq, const char *device, const char *backend)
+{
+	/* the control byte restarts the auto-increment on channel 0, the first byte read is stale */
+	acq->control = PCF8591_CONTROL;
+	acq->rx = calloc(acq->batch + 1, 1);
+	if (!acq->rx)
+		return -ENOMEM;
+
+	acq->msgs[0].addr = acq->i2c_addr;
+	acq->msgs[0].flags = 0;
+	acq->msgs[0].len = 1;
+	acq->msgs[0].buf = &acq->control;
+	acq->msgs[1].addr = acq->i2c_addr;
+	acq->msgs[1].flags = I2C_M_RD;
+	acq->msgs[1].len = acq->batch + 1;
+	acq->msgs[1].buf = acq->rx;
+
+	if (strcmp(backend, "sim") == 0)
+	{
+		acq->i2c_sim = 1;
+		acq->i2c_fd = -1;
+		return 0;
+	}
+
+	if (!device)
+		device = "/dev/i2c-0";
+	acq->i2c_fd = open(device, O_RDWR);
+	if (acq->i2c_fd < 0)
+	{
+		fprintf(stderr, "can't open %s:%s\n", device, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+static int pcf8591_convert(struct acquisition *acq, uint16_t *data)
+{
+	unsigned int i;
+
+	if (acq->i2c_sim)
+	{
+		/* deterministic ramps, 9 bits per byte on the wire */
+		uint64_t ns = (uint64_t)(acq->batch + 4) * 9 * 1000000000ULL / PCF8591_I2C_SPEED;
+		struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+		for (i = 0; i < acq->batch; i++)
+			acq->rx[i + 1] = (uint8_t)(acq->i2c_sim_phase++ >> 2) + 64 * (i % PCF8591_NB_CHAN);
+		nanosleep(&ts, NULL);
+	}
+	else
+	{
+		struct i2c_rdwr_ioctl_data rdwr = { acq->msgs, 2 };
+
+		if (ioctl(acq->i2c_fd, I2C_RDWR, &rdwr) < 0)
+			return -errno;
+	}
+
+	for (i = 0; i < acq->batch; i++)
+		data[i] = acq->rx[i + 1];
+	return 0;
+}
+
+static void pcf8591_close(struct acquisition *acq)
+{
+	if (acq->i2c_fd >= 0)
+		close(acq->i2c_fd);
+	free(acq->rx);
+}
+
+static const struct adc_source adc_source_pcf8591 = {
+	.name		= "pcf8591",
+	.nchan_max	= PCF8591_NB_CHAN,
+	.bits		= 8,
+	.open		= pcf8591_open,
+	.convert	= pcf8591_convert,
+	.close		= pcf8591_close,
+};
+
+// =======================
+// acquisition thread
+// =======================
+static void *acquisition_thread(void *arg)
+{
+	struct acquisition *acq = arg;
+	uint64_t prev_ts = 0;
+	uint64_t period_ns = ACQ_RETRY_NS;
+	unsigned int failures = 0;
+	double rate = 0;
+
+	while (!acq->stop)
+	{
+		struct adcbus_block *block = adcbus_claim(&acq->ring);
+		uint64_t ts = now_ns();
+		int ret = acq->source->convert(acq, block->data);
+
+		if (ret < 0)
+		{
+			/* a real-time thread must not spin on a failing bus, retry each block period */
+			struct timespec wait = { period_ns / 1000000000ULL, period_ns % 1000000000ULL };
+
+			acq->errors++;
+			if (failures++ == 0)
+				fprintf(stderr, "%s convert failed:%s\n", acq->source->name, strerror(-ret));
+			if (failures >= ACQ_MAX_ERRORS)
+			{
+				fprintf(stderr, "%s convert failed %u times, stopping\n", acq->source->name, failures);
+				acq->failed = 1;
+				break;
+			}
+			nanosleep(&wait, NULL);
+			prev_ts = 0;
+			continue;
+		}
+		failures = 0;
+
+		block->ts_ns = ts;
+		block->duration_ns = now_ns() - ts;
+		block->nsamples = acq->batch;
+		block->nchan = acq->nchan;
+		block->bits = acq->source->bits;
+		adcbus_publish(&acq->ring, block);
+
+		/* frames per second seen by the readers */
+		if (prev_ts)
+		{
+			double r = (acq->batch / acq->nchan) * 1e9 / (ts - prev_ts);
+			rate = rate ? 0.9 * rate + 0.1 * r : r;
+			acq->ring.shm->rate = rate;
+			period_ns = ts - prev_ts;
+		}
+		prev_ts = ts;
+	}
+	return NULL;
+}
+
+static int acquisition_start(struct acquisition *acq, pthread_t *thread)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpuset;
+	int ret;
+
+	pthread_attr_init(&attr);
+	if (acq->priority > 0)
+	{
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = acq->priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (acq->cpu >= 0)
+	{
+		CPU_ZERO(&cpuset);
+		CPU_SET(acq->cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+	}
+
+	ret = pthread_create(thread, &attr, acquisition_thread, acq);
+	if (ret == EPERM)
+	{
+		fprintf(stderr, "not allowed to use SCHED_FIFO, fallback to normal scheduling\n");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(thread, &attr, acquisition_thread, acq);
+	}
+	pthread_attr_destroy(&attr);
+	return -ret;
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-S source] [-d device] [-B backend] [-s speed_hz] [-A addr] [-c nchan] [-n batch]\n"
+			"\t[-P name] [-N nblocks] [-p priority] [-a cpu] [-o output] [-t] [-b seconds]\n"
+			"\t-S : mcp3002 (default) or pcf8591\n"
+			"\t-B : spidev (mcp3002 default), i2c-dev (pcf8591 default) or sim\n"
+			"\t-P : publish the blocks in /dev/shm/<name> for adcbus readers\n"
+			"\t-t : text output (one line per frame)\n"
+			"\t-b : benchmark, report rates after the given duration\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct acquisition acq;
+	struct adcbus_reader reader;
+	const char *device = NULL;
+	const char *backend = NULL;
+	const char *output = NULL;
+	const char *publish = NULL;
+	unsigned int nblocks = 64;
+	int text = 0;
+	int bench = 0;
+	int outfd = STDOUT_FILENO;
+	pthread_t thread;
+	uint64_t start, samples = 0, blocks = 0, latency = 0;
+	double cpu;
+	int opt, ret;
+
+	memset(&acq, 0, sizeof(acq));
+	acq.source = &adc_source_mcp3002;
+	acq.nchan = 0;
+	acq.batch = 256;
+	acq.speed_hz = 1000000;
+	acq.i2c_addr = PCF8591_ADDR;
+	acq.i2c_fd = -1;
+	acq.priority = 50;
+	acq.cpu = -1;
+
+	while ((opt = getopt(argc, argv, "S:d:B:s:A:c:n:P:N:p:a:o:tb:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'S':
+				if (strcmp(optarg, "pcf8591") == 0)
+					acq.source = &adc_source_pcf8591;
+				else if (strcmp(optarg, "mcp3002") != 0)
+				{
+					fprintf(stderr, "unknown source %s\n", optarg);
+					return -1;
+				}
+				break;
+			case 'd': device = optarg; break;
+			case 'B': backend = optarg; break;
+			case 's': acq.speed_hz = strtoul(optarg, NULL, 0); break;
+			case 'A': acq.i2c_addr = strtoul(optarg, NULL, 0); break;
+			case 'c': acq.nchan = atoi(optarg); break;
+			case 'n': acq.batch = atoi(optarg); break;
+			case 'P': publish = optarg; break;
+			case 'N': nblocks = atoi(optarg); break;
+			case 'p': acq.priority = atoi(optarg); break;
+			case 'a': acq.cpu = atoi(optarg); break;
+			case 'o': output = optarg; break;
+			case 't': text = 1; break;
+			case 'b': bench = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+
+	if (!backend)
+		backend = (acq.source == &adc_source_pcf8591) ? "i2c-dev" : "spidev";
+	if (acq.nchan == 0)
+		acq.nchan = acq.source->nchan_max;
+	if (acq.source == &adc_source_pcf8591 && acq.nchan != PCF8591_NB_CHAN)
+	{
+		fprintf(stderr, "pcf8591 auto-increment converts the %d channels\n", PCF8591_NB_CHAN);
+		return -1;
+	}
+	if (acq.nchan < 1 || acq.nchan > acq.source->nchan_max)
+	{
+		fprintf(stderr, "nchan should be in [1,%u]\n", acq.source->nchan_max);
+		return -1;
+	}
+	if (acq.batch < acq.nchan || acq.batch > SPIBUS_MAX_TRANSFERS)
+	{
+		fprintf(stderr, "batch should be in [%u,%zu]\n", acq.nchan, SPIBUS_MAX_TRANSFERS);
+		return -1;
+	}
+	acq.batch -= acq.batch % acq.nchan;
+
+	ret = adcbus_create(&acq.ring, publish, nblocks, acq.batch, acq.nchan, acq.source->bits, acq.source->name);
+	if (ret < 0)
+	{
+		fprintf(stderr, "adcbus_create failed:%s\n", strerror(-ret));
+		return -1;
+	}
+
+	if (acq.source->open(&acq, device, backend) < 0)
+	{
+		adcbus_close(&acq.ring);
+		return -1;
+	}
+
+	/* a published bus is read by its clients, output only when asked */
+	if (!publish || output || text || bench)
+	{
+		if (output && strcmp(output, "-") != 0 && !bench)
+		{
+			outfd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (outfd < 0)
+			{
+				fprintf(stderr, "can't open %s:%s\n", output, strerror(errno));
+				return -1;
+			}
+		}
+		adcbus_reader_open(&reader, &acq.ring);
+	}
+	else
+	{
+		reader.bus = NULL;
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	start = now_ns();
+	cpu = cpu_seconds();
+	ret = acquisition_start(&acq, &thread);
+	if (ret < 0)
+	{
+		fprintf(stderr, "acquisition_start failed:%s\n", strerror(-ret));
+		return -1;
+	}
+
+	while (!quit && !acq.failed)
+	{
+		const struct adcbus_block *block;
+
+		if (!reader.bus)
+		{
+			/* wakes up to notice a failed acquisition */
+			sleep(1);
+			continue;
+		}
+
+		block = adcbus_next(&reader, 1000);
+		if (block)
+		{
+			blocks++;
+			samples += block->nsamples;
+			latency += now_ns() - block->ts_ns;
+			if (!bench)
+			{
+				if (text)
+				{
+					unsigned int i;
+					for (i = 0; i < block->nsamples; i += block->nchan)
+					{
+						unsigned int c;
+						dprintf(outfd, "%llu", (unsigned long long)(block->ts_ns + block->duration_ns * i / block->nsamples));
+						for (c = 0; c < block->nchan; c++)
+							dprintf(outfd, " %u", block->data[i + c]);
+						dprintf(outfd, "\n");
+					}
+				}
+				else if (write(outfd, block, sizeof(*block) + block->nsamples * sizeof(uint16_t)) < 0)
+				{
+					quit = 1;
+				}
+			}
+			adcbus_release(&reader, block);
+		}
+
+		if (bench && now_ns() - start >= (uint64_t)bench * 1000000000ULL)
+			break;
+	}
+
+	acq.stop = 1;
+	pthread_join(thread, NULL);
+
+	if (bench)
+	{
+		double elapsed = (now_ns() - start) / 1e9;
+		cpu = cpu_seconds() - cpu;
+		printf("source:%s backend:%s nchan:%u batch:%u\n", acq.source->name, backend, acq.nchan, acq.batch);
+		printf("elapsed:%.3f s samples:%llu rate:%.0f samples/s transactions:%.0f /s\n",
+		       elapsed, (unsigned long long)samples, samples / elapsed, acq.ring.shm->head / elapsed);
+		printf("blocks:%llu lost:%llu errors:%llu latency:%.1f us cpu:%.1f %%\n",
+		       (unsigned long long)blocks, (unsigned long long)reader.lost, (unsigned long long)acq.errors,
+		       blocks ? latency / blocks / 1e3 : 0.0, 100.0 * cpu / elapsed);
+	}
+
+	if (reader.bus)
+		adcbus_reader_close(&reader);
+	acq.source->close(&acq);
+	adcbus_close(&acq.ring);
+	if (outfd != STDOUT_FILENO)
+		close(outfd);
+
+	return acq.failed ? -1 : 0;
+}
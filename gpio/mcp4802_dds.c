@@ -0,0 +1,362 @@
+/*
+ * MCP4802 DDS waveform generator
+ *
+ * Each channel runs a 32 bits phase accumulator over a table of precomputed
+ * SPI frames. Many updates are sent per SPI_IOC_MESSAGE, the update rate is
+ * paced with the delay_usecs of the transfers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "spibus.h"
+
+#define TABLE_BITS	10
+#define TABLE_SIZE	(1 << TABLE_BITS)
+
+struct channel
+{
+	uint8_t		frames[TABLE_SIZE][2];	/* precomputed SPI frames */
+	uint32_t	phase;
+	uint32_t	step;			/* phase increment per update */
+};
+
+struct generator
+{
+	struct spibus		bus;
+	struct channel		chan[2];
+	unsigned int		nchan;
+	unsigned int		rate;		/* updates per second */
+	unsigned int		batch;		/* updates per message */
+	uint32_t		wire_ns;	/* time on the bus for one update */
+	uint64_t		period_frac;	/* pacing error accumulators */
+	int64_t			delay_err;
+
+	struct spi_ioc_transfer	*tr;
+	uint8_t			*tx;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// =======================
+// waveform tables
+// =======================
+static int load_arbitrary(const char *path, uint8_t *table)
+{
+	uint8_t *values = NULL;
+	unsigned int count = 0, size = 0, i;
+	unsigned int value;
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+	{
+		fprintf(stderr, "can't open %s:%s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fscanf(f, "%u", &value) == 1)
+	{
+		if (count == size)
+		{
+			size = size ? 2 * size : 256;
+			values = realloc(values, size);
+			if (!values)
+			{
+				fclose(f);
+				return -1;
+			}
+		}
+		values[count++] = (value > 255) ? 255 : value;
+	}
+	fclose(f);
+
+	if (count == 0)
+	{
+		fprintf(stderr, "no value in %s\n", path);
+		free(values);
+		return -1;
+	}
+
+	/* stretch the samples over the table */
+	for (i = 0; i < TABLE_SIZE; i++)
+		table[i] = values[(uint64_t)i * count / TABLE_SIZE];
+	free(values);
+	return 0;
+}
+
+static int build_table(struct channel *chan, int id, const char *waveform)
+{
+	uint8_t table[TABLE_SIZE];
+	unsigned int i;
+
+	if (strcmp(waveform, "sine") == 0)
+	{
+		for (i = 0; i < TABLE_SIZE; i++)
+			table[i] = lrint(127.5 + 127.5 * sin(2 * M_PI * i / TABLE_SIZE));
+	}
+	else if (strcmp(waveform, "triangle") == 0)
+	{
+		for (i = 0; i < TABLE_SIZE; i++)
+			table[i] = (i < TABLE_SIZE/2) ? (i * 510 / TABLE_SIZE) : ((TABLE_SIZE - 1 - i) * 510 / TABLE_SIZE);
+	}
+	else if (strcmp(waveform, "square") == 0)
+	{
+		for (i = 0; i < TABLE_SIZE; i++)
+			table[i] = (i < TABLE_SIZE/2) ? 255 : 0;
+	}
+	else if (strcmp(waveform, "saw") == 0)
+	{
+		for (i = 0; i < TABLE_SIZE; i++)
+			table[i] = i * 256 / TABLE_SIZE;
+	}
+	else if (strncmp(waveform, "file:", 5) == 0)
+	{
+		if (load_arbitrary(waveform + 5, table) < 0)
+			return -1;
+	}
+	else
+	{
+		fprintf(stderr, "unknown waveform %s\n", waveform);
+		return -1;
+	}
+
+	for (i = 0; i < TABLE_SIZE; i++)
+		mcp4802_frame(chan->frames[i], id, table[i]);
+	return 0;
+}
+
+// =======================
+// generator
+// =======================
+static int generator_init(struct generator *gen, double freq[2])
+{
+	unsigned int ntr = gen->batch * gen->nchan;
+	unsigned int i;
+
+	gen->tr = calloc(ntr, sizeof(*gen->tr));
+	gen->tx = calloc(ntr, 2);
+	if (!gen->tr || !gen->tx)
+		return -ENOMEM;
+
+	for (i = 0; i < gen->nchan; i++)
+		gen->chan[i].step = (uint32_t)llrint(freq[i] * 4294967296.0 / gen->rate);
+
+	/* chip select rising edge latches each channel */
+	for (i = 0; i < ntr; i++)
+	{
+		gen->tr[i].tx_buf = (unsigned long)&gen->tx[2*i];
+		gen->tr[i].len = 2;
+		gen->tr[i].speed_hz = gen->bus.speed_hz;
+		gen->tr[i].bits_per_word = 8;
+		gen->tr[i].cs_change = (i != ntr - 1);
+	}
+	gen->wire_ns = (uint64_t)gen->nchan * 16 * 1000000000ULL / gen->bus.speed_hz;
+	return 0;
+}
+
+static void generator_release(struct generator *gen)
+{
+	free(gen->tx);
+	free(gen->tr);
+}
+
+/*
+ * Fill the next message : copy precomputed frames and spread the delay
+ * needed to reach the update period over the updates. 'late_ns' is removed
+ * from the delays so the long term rate stays locked on the clock.
+ */
+static void generator_fill(struct generator *gen, int64_t late_ns)
+{
+	uint64_t period_ns = 1000000000ULL / gen->rate;
+	uint64_t period_rem = 1000000000ULL % gen->rate;
+	uint8_t *tx = gen->tx;
+	unsigned int i, c;
+
+	for (i = 0; i < gen->batch; i++)
+	{
+		struct spi_ioc_transfer *last = &gen->tr[(i + 1) * gen->nchan - 1];
+		int64_t delay_ns = period_ns - gen->wire_ns;
+
+		for (c = 0; c < gen->nchan; c++)
+		{
+			struct channel *chan = &gen->chan[c];
+			const uint8_t *frame = chan->frames[chan->phase >> (32 - TABLE_BITS)];
+			tx[0] = frame[0];
+			tx[1] = frame[1];
+			tx += 2;
+			chan->phase += chan->step;
+		}
+
+		gen->period_frac += period_rem;
+		if (gen->period_frac >= gen->rate)
+		{
+			gen->period_frac -= gen->rate;
+			delay_ns++;
+		}
+		if (late_ns > 0)
+		{
+			int64_t catchup = (late_ns < delay_ns) ? late_ns : delay_ns;
+			delay_ns -= catchup;
+			late_ns -= catchup;
+		}
+		/* delay_usecs resolution is 1us, carry the remainder to the next update */
+		delay_ns += gen->delay_err;
+		if (delay_ns < 0)
+			delay_ns = 0;
+		last->delay_usecs = delay_ns / 1000;
+		gen->delay_err = delay_ns - last->delay_usecs * 1000;
+	}
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-B backend] [-s speed_hz] [-r rate] [-n batch]\n"
+			"\t[-w waveformA] [-W waveformB] [-f freqA] [-F freqB] [-c nchan] [-b seconds]\n"
+			"\t-B : spidev (default) or sim-mcp4802\n"
+			"\t-w/-W : sine, triangle, square, saw or file:<path> (one value 0-255 per line)\n"
+			"\t-b : benchmark, report output rate and cpu use after the given duration\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct generator gen;
+	const char *device = "/dev/spidev0.1";
+	const char *backend = "spidev";
+	const char *waveform[2] = { "sine", "sine" };
+	double freq[2] = { 1000, 1000 };
+	const struct spibus_ops *ops;
+	uint32_t speed_hz = 8000000;
+	uint64_t start, expected, updates = 0;
+	int64_t late = 0;
+	int bench = 0;
+	double cpu;
+	unsigned int i;
+	int opt;
+
+	memset(&gen, 0, sizeof(gen));
+	gen.nchan = 2;
+	gen.rate = 20000;
+	gen.batch = 128;
+
+	while ((opt = getopt(argc, argv, "d:B:s:r:n:w:W:f:F:c:b:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': device = optarg; break;
+			case 'B': backend = optarg; break;
+			case 's': speed_hz = strtoul(optarg, NULL, 0); break;
+			case 'r': gen.rate = atoi(optarg); break;
+			case 'n': gen.batch = atoi(optarg); break;
+			case 'w': waveform[0] = optarg; break;
+			case 'W': waveform[1] = optarg; break;
+			case 'f': freq[0] = atof(optarg); break;
+			case 'F': freq[1] = atof(optarg); break;
+			case 'c': gen.nchan = atoi(optarg); break;
+			case 'b': bench = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+
+	if (gen.nchan < 1 || gen.nchan > 2)
+	{
+		fprintf(stderr, "nchan should be 1 or 2\n");
+		return -1;
+	}
+	if (gen.batch < 1 || gen.batch * gen.nchan > SPIBUS_MAX_TRANSFERS)
+	{
+		fprintf(stderr, "batch should be in [1,%zu]\n", SPIBUS_MAX_TRANSFERS / gen.nchan);
+		return -1;
+	}
+	if (gen.rate < 1)
+	{
+		fprintf(stderr, "invalid rate %u\n", gen.rate);
+		return -1;
+	}
+
+	for (i = 0; i < gen.nchan; i++)
+	{
+		if (build_table(&gen.chan[i], i, waveform[i]) < 0)
+			return -1;
+	}
+
+	ops = spibus_lookup(backend);
+	if (!ops)
+	{
+		fprintf(stderr, "unknown backend %s\n", backend);
+		return -1;
+	}
+	if (spibus_open(&gen.bus, ops, device, speed_hz) < 0)
+		return -1;
+
+	if (generator_init(&gen, freq) < 0)
+	{
+		fprintf(stderr, "generator_init failed\n");
+		return -1;
+	}
+	if (gen.wire_ns * (uint64_t)gen.rate > 1000000000ULL)
+		fprintf(stderr, "rate %u not reachable at %u Hz, running as fast as the bus allows\n", gen.rate, speed_hz);
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	start = now_ns();
+	cpu = cpu_seconds();
+	while (!quit)
+	{
+		generator_fill(&gen, late);
+		if (spibus_transfer(&gen.bus, gen.tr, gen.batch * gen.nchan) < 0)
+		{
+			fprintf(stderr, "ERROR: Can't send spi message:%s\n", strerror(errno));
+			break;
+		}
+		updates += gen.batch;
+
+		/* compare with the ideal clock to compensate the time between messages */
+		expected = start + updates * 1000000000ULL / gen.rate;
+		late = (int64_t)(now_ns() - expected);
+
+		if (bench && now_ns() - start >= (uint64_t)bench * 1000000000ULL)
+			break;
+	}
+
+	if (bench)
+	{
+		double elapsed = (now_ns() - start) / 1e9;
+		cpu = cpu_seconds() - cpu;
+		printf("backend:%s nchan:%u batch:%u speed:%u Hz\n", ops->name, gen.nchan, gen.batch, speed_hz);
+		printf("elapsed:%.3f s updates:%llu rate:%.1f updates/s (target %u) messages:%.0f /s cpu:%.1f %%\n",
+		       elapsed, (unsigned long long)updates, updates / elapsed, gen.rate,
+		       gen.bus.messages / elapsed, 100.0 * cpu / elapsed);
+	}
+
+	generator_release(&gen);
+	spibus_close(&gen.bus);
+
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * SPI bus backends : spidev or simulated MCP3002/MCP4802
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "spibus.h"
+
+// =======================
+// spidev backend
+// =======================
+static int spidev_open(struct spibus *bus, const char *device, uint32_t speed_hz)
+{
+	uint8_t mode = SPI_MODE_0;
+	uint8_t bits = 8;
+
+	bus->fd = open(device, O_RDWR);
+	if (bus->fd < 0)
+	{
+		fprintf(stderr, "can't open %s:%s\n", device, strerror(errno));
+		return -errno;
+	}
+	if ( (ioctl(bus->fd, SPI_IOC_WR_MODE, &mode) < 0)
+	  || (ioctl(bus->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+	  || (ioctl(bus->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0) )
+	{
+		int err = -errno;
+		fprintf(stderr, "can't configure %s:%s\n", device, strerror(errno));
+		close(bus->fd);
+		bus->fd = -1;
+		return err;
+	}
+	return 0;
+}
+
+static int spidev_transfer(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n)
+{
+	if (ioctl(bus->fd, SPI_IOC_MESSAGE(n), tr) < 0)
+		return -errno;
+	return 0;
+}
+
+static void spidev_close(struct spibus *bus)
+{
+	if (bus->fd >= 0)
+		close(bus->fd);
+	bus->fd = -1;
+}
+
+const struct spibus_ops spibus_spidev_ops = {
+	.name		= "spidev",
+	.open		= spidev_open,
+	.transfer	= spidev_transfer,
+	.close		= spidev_close,
+};
+
+// =======================
+// simulated backends
+// =======================
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int sim_open(struct spibus *bus, const char *device, uint32_t speed_hz)
+{
+	bus->fd = -1;
+	bus->sim_phase = 0;
+	bus->sim_busy_until = sim_now();
+	return 0;
+}
+
+/*
+ * Hold the caller for the time the message would take on the wire,
+ * so rates measured against the simulator are meaningful.
+ */
+static void sim_wire_time(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n)
+{
+	uint64_t ns = 0;
+	uint64_t now = sim_now();
+	struct timespec ts;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+	{
+		uint32_t speed = tr[i].speed_hz ? tr[i].speed_hz : bus->speed_hz;
+		ns += (uint64_t)tr[i].len * 8 * 1000000000ULL / speed;
+		ns += (uint64_t)tr[i].delay_usecs * 1000;
+	}
+
+	if (bus->sim_busy_until < now)
+		bus->sim_busy_until = now;
+	bus->sim_busy_until += ns;
+
+	ts.tv_sec  = bus->sim_busy_until / 1000000000ULL;
+	ts.tv_nsec = bus->sim_busy_until % 1000000000ULL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* deterministic waveforms : triangle on channel 0, sawtooth on channel 1 */
+static uint16_t sim_mcp3002_sample(struct spibus *bus, int chan)
+{
+	unsigned int t = bus->sim_phase++ & 0x7FF;
+
+	if (chan == 0)
+		return (t < 0x400) ? t : 0x7FF - t;
+	return t >> 1;
+}
+
+static int sim_mcp3002_transfer(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+	{
+		const uint8_t *tx = (const uint8_t *)(uintptr_t)tr[i].tx_buf;
+		uint8_t *rx = (uint8_t *)(uintptr_t)tr[i].rx_buf;
+		uint16_t value;
+
+		if (tr[i].len != 2 || !tx || !rx)
+			return -EINVAL;
+
+		value = sim_mcp3002_sample(bus, (tx[0] >> 5) & 1);
+		rx[0] = (value >> 7) & 0x07;
+		rx[1] = (value << 1) & 0xFE;
+	}
+	sim_wire_time(bus, tr, n);
+	return 0;
+}
+
+static int sim_mcp4802_transfer(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+	{
+		const uint8_t *tx = (const uint8_t *)(uintptr_t)tr[i].tx_buf;
+
+		if (tr[i].len != 2 || !tx)
+			return -EINVAL;
+
+		bus->sim_dac[tx[0] >> 7] = ((tx[0] & 0xF) << 4) | (tx[1] >> 4);
+	}
+	sim_wire_time(bus, tr, n);
+	return 0;
+}
+
+static void sim_close(struct spibus *bus)
+{
+}
+
+const struct spibus_ops spibus_sim_mcp3002_ops = {
+	.name		= "sim-mcp3002",
+	.open		= sim_open,
+	.transfer	= sim_mcp3002_transfer,
+	.close		= sim_close,
+};
+
+const struct spibus_ops spibus_sim_mcp4802_ops = {
+	.name		= "sim-mcp4802",
+	.open		= sim_open,
+	.transfer	= sim_mcp4802_transfer,
+	.close		= sim_close,
+};
+
+// =======================
+// generic interface
+// =======================
+static const struct spibus_ops *spibus_backends[] = {
+	&spibus_spidev_ops,
+	&spibus_sim_mcp3002_ops,
+	&spibus_sim_mcp4802_ops,
+};
+
+const struct spibus_ops *spibus_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(spibus_backends)/sizeof(spibus_backends[0]); i++)
+	{
+		if (strcmp(spibus_backends[i]->name, name) == 0)
+			return spibus_backends[i];
+	}
+	return NULL;
+}
+
+int spibus_open(struct spibus *bus, const struct spibus_ops *ops, const char *device, uint32_t speed_hz)
+{
+	memset(bus, 0, sizeof(*bus));
+	bus->ops = ops;
+	bus->speed_hz = speed_hz;
+	return ops->open(bus, device, speed_hz);
+}
+
+int spibus_transfer(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n)
+{
+	int ret = bus->ops->transfer(bus, tr, n);
+	if (ret == 0)
+	{
+		bus->messages++;
+		bus->transfers += n;
+	}
+	return ret;
+}
+
+void spibus_close(struct spibus *bus)
+{
+	bus->ops->close(bus);
+}
@@ -0,0 +1,67 @@
+/*
+ * SPI bus backends : spidev or simulated MCP3002/MCP4802
+ */
+#ifndef SPIBUS_H
+#define SPIBUS_H
+
+#include <stdint.h>
+#include <linux/spi/spidev.h>
+
+/* spidev limits one SPI_IOC_MESSAGE to (1<<_IOC_SIZEBITS) bytes of transfers */
+#define SPIBUS_MAX_TRANSFERS	((1 << _IOC_SIZEBITS) / sizeof(struct spi_ioc_transfer) - 1)
+
+struct spibus;
+
+struct spibus_ops
+{
+	const char *name;
+	int  (*open)(struct spibus *bus, const char *device, uint32_t speed_hz);
+	/* submit n transfers as one message, return 0 or -errno */
+	int  (*transfer)(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n);
+	void (*close)(struct spibus *bus);
+};
+
+struct spibus
+{
+	const struct spibus_ops	*ops;
+	int			fd;
+	uint32_t		speed_hz;
+	/* statistics */
+	uint64_t		messages;
+	uint64_t		transfers;
+	/* simulation state */
+	uint64_t		sim_phase;
+	uint64_t		sim_busy_until;
+	uint8_t			sim_dac[2];
+};
+
+/* backends */
+extern const struct spibus_ops spibus_spidev_ops;
+extern const struct spibus_ops spibus_sim_mcp3002_ops;
+extern const struct spibus_ops spibus_sim_mcp4802_ops;
+
+const struct spibus_ops *spibus_lookup(const char *name);
+
+int  spibus_open(struct spibus *bus, const struct spibus_ops *ops, const char *device, uint32_t speed_hz);
+int  spibus_transfer(struct spibus *bus, struct spi_ioc_transfer *tr, unsigned int n);
+void spibus_close(struct spibus *bus);
+
+/* MCP3002 command/answer encoding (start, single ended, channel, MSB first) */
+static inline uint8_t mcp3002_cmd(int chan)
+{
+	return 0xD0 | ((chan & 1) << 5);
+}
+
+static inline uint16_t mcp3002_decode(const uint8_t *rx)
+{
+	return ((rx[0] << 7) | (rx[1] >> 1)) & 0x3FF;
+}
+
+/* MCP4802 frame (channel, 1x gain, active, 8 bits value left aligned on 12) */
+static inline void mcp4802_frame(uint8_t *tx, int chan, uint8_t value)
+{
+	tx[0] = 0x30 | ((chan & 1) << 7) | (value >> 4);
+	tx[1] = (value & 0xF) << 4;
+}
+
+#endif
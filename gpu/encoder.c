@@ -0,0 +1,580 @@
+/*
+ * camera -> video_encode tunnel with a pooled output buffer
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "encoder.h"
+
+#define OMX_INIT_STRUCTURE(a) \
+	memset(&(a), 0, sizeof(a)); \
+	(a).nSize = sizeof(a); \
+	(a).nVersion.nVersion = OMX_VERSION
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t encoder_ticks(OMX_TICKS ticks)
+{
+#ifdef OMX_SKIP64BIT
+	return ((uint64_t)ticks.nHighPart << 32) | ticks.nLowPart;
+#else
+	return ticks;
+#endif
+}
+
+// =======================================================================
+// output buffer pool
+// =======================================================================
+static void *pool_malloc(void *userdata, VCOS_UNSIGNED size, VCOS_UNSIGNED align, const char *description)
+{
+	struct encoder *enc = userdata;
+	size_t offset = (enc->pool_used + align - 1) & ~((size_t)align - 1);
+
+	if (offset + size > enc->pool_size)
+	{
+		fprintf(stderr, "pool exhausted, %u bytes requested for %s\n", size, description);
+		return NULL;
+	}
+	enc->pool_used = offset + size;
+	return enc->pool + offset;
+}
+
+static void pool_free(void *userdata, void *pointer)
+{
+	// buffers are returned with the pool in encoder_close
+}
+
+static void fill_buffer_done(void *data, COMPONENT_T *comp)
+{
+	struct encoder *enc = data;
+	uint64_t one = 1;
+
+	if (write(enc->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "eventfd write failed:%s\n", strerror(errno));
+}
+
+// =======================================================================
+// setup
+// =======================================================================
+static int setup_camera(struct encoder *enc)
+{
+	OMX_CONFIG_REQUESTCALLBACKTYPE cbtype;
+	OMX_PARAM_U32TYPE device;
+	OMX_PARAM_PORTDEFINITIONTYPE def;
+	OMX_ERRORTYPE err;
+
+	// the camera is ready once it acknowledges the device number
+	OMX_INIT_STRUCTURE(cbtype);
+	cbtype.nPortIndex = OMX_ALL;
+	cbtype.nIndex = OMX_IndexParamCameraDeviceNumber;
+	cbtype.bEnable = OMX_TRUE;
+	err = OMX_SetConfig(ILC_GET_HANDLE(enc->camera), OMX_IndexConfigRequestCallback, &cbtype);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetConfig() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	OMX_INIT_STRUCTURE(device);
+	device.nPortIndex = OMX_ALL;
+	device.nU32 = 0;
+	err = OMX_SetParameter(ILC_GET_HANDLE(enc->camera), OMX_IndexParamCameraDeviceNumber, &device);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	if (ilclient_wait_for_event(enc->camera, OMX_EventParamOrConfigChanged, OMX_ALL, 0, OMX_IndexParamCameraDeviceNumber, 0, ILCLIENT_PARAMETER_CHANGED, 1000) != 0)
+	{
+		fprintf(stderr, "%s:%d: camera not ready!\n", __FUNCTION__, __LINE__);
+		return -1;
+	}
+
+	OMX_INIT_STRUCTURE(def);
+	def.nPortIndex = ENCODER_CAMERA_VIDEO_PORT;
+	err = OMX_GetParameter(ILC_GET_HANDLE(enc->camera), OMX_IndexParamPortDefinition, &def);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_GetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	def.format.video.nFrameWidth = enc->config.width;
+	def.format.video.nFrameHeight = enc->config.height;
+	def.format.video.xFramerate = enc->config.framerate << 16;
+	def.format.video.nStride = (enc->config.width + 31) & ~31;
+	def.format.video.nSliceHeight = (enc->config.height + 15) & ~15;
+	def.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+	err = OMX_SetParameter(ILC_GET_HANDLE(enc->camera), OMX_IndexParamPortDefinition, &def);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	return 0;
+}
+
+static int setup_encoder(struct encoder *enc)
+{
+	OMX_PARAM_PORTDEFINITIONTYPE def;
+	OMX_VIDEO_PARAM_PORTFORMATTYPE format;
+	OMX_VIDEO_PARAM_BITRATETYPE bitrate;
+	OMX_PARAM_U32TYPE period;
+	OMX_ERRORTYPE err;
+
+	OMX_INIT_STRUCTURE(def);
+	def.nPortIndex = ENCODER_OUTPUT_PORT;
+	err = OMX_GetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamPortDefinition, &def);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_GetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	def.format.video.nFrameWidth = enc->config.width;
+	def.format.video.nFrameHeight = enc->config.height;
+	def.format.video.xFramerate = enc->config.framerate << 16;
+	def.format.video.nStride = (enc->config.width + 31) & ~31;
+	def.format.video.nSliceHeight = (enc->config.height + 15) & ~15;
+	def.format.video.nBitrate = enc->config.bitrate;
+	def.format.video.eCompressionFormat = OMX_VIDEO_CodingAVC;
+	def.format.video.eColorFormat = OMX_COLOR_FormatUnused;
+	if (enc->config.buffers)
+		def.nBufferCountActual = enc->config.buffers;
+	if (enc->config.buffer_size)
+		def.nBufferSize = enc->config.buffer_size;
+	err = OMX_SetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamPortDefinition, &def);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+
+	OMX_INIT_STRUCTURE(format);
+	format.nPortIndex = ENCODER_OUTPUT_PORT;
+	format.eCompressionFormat = OMX_VIDEO_CodingAVC;
+	err = OMX_SetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamVideoPortFormat, &format);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+
+	OMX_INIT_STRUCTURE(bitrate);
+	bitrate.nPortIndex = ENCODER_OUTPUT_PORT;
+	bitrate.eControlRate = OMX_Video_ControlRateVariable;
+	bitrate.nTargetBitrate = enc->config.bitrate;
+	err = OMX_SetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamVideoBitrate, &bitrate);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+
+	if (enc->config.intra_period)
+	{
+		OMX_INIT_STRUCTURE(period);
+		period.nPortIndex = ENCODER_OUTPUT_PORT;
+		period.nU32 = enc->config.intra_period;
+		err = OMX_SetConfig(ILC_GET_HANDLE(enc->encode), OMX_IndexConfigBrcmVideoIntraPeriod, &period);
+		if (err != OMX_ErrorNone)
+			fprintf(stderr, "%s:%d: intra period not supported err:%X\n", __FUNCTION__, __LINE__, err);
+	}
+
+	if (enc->config.inline_headers)
+	{
+		OMX_CONFIG_PORTBOOLEANTYPE inline_headers;
+		OMX_INIT_STRUCTURE(inline_headers);
+		inline_headers.nPortIndex = ENCODER_OUTPUT_PORT;
+		inline_headers.bEnabled = OMX_TRUE;
+		err = OMX_SetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamBrcmVideoAVCInlineHeaderEnable, &inline_headers);
+		if (err != OMX_ErrorNone)
+		{
+			fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+			return -1;
+		}
+	}
+
+	if (enc->config.inline_vectors)
+	{
+		OMX_CONFIG_PORTBOOLEANTYPE inline_vectors;
+		OMX_INIT_STRUCTURE(inline_vectors);
+		inline_vectors.nPortIndex = ENCODER_OUTPUT_PORT;
+		inline_vectors.bEnabled = OMX_TRUE;
+		err = OMX_SetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamBrcmVideoAVCInlineVectorsEnable, &inline_vectors);
+		if (err != OMX_ErrorNone)
+		{
+			fprintf(stderr, "%s:%d: OMX_SetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+			return -1;
+		}
+	}
+
+	// read back what the component accepted, this sizes the pool
+	err = OMX_GetParameter(ILC_GET_HANDLE(enc->encode), OMX_IndexParamPortDefinition, &def);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_GetParameter() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	enc->config.buffers = def.nBufferCountActual;
+	enc->buffer_size = def.nBufferSize;
+	size_t align = def.nBufferAlignment > 64 ? def.nBufferAlignment : 64;
+	enc->pool_size = (size_t)def.nBufferCountActual * ((def.nBufferSize + align - 1) & ~(align - 1));
+	if (posix_memalign((void **)&enc->pool, align, enc->pool_size) != 0)
+	{
+		fprintf(stderr, "%s:%d: can't allocate %zu bytes pool\n", __FUNCTION__, __LINE__, enc->pool_size);
+		enc->pool = NULL;
+		return -1;
+	}
+	enc->pool_used = 0;
+	return 0;
+}
+
+int encoder_open(struct encoder *enc, const struct encoder_config *config)
+{
+	memset(enc, 0, sizeof(*enc));
+	enc->config = *config;
+	enc->efd = -1;
+
+	bcm_host_init();
+	enc->client = ilclient_init();
+	if (enc->client == NULL)
+	{
+		fprintf(stderr, "ilclient_init failed\n");
+		return -1;
+	}
+	OMX_ERRORTYPE err = OMX_Init();
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "omx_init failed err:%X!\n", err);
+		ilclient_destroy(enc->client);
+		enc->client = NULL;
+		return -1;
+	}
+	enc->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (enc->efd < 0)
+	{
+		fprintf(stderr, "eventfd failed:%s\n", strerror(errno));
+		goto error;
+	}
+	ilclient_set_fill_buffer_done_callback(enc->client, fill_buffer_done, enc);
+
+	if (ilclient_create_component(enc->client, &enc->camera, "camera", ILCLIENT_DISABLE_ALL_PORTS) != 0)
+	{
+		fprintf(stderr, "%s:%d: ilclient_create_component(camera) failed!\n", __FUNCTION__, __LINE__);
+		goto error;
+	}
+	enc->list[0] = enc->camera;
+	if (ilclient_create_component(enc->client, &enc->encode, "video_encode", ILCLIENT_DISABLE_ALL_PORTS | ILCLIENT_ENABLE_OUTPUT_BUFFERS) != 0)
+	{
+		fprintf(stderr, "%s:%d: ilclient_create_component(video_encode) failed!\n", __FUNCTION__, __LINE__);
+		goto error;
+	}
+	enc->list[1] = enc->encode;
+
+	if (setup_camera(enc) < 0 || setup_encoder(enc) < 0)
+		goto error;
+
+	if (ilclient_change_component_state(enc->camera, OMX_StateIdle) != 0)
+	{
+		fprintf(stderr, "%s:%d: camera to idle failed!\n", __FUNCTION__, __LINE__);
+		goto error;
+	}
+	set_tunnel(&enc->tunnel[0], enc->camera, ENCODER_CAMERA_VIDEO_PORT, enc->encode, ENCODER_INPUT_PORT);
+	if (ilclient_setup_tunnel(&enc->tunnel[0], 0, 0) != 0)
+	{
+		fprintf(stderr, "%s:%d: ilclient_setup_tunnel() failed!\n", __FUNCTION__, __LINE__);
+		goto error;
+	}
+	if (ilclient_change_component_state(enc->encode, OMX_StateIdle) != 0)
+	{
+		fprintf(stderr, "%s:%d: video_encode to idle failed!\n", __FUNCTION__, __LINE__);
+		goto error;
+	}
+	if (ilclient_enable_port_buffers(enc->encode, ENCODER_OUTPUT_PORT, pool_malloc, pool_free, enc) != 0)
+	{
+		fprintf(stderr, "%s:%d: ilclient_enable_port_buffers() failed!\n", __FUNCTION__, __LINE__);
+		goto error;
+	}
+	return 0;
+
+error:
+	encoder_close(enc);
+	return -1;
+}
+
+int encoder_start(struct encoder *enc)
+{
+	OMX_CONFIG_PORTBOOLEANTYPE capture;
+	OMX_BUFFERHEADERTYPE *buf;
+	OMX_ERRORTYPE err;
+
+	ilclient_state_transition(enc->list, OMX_StateExecuting);
+	enc->started = 1;
+
+	// hand the whole pool to the encoder
+	while ((buf = ilclient_get_output_buffer(enc->encode, ENCODER_OUTPUT_PORT, 0)) != NULL)
+	{
+		err = OMX_FillThisBuffer(ILC_GET_HANDLE(enc->encode), buf);
+		if (err != OMX_ErrorNone)
+		{
+			fprintf(stderr, "%s:%d: OMX_FillThisBuffer() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+			return -1;
+		}
+	}
+
+	memset(&enc->stats, 0, sizeof(enc->stats));
+	enc->stats.start_us = now_us();
+	enc->stats.interval_min = UINT64_MAX;
+
+	OMX_INIT_STRUCTURE(capture);
+	capture.nPortIndex = ENCODER_CAMERA_VIDEO_PORT;
+	capture.bEnabled = OMX_TRUE;
+	err = OMX_SetConfig(ILC_GET_HANDLE(enc->camera), OMX_IndexConfigPortCapturing, &capture);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetConfig() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	return 0;
+}
+
+// =======================================================================
+// streaming
+// =======================================================================
+static void account(struct encoder *enc, OMX_BUFFERHEADERTYPE *buf)
+{
+	struct encoder_stats *stats = &enc->stats;
+	uint64_t now = now_us();
+
+	// motion vectors are not part of the stream
+	if (buf->nFlags & OMX_BUFFERFLAG_CODECSIDEINFO)
+		return;
+	stats->buffers++;
+	stats->bytes += buf->nFilledLen;
+	stats->last_us = now;
+	if (!(buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) || (buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG))
+		return;
+
+	int64_t ts = encoder_ticks(buf->nTimeStamp);
+	int64_t offset = now - ts;
+	uint64_t latency;
+
+	stats->frames++;
+	if (buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME)
+		stats->keyframes++;
+	if (stats->frames == 1)
+		stats->first_ts = ts;
+	else
+	{
+		uint64_t interval = ts - stats->last_ts;
+		if (interval < stats->interval_min)
+			stats->interval_min = interval;
+		if (interval > stats->interval_max)
+			stats->interval_max = interval;
+	}
+	stats->last_ts = ts;
+
+	// the camera clock is not CLOCK_MONOTONIC, the fastest frame is the reference
+	if (stats->frames == 1 || offset < stats->offset_min)
+		stats->offset_min = offset;
+	latency = offset - stats->offset_min;
+	stats->latency_sum += latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+	if (latency / ENCODER_HIST_BIN_US < ENCODER_HIST_BINS)
+		stats->hist[latency / ENCODER_HIST_BIN_US]++;
+	else
+		stats->hist[ENCODER_HIST_BINS]++;
+}
+
+OMX_BUFFERHEADERTYPE *encoder_read(struct encoder *enc, int timeout_ms)
+{
+	for (;;)
+	{
+		OMX_BUFFERHEADERTYPE *buf = ilclient_get_output_buffer(enc->encode, ENCODER_OUTPUT_PORT, 0);
+		struct pollfd pfd;
+		uint64_t count;
+
+		if (buf)
+		{
+			account(enc, buf);
+			return buf;
+		}
+
+		pfd.fd = enc->efd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout_ms) <= 0)
+			return NULL;
+		if (read(enc->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			return NULL;
+	}
+}
+
+int encoder_release(struct encoder *enc, OMX_BUFFERHEADERTYPE *buf)
+{
+	OMX_ERRORTYPE err = OMX_FillThisBuffer(ILC_GET_HANDLE(enc->encode), buf);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_FillThisBuffer() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	return 0;
+}
+
+// =======================================================================
+// runtime control
+// =======================================================================
+int encoder_set_bitrate(struct encoder *enc, unsigned int bitrate)
+{
+	OMX_VIDEO_CONFIG_BITRATETYPE config;
+	OMX_ERRORTYPE err;
+
+	OMX_INIT_STRUCTURE(config);
+	config.nPortIndex = ENCODER_OUTPUT_PORT;
+	config.nEncodeBitrate = bitrate;
+	err = OMX_SetConfig(ILC_GET_HANDLE(enc->encode), OMX_IndexConfigVideoBitrate, &config);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetConfig() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	enc->config.bitrate = bitrate;
+	return 0;
+}
+
+// the camera paces the tunnel, the encoder needs the rate for its rate control
+int encoder_set_framerate(struct encoder *enc, unsigned int framerate)
+{
+	OMX_CONFIG_FRAMERATETYPE config;
+	OMX_ERRORTYPE err;
+
+	OMX_INIT_STRUCTURE(config);
+	config.nPortIndex = ENCODER_CAMERA_VIDEO_PORT;
+	config.xEncodeFramerate = framerate << 16;
+	err = OMX_SetConfig(ILC_GET_HANDLE(enc->camera), OMX_IndexConfigVideoFramerate, &config);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetConfig() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	config.nPortIndex = ENCODER_OUTPUT_PORT;
+	err = OMX_SetConfig(ILC_GET_HANDLE(enc->encode), OMX_IndexConfigVideoFramerate, &config);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetConfig() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	enc->config.framerate = framerate;
+	return 0;
+}
+
+int encoder_request_keyframe(struct encoder *enc)
+{
+	OMX_CONFIG_PORTBOOLEANTYPE request;
+	OMX_ERRORTYPE err;
+
+	OMX_INIT_STRUCTURE(request);
+	request.nPortIndex = ENCODER_OUTPUT_PORT;
+	request.bEnabled = OMX_TRUE;
+	err = OMX_SetConfig(ILC_GET_HANDLE(enc->encode), OMX_IndexConfigBrcmVideoRequestIFrame, &request);
+	if (err != OMX_ErrorNone)
+	{
+		fprintf(stderr, "%s:%d: OMX_SetConfig() failed err:%X!\n", __FUNCTION__, __LINE__, err);
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t percentile(const struct encoder_stats *stats, unsigned int pct)
+{
+	uint64_t target = (stats->frames * pct + 99) / 100;
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i <= ENCODER_HIST_BINS; i++)
+	{
+		count += stats->hist[i];
+		if (count >= target)
+			return (uint64_t)i * ENCODER_HIST_BIN_US;
+	}
+	return stats->latency_max;
+}
+
+void encoder_print_stats(struct encoder *enc, FILE *out)
+{
+	const struct encoder_stats *stats = &enc->stats;
+	double elapsed = (stats->last_us - stats->start_us) / 1e6;
+
+	if (stats->frames == 0 || elapsed <= 0)
+	{
+		fprintf(out, "no frame\n");
+		return;
+	}
+	fprintf(out, "frames:%llu key:%llu elapsed:%.2f s fps:%.2f bitrate:%.0f kbps buffers/frame:%.2f\n",
+		(unsigned long long)stats->frames, (unsigned long long)stats->keyframes, elapsed,
+		stats->frames / elapsed, stats->bytes * 8 / elapsed / 1000, (double)stats->buffers / stats->frames);
+	if (stats->frames > 1)
+		fprintf(out, "interval min:%.2f avg:%.2f max:%.2f ms\n",
+			stats->interval_min / 1e3, (stats->last_ts - stats->first_ts) / 1e3 / (stats->frames - 1), stats->interval_max / 1e3);
+	fprintf(out, "latency avg:%.2f p50:%.1f p99:%.1f max:%.2f ms pool:%u x %zu bytes\n",
+		stats->latency_sum / 1e3 / stats->frames, percentile(stats, 50) / 1e3, percentile(stats, 99) / 1e3,
+		stats->latency_max / 1e3, enc->config.buffers, enc->buffer_size);
+}
+
+void encoder_stop(struct encoder *enc)
+{
+	OMX_CONFIG_PORTBOOLEANTYPE capture;
+
+	if (!enc->started)
+		return;
+	OMX_INIT_STRUCTURE(capture);
+	capture.nPortIndex = ENCODER_CAMERA_VIDEO_PORT;
+	capture.bEnabled = OMX_FALSE;
+	OMX_SetConfig(ILC_GET_HANDLE(enc->camera), OMX_IndexConfigPortCapturing, &capture);
+	enc->started = 0;
+}
+
+void encoder_close(struct encoder *enc)
+{
+	encoder_stop(enc);
+	if (enc->tunnel[0].source)
+	{
+		ilclient_disable_tunnel(&enc->tunnel[0]);
+	}
+	if (enc->encode && enc->pool)
+	{
+		ilclient_disable_port_buffers(enc->encode, ENCODER_OUTPUT_PORT, NULL, pool_free, enc);
+	}
+	if (enc->tunnel[0].source)
+	{
+		ilclient_teardown_tunnels(enc->tunnel);
+		memset(enc->tunnel, 0, sizeof(enc->tunnel));
+	}
+	if (enc->list[0])
+	{
+		ilclient_state_transition(enc->list, OMX_StateIdle);
+		ilclient_state_transition(enc->list, OMX_StateLoaded);
+		ilclient_cleanup_components(enc->list);
+		enc->list[0] = enc->list[1] = NULL;
+	}
+	if (enc->client)
+	{
+		OMX_Deinit();
+		ilclient_destroy(enc->client);
+		enc->client = NULL;
+	}
+	free(enc->pool);
+	enc->pool = NULL;
+	if (enc->efd >= 0)
+		close(enc->efd);
+	enc->efd = -1;
+}
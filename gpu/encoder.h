@@ -0,0 +1,95 @@
+/*
+ * camera -> video_encode tunnel with a pooled output buffer
+ *
+ * The encoder output port uses buffers carved out of a single allocation made
+ * once at open, they go back to the encoder with encoder_release as soon as
+ * the consumer is done, so steady state runs without any allocation.
+ */
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bcm_host.h"
+#include "ilclient.h"
+
+#define ENCODER_CAMERA_VIDEO_PORT 71
+#define ENCODER_INPUT_PORT 200
+#define ENCODER_OUTPUT_PORT 201
+
+// latency histogram, 100 us per bin up to 100 ms
+#define ENCODER_HIST_BIN_US 100
+#define ENCODER_HIST_BINS 1000
+
+struct encoder_config
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int framerate;
+	unsigned int bitrate;
+	unsigned int intra_period;
+	unsigned int buffers;
+	unsigned int buffer_size;
+	// SPS/PPS in front of every IDR, for clients joining a running stream
+	int inline_headers;
+	// a OMX_BUFFERFLAG_CODECSIDEINFO buffer of motion vectors after each frame (motion.h)
+	int inline_vectors;
+};
+
+struct encoder_stats
+{
+	uint64_t frames;
+	uint64_t keyframes;
+	uint64_t bytes;
+	uint64_t buffers;
+	uint64_t start_us;
+	uint64_t last_us;
+	uint64_t frame_bytes;
+	// frame interval on the camera clock
+	int64_t first_ts;
+	int64_t last_ts;
+	uint64_t interval_min;
+	uint64_t interval_max;
+	// arrival time minus the camera timestamp, relative to the smallest one seen
+	int64_t offset_min;
+	uint64_t latency_sum;
+	uint64_t latency_max;
+	uint32_t hist[ENCODER_HIST_BINS + 1];
+};
+
+struct encoder
+{
+	ILCLIENT_T *client;
+	COMPONENT_T *camera;
+	COMPONENT_T *encode;
+	COMPONENT_T *list[3];
+	TUNNEL_T tunnel[2];
+	struct encoder_config config;
+
+	// output buffer pool
+	uint8_t *pool;
+	size_t pool_size;
+	size_t pool_used;
+	size_t buffer_size;
+
+	// signaled by the fill buffer done callback
+	int efd;
+	int started;
+	struct encoder_stats stats;
+};
+
+int encoder_open(struct encoder *enc, const struct encoder_config *config);
+int encoder_start(struct encoder *enc);
+OMX_BUFFERHEADERTYPE *encoder_read(struct encoder *enc, int timeout_ms);
+int encoder_release(struct encoder *enc, OMX_BUFFERHEADERTYPE *buf);
+void encoder_stop(struct encoder *enc);
+int encoder_set_bitrate(struct encoder *enc, unsigned int bitrate);
+int encoder_set_framerate(struct encoder *enc, unsigned int framerate);
+int encoder_request_keyframe(struct encoder *enc);
+void encoder_close(struct encoder *enc);
+void encoder_print_stats(struct encoder *enc, FILE *out);
+
+uint64_t encoder_ticks(OMX_TICKS ticks);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Motion detection from the H.264 encoder inline motion vectors
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "motion.h"
+
+int motion_init(struct motion *m, const struct motion_config *config)
+{
+	memset(m, 0, sizeof(*m));
+	m->config = *config;
+	m->cols = (config->width + 15) / 16;
+	m->rows = (config->height + 15) / 16;
+	m->frame_size = (size_t)(m->cols + 1) * m->rows * sizeof(struct motion_vector);
+	if (m->config.trigger == 0)
+		m->config.trigger = 1;
+	if (m->config.hold == 0)
+		m->config.hold = 1;
+	m->moving = calloc(m->cols * m->rows, 1);
+	m->mask = calloc(m->cols * m->rows, 1);
+	if (!m->moving || !m->mask)
+	{
+		motion_free(m);
+		return -1;
+	}
+	return 0;
+}
+
+void motion_free(struct motion *m)
+{
+	free(m->moving);
+	free(m->mask);
+	m->moving = m->mask = NULL;
+}
+
+// at least one of the 8 neighbours moving
+static int neighbour_moving(const struct motion *m, unsigned int col, unsigned int row)
+{
+	unsigned int c0 = col ? col - 1 : 0, c1 = col + 1 < m->cols ? col + 1 : col;
+	unsigned int r0 = row ? row - 1 : 0, r1 = row + 1 < m->rows ? row + 1 : row;
+	unsigned int c, r;
+
+	for (r = r0; r <= r1; r++)
+		for (c = c0; c <= c1; c++)
+			if ((c != col || r != row) && m->moving[r * m->cols + c])
+				return 1;
+	return 0;
+}
+
+static void aggregate(struct motion *m, const uint8_t *vectors)
+{
+	unsigned int min2 = m->config.magnitude * m->config.magnitude;
+	unsigned int col, row;
+
+	for (row = 0; row < m->rows; row++)
+	{
+		// the padding column is skipped
+		const uint8_t *v = vectors + (size_t)row * (m->cols + 1) * sizeof(struct motion_vector);
+
+		for (col = 0; col < m->cols; col++, v += sizeof(struct motion_vector))
+		{
+			int x = (int8_t)v[0], y = (int8_t)v[1];
+			m->moving[row * m->cols + col] = (unsigned int)(x * x + y * y) >= min2;
+		}
+	}
+
+	m->blocks = 0;
+	m->left = m->cols;
+	m->top = m->rows;
+	m->right = m->bottom = 0;
+	for (row = 0; row < m->rows; row++)
+	{
+		for (col = 0; col < m->cols; col++)
+		{
+			uint8_t on = m->moving[row * m->cols + col] && neighbour_moving(m, col, row);
+
+			m->mask[row * m->cols + col] = on;
+			if (!on)
+				continue;
+			m->blocks++;
+			if (col < m->left)
+				m->left = col;
+			if (col > m->right)
+				m->right = col;
+			if (row < m->top)
+				m->top = row;
+			if (row > m->bottom)
+				m->bottom = row;
+		}
+	}
+	m->score = m->blocks * 1000 / (m->cols * m->rows);
+}
+
+int motion_frame(struct motion *m, const uint8_t *vectors, size_t size)
+{
+	if (size != m->frame_size)
+		return -1;
+
+	aggregate(m, vectors);
+	m->frames++;
+
+	if (m->score >= m->config.threshold && m->config.threshold)
+	{
+		m->above++;
+		m->below = 0;
+	}
+	else
+	{
+		m->below++;
+		m->above = 0;
+	}
+
+	if (m->active)
+	{
+		m->active_frames++;
+		if (m->score > m->peak)
+			m->peak = m->score;
+		if (m->below >= m->config.hold)
+		{
+			m->active = 0;
+			return MOTION_STOP;
+		}
+	}
+	else if (m->above >= m->config.trigger)
+	{
+		m->active = 1;
+		m->active_frames++;
+		m->events++;
+		m->peak = m->score;
+		return MOTION_START;
+	}
+	return MOTION_NONE;
+}
+
+void motion_print_mask(const struct motion *m, FILE *out)
+{
+	unsigned int col, row;
+
+	for (row = 0; row < m->rows; row++)
+	{
+		for (col = 0; col < m->cols; col++)
+			fputc(m->mask[row * m->cols + col] ? '#' : (m->moving[row * m->cols + col] ? '+' : '.'), out);
+		fputc('\n', out);
+	}
+}
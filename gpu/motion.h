@@ -0,0 +1,78 @@
+/*
+ * Motion detection from the H.264 encoder inline motion vectors
+ *
+ * With OMX_IndexParamBrcmVideoAVCInlineVectorsEnable the encoder follows each
+ * frame with a buffer flagged OMX_BUFFERFLAG_CODECSIDEINFO : one entry per
+ * macroblock, (width + 15) / 16 + 1 columns (the last one is padding) by
+ * (height + 15) / 16 rows. raspivid -x writes the same buffers back to back,
+ * such a dump goes through the same code as the live encoder.
+ *
+ * A macroblock moves when its vector is at least 'magnitude' long, the ones
+ * without any moving neighbour are dropped as noise. The score is the moving
+ * part of the frame in per mille with the mask and bounding box of the moving
+ * macroblocks. The activity starts after 'trigger' frames at or above
+ * 'threshold' and stops after 'hold' frames under it, the consumer only wakes
+ * up at these transitions.
+ */
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct motion_vector
+{
+	int8_t x;
+	int8_t y;
+	uint16_t sad;
+};
+
+enum motion_event
+{
+	MOTION_NONE,
+	MOTION_START,
+	MOTION_STOP,
+};
+
+struct motion_config
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int magnitude;	// vector length of a moving macroblock
+	unsigned int threshold;	// per mille of moving macroblocks
+	unsigned int trigger;	// frames at or above the threshold to start
+	unsigned int hold;	// frames under the threshold to stop
+};
+
+struct motion
+{
+	struct motion_config config;
+	unsigned int cols;	// macroblocks per row, without the padding column
+	unsigned int rows;
+	size_t frame_size;	// bytes of one vector buffer
+
+	// last frame
+	uint8_t *moving;	// vector over the magnitude
+	uint8_t *mask;		// moving with a moving neighbour
+	unsigned int blocks;
+	unsigned int score;
+	unsigned int left, top, right, bottom;	// bounding box, macroblocks
+
+	// activity
+	int active;
+	unsigned int above;
+	unsigned int below;
+	uint64_t frames;
+	uint64_t active_frames;
+	uint64_t events;
+	unsigned int peak;	// highest score of the current activity
+};
+
+int  motion_init(struct motion *m, const struct motion_config *config);
+// one vector buffer, MOTION_START or MOTION_STOP at the transitions, -1 if the size does not match
+int  motion_frame(struct motion *m, const uint8_t *vectors, size_t size);
+void motion_print_mask(const struct motion *m, FILE *out);
+void motion_free(struct motion *m);
+
+#endif
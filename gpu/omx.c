@@ -1,35 +1,577 @@
+/*
+ * OMX component probe : ports, supported formats and initialization latency
+ *
+ * Each component is created with OMX_GetHandle, its ports and formats are
+ * walked, then with all ports disabled it goes Loaded -> Idle -> Executing ->
+ * Idle -> Loaded before OMX_FreeHandle. Every step is timed, -r repeats the
+ * cycle to get min/avg/max.
+ *
+ * Output is JSON lines : a header with the core init times, one object per
+ * component and a trailer with the deinit time, so that runs on different
+ * firmwares (or the stub IL core) can be diffed.
+ */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
+#include "bcm_host.h"
 #include <IL/OMX_Core.h>
+#include <IL/OMX_Broadcom.h>
 
-int main(int argc, char **argv)
+#define OMX_INIT_STRUCTURE(a) \
+	memset(&(a), 0, sizeof(a)); \
+	(a).nSize = sizeof(a); \
+	(a).nVersion.nVersion = OMX_VERSION
+
+#define PROBE_TIMEOUT_MS 2000
+#define PROBE_MAX_FORMATS 64
+#define PROBE_TIMEOUT ((OMX_ERRORTYPE)1)
+
+// =======================================================================
+// timing
+// =======================================================================
+enum phase
+{
+	PHASE_GET_HANDLE,
+	PHASE_DISABLE_PORTS,
+	PHASE_LOADED_TO_IDLE,
+	PHASE_IDLE_TO_EXECUTING,
+	PHASE_EXECUTING_TO_IDLE,
+	PHASE_IDLE_TO_LOADED,
+	PHASE_FREE_HANDLE,
+	PHASE_MAX
+};
+
+static const char *phase_name[PHASE_MAX] =
+{
+	"get_handle",
+	"disable_ports",
+	"loaded_to_idle",
+	"idle_to_executing",
+	"executing_to_idle",
+	"idle_to_loaded",
+	"free_handle",
+};
+
+struct timing
+{
+	double min;
+	double max;
+	double sum;
+	unsigned int count;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void timing_add(struct timing *t, double us)
+{
+	if (t->count == 0 || us < t->min)
+		t->min = us;
+	if (t->count == 0 || us > t->max)
+		t->max = us;
+	t->sum += us;
+	t->count++;
+}
+
+// =======================================================================
+// command completion
+// =======================================================================
+struct probe
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int completed[OMX_CommandMarkBuffer + 1];
+	OMX_ERRORTYPE error;
+};
+
+static OMX_ERRORTYPE event_handler(OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2, OMX_PTR pEventData)
+{
+	struct probe *probe = pAppData;
+
+	pthread_mutex_lock(&probe->lock);
+	if (eEvent == OMX_EventCmdComplete && nData1 <= OMX_CommandMarkBuffer)
+		probe->completed[nData1]++;
+	else if (eEvent == OMX_EventError)
+		probe->error = (OMX_ERRORTYPE)nData1;
+	pthread_cond_broadcast(&probe->cond);
+	pthread_mutex_unlock(&probe->lock);
+	return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE empty_buffer_done(OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE *pBuffer)
+{
+	return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE fill_buffer_done(OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE *pBuffer)
+{
+	return OMX_ErrorNone;
+}
+
+static void probe_reset(struct probe *probe)
+{
+	pthread_mutex_lock(&probe->lock);
+	memset(probe->completed, 0, sizeof(probe->completed));
+	probe->error = OMX_ErrorNone;
+	pthread_mutex_unlock(&probe->lock);
+}
+
+// send a command and wait for its completion events
+static OMX_ERRORTYPE probe_command(struct probe *probe, OMX_HANDLETYPE handle, OMX_COMMANDTYPE cmd, OMX_U32 param, unsigned int count)
 {
-    bcm_host_init();
-    OMX_Init();
-
-    char name[OMX_MAX_STRINGNAME_SIZE];
-    name[0] = '\0';
-
-    OMX_U32 index = 0;
-    OMX_ERRORTYPE err = OMX_ErrorNone;
-    do
-    {
-        err = OMX_ComponentNameEnum(name, OMX_MAX_STRINGNAME_SIZE, index);
-        if (err == OMX_ErrorNone)
-        {
-		OMX_U32 numRoles = 0;
-		err = OMX_GetRolesOfComponent(name,&numRoles,NULL);
+	struct timespec deadline;
+	OMX_ERRORTYPE err;
+
+	probe_reset(probe);
+	err = OMX_SendCommand(handle, cmd, param, NULL);
+	if (err != OMX_ErrorNone)
+		return err;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += PROBE_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (PROBE_TIMEOUT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_nsec -= 1000000000;
+		deadline.tv_sec++;
+	}
+	pthread_mutex_lock(&probe->lock);
+	while (probe->completed[cmd] < count && probe->error == OMX_ErrorNone)
+	{
+		if (pthread_cond_timedwait(&probe->cond, &probe->lock, &deadline) != 0)
+		{
+			err = PROBE_TIMEOUT;
+			break;
+		}
+	}
+	if (probe->error != OMX_ErrorNone)
+		err = probe->error;
+	pthread_mutex_unlock(&probe->lock);
+	return err;
+}
+
+// =======================================================================
+// names
+// =======================================================================
+static const char *domain_name(OMX_PORTDOMAINTYPE domain)
+{
+	switch (domain)
+	{
+		case OMX_PortDomainAudio: return "audio";
+		case OMX_PortDomainVideo: return "video";
+		case OMX_PortDomainImage: return "image";
+		case OMX_PortDomainOther: return "other";
+		default: return "unknown";
+	}
+}
+
+static const char *video_coding_name(OMX_VIDEO_CODINGTYPE coding)
+{
+	static const char *names[] = { "unused", "autodetect", "mpeg2", "h263", "mpeg4", "wmv", "rv", "avc", "mjpeg" };
+	return (coding < sizeof(names)/sizeof(names[0])) ? names[coding] : NULL;
+}
+
+static const char *image_coding_name(OMX_IMAGE_CODINGTYPE coding)
+{
+	static const char *names[] = { "unused", "autodetect", "jpeg", "jpeg2k", "exif", "tiff", "gif", "png", "lzw", "bmp" };
+	return (coding < sizeof(names)/sizeof(names[0])) ? names[coding] : NULL;
+}
+
+static const char *audio_coding_name(OMX_AUDIO_CODINGTYPE coding)
+{
+	static const char *names[] = { "unused", "autodetect", "pcm" };
+	return (coding < sizeof(names)/sizeof(names[0])) ? names[coding] : NULL;
+}
+
+static const char *color_name(OMX_COLOR_FORMATTYPE color)
+{
+	switch (color)
+	{
+		case OMX_COLOR_FormatUnused: return "unused";
+		case OMX_COLOR_Format16bitRGB565: return "rgb565";
+		case OMX_COLOR_Format24bitBGR888: return "bgr888";
+		case OMX_COLOR_FormatYUV420PackedPlanar: return "yuv420packedplanar";
+		case OMX_COLOR_FormatYUV420PackedSemiPlanar: return "yuv420packedsemiplanar";
+		default: return NULL;
+	}
+}
+
+// known names as strings, anything else as its value
+static void print_enum(const char *key, const char *name, unsigned int value)
+{
+	if (name)
+		printf("\"%s\":\"%s\"", key, name);
+	else
+		printf("\"%s\":\"0x%x\"", key, value);
+}
+
+static void print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+// =======================================================================
+// ports
+// =======================================================================
+static void print_formats(OMX_HANDLETYPE handle, OMX_PORTDOMAINTYPE domain, OMX_U32 port)
+{
+	OMX_U32 i;
+
+	printf(",\"formats\":[");
+	for (i = 0; i < PROBE_MAX_FORMATS; i++)
+	{
+		if (domain == OMX_PortDomainVideo)
+		{
+			OMX_VIDEO_PARAM_PORTFORMATTYPE format;
+			OMX_INIT_STRUCTURE(format);
+			format.nPortIndex = port;
+			format.nIndex = i;
+			if (OMX_GetParameter(handle, OMX_IndexParamVideoPortFormat, &format) != OMX_ErrorNone)
+				break;
+			printf("%s{", i ? "," : "");
+			print_enum("compression", video_coding_name(format.eCompressionFormat), format.eCompressionFormat);
+			putchar(',');
+			print_enum("color", color_name(format.eColorFormat), format.eColorFormat);
+			putchar('}');
+		}
+		else if (domain == OMX_PortDomainImage)
+		{
+			OMX_IMAGE_PARAM_PORTFORMATTYPE format;
+			OMX_INIT_STRUCTURE(format);
+			format.nPortIndex = port;
+			format.nIndex = i;
+			if (OMX_GetParameter(handle, OMX_IndexParamImagePortFormat, &format) != OMX_ErrorNone)
+				break;
+			printf("%s{", i ? "," : "");
+			print_enum("compression", image_coding_name(format.eCompressionFormat), format.eCompressionFormat);
+			putchar(',');
+			print_enum("color", color_name(format.eColorFormat), format.eColorFormat);
+			putchar('}');
+		}
+		else if (domain == OMX_PortDomainAudio)
+		{
+			OMX_AUDIO_PARAM_PORTFORMATTYPE format;
+			OMX_INIT_STRUCTURE(format);
+			format.nPortIndex = port;
+			format.nIndex = i;
+			if (OMX_GetParameter(handle, OMX_IndexParamAudioPortFormat, &format) != OMX_ErrorNone)
+				break;
+			printf("%s{", i ? "," : "");
+			print_enum("encoding", audio_coding_name(format.eEncoding), format.eEncoding);
+			putchar('}');
+		}
+		else
+		{
+			break;
+		}
+	}
+	putchar(']');
+}
+
+static void print_ports(OMX_HANDLETYPE handle, OMX_U32 *ports, unsigned int *nports, unsigned int max)
+{
+	static const OMX_INDEXTYPE init[] = { OMX_IndexParamAudioInit, OMX_IndexParamImageInit, OMX_IndexParamVideoInit, OMX_IndexParamOtherInit };
+	unsigned int d, first = 1;
+
+	*nports = 0;
+	printf(",\"ports\":[");
+	for (d = 0; d < sizeof(init)/sizeof(init[0]); d++)
+	{
+		OMX_PORT_PARAM_TYPE param;
+		OMX_U32 p;
+
+		OMX_INIT_STRUCTURE(param);
+		if (OMX_GetParameter(handle, init[d], &param) != OMX_ErrorNone)
+			continue;
+		for (p = param.nStartPortNumber; p < param.nStartPortNumber + param.nPorts; p++)
+		{
+			OMX_PARAM_PORTDEFINITIONTYPE def;
+
+			if (*nports < max)
+				ports[(*nports)++] = p;
+			OMX_INIT_STRUCTURE(def);
+			def.nPortIndex = p;
+			printf("%s{\"index\":%u", first ? "" : ",", p);
+			first = 0;
+			if (OMX_GetParameter(handle, OMX_IndexParamPortDefinition, &def) != OMX_ErrorNone)
+			{
+				printf(",\"error\":\"portdefinition\"}");
+				continue;
+			}
+			printf(",\"dir\":\"%s\",\"domain\":\"%s\",\"enabled\":%d,\"buffers\":%u,\"buffers_min\":%u,\"buffer_size\":%u,\"alignment\":%u",
+				def.eDir == OMX_DirInput ? "in" : "out", domain_name(def.eDomain), def.bEnabled ? 1 : 0,
+				def.nBufferCountActual, def.nBufferCountMin, def.nBufferSize, def.nBufferAlignment);
+			if (def.eDomain == OMX_PortDomainVideo)
+			{
+				printf(",\"width\":%u,\"height\":%u,\"stride\":%d,\"slice_height\":%u,\"framerate\":%.2f,",
+					def.format.video.nFrameWidth, def.format.video.nFrameHeight, def.format.video.nStride,
+					def.format.video.nSliceHeight, def.format.video.xFramerate / 65536.0);
+				print_enum("compression", video_coding_name(def.format.video.eCompressionFormat), def.format.video.eCompressionFormat);
+				putchar(',');
+				print_enum("color", color_name(def.format.video.eColorFormat), def.format.video.eColorFormat);
+			}
+			print_formats(handle, def.eDomain, p);
+			putchar('}');
+		}
+	}
+	putchar(']');
+}
+
+// =======================================================================
+// components
+// =======================================================================
+struct component_probe
+{
+	struct timing timing[PHASE_MAX];
+	enum phase failed_phase;
+	OMX_ERRORTYPE failed;
+};
+
+#define PROBE_MAX_PORTS 32
+
+// one create / configure / destroy cycle, ports are printed on the first one
+static void probe_cycle(struct probe *probe, char *name, struct component_probe *result, int describe)
+{
+	OMX_CALLBACKTYPE callbacks = { event_handler, empty_buffer_done, fill_buffer_done };
+	OMX_U32 ports[PROBE_MAX_PORTS];
+	unsigned int nports = 0, i;
+	OMX_HANDLETYPE handle = NULL;
+	OMX_ERRORTYPE err;
+	enum phase phase;
+	double start;
+
+	start = now_us();
+	err = OMX_GetHandle(&handle, name, probe, &callbacks);
+	if (err != OMX_ErrorNone)
+	{
+		result->failed_phase = PHASE_GET_HANDLE;
+		result->failed = err;
+		return;
+	}
+	timing_add(&result->timing[PHASE_GET_HANDLE], now_us() - start);
+
+	if (describe)
+		print_ports(handle, ports, &nports, PROBE_MAX_PORTS);
+	else
+	{
+		// the port list is needed to disable them
+		static const OMX_INDEXTYPE init[] = { OMX_IndexParamAudioInit, OMX_IndexParamImageInit, OMX_IndexParamVideoInit, OMX_IndexParamOtherInit };
+		unsigned int d;
+		for (d = 0; d < sizeof(init)/sizeof(init[0]); d++)
+		{
+			OMX_PORT_PARAM_TYPE param;
+			OMX_INIT_STRUCTURE(param);
+			if (OMX_GetParameter(handle, init[d], &param) != OMX_ErrorNone)
+				continue;
+			for (i = 0; i < param.nPorts && nports < PROBE_MAX_PORTS; i++)
+				ports[nports++] = param.nStartPortNumber + i;
+		}
+	}
+
+	// ports are disabled so that state changes do not need buffers
+	start = now_us();
+	for (i = 0; i < nports; i++)
+	{
+		err = probe_command(probe, handle, OMX_CommandPortDisable, ports[i], 1);
 		if (err != OMX_ErrorNone)
+			break;
+	}
+	if (err != OMX_ErrorNone)
+	{
+		result->failed_phase = PHASE_DISABLE_PORTS;
+		result->failed = err;
+		goto free;
+	}
+	timing_add(&result->timing[PHASE_DISABLE_PORTS], now_us() - start);
+
+	{
+		static const OMX_STATETYPE states[] = { OMX_StateIdle, OMX_StateExecuting, OMX_StateIdle, OMX_StateLoaded };
+		for (phase = PHASE_LOADED_TO_IDLE; phase <= PHASE_IDLE_TO_LOADED; phase++)
+		{
+			start = now_us();
+			err = probe_command(probe, handle, OMX_CommandStateSet, states[phase - PHASE_LOADED_TO_IDLE], 1);
+			if (err != OMX_ErrorNone)
+			{
+				result->failed_phase = phase;
+				result->failed = err;
+				// back to loaded before freeing
+				if (phase == PHASE_EXECUTING_TO_IDLE)
+					probe_command(probe, handle, OMX_CommandStateSet, OMX_StateIdle, 1);
+				if (phase != PHASE_LOADED_TO_IDLE)
+					probe_command(probe, handle, OMX_CommandStateSet, OMX_StateLoaded, 1);
+				goto free;
+			}
+			timing_add(&result->timing[phase], now_us() - start);
+		}
+	}
+
+free:
+	start = now_us();
+	err = OMX_FreeHandle(handle);
+	if (err != OMX_ErrorNone)
+	{
+		if (result->failed == OMX_ErrorNone)
 		{
-			printf("Error er:%x\n", err);
+			result->failed_phase = PHASE_FREE_HANDLE;
+			result->failed = err;
 		}
-		printf("#%d [%s] numRoles = %x\n", index, name, numRoles);
-		index++;
-        }
-    } while (err == OMX_ErrorNone);
-   
-    OMX_Deinit();
+		return;
+	}
+	timing_add(&result->timing[PHASE_FREE_HANDLE], now_us() - start);
+}
+
+static void probe_component(struct probe *probe, char *name, OMX_U32 index, int repeat)
+{
+	struct component_probe result;
+	OMX_U32 numRoles = 0;
+	int r;
+	unsigned int p;
+
+	memset(&result, 0, sizeof(result));
+
+	printf("{\"index\":%u,\"component\":", index);
+	print_string(name);
+	printf(",\"roles\":[");
+	if (OMX_GetRolesOfComponent(name, &numRoles, NULL) == OMX_ErrorNone && numRoles > 0)
+	{
+		OMX_U8 *roles[16];
+		OMX_U32 i;
+
+		if (numRoles > 16)
+			numRoles = 16;
+		for (i = 0; i < numRoles; i++)
+			roles[i] = calloc(1, OMX_MAX_STRINGNAME_SIZE);
+		if (OMX_GetRolesOfComponent(name, &numRoles, roles) == OMX_ErrorNone)
+		{
+			for (i = 0; i < numRoles; i++)
+			{
+				if (i)
+					putchar(',');
+				print_string((char *)roles[i]);
+			}
+		}
+		for (i = 0; i < 16 && i < numRoles; i++)
+			free(roles[i]);
+	}
+	putchar(']');
+
+	for (r = 0; r < repeat && result.failed == OMX_ErrorNone; r++)
+		probe_cycle(probe, name, &result, r == 0);
+
+	printf(",\"timing_us\":{");
+	for (p = 0; p < PHASE_MAX; p++)
+	{
+		const struct timing *t = &result.timing[p];
+		printf("%s\"%s\":", p ? "," : "", phase_name[p]);
+		if (t->count)
+			printf("{\"min\":%.1f,\"avg\":%.1f,\"max\":%.1f,\"count\":%u}", t->min, t->sum / t->count, t->max, t->count);
+		else
+			printf("null");
+	}
+	putchar('}');
+	if (result.failed != OMX_ErrorNone)
+	{
+		printf(",\"error\":{\"phase\":\"%s\",", phase_name[result.failed_phase]);
+		if (result.failed == PROBE_TIMEOUT)
+			printf("\"code\":\"timeout\"}");
+		else
+			printf("\"code\":\"0x%08x\"}", result.failed);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r repeat] [-c component]...\n"
+			"\t-r : create/destroy cycles per component, timings are min/avg/max (default 1)\n"
+			"\t-c : only probe the given components (OMX.broadcom. prefix optional)\n", prog);
+}
+
+static int selected(const char *name, char **filters, int nfilters)
+{
+	int i;
+
+	if (nfilters == 0)
+		return 1;
+	for (i = 0; i < nfilters; i++)
+	{
+		const char *short_name = strrchr(name, '.');
+		if (strcmp(name, filters[i]) == 0 || (short_name && strcmp(short_name + 1, filters[i]) == 0))
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct probe probe;
+	char *filters[32];
+	int nfilters = 0;
+	int repeat = 1;
+	unsigned int count = 0;
+	double start, host_us, init_us;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:c:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r': repeat = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+			case 'c': if (nfilters < 32) filters[nfilters++] = optarg; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+
+	pthread_mutex_init(&probe.lock, NULL);
+	pthread_cond_init(&probe.cond, NULL);
+
+	start = now_us();
+	bcm_host_init();
+	host_us = now_us() - start;
+
+	start = now_us();
+	OMX_ERRORTYPE err = OMX_Init();
+	init_us = now_us() - start;
+	printf("{\"probe\":\"omx\",\"repeat\":%d,\"bcm_host_init_us\":%.1f,\"omx_init_us\":%.1f", repeat, host_us, init_us);
+	if (err != OMX_ErrorNone)
+	{
+		printf(",\"error\":{\"phase\":\"omx_init\",\"code\":\"0x%08x\"}}\n", err);
+		return -1;
+	}
+	printf("}\n");
+
+	char name[OMX_MAX_STRINGNAME_SIZE];
+	OMX_U32 index;
+	for (index = 0; ; index++)
+	{
+		name[0] = '\0';
+		if (OMX_ComponentNameEnum(name, OMX_MAX_STRINGNAME_SIZE, index) != OMX_ErrorNone)
+			break;
+		if (!selected(name, filters, nfilters))
+			continue;
+		probe_component(&probe, name, index, repeat);
+		count++;
+	}
+
+	start = now_us();
+	OMX_Deinit();
+	printf("{\"components\":%u,\"omx_deinit_us\":%.1f}\n", count, now_us() - start);
 
-    return 0;
+	return 0;
 }
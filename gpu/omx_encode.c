@@ -0,0 +1,129 @@
+/*
+ * camera -> video_encode : write an H.264 Annex-B elementary stream
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "encoder.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-W width] [-H height] [-f fps] [-b bitrate] [-i intra] [-n buffers] [-s size] [-t seconds] [-S seconds] [-o file]\n"
+			"\t-W -H : frame size (default 1280x720)\n"
+			"\t-f    : framerate (default 30)\n"
+			"\t-b    : bitrate in bit/s (default 2000000)\n"
+			"\t-i    : intra period in frames (default encoder choice)\n"
+			"\t-n    : number of output buffers in the pool (default 4)\n"
+			"\t-s    : size of the output buffers (default encoder choice)\n"
+			"\t-t    : stop after the given duration\n"
+			"\t-S    : print statistics every given seconds\n"
+			"\t-o    : Annex-B output file, - for stdout, nothing written without it\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct encoder_config config = { 1280, 720, 30, 2000000, 0, 4, 0 };
+	struct encoder enc;
+	const char *output = NULL;
+	FILE *out = NULL;
+	int duration = 0;
+	int period = 0;
+	time_t start, report;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "W:H:f:b:i:n:s:t:S:o:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'W': config.width = atoi(optarg); break;
+			case 'H': config.height = atoi(optarg); break;
+			case 'f': config.framerate = atoi(optarg); break;
+			case 'b': config.bitrate = atoi(optarg); break;
+			case 'i': config.intra_period = atoi(optarg); break;
+			case 'n': config.buffers = atoi(optarg); break;
+			case 's': config.buffer_size = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'S': period = atoi(optarg); break;
+			case 'o': output = optarg; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+
+	if (output)
+	{
+		out = (strcmp(output, "-") == 0) ? stdout : fopen(output, "wb");
+		if (out == NULL)
+		{
+			fprintf(stderr, "can't open %s\n", output);
+			return -1;
+		}
+	}
+
+	if (encoder_open(&enc, &config) < 0)
+		return -1;
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	if (encoder_start(&enc) < 0)
+	{
+		encoder_close(&enc);
+		return -1;
+	}
+	fprintf(stderr, "encoding %ux%u@%u %u bit/s pool:%u x %zu bytes\n",
+		config.width, config.height, config.framerate, config.bitrate, enc.config.buffers, enc.buffer_size);
+
+	start = report = time(NULL);
+	while (!quit)
+	{
+		OMX_BUFFERHEADERTYPE *buf = encoder_read(&enc, 1000);
+		time_t now = time(NULL);
+
+		if (buf)
+		{
+			// the encoder output is already Annex-B, SPS/PPS come first flagged as codec config
+			if (out && buf->nFilledLen > 0)
+			{
+				if (fwrite(buf->pBuffer + buf->nOffset, 1, buf->nFilledLen, out) != buf->nFilledLen)
+				{
+					fprintf(stderr, "write failed\n");
+					quit = 1;
+				}
+			}
+			if (encoder_release(&enc, buf) < 0)
+				break;
+		}
+		else
+		{
+			fprintf(stderr, "no buffer from encoder\n");
+		}
+
+		if (period && now - report >= period)
+		{
+			encoder_print_stats(&enc, stderr);
+			report = now;
+		}
+		if (duration && now - start >= duration)
+			break;
+	}
+
+	encoder_print_stats(&enc, stderr);
+	encoder_close(&enc);
+	if (out && out != stdout)
+		fclose(out);
+	else if (out)
+		fflush(out);
+
+	return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * camera -> video_encode with inline motion vectors : motion detection
+ *
+ * Only the vectors the encoder computes anyway are looked at (motion.h), a
+ * few KB per frame instead of the pixels. The activity transitions are JSON
+ * lines on stdout, the H.264 stream is only written (-o) while there is
+ * activity, starting with an IDR requested at the start of each activity.
+ *
+ * -r replays a vector dump (raspivid -x, or -x here) without camera, as fast
+ * as it reads, the times follow the -f rate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "encoder.h"
+#include "motion.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static void print_event(const struct motion *m, int event, double time_s)
+{
+	if (event == MOTION_START)
+		printf("{\"event\":\"start\",\"frame\":%llu,\"time\":%.3f,\"score\":%u,\"blocks\":%u,\"box\":[%u,%u,%u,%u]}\n",
+		       (unsigned long long)m->frames - 1, time_s, m->score, m->blocks,
+		       m->left * 16, m->top * 16, (m->right + 1) * 16, (m->bottom + 1) * 16);
+	else
+		printf("{\"event\":\"stop\",\"frame\":%llu,\"time\":%.3f,\"peak\":%u}\n",
+		       (unsigned long long)m->frames - 1, time_s, m->peak);
+	fflush(stdout);
+}
+
+static void print_stats(const struct motion *m, FILE *out)
+{
+	fprintf(out, "frames:%llu active:%llu (%.1f%%) events:%llu score:%u%s\n",
+		(unsigned long long)m->frames, (unsigned long long)m->active_frames,
+		m->frames ? 100.0 * m->active_frames / m->frames : 0.0, (unsigned long long)m->events,
+		m->score, m->active ? " active" : "");
+}
+
+// =======================================================================
+// vector dump replay
+// =======================================================================
+static int replay(struct motion *m, const char *name, unsigned int framerate, int show_mask)
+{
+	FILE *in = strcmp(name, "-") ? fopen(name, "rb") : stdin;
+	uint8_t *vectors;
+
+	if (!in)
+	{
+		fprintf(stderr, "can't open %s\n", name);
+		return -1;
+	}
+	vectors = malloc(m->frame_size);
+	while (vectors && !quit && fread(vectors, 1, m->frame_size, in) == m->frame_size)
+	{
+		int event = motion_frame(m, vectors, m->frame_size);
+
+		if (event == MOTION_NONE)
+			continue;
+		print_event(m, event, (double)(m->frames - 1) / framerate);
+		if (event == MOTION_START && show_mask)
+			motion_print_mask(m, stderr);
+	}
+	print_stats(m, stderr);
+	free(vectors);
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-W width] [-H height] [-f fps] [-b bitrate] [-m magnitude] [-T threshold] [-n trigger] [-k hold] [-t seconds] [-S seconds] [-M] [-x file] [-o file] [-r file]\n"
+			"\t-W -H : frame size (default 1280x720)\n"
+			"\t-f    : framerate (default 30)\n"
+			"\t-b    : bitrate in bit/s (default 2000000)\n"
+			"\t-m    : vector length of a moving macroblock (default 2)\n"
+			"\t-T    : per mille of moving macroblocks for activity (default 5)\n"
+			"\t-n    : frames over the threshold to start (default 3)\n"
+			"\t-k    : frames under the threshold to stop (default 30)\n"
+			"\t-t    : stop after the given duration\n"
+			"\t-S    : print statistics every given seconds\n"
+			"\t-M    : print the macroblock mask at each start\n"
+			"\t-x    : write the vectors to a dump file\n"
+			"\t-o    : Annex-B output of the active periods\n"
+			"\t-r    : replay a vector dump instead of the camera, - for stdin\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct encoder_config config = { 1280, 720, 30, 2000000, 0, 4, 0 };
+	struct motion_config mconfig = { 0, 0, 2, 5, 3, 30 };
+	struct encoder enc;
+	struct motion motion;
+	const char *output = NULL, *dump_name = NULL, *replay_name = NULL;
+	FILE *out = NULL, *dump = NULL;
+	int duration = 0;
+	int period = 0;
+	int show_mask = 0;
+	int writing = 0;
+	time_t start, report;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "W:H:f:b:m:T:n:k:t:S:Mx:o:r:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'W': config.width = atoi(optarg); break;
+			case 'H': config.height = atoi(optarg); break;
+			case 'f': config.framerate = atoi(optarg); break;
+			case 'b': config.bitrate = atoi(optarg); break;
+			case 'm': mconfig.magnitude = atoi(optarg); break;
+			case 'T': mconfig.threshold = atoi(optarg); break;
+			case 'n': mconfig.trigger = atoi(optarg); break;
+			case 'k': mconfig.hold = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'S': period = atoi(optarg); break;
+			case 'M': show_mask = 1; break;
+			case 'x': dump_name = optarg; break;
+			case 'o': output = optarg; break;
+			case 'r': replay_name = optarg; break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (config.framerate == 0)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	mconfig.width = config.width;
+	mconfig.height = config.height;
+	if (motion_init(&motion, &mconfig) < 0)
+	{
+		fprintf(stderr, "can't allocate the %ux%u macroblocks\n", motion.cols, motion.rows);
+		return -1;
+	}
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	if (replay_name)
+	{
+		int ret = replay(&motion, replay_name, config.framerate, show_mask);
+		motion_free(&motion);
+		return ret;
+	}
+
+	if (output)
+	{
+		out = (strcmp(output, "-") == 0) ? stdout : fopen(output, "wb");
+		if (out == NULL)
+		{
+			fprintf(stderr, "can't open %s\n", output);
+			return -1;
+		}
+	}
+	if (dump_name)
+	{
+		dump = fopen(dump_name, "wb");
+		if (dump == NULL)
+		{
+			fprintf(stderr, "can't open %s\n", dump_name);
+			return -1;
+		}
+	}
+
+	// the IDR requested at each start carries SPS/PPS
+	config.inline_headers = 1;
+	config.inline_vectors = 1;
+	if (encoder_open(&enc, &config) < 0)
+		return -1;
+	if (encoder_start(&enc) < 0)
+	{
+		encoder_close(&enc);
+		return -1;
+	}
+	fprintf(stderr, "motion %ux%u@%u %ux%u macroblocks, %zu bytes of vectors per frame\n",
+		config.width, config.height, config.framerate, motion.cols, motion.rows, motion.frame_size);
+
+	start = report = time(NULL);
+	while (!quit)
+	{
+		OMX_BUFFERHEADERTYPE *buf = encoder_read(&enc, 1000);
+		time_t now = time(NULL);
+
+		if (buf && (buf->nFlags & OMX_BUFFERFLAG_CODECSIDEINFO))
+		{
+			const uint8_t *vectors = buf->pBuffer + buf->nOffset;
+			int event = motion_frame(&motion, vectors, buf->nFilledLen);
+
+			if (event < 0)
+				fprintf(stderr, "unexpected vector buffer of %u bytes\n", buf->nFilledLen);
+			else if (event != MOTION_NONE)
+			{
+				print_event(&motion, event, encoder_ticks(buf->nTimeStamp) / 1e6);
+				if (event == MOTION_START && show_mask)
+					motion_print_mask(&motion, stderr);
+				if (event == MOTION_START && out)
+					encoder_request_keyframe(&enc);
+				if (event == MOTION_STOP)
+					writing = 0;
+			}
+			if (dump && fwrite(vectors, 1, buf->nFilledLen, dump) != buf->nFilledLen)
+			{
+				fprintf(stderr, "dump write failed\n");
+				quit = 1;
+			}
+		}
+		else if (buf)
+		{
+			// the stream of an activity starts at the SPS/PPS of its IDR, an IDR can span several buffers
+			if (motion.active && (buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG))
+				writing = 1;
+			if (out && writing && buf->nFilledLen > 0)
+			{
+				if (fwrite(buf->pBuffer + buf->nOffset, 1, buf->nFilledLen, out) != buf->nFilledLen)
+				{
+					fprintf(stderr, "write failed\n");
+					quit = 1;
+				}
+			}
+		}
+		else
+		{
+			fprintf(stderr, "no buffer from encoder\n");
+		}
+		if (buf && encoder_release(&enc, buf) < 0)
+			break;
+
+		if (period && now - report >= period)
+		{
+			print_stats(&motion, stderr);
+			report = now;
+		}
+		if (duration && now - start >= duration)
+			break;
+	}
+
+	print_stats(&motion, stderr);
+	encoder_close(&enc);
+	motion_free(&motion);
+	if (dump)
+		fclose(dump);
+	if (out && out != stdout)
+		fclose(out);
+	else if (out)
+		fflush(out);
+
+	return 0;
+}
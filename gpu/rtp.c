@@ -0,0 +1,171 @@
+/*
+ * H.264 access units shared between RTP sessions, and their RTP packetization
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "rtp.h"
+
+// =======================================================================
+// access units
+// =======================================================================
+struct au *au_alloc(size_t capacity)
+{
+	struct au *au = malloc(sizeof(*au) + capacity);
+
+	if (au)
+	{
+		au->refcount = 1;
+		au->key = 0;
+		au->ts_us = 0;
+		au->size = 0;
+		au->capacity = capacity;
+	}
+	return au;
+}
+
+// only before the access unit is shared, it may move
+int au_append(struct au **au, const uint8_t *data, size_t len)
+{
+	if ((*au)->size + len > (*au)->capacity)
+	{
+		size_t capacity = ((*au)->size + len) * 2;
+		struct au *bigger = realloc(*au, sizeof(**au) + capacity);
+		if (bigger == NULL)
+			return -1;
+		bigger->capacity = capacity;
+		*au = bigger;
+	}
+	memcpy((*au)->data + (*au)->size, data, len);
+	(*au)->size += len;
+	return 0;
+}
+
+struct au *au_ref(struct au *au)
+{
+	__atomic_add_fetch(&au->refcount, 1, __ATOMIC_RELAXED);
+	return au;
+}
+
+void au_unref(struct au *au)
+{
+	if (__atomic_sub_fetch(&au->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(au);
+}
+
+const uint8_t *h264_next_nal(const uint8_t *data, const uint8_t *end, size_t *len)
+{
+	const uint8_t *p = data;
+	const uint8_t *nal;
+
+	// start code
+	while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+		p++;
+	if (p + 3 > end)
+		return NULL;
+	nal = p + 3;
+
+	// up to the next one, a 4 bytes start code leaves its leading zero behind
+	p = nal;
+	while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && (p[2] == 1 || (p[2] == 0 && p + 4 <= end && p[3] == 1))))
+		p++;
+	if (p + 3 > end)
+		p = end;
+	*len = p - nal;
+	return nal;
+}
+
+// =======================================================================
+// packetization (RFC 6184)
+// =======================================================================
+static int rtp_send(int fd, uint8_t *header, size_t header_len, const uint8_t *payload, size_t len, struct rtp_stats *stats)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_len;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if (sendmsg(fd, &msg, MSG_DONTWAIT) < 0)
+	{
+		// a full socket buffer is a slow client, the packet is lost for it only
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+		{
+			stats->dropped++;
+			return 0;
+		}
+		return -1;
+	}
+	stats->packets++;
+	stats->bytes += header_len + len;
+	return 0;
+}
+
+static void rtp_header(uint8_t *header, int marker, uint16_t seq, uint32_t rtptime, uint32_t ssrc)
+{
+	header[0] = 0x80;
+	header[1] = (marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+	header[2] = seq >> 8;
+	header[3] = seq & 0xff;
+	header[4] = rtptime >> 24;
+	header[5] = rtptime >> 16;
+	header[6] = rtptime >> 8;
+	header[7] = rtptime;
+	header[8] = ssrc >> 24;
+	header[9] = ssrc >> 16;
+	header[10] = ssrc >> 8;
+	header[11] = ssrc;
+}
+
+int rtp_send_au(int fd, const struct au *au, uint16_t *seq, uint32_t ssrc, uint32_t rtptime, struct rtp_stats *stats)
+{
+	const uint8_t *end = au->data + au->size;
+	const uint8_t *nal, *next;
+	size_t len, next_len = 0;
+	uint8_t header[14];
+
+	for (nal = h264_next_nal(au->data, end, &len); nal; nal = next, len = next_len)
+	{
+		// the marker goes on the last packet of the access unit
+		int last;
+
+		next = h264_next_nal(nal + len, end, &next_len);
+		last = (next == NULL);
+		if (len == 0)
+			continue;
+		if (len <= RTP_MTU)
+		{
+			rtp_header(header, last, (*seq)++, rtptime, ssrc);
+			if (rtp_send(fd, header, 12, nal, len, stats) < 0)
+				return -1;
+		}
+		else
+		{
+			// FU-A, the NAL header is split between the indicator and the FU header
+			size_t pos = 1;
+			while (pos < len)
+			{
+				size_t chunk = (len - pos > RTP_MTU - 2) ? RTP_MTU - 2 : len - pos;
+				int first = (pos == 1);
+				int final = (pos + chunk == len);
+
+				rtp_header(header, last && final, (*seq)++, rtptime, ssrc);
+				header[12] = (nal[0] & 0xe0) | 28;
+				header[13] = (first ? 0x80 : 0) | (final ? 0x40 : 0) | (nal[0] & 0x1f);
+				if (rtp_send(fd, header, 14, nal + pos, chunk, stats) < 0)
+					return -1;
+				pos += chunk;
+			}
+		}
+	}
+	return 0;
+}
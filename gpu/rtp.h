@@ -0,0 +1,46 @@
+/*
+ * H.264 access units shared between RTP sessions, and their RTP packetization
+ *
+ * An access unit is encoded once and queued by reference in every session,
+ * packets are sent with an iovec pointing into it, so the payload is never
+ * copied whatever the number of clients.
+ */
+#ifndef RTP_H
+#define RTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTP_PAYLOAD_TYPE 96
+#define RTP_CLOCK 90000
+#define RTP_MTU 1400
+
+struct au
+{
+	int refcount;
+	int key;
+	uint64_t ts_us;
+	size_t size;
+	size_t capacity;
+	uint8_t data[];
+};
+
+struct au *au_alloc(size_t capacity);
+int au_append(struct au **au, const uint8_t *data, size_t len);
+struct au *au_ref(struct au *au);
+void au_unref(struct au *au);
+
+// find the next NAL unit of an Annex-B buffer, returns its start or NULL
+const uint8_t *h264_next_nal(const uint8_t *data, const uint8_t *end, size_t *len);
+
+struct rtp_stats
+{
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t dropped;
+};
+
+// send an access unit on a connected UDP socket, single NAL or FU-A packets
+int rtp_send_au(int fd, const struct au *au, uint16_t *seq, uint32_t ssrc, uint32_t rtptime, struct rtp_stats *stats);
+
+#endif
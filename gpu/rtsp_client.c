@@ -0,0 +1,320 @@
+/*
+ * RTSP loopback client : open several RTP/UDP sessions on a stream and measure
+ * what each of them receives (frames, loss, interarrival jitter as RFC 3550)
+ *
+ * With -B or -F a SET_PARAMETER is sent at half the duration, the bitrate of
+ * both halves is reported to check the change is applied on the fly.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rtp.h"
+
+#define MAX_SESSIONS 64
+
+struct session
+{
+	int fd;
+	int rtp_fd;
+	int cseq;
+	char id[32];
+
+	int started;
+	uint16_t last_seq;
+	uint32_t cycles;
+	uint32_t base_seq;
+	uint64_t packets;
+	uint64_t bytes[2];
+	uint64_t frames;
+	uint64_t lost;
+	int64_t transit;
+	double jitter;
+	double first_frame_ms;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// send a request and wait for the whole answer, returns the status code
+static int request(struct session *s, const char *method, const char *url, const char *headers, const char *body, char *answer, size_t size)
+{
+	char buf[2048];
+	size_t len = 0;
+	int status = -1;
+
+	len = snprintf(buf, sizeof(buf), "%s %s RTSP/1.0\r\nCSeq: %d\r\nUser-Agent: rpi rtsp_client\r\n%s%s%s",
+		method, url, ++s->cseq, s->id[0] ? "Session: " : "", s->id, s->id[0] ? "\r\n" : "");
+	len += snprintf(buf + len, sizeof(buf) - len, "%s", headers ? headers : "");
+	if (body)
+		len += snprintf(buf + len, sizeof(buf) - len, "Content-Type: text/parameters\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+	else
+		len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+	if (send(s->fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+		return -1;
+
+	len = 0;
+	for (;;)
+	{
+		char *end;
+		ssize_t n = recv(s->fd, answer + len, size - 1 - len, 0);
+		if (n <= 0)
+			return -1;
+		len += n;
+		answer[len] = '\0';
+		end = strstr(answer, "\r\n\r\n");
+		if (end)
+		{
+			char *cl = strcasestr(answer, "Content-Length:");
+			size_t body_len = cl ? strtoul(cl + 15, NULL, 10) : 0;
+			if ((size_t)(end + 4 - answer) + body_len <= len || len == size - 1)
+				break;
+		}
+	}
+	sscanf(answer, "RTSP/1.0 %d", &status);
+	return status;
+}
+
+static int session_open(struct session *s, const struct sockaddr_in *server, const char *url)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char answer[4096], headers[256], track[512];
+	char *p;
+	int status;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	s->rtp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (s->fd < 0 || s->rtp_fd < 0)
+		return -1;
+	if (connect(s->fd, (const struct sockaddr *)server, sizeof(*server)) < 0)
+	{
+		fprintf(stderr, "connect failed:%s\n", strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	bind(s->rtp_fd, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(s->rtp_fd, (struct sockaddr *)&addr, &addrlen);
+	// packets arriving between two polls of a few ms, for all the sessions
+	{
+		int rcvbuf = 1 << 20;
+		setsockopt(s->rtp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	}
+
+	status = request(s, "DESCRIBE", url, "Accept: application/sdp\r\n", NULL, answer, sizeof(answer));
+	if (status != 200)
+	{
+		fprintf(stderr, "DESCRIBE %s failed:%d\n", url, status);
+		return -1;
+	}
+	snprintf(track, sizeof(track), "%s/track0", url);
+	snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n", ntohs(addr.sin_port), ntohs(addr.sin_port) + 1);
+	status = request(s, "SETUP", track, headers, NULL, answer, sizeof(answer));
+	p = strcasestr(answer, "\nSession:");
+	if (status != 200 || p == NULL)
+	{
+		fprintf(stderr, "SETUP %s failed:%d\n", track, status);
+		return -1;
+	}
+	sscanf(p + 9, " %31[0-9A-Fa-f]", s->id);
+	return 0;
+}
+
+static void receive(struct session *s, int half, double start)
+{
+	uint8_t pkt[2048];
+	ssize_t len;
+
+	while ((len = recv(s->rtp_fd, pkt, sizeof(pkt), MSG_DONTWAIT)) >= 12)
+	{
+		uint16_t seq = (pkt[2] << 8) | pkt[3];
+		uint32_t rtptime = ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+		double now = now_ms();
+		int64_t arrival = (int64_t)(now * RTP_CLOCK / 1000);
+		int64_t transit = arrival - rtptime;
+
+		if (!s->started)
+		{
+			s->started = 1;
+			s->base_seq = seq;
+			s->last_seq = seq - 1;
+			s->transit = transit;
+		}
+		else
+		{
+			// RFC 3550 A.8, rtptime is the same for every packet of a frame
+			int64_t d = transit - s->transit;
+			s->transit = transit;
+			if (d < 0)
+				d = -d;
+			s->jitter += (d - s->jitter) / 16;
+		}
+		if (seq < s->last_seq && (uint16_t)(s->last_seq - seq) > 0x8000)
+			s->cycles += 0x10000;
+		if ((uint16_t)(seq - s->last_seq) < 0x8000)
+			s->last_seq = seq;
+		s->packets++;
+		s->bytes[half] += len;
+		if (pkt[1] & 0x80)
+		{
+			if (s->frames == 0)
+				s->first_frame_ms = now - start;
+			s->frames++;
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n sessions] [-t seconds] [-B bitrate] [-F framerate] url\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	static struct session sessions[MAX_SESSIONS];
+	struct sockaddr_in server;
+	struct addrinfo hints, *res;
+	char host[256], answer[2048];
+	const char *url;
+	int port = 554;
+	int nsessions = 1;
+	int duration = 10;
+	unsigned int bitrate = 0, framerate = 0;
+	double start, half_time, stop;
+	int half = 0;
+	int opt, i, status;
+
+	while ((opt = getopt(argc, argv, "n:t:B:F:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': nsessions = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'B': bitrate = atoi(optarg); break;
+			case 'F': framerate = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (optind >= argc || nsessions < 1 || nsessions > MAX_SESSIONS)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	url = argv[optind];
+	if (sscanf(url, "rtsp://%255[^:/]:%d", host, &port) < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0)
+	{
+		fprintf(stderr, "can't resolve %s\n", host);
+		return -1;
+	}
+	server = *(struct sockaddr_in *)res->ai_addr;
+	server.sin_port = htons(port);
+	freeaddrinfo(res);
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	for (i = 0; i < nsessions; i++)
+	{
+		if (session_open(&sessions[i], &server, url) < 0)
+			return -1;
+	}
+	start = now_ms();
+	for (i = 0; i < nsessions; i++)
+	{
+		status = request(&sessions[i], "PLAY", url, "Range: npt=0.000-\r\n", NULL, answer, sizeof(answer));
+		if (status != 200)
+		{
+			fprintf(stderr, "PLAY failed:%d\n", status);
+			return -1;
+		}
+	}
+
+	half_time = start + duration * 500.0;
+	stop = start + duration * 1000.0;
+	while (!quit && now_ms() < stop)
+	{
+		struct pollfd pfd[MAX_SESSIONS];
+
+		for (i = 0; i < nsessions; i++)
+		{
+			pfd[i].fd = sessions[i].rtp_fd;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, nsessions, 100) < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < nsessions; i++)
+		{
+			if (pfd[i].revents & POLLIN)
+				receive(&sessions[i], half, start);
+		}
+
+		if (!half && now_ms() >= half_time)
+		{
+			half = 1;
+			if (bitrate || framerate)
+			{
+				char body[128];
+				int len = 0;
+				if (bitrate)
+					len += snprintf(body + len, sizeof(body) - len, "bitrate: %u\r\n", bitrate);
+				if (framerate)
+					len += snprintf(body + len, sizeof(body) - len, "framerate: %u\r\n", framerate);
+				status = request(&sessions[0], "SET_PARAMETER", url, NULL, body, answer, sizeof(answer));
+				fprintf(stderr, "SET_PARAMETER %s", status == 200 ? "ok\n" : "failed\n");
+			}
+		}
+	}
+	stop = now_ms();
+
+	for (i = 0; i < nsessions; i++)
+	{
+		struct session *s = &sessions[i];
+		uint64_t expected = s->started ? s->cycles + s->last_seq - s->base_seq + 1 : 0;
+		double first = (half_time - start) / 1000;
+		double second = (stop - half_time) / 1000;
+
+		s->lost = expected > s->packets ? expected - s->packets : 0;
+		printf("session %d packets:%llu frames:%llu lost:%llu jitter:%.2f ms first frame:%.1f ms kbps:%.0f/%.0f\n", i,
+			(unsigned long long)s->packets, (unsigned long long)s->frames, (unsigned long long)s->lost,
+			s->jitter * 1000 / RTP_CLOCK, s->first_frame_ms,
+			s->bytes[0] * 8 / first / 1000, second > 0 ? s->bytes[1] * 8 / second / 1000 : 0);
+		request(s, "TEARDOWN", url, NULL, NULL, answer, sizeof(answer));
+		close(s->rtp_fd);
+		close(s->fd);
+	}
+	return 0;
+}
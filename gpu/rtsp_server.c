@@ -0,0 +1,1052 @@
+/*
+ * RTSP server : each source is captured and encoded once, its access units
+ * are fanned out by reference to every RTP session
+ *
+ * Sources :
+ *  camera : camera -> video_encode tunnel (encoder.c), SPS/PPS inline before each IDR
+ *  test   : synthetic H.264 access units paced at the framerate, for loopback tests
+ *
+ * A source thread publishes each access unit in the queue of the playing
+ * sessions (a reference, never a copy), the main thread serves RTSP and sends
+ * the queued units over RTP/UDP with iovecs pointing into them. A session that
+ * lags behind loses its queue and restarts on the next IDR, the encoder never
+ * waits for a client.
+ *
+ * Bitrate and framerate are changed at runtime with SET_PARAMETER :
+ *   bitrate: 500000
+ *   framerate: 15
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "encoder.h"
+#include "rtp.h"
+
+#define MAX_MEDIA 4
+#define MAX_CLIENTS 64
+#define SESSION_QUEUE 32
+#define SESSION_TIMEOUT 60
+
+struct medium;
+struct server;
+
+struct source_ops
+{
+	const char *name;
+	const char *path;
+	int (*open)(struct medium *m);
+	struct au *(*read)(struct medium *m);
+	int (*set_bitrate)(struct medium *m, unsigned int bitrate);
+	int (*set_framerate)(struct medium *m, unsigned int framerate);
+	void (*request_keyframe)(struct medium *m);
+	void (*close)(struct medium *m);
+};
+
+struct medium
+{
+	const struct source_ops *ops;
+	struct server *server;
+	struct encoder_config config;
+	pthread_t thread;
+
+	// camera
+	struct encoder enc;
+	struct au *pending;
+
+	// test
+	struct timespec next;
+	unsigned int frame;
+	uint32_t seed;
+	int keyframe_request;
+
+	// parameter sets of the last IDR, for the SDP
+	uint8_t sps[64];
+	size_t sps_len;
+	uint8_t pps[64];
+	size_t pps_len;
+	uint64_t last_ts;
+
+	uint64_t frames;
+	uint64_t bytes;
+};
+
+struct client
+{
+	int fd;
+	char in[4096];
+	size_t inlen;
+	struct sockaddr_in peer;
+
+	// session, one track per connection
+	struct medium *medium;
+	uint32_t session;
+	int playing;
+	int rtp_fd;
+	uint16_t seq;
+	uint32_t ssrc;
+	uint32_t rtp_offset;
+	int waiting_key;
+	struct au *queue[SESSION_QUEUE];
+	unsigned int qhead;
+	unsigned int qcount;
+	struct rtp_stats stats;
+	uint64_t overflows;
+};
+
+struct server
+{
+	int listen_fd;
+	int efd;
+	pthread_mutex_t lock;
+	struct medium media[MAX_MEDIA];
+	int nmedia;
+	struct client *clients[MAX_CLIENTS];
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// =======================================================================
+// camera source
+// =======================================================================
+static int camera_open(struct medium *m)
+{
+	m->config.inline_headers = 1;
+	if (encoder_open(&m->enc, &m->config) < 0)
+		return -1;
+	if (encoder_start(&m->enc) < 0)
+	{
+		encoder_close(&m->enc);
+		return -1;
+	}
+	return 0;
+}
+
+// gather the encoder buffers of one frame, they go back to the encoder at once
+static struct au *camera_read(struct medium *m)
+{
+	for (;;)
+	{
+		OMX_BUFFERHEADERTYPE *buf = encoder_read(&m->enc, 1000);
+		OMX_U32 flags;
+		uint64_t ts;
+		int ret = 0;
+
+		if (buf == NULL)
+			return NULL;
+		if (m->pending == NULL)
+			m->pending = au_alloc(m->config.bitrate / 8 / m->config.framerate * 4 + 4096);
+		if (m->pending)
+			ret = au_append(&m->pending, buf->pBuffer + buf->nOffset, buf->nFilledLen);
+		flags = buf->nFlags;
+		ts = encoder_ticks(buf->nTimeStamp);
+		encoder_release(&m->enc, buf);
+		if (m->pending == NULL || ret < 0)
+			return NULL;
+
+		if ((flags & OMX_BUFFERFLAG_ENDOFFRAME) && !(flags & OMX_BUFFERFLAG_CODECCONFIG))
+		{
+			struct au *au = m->pending;
+			m->pending = NULL;
+			au->ts_us = ts;
+			au->key = (flags & OMX_BUFFERFLAG_SYNCFRAME) != 0;
+			return au;
+		}
+	}
+}
+
+static int camera_set_bitrate(struct medium *m, unsigned int bitrate)
+{
+	if (encoder_set_bitrate(&m->enc, bitrate) < 0)
+		return -1;
+	m->config.bitrate = bitrate;
+	return 0;
+}
+
+static int camera_set_framerate(struct medium *m, unsigned int framerate)
+{
+	if (encoder_set_framerate(&m->enc, framerate) < 0)
+		return -1;
+	m->config.framerate = framerate;
+	return 0;
+}
+
+static void camera_request_keyframe(struct medium *m)
+{
+	encoder_request_keyframe(&m->enc);
+}
+
+static void camera_close(struct medium *m)
+{
+	encoder_close(&m->enc);
+	if (m->pending)
+		au_unref(m->pending);
+	m->pending = NULL;
+}
+
+// =======================================================================
+// test source
+// =======================================================================
+static const uint8_t test_sps[] = { 0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8, 0x06, 0xd0, 0xa1, 0x35 };
+static const uint8_t test_pps[] = { 0, 0, 0, 1, 0x68, 0xce, 0x06, 0xe2 };
+
+static int test_open(struct medium *m)
+{
+	m->seed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &m->next);
+	return 0;
+}
+
+static struct au *test_read(struct medium *m)
+{
+	unsigned int framerate = __atomic_load_n(&m->config.framerate, __ATOMIC_RELAXED);
+	unsigned int bitrate = __atomic_load_n(&m->config.bitrate, __ATOMIC_RELAXED);
+	unsigned int intra = m->config.intra_period ? m->config.intra_period : framerate * 2;
+	uint64_t period = 1000000000ULL / framerate;
+	struct timespec now;
+	struct au *au;
+	size_t size, i;
+	int key;
+
+	m->next.tv_nsec += period;
+	while (m->next.tv_nsec >= 1000000000)
+	{
+		m->next.tv_nsec -= 1000000000;
+		m->next.tv_sec++;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &m->next, NULL) == EINTR && !quit);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// late by more than a frame, restart the schedule from now
+	if ((now.tv_sec - m->next.tv_sec) * 1000000000LL + (now.tv_nsec - m->next.tv_nsec) > (int64_t)period)
+		m->next = now;
+
+	key = (m->frame % intra == 0) || __atomic_exchange_n(&m->keyframe_request, 0, __ATOMIC_RELAXED);
+	m->frame = key ? 1 : m->frame + 1;
+
+	// an IDR costs 4 P frames, spread so that the average matches the bitrate
+	size = (uint64_t)bitrate / 8 / framerate * intra / (intra + 3);
+	if (key)
+		size *= 4;
+	if (size < 16)
+		size = 16;
+
+	au = au_alloc(size + sizeof(test_sps) + sizeof(test_pps) + 8);
+	if (au == NULL)
+		return NULL;
+	if (key)
+	{
+		au_append(&au, test_sps, sizeof(test_sps));
+		au_append(&au, test_pps, sizeof(test_pps));
+	}
+	au->data[au->size++] = 0;
+	au->data[au->size++] = 0;
+	au->data[au->size++] = 0;
+	au->data[au->size++] = 1;
+	au->data[au->size++] = key ? 0x65 : 0x41;
+	for (i = 0; i < size; i++)
+	{
+		m->seed = m->seed * 1103515245 + 12345;
+		// never 0, so that the payload does not contain start codes
+		au->data[au->size++] = (uint8_t)(m->seed >> 16) | 0x01;
+	}
+	au->key = key;
+	au->ts_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	return au;
+}
+
+static int test_set_bitrate(struct medium *m, unsigned int bitrate)
+{
+	__atomic_store_n(&m->config.bitrate, bitrate, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int test_set_framerate(struct medium *m, unsigned int framerate)
+{
+	__atomic_store_n(&m->config.framerate, framerate, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void test_request_keyframe(struct medium *m)
+{
+	__atomic_store_n(&m->keyframe_request, 1, __ATOMIC_RELAXED);
+}
+
+static void test_close(struct medium *m)
+{
+}
+
+static const struct source_ops sources[] =
+{
+	{ "camera", "/camera.h264", camera_open, camera_read, camera_set_bitrate, camera_set_framerate, camera_request_keyframe, camera_close },
+	{ "test", "/test.h264", test_open, test_read, test_set_bitrate, test_set_framerate, test_request_keyframe, test_close },
+};
+#define NB_SOURCES (sizeof(sources)/sizeof(sources[0]))
+
+// =======================================================================
+// fan-out
+// =======================================================================
+static void drop_queue(struct client *c)
+{
+	while (c->qcount)
+	{
+		au_unref(c->queue[c->qhead]);
+		c->qhead = (c->qhead + 1) % SESSION_QUEUE;
+		c->qcount--;
+	}
+}
+
+// keep the parameter sets of an IDR for DESCRIBE, called with the lock held
+static void cache_parameter_sets(struct medium *m, const struct au *au)
+{
+	const uint8_t *end = au->data + au->size;
+	const uint8_t *nal = au->data;
+	size_t len = 0;
+
+	while ((nal = h264_next_nal(nal + len, end, &len)) != NULL)
+	{
+		if (len == 0 || len > sizeof(m->sps))
+			continue;
+		if ((nal[0] & 0x1f) == 7)
+		{
+			memcpy(m->sps, nal, len);
+			m->sps_len = len;
+		}
+		else if ((nal[0] & 0x1f) == 8)
+		{
+			memcpy(m->pps, nal, len);
+			m->pps_len = len;
+		}
+	}
+}
+
+static void publish(struct medium *m, struct au *au)
+{
+	struct server *s = m->server;
+	uint64_t one = 1;
+	int request = 0;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	m->frames++;
+	m->bytes += au->size;
+	m->last_ts = au->ts_us;
+	if (au->key)
+		cache_parameter_sets(m, au);
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		struct client *c = s->clients[i];
+		if (c == NULL || c->medium != m || !c->playing)
+			continue;
+		if (c->qcount == SESSION_QUEUE)
+		{
+			drop_queue(c);
+			c->overflows++;
+			c->waiting_key = 1;
+			request = 1;
+		}
+		if (c->waiting_key && !au->key)
+			continue;
+		c->waiting_key = 0;
+		c->queue[(c->qhead + c->qcount) % SESSION_QUEUE] = au_ref(au);
+		c->qcount++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (request)
+		m->ops->request_keyframe(m);
+	if (write(s->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "eventfd write failed:%s\n", strerror(errno));
+	au_unref(au);
+}
+
+static void *medium_thread(void *arg)
+{
+	struct medium *m = arg;
+
+	while (!quit)
+	{
+		struct au *au = m->ops->read(m);
+		if (au)
+			publish(m, au);
+	}
+	return NULL;
+}
+
+// send what the source threads queued, the payload stays in the shared access units
+static void send_queued(struct server *s)
+{
+	struct au *batch[SESSION_QUEUE];
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		struct client *c = s->clients[i];
+		unsigned int n = 0, j;
+
+		if (c == NULL)
+			continue;
+		pthread_mutex_lock(&s->lock);
+		while (c->qcount)
+		{
+			batch[n++] = c->queue[c->qhead];
+			c->qhead = (c->qhead + 1) % SESSION_QUEUE;
+			c->qcount--;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		for (j = 0; j < n; j++)
+		{
+			uint32_t rtptime = (uint32_t)(batch[j]->ts_us * 9 / 100) + c->rtp_offset;
+			if (rtp_send_au(c->rtp_fd, batch[j], &c->seq, c->ssrc, rtptime, &c->stats) < 0)
+				fprintf(stderr, "session %08x send failed:%s\n", c->session, strerror(errno));
+			au_unref(batch[j]);
+		}
+	}
+}
+
+// =======================================================================
+// RTSP
+// =======================================================================
+static void base64(const uint8_t *in, size_t len, char *out)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for (i = 0; i + 2 < len; i += 3)
+	{
+		*out++ = table[in[i] >> 2];
+		*out++ = table[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+		*out++ = table[((in[i + 1] & 15) << 2) | (in[i + 2] >> 6)];
+		*out++ = table[in[i + 2] & 63];
+	}
+	if (i < len)
+	{
+		*out++ = table[in[i] >> 2];
+		if (i + 1 < len)
+		{
+			*out++ = table[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+			*out++ = table[(in[i + 1] & 15) << 2];
+		}
+		else
+		{
+			*out++ = table[(in[i] & 3) << 4];
+			*out++ = '=';
+		}
+		*out++ = '=';
+	}
+	*out = '\0';
+}
+
+// value of a header, copied in out, NULL if missing
+static const char *header_value(const char *headers, const char *name, char *out, size_t size)
+{
+	size_t len = strlen(name);
+	const char *line = headers;
+
+	while (line && *line)
+	{
+		if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+		{
+			const char *value = line + len + 1;
+			size_t n = 0;
+			while (*value == ' ')
+				value++;
+			while (value[n] && value[n] != '\r' && value[n] != '\n' && n + 1 < size)
+			{
+				out[n] = value[n];
+				n++;
+			}
+			out[n] = '\0';
+			return out;
+		}
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	return NULL;
+}
+
+static struct medium *find_medium(struct server *s, const char *url)
+{
+	const char *path = url;
+	int i;
+
+	if (strncmp(path, "rtsp://", 7) == 0)
+	{
+		path = strchr(path + 7, '/');
+		if (path == NULL)
+			return NULL;
+	}
+	for (i = 0; i < s->nmedia; i++)
+	{
+		size_t len = strlen(s->media[i].ops->path);
+		if (strncmp(path, s->media[i].ops->path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+			return &s->media[i];
+	}
+	return NULL;
+}
+
+static void reply(struct client *c, const char *cseq, const char *status, const char *headers, const char *body)
+{
+	char buf[4096];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "RTSP/1.0 %s\r\nCSeq: %s\r\nServer: rpi rtsp_server\r\n%s", status, cseq ? cseq : "0", headers ? headers : "");
+	if (body)
+		len += snprintf(buf + len, sizeof(buf) - len, "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+	else
+		len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+	if (len > (int)sizeof(buf))
+		len = sizeof(buf);
+	if (send(c->fd, buf, len, MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "reply failed:%s\n", strerror(errno));
+}
+
+static void describe(struct server *s, struct client *c, const char *url, const char *cseq)
+{
+	struct medium *m = find_medium(s, url);
+	struct sockaddr_in local;
+	socklen_t locallen = sizeof(local);
+	char sdp[1024], headers[512], sps[128], pps[128];
+	int len;
+
+	if (m == NULL)
+	{
+		reply(c, cseq, "404 Not Found", NULL, NULL);
+		return;
+	}
+	getsockname(c->fd, (struct sockaddr *)&local, &locallen);
+
+	len = snprintf(sdp, sizeof(sdp),
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 %s\r\n"
+		"s=%s\r\n"
+		"c=IN IP4 0.0.0.0\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"m=video 0 RTP/AVP %d\r\n"
+		"a=rtpmap:%d H264/%d\r\n",
+		(unsigned int)time(NULL), inet_ntoa(local.sin_addr), m->ops->name,
+		RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, RTP_CLOCK);
+	pthread_mutex_lock(&s->lock);
+	if (m->sps_len >= 4 && m->pps_len)
+	{
+		base64(m->sps, m->sps_len, sps);
+		base64(m->pps, m->pps_len, pps);
+		len += snprintf(sdp + len, sizeof(sdp) - len,
+			"a=fmtp:%d packetization-mode=1;profile-level-id=%02X%02X%02X;sprop-parameter-sets=%s,%s\r\n",
+			RTP_PAYLOAD_TYPE, m->sps[1], m->sps[2], m->sps[3], sps, pps);
+	}
+	else
+	{
+		len += snprintf(sdp + len, sizeof(sdp) - len, "a=fmtp:%d packetization-mode=1\r\n", RTP_PAYLOAD_TYPE);
+	}
+	pthread_mutex_unlock(&s->lock);
+	snprintf(sdp + len, sizeof(sdp) - len, "a=control:track0\r\n");
+
+	snprintf(headers, sizeof(headers), "Content-Type: application/sdp\r\nContent-Base: %s/\r\n", url);
+	reply(c, cseq, "200 OK", headers, sdp);
+}
+
+static void setup(struct server *s, struct client *c, const char *url, const char *cseq, const char *transport)
+{
+	struct medium *m = find_medium(s, url);
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	const char *port;
+	char headers[512];
+	int rtp_port;
+
+	if (m == NULL)
+	{
+		reply(c, cseq, "404 Not Found", NULL, NULL);
+		return;
+	}
+	if (c->medium)
+	{
+		reply(c, cseq, "459 Aggregate Operation Not Allowed", NULL, NULL);
+		return;
+	}
+	// RTP over UDP only, interleaved TCP would let one client stall the sender
+	port = transport ? strstr(transport, "client_port=") : NULL;
+	if (port == NULL || strstr(transport, "RTP/AVP/TCP"))
+	{
+		reply(c, cseq, "461 Unsupported Transport", NULL, NULL);
+		return;
+	}
+	rtp_port = atoi(port + 12);
+
+	c->rtp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (c->rtp_fd < 0)
+	{
+		reply(c, cseq, "500 Internal Server Error", NULL, NULL);
+		return;
+	}
+	addr = c->peer;
+	addr.sin_port = htons(rtp_port);
+	if (connect(c->rtp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(c->rtp_fd);
+		c->rtp_fd = -1;
+		reply(c, cseq, "500 Internal Server Error", NULL, NULL);
+		return;
+	}
+	getsockname(c->rtp_fd, (struct sockaddr *)&addr, &addrlen);
+
+	c->session = random();
+	c->ssrc = random();
+	c->seq = random();
+	c->rtp_offset = random();
+	pthread_mutex_lock(&s->lock);
+	c->medium = m;
+	pthread_mutex_unlock(&s->lock);
+
+	snprintf(headers, sizeof(headers),
+		"Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\nSession: %08X;timeout=%d\r\n",
+		rtp_port, rtp_port + 1, ntohs(addr.sin_port), ntohs(addr.sin_port) + 1, c->ssrc, c->session, SESSION_TIMEOUT);
+	reply(c, cseq, "200 OK", headers, NULL);
+}
+
+static int check_session(struct client *c, const char *cseq, const char *session)
+{
+	if (c->medium == NULL || session == NULL || strtoul(session, NULL, 16) != c->session)
+	{
+		reply(c, cseq, "454 Session Not Found", NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static void play(struct server *s, struct client *c, const char *url, const char *cseq, const char *session)
+{
+	char headers[512];
+	uint32_t rtptime;
+
+	if (check_session(c, cseq, session) < 0)
+		return;
+	pthread_mutex_lock(&s->lock);
+	c->playing = 1;
+	c->waiting_key = 1;
+	rtptime = (uint32_t)(c->medium->last_ts * 9 / 100) + c->rtp_offset;
+	pthread_mutex_unlock(&s->lock);
+	// start the new client on a fresh IDR rather than waiting for the intra period
+	c->medium->ops->request_keyframe(c->medium);
+
+	snprintf(headers, sizeof(headers), "Session: %08X\r\nRange: npt=0.000-\r\nRTP-Info: url=%s;seq=%u;rtptime=%u\r\n",
+		c->session, url, c->seq, rtptime);
+	reply(c, cseq, "200 OK", headers, NULL);
+}
+
+static void stop(struct server *s, struct client *c)
+{
+	pthread_mutex_lock(&s->lock);
+	c->playing = 0;
+	drop_queue(c);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void parameters(struct server *s, struct client *c, const char *method, const char *url, const char *cseq, const char *body)
+{
+	struct medium *m = c->medium ? c->medium : find_medium(s, url);
+	char out[512];
+	size_t len = 0;
+	const char *line;
+	int set = (strcmp(method, "SET_PARAMETER") == 0);
+
+	if (m == NULL)
+		m = &s->media[0];
+	out[0] = '\0';
+	for (line = body; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+	{
+		char name[32];
+		unsigned int value = 0;
+		int n = 0;
+
+		if (sscanf(line, "%31[a-z_]%n", name, &n) != 1)
+			continue;
+		if (set)
+		{
+			if (sscanf(line + n, " : %u", &value) != 1)
+				continue;
+			if ((strcmp(name, "bitrate") == 0 && m->ops->set_bitrate(m, value) == 0)
+			    || (strcmp(name, "framerate") == 0 && value > 0 && m->ops->set_framerate(m, value) == 0))
+			{
+				fprintf(stderr, "%s %s:%u\n", m->ops->name, name, value);
+				continue;
+			}
+			reply(c, cseq, "451 Parameter Not Understood", NULL, NULL);
+			return;
+		}
+		if (strcmp(name, "bitrate") == 0)
+			len += snprintf(out + len, sizeof(out) - len, "bitrate: %u\r\n", m->config.bitrate);
+		else if (strcmp(name, "framerate") == 0)
+			len += snprintf(out + len, sizeof(out) - len, "framerate: %u\r\n", m->config.framerate);
+		if (len >= sizeof(out))
+			break;
+	}
+	if (c->session)
+	{
+		char headers[64];
+		snprintf(headers, sizeof(headers), "Session: %08X\r\n", c->session);
+		reply(c, cseq, "200 OK", headers, len ? out : NULL);
+	}
+	else
+	{
+		reply(c, cseq, "200 OK", NULL, len ? out : NULL);
+	}
+}
+
+// handle the complete requests in the input buffer, -1 closes the connection
+static int handle_requests(struct server *s, struct client *c)
+{
+	for (;;)
+	{
+		char method[32], url[256], cseq[16], session[32], transport[256], length[16];
+		char *end, *headers, *body;
+		size_t body_len = 0, consumed;
+
+		c->in[c->inlen] = '\0';
+		end = strstr(c->in, "\r\n\r\n");
+		if (end == NULL)
+			return (c->inlen >= sizeof(c->in) - 1) ? -1 : 0;
+		if (header_value(c->in, "Content-Length", length, sizeof(length)))
+			body_len = strtoul(length, NULL, 10);
+		consumed = end + 4 - c->in + body_len;
+		if (consumed > sizeof(c->in) - 1)
+			return -1;
+		if (consumed > c->inlen)
+			return 0;
+
+		body = end + 4;
+		{
+			char saved = body[body_len];
+			body[body_len] = '\0';
+			*end = '\0';
+			headers = strchr(c->in, '\n');
+			if (sscanf(c->in, "%31s %255s", method, url) != 2 || headers == NULL)
+				return -1;
+			headers++;
+
+			const char *cs = header_value(headers, "CSeq", cseq, sizeof(cseq));
+			const char *sess = header_value(headers, "Session", session, sizeof(session));
+
+			if (strcmp(method, "OPTIONS") == 0)
+				reply(c, cs, "200 OK", "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n", NULL);
+			else if (strcmp(method, "DESCRIBE") == 0)
+				describe(s, c, url, cs);
+			else if (strcmp(method, "SETUP") == 0)
+				setup(s, c, url, cs, header_value(headers, "Transport", transport, sizeof(transport)));
+			else if (strcmp(method, "PLAY") == 0)
+				play(s, c, url, cs, sess);
+			else if (strcmp(method, "PAUSE") == 0)
+			{
+				if (check_session(c, cs, sess) == 0)
+				{
+					stop(s, c);
+					reply(c, cs, "200 OK", NULL, NULL);
+				}
+			}
+			else if (strcmp(method, "TEARDOWN") == 0)
+			{
+				if (check_session(c, cs, sess) == 0)
+				{
+					stop(s, c);
+					reply(c, cs, "200 OK", NULL, NULL);
+					return -1;
+				}
+			}
+			else if (strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0)
+				parameters(s, c, method, url, cs, body);
+			else
+				reply(c, cs, "501 Not Implemented", NULL, NULL);
+
+			body[body_len] = saved;
+		}
+		memmove(c->in, c->in + consumed, c->inlen - consumed);
+		c->inlen -= consumed;
+	}
+}
+
+static void close_client(struct server *s, int i)
+{
+	struct client *c = s->clients[i];
+
+	pthread_mutex_lock(&s->lock);
+	s->clients[i] = NULL;
+	drop_queue(c);
+	pthread_mutex_unlock(&s->lock);
+	if (c->session)
+		fprintf(stderr, "session %08X closed packets:%llu dropped:%llu overflows:%llu\n", c->session,
+			(unsigned long long)c->stats.packets, (unsigned long long)c->stats.dropped, (unsigned long long)c->overflows);
+	if (c->rtp_fd >= 0)
+		close(c->rtp_fd);
+	close(c->fd);
+	free(c);
+}
+
+static void accept_client(struct server *s)
+{
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+	int fd = accept4(s->listen_fd, (struct sockaddr *)&peer, &len, SOCK_CLOEXEC);
+	struct client *c;
+	int i;
+
+	if (fd < 0)
+		return;
+	for (i = 0; i < MAX_CLIENTS && s->clients[i]; i++);
+	c = (i < MAX_CLIENTS) ? calloc(1, sizeof(*c)) : NULL;
+	if (c == NULL)
+	{
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->rtp_fd = -1;
+	c->peer = peer;
+	pthread_mutex_lock(&s->lock);
+	s->clients[i] = c;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// =======================================================================
+// main
+// =======================================================================
+static void print_stats(struct server *s, double elapsed, double cpu)
+{
+	int i, j;
+
+	for (i = 0; i < s->nmedia; i++)
+	{
+		struct medium *m = &s->media[i];
+		uint64_t packets = 0, dropped = 0;
+		int clients = 0;
+
+		pthread_mutex_lock(&s->lock);
+		for (j = 0; j < MAX_CLIENTS; j++)
+		{
+			struct client *c = s->clients[j];
+			if (c && c->medium == m && c->playing)
+			{
+				clients++;
+				packets += c->stats.packets;
+				dropped += c->stats.dropped;
+			}
+		}
+		fprintf(stderr, "%s fps:%.1f bitrate:%.0f kbps clients:%d packets:%llu dropped:%llu\n",
+			m->ops->path, m->frames / elapsed, m->bytes * 8 / elapsed / 1000, clients,
+			(unsigned long long)packets, (unsigned long long)dropped);
+		m->frames = 0;
+		m->bytes = 0;
+		pthread_mutex_unlock(&s->lock);
+	}
+	fprintf(stderr, "cpu:%.1f%%\n", cpu * 100);
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p port] [-S source]... [-W width] [-H height] [-f fps] [-b bitrate] [-i intra] [-s seconds]\n"
+			"\t-S : camera or test, can be repeated (default both)\n"
+			"\t-s : print statistics every given seconds\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct server server;
+	struct encoder_config config = { 640, 480, 25, 1000000, 0, 4, 0, 1 };
+	const struct source_ops *selected[MAX_MEDIA];
+	int nselected = 0;
+	int port = 8554;
+	int period = 0;
+	struct sockaddr_in addr;
+	int opt, i, one = 1;
+	uint64_t last;
+	double last_cpu;
+
+	while ((opt = getopt(argc, argv, "p:S:W:H:f:b:i:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': port = atoi(optarg); break;
+			case 'S':
+			{
+				unsigned int n;
+				for (n = 0; n < NB_SOURCES && strcmp(sources[n].name, optarg) != 0; n++);
+				if (n == NB_SOURCES || nselected >= MAX_MEDIA)
+				{
+					usage(argv[0]);
+					return -1;
+				}
+				selected[nselected++] = &sources[n];
+				break;
+			}
+			case 'W': config.width = atoi(optarg); break;
+			case 'H': config.height = atoi(optarg); break;
+			case 'f': config.framerate = atoi(optarg); break;
+			case 'b': config.bitrate = atoi(optarg); break;
+			case 'i': config.intra_period = atoi(optarg); break;
+			case 's': period = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (nselected == 0)
+	{
+		for (i = 0; i < (int)NB_SOURCES; i++)
+			selected[nselected++] = &sources[i];
+	}
+
+	memset(&server, 0, sizeof(server));
+	pthread_mutex_init(&server.lock, NULL);
+	srandom(time(NULL) ^ getpid());
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	server.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server.efd < 0 || server.listen_fd < 0)
+	{
+		fprintf(stderr, "socket failed:%s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server.listen_fd, 16) < 0)
+	{
+		fprintf(stderr, "can't listen on %d:%s\n", port, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < nselected; i++)
+	{
+		struct medium *m = &server.media[server.nmedia];
+		m->ops = selected[i];
+		m->server = &server;
+		m->config = config;
+		if (m->ops->open(m) < 0)
+		{
+			fprintf(stderr, "can't open source %s\n", m->ops->name);
+			continue;
+		}
+		if (pthread_create(&m->thread, NULL, medium_thread, m) != 0)
+		{
+			m->ops->close(m);
+			continue;
+		}
+		server.nmedia++;
+		fprintf(stderr, "rtsp://0.0.0.0:%d%s %ux%u@%u %u bit/s\n", port, m->ops->path,
+			config.width, config.height, config.framerate, config.bitrate);
+	}
+	if (server.nmedia == 0)
+		return -1;
+
+	last = now_us();
+	last_cpu = cpu_seconds();
+	while (!quit)
+	{
+		struct pollfd pfd[MAX_CLIENTS + 2];
+		int index[MAX_CLIENTS + 2];
+		int n = 0;
+
+		pfd[n].fd = server.listen_fd;
+		pfd[n++].events = POLLIN;
+		pfd[n].fd = server.efd;
+		pfd[n++].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (server.clients[i])
+			{
+				index[n] = i;
+				pfd[n].fd = server.clients[i]->fd;
+				pfd[n++].events = POLLIN;
+			}
+		}
+
+		if (poll(pfd, n, 1000) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[1].revents & POLLIN)
+		{
+			uint64_t count;
+			if (read(server.efd, &count, sizeof(count)) > 0)
+				send_queued(&server);
+		}
+		for (i = 2; i < n; i++)
+		{
+			struct client *c = server.clients[index[i]];
+			ssize_t len;
+
+			if (!(pfd[i].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			len = recv(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen, 0);
+			if (len <= 0)
+			{
+				close_client(&server, index[i]);
+				continue;
+			}
+			c->inlen += len;
+			if (handle_requests(&server, c) < 0)
+				close_client(&server, index[i]);
+		}
+		if (pfd[0].revents & POLLIN)
+			accept_client(&server);
+
+		if (period && now_us() - last >= (uint64_t)period * 1000000)
+		{
+			uint64_t now = now_us();
+			double cpu = cpu_seconds();
+			print_stats(&server, (now - last) / 1e6, (cpu - last_cpu) / ((now - last) / 1e6));
+			last = now;
+			last_cpu = cpu;
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (server.clients[i])
+			close_client(&server, i);
+	}
+	for (i = 0; i < server.nmedia; i++)
+	{
+		pthread_join(server.media[i].thread, NULL);
+		server.media[i].ops->close(&server.media[i]);
+	}
+	close(server.listen_fd);
+	close(server.efd);
+	return 0;
+}
@@ -0,0 +1,9 @@
+/*
+ * Stub IL core : Broadcom extensions are folded into OMX_Core.h
+ */
+#ifndef OMX_Broadcom_h
+#define OMX_Broadcom_h
+
+#include "OMX_Core.h"
+
+#endif
@@ -0,0 +1,452 @@
+/*
+ * Stub IL core : the subset of the OpenMAX IL 1.1.2 headers used by the gpu
+ * tools, so that they build and run on a host without /opt/vc.
+ * Structures keep the layout of the Khronos headers, index values are local.
+ */
+#ifndef OMX_Core_h
+#define OMX_Core_h
+
+#include <stdint.h>
+
+// =======================================================================
+// types
+// =======================================================================
+typedef uint8_t  OMX_U8;
+typedef int8_t   OMX_S8;
+typedef uint16_t OMX_U16;
+typedef int16_t  OMX_S16;
+typedef uint32_t OMX_U32;
+typedef int32_t  OMX_S32;
+typedef uint64_t OMX_U64;
+typedef int64_t  OMX_S64;
+typedef char     OMX_STRING_CHAR;
+typedef char*    OMX_STRING;
+typedef void*    OMX_PTR;
+typedef void*    OMX_HANDLETYPE;
+typedef void*    OMX_NATIVE_WINDOWTYPE;
+typedef void*    OMX_NATIVE_DEVICETYPE;
+typedef enum OMX_BOOL { OMX_FALSE = 0, OMX_TRUE = 1 } OMX_BOOL;
+
+#ifdef OMX_SKIP64BIT
+typedef struct OMX_TICKS
+{
+	OMX_U32 nLowPart;
+	OMX_U32 nHighPart;
+} OMX_TICKS;
+#else
+typedef OMX_S64 OMX_TICKS;
+#endif
+
+typedef union OMX_VERSIONTYPE
+{
+	struct
+	{
+		OMX_U8 nVersionMajor;
+		OMX_U8 nVersionMinor;
+		OMX_U8 nRevision;
+		OMX_U8 nStep;
+	} s;
+	OMX_U32 nVersion;
+} OMX_VERSIONTYPE;
+
+#define OMX_VERSION_MAJOR 1
+#define OMX_VERSION_MINOR 1
+#define OMX_VERSION_REVISION 2
+#define OMX_VERSION_STEP 0
+#define OMX_VERSION ((OMX_VERSION_STEP<<24) | (OMX_VERSION_REVISION<<16) | (OMX_VERSION_MINOR<<8) | OMX_VERSION_MAJOR)
+
+#define OMX_MAX_STRINGNAME_SIZE 128
+#define OMX_ALL 0xFFFFFFFF
+
+typedef enum OMX_ERRORTYPE
+{
+	OMX_ErrorNone = 0,
+	OMX_ErrorInsufficientResources = (OMX_S32) 0x80001000,
+	OMX_ErrorUndefined = (OMX_S32) 0x80001001,
+	OMX_ErrorInvalidComponentName = (OMX_S32) 0x80001002,
+	OMX_ErrorComponentNotFound = (OMX_S32) 0x80001003,
+	OMX_ErrorBadParameter = (OMX_S32) 0x80001005,
+	OMX_ErrorNotImplemented = (OMX_S32) 0x80001006,
+	OMX_ErrorNoMore = (OMX_S32) 0x8000100E,
+	OMX_ErrorIncorrectStateOperation = (OMX_S32) 0x80001018,
+	OMX_ErrorUnsupportedIndex = (OMX_S32) 0x8000101A,
+	OMX_ErrorBadPortIndex = (OMX_S32) 0x8000101B,
+	OMX_ErrorMax = 0x7FFFFFFF
+} OMX_ERRORTYPE;
+
+typedef enum OMX_STATETYPE
+{
+	OMX_StateInvalid,
+	OMX_StateLoaded,
+	OMX_StateIdle,
+	OMX_StateExecuting,
+	OMX_StatePause,
+	OMX_StateWaitForResources,
+	OMX_StateMax = 0x7FFFFFFF
+} OMX_STATETYPE;
+
+typedef enum OMX_COMMANDTYPE
+{
+	OMX_CommandStateSet,
+	OMX_CommandFlush,
+	OMX_CommandPortDisable,
+	OMX_CommandPortEnable,
+	OMX_CommandMarkBuffer,
+	OMX_CommandMax = 0x7FFFFFFF
+} OMX_COMMANDTYPE;
+
+typedef enum OMX_EVENTTYPE
+{
+	OMX_EventCmdComplete,
+	OMX_EventError,
+	OMX_EventMark,
+	OMX_EventPortSettingsChanged,
+	OMX_EventBufferFlag,
+	OMX_EventResourcesAcquired,
+	OMX_EventComponentResumed,
+	OMX_EventDynamicResourcesAvailable,
+	OMX_EventPortFormatDetected,
+	OMX_EventParamOrConfigChanged = 0x7F000001,
+	OMX_EventMax = 0x7FFFFFFF
+} OMX_EVENTTYPE;
+
+typedef enum OMX_DIRTYPE
+{
+	OMX_DirInput,
+	OMX_DirOutput,
+	OMX_DirMax = 0x7FFFFFFF
+} OMX_DIRTYPE;
+
+typedef enum OMX_PORTDOMAINTYPE
+{
+	OMX_PortDomainAudio,
+	OMX_PortDomainVideo,
+	OMX_PortDomainImage,
+	OMX_PortDomainOther,
+	OMX_PortDomainMax = 0x7FFFFFFF
+} OMX_PORTDOMAINTYPE;
+
+// =======================================================================
+// buffers
+// =======================================================================
+#define OMX_BUFFERFLAG_EOS            0x00000001
+#define OMX_BUFFERFLAG_STARTTIME      0x00000002
+#define OMX_BUFFERFLAG_DECODEONLY     0x00000004
+#define OMX_BUFFERFLAG_DATACORRUPT    0x00000008
+#define OMX_BUFFERFLAG_ENDOFFRAME     0x00000010
+#define OMX_BUFFERFLAG_SYNCFRAME      0x00000020
+#define OMX_BUFFERFLAG_EXTRADATA      0x00000040
+#define OMX_BUFFERFLAG_CODECCONFIG    0x00000080
+#define OMX_BUFFERFLAG_TIME_UNKNOWN   0x00000100
+#define OMX_BUFFERFLAG_CODECSIDEINFO  0x00000800
+
+typedef struct OMX_MARKTYPE
+{
+	OMX_HANDLETYPE hMarkTargetComponent;
+	OMX_PTR pMarkData;
+} OMX_MARKTYPE;
+
+typedef struct OMX_BUFFERHEADERTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U8* pBuffer;
+	OMX_U32 nAllocLen;
+	OMX_U32 nFilledLen;
+	OMX_U32 nOffset;
+	OMX_PTR pAppPrivate;
+	OMX_PTR pPlatformPrivate;
+	OMX_PTR pInputPortPrivate;
+	OMX_PTR pOutputPortPrivate;
+	OMX_HANDLETYPE hMarkTargetComponent;
+	OMX_PTR pMarkData;
+	OMX_U32 nTickCount;
+	OMX_TICKS nTimeStamp;
+	OMX_U32 nFlags;
+	OMX_U32 nOutputPortIndex;
+	OMX_U32 nInputPortIndex;
+} OMX_BUFFERHEADERTYPE;
+
+// =======================================================================
+// indexes
+// =======================================================================
+typedef enum OMX_INDEXTYPE
+{
+	OMX_IndexComponentStartUnused = 0x01000000,
+	OMX_IndexParamPriorityMgmt,
+	OMX_IndexParamAudioInit,
+	OMX_IndexParamImageInit,
+	OMX_IndexParamVideoInit,
+	OMX_IndexParamOtherInit,
+
+	OMX_IndexPortStartUnused = 0x02000000,
+	OMX_IndexParamPortDefinition,
+
+	OMX_IndexAudioStartUnused = 0x04000000,
+	OMX_IndexParamAudioPortFormat,
+
+	OMX_IndexImageStartUnused = 0x05000000,
+	OMX_IndexParamImagePortFormat,
+
+	OMX_IndexVideoStartUnused = 0x06000000,
+	OMX_IndexParamVideoPortFormat,
+	OMX_IndexParamVideoQuantization,
+	OMX_IndexParamVideoFastUpdate,
+	OMX_IndexParamVideoBitrate,
+	OMX_IndexParamVideoMotionVector,
+	OMX_IndexParamVideoIntraRefresh,
+	OMX_IndexParamVideoErrorCorrection,
+	OMX_IndexParamVideoVBSMC,
+	OMX_IndexParamVideoMpeg2,
+	OMX_IndexParamVideoMpeg4,
+	OMX_IndexParamVideoWmv,
+	OMX_IndexParamVideoRv,
+	OMX_IndexParamVideoAvc,
+	OMX_IndexParamVideoH263,
+	OMX_IndexParamVideoProfileLevelQuerySupported,
+	OMX_IndexParamVideoProfileLevelCurrent,
+	OMX_IndexConfigVideoBitrate,
+	OMX_IndexConfigVideoFramerate,
+	OMX_IndexConfigVideoIntraVOPRefresh,
+
+	OMX_IndexCommonStartUnused = 0x07000000,
+	OMX_IndexConfigCommonPortCapturing,
+
+	OMX_IndexVendorStartUnused = 0x7F000000,
+	OMX_IndexParamCameraDeviceNumber,
+	OMX_IndexParamCameraDevicesPresent,
+	OMX_IndexConfigRequestCallback,
+	OMX_IndexConfigPortCapturing,
+	OMX_IndexConfigBrcmVideoIntraPeriod,
+	OMX_IndexConfigBrcmVideoRequestIFrame,
+	OMX_IndexParamBrcmVideoAVCInlineHeaderEnable,
+	OMX_IndexParamBrcmVideoAVCInlineVectorsEnable,
+	OMX_IndexMax = 0x7FFFFFFF
+} OMX_INDEXTYPE;
+
+// =======================================================================
+// video
+// =======================================================================
+typedef enum OMX_VIDEO_CODINGTYPE
+{
+	OMX_VIDEO_CodingUnused,
+	OMX_VIDEO_CodingAutoDetect,
+	OMX_VIDEO_CodingMPEG2,
+	OMX_VIDEO_CodingH263,
+	OMX_VIDEO_CodingMPEG4,
+	OMX_VIDEO_CodingWMV,
+	OMX_VIDEO_CodingRV,
+	OMX_VIDEO_CodingAVC,
+	OMX_VIDEO_CodingMJPEG,
+	OMX_VIDEO_CodingMax = 0x7FFFFFFF
+} OMX_VIDEO_CODINGTYPE;
+
+typedef enum OMX_COLOR_FORMATTYPE
+{
+	OMX_COLOR_FormatUnused,
+	OMX_COLOR_Format16bitRGB565 = 6,
+	OMX_COLOR_Format24bitBGR888 = 12,
+	OMX_COLOR_FormatYUV420PackedPlanar = 20,
+	OMX_COLOR_FormatYUV420PackedSemiPlanar = 39,
+	OMX_COLOR_FormatMax = 0x7FFFFFFF
+} OMX_COLOR_FORMATTYPE;
+
+typedef enum OMX_VIDEO_CONTROLRATETYPE
+{
+	OMX_Video_ControlRateDisable,
+	OMX_Video_ControlRateVariable,
+	OMX_Video_ControlRateConstant,
+	OMX_Video_ControlRateVariableSkipFrames,
+	OMX_Video_ControlRateConstantSkipFrames,
+	OMX_Video_ControlRateMax = 0x7FFFFFFF
+} OMX_VIDEO_CONTROLRATETYPE;
+
+typedef struct OMX_VIDEO_PORTDEFINITIONTYPE
+{
+	OMX_STRING cMIMEType;
+	OMX_NATIVE_DEVICETYPE pNativeRender;
+	OMX_U32 nFrameWidth;
+	OMX_U32 nFrameHeight;
+	OMX_S32 nStride;
+	OMX_U32 nSliceHeight;
+	OMX_U32 nBitrate;
+	OMX_U32 xFramerate;
+	OMX_BOOL bFlagErrorConcealment;
+	OMX_VIDEO_CODINGTYPE eCompressionFormat;
+	OMX_COLOR_FORMATTYPE eColorFormat;
+	OMX_NATIVE_WINDOWTYPE pNativeWindow;
+} OMX_VIDEO_PORTDEFINITIONTYPE;
+
+typedef struct OMX_PARAM_PORTDEFINITIONTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_DIRTYPE eDir;
+	OMX_U32 nBufferCountActual;
+	OMX_U32 nBufferCountMin;
+	OMX_U32 nBufferSize;
+	OMX_BOOL bEnabled;
+	OMX_BOOL bPopulated;
+	OMX_PORTDOMAINTYPE eDomain;
+	union
+	{
+		OMX_VIDEO_PORTDEFINITIONTYPE video;
+		OMX_U8 padding[64];
+	} format;
+	OMX_BOOL bBuffersContiguous;
+	OMX_U32 nBufferAlignment;
+} OMX_PARAM_PORTDEFINITIONTYPE;
+
+typedef struct OMX_VIDEO_PARAM_PORTFORMATTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_U32 nIndex;
+	OMX_VIDEO_CODINGTYPE eCompressionFormat;
+	OMX_COLOR_FORMATTYPE eColorFormat;
+	OMX_U32 xFramerate;
+} OMX_VIDEO_PARAM_PORTFORMATTYPE;
+
+typedef struct OMX_VIDEO_PARAM_BITRATETYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_VIDEO_CONTROLRATETYPE eControlRate;
+	OMX_U32 nTargetBitrate;
+} OMX_VIDEO_PARAM_BITRATETYPE;
+
+typedef struct OMX_VIDEO_CONFIG_BITRATETYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_U32 nEncodeBitrate;
+} OMX_VIDEO_CONFIG_BITRATETYPE;
+
+typedef struct OMX_CONFIG_FRAMERATETYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_U32 xEncodeFramerate;
+} OMX_CONFIG_FRAMERATETYPE;
+
+// =======================================================================
+// image and audio
+// =======================================================================
+typedef enum OMX_IMAGE_CODINGTYPE
+{
+	OMX_IMAGE_CodingUnused,
+	OMX_IMAGE_CodingAutoDetect,
+	OMX_IMAGE_CodingJPEG,
+	OMX_IMAGE_CodingJPEG2K,
+	OMX_IMAGE_CodingEXIF,
+	OMX_IMAGE_CodingTIFF,
+	OMX_IMAGE_CodingGIF,
+	OMX_IMAGE_CodingPNG,
+	OMX_IMAGE_CodingLZW,
+	OMX_IMAGE_CodingBMP,
+	OMX_IMAGE_CodingMax = 0x7FFFFFFF
+} OMX_IMAGE_CODINGTYPE;
+
+typedef struct OMX_IMAGE_PARAM_PORTFORMATTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_U32 nIndex;
+	OMX_IMAGE_CODINGTYPE eCompressionFormat;
+	OMX_COLOR_FORMATTYPE eColorFormat;
+} OMX_IMAGE_PARAM_PORTFORMATTYPE;
+
+typedef enum OMX_AUDIO_CODINGTYPE
+{
+	OMX_AUDIO_CodingUnused,
+	OMX_AUDIO_CodingAutoDetect,
+	OMX_AUDIO_CodingPCM,
+	OMX_AUDIO_CodingMax = 0x7FFFFFFF
+} OMX_AUDIO_CODINGTYPE;
+
+typedef struct OMX_AUDIO_PARAM_PORTFORMATTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_U32 nIndex;
+	OMX_AUDIO_CODINGTYPE eEncoding;
+} OMX_AUDIO_PARAM_PORTFORMATTYPE;
+
+// =======================================================================
+// common
+// =======================================================================
+typedef struct OMX_PORT_PARAM_TYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPorts;
+	OMX_U32 nStartPortNumber;
+} OMX_PORT_PARAM_TYPE;
+
+typedef struct OMX_PARAM_U32TYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_U32 nU32;
+} OMX_PARAM_U32TYPE;
+
+typedef struct OMX_CONFIG_BOOLEANTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_BOOL bEnabled;
+} OMX_CONFIG_BOOLEANTYPE;
+
+typedef struct OMX_CONFIG_PORTBOOLEANTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_BOOL bEnabled;
+} OMX_CONFIG_PORTBOOLEANTYPE;
+
+typedef struct OMX_CONFIG_REQUESTCALLBACKTYPE
+{
+	OMX_U32 nSize;
+	OMX_VERSIONTYPE nVersion;
+	OMX_U32 nPortIndex;
+	OMX_INDEXTYPE nIndex;
+	OMX_BOOL bEnable;
+} OMX_CONFIG_REQUESTCALLBACKTYPE;
+
+// =======================================================================
+// core
+// =======================================================================
+OMX_ERRORTYPE OMX_Init(void);
+OMX_ERRORTYPE OMX_Deinit(void);
+OMX_ERRORTYPE OMX_ComponentNameEnum(OMX_STRING cComponentName, OMX_U32 nNameLength, OMX_U32 nIndex);
+OMX_ERRORTYPE OMX_GetRolesOfComponent(OMX_STRING compName, OMX_U32 *pNumRoles, OMX_U8 **roles);
+
+typedef struct OMX_CALLBACKTYPE
+{
+	OMX_ERRORTYPE (*EventHandler)(OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2, OMX_PTR pEventData);
+	OMX_ERRORTYPE (*EmptyBufferDone)(OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE *pBuffer);
+	OMX_ERRORTYPE (*FillBufferDone)(OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE *pBuffer);
+} OMX_CALLBACKTYPE;
+
+OMX_ERRORTYPE OMX_GetHandle(OMX_HANDLETYPE *pHandle, OMX_STRING cComponentName, OMX_PTR pAppData, OMX_CALLBACKTYPE *pCallBacks);
+OMX_ERRORTYPE OMX_FreeHandle(OMX_HANDLETYPE hComponent);
+
+// the Khronos header defines these as macros calling the component, the stub has plain functions
+OMX_ERRORTYPE OMX_SendCommand(OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE Cmd, OMX_U32 nParam1, OMX_PTR pCmdData);
+OMX_ERRORTYPE OMX_GetParameter(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nParamIndex, OMX_PTR pComponentParameterStructure);
+OMX_ERRORTYPE OMX_SetParameter(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_PTR pComponentParameterStructure);
+OMX_ERRORTYPE OMX_GetConfig(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_PTR pComponentConfigStructure);
+OMX_ERRORTYPE OMX_SetConfig(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_PTR pComponentConfigStructure);
+OMX_ERRORTYPE OMX_FillThisBuffer(OMX_HANDLETYPE hComponent, OMX_BUFFERHEADERTYPE *pBuffer);
+OMX_ERRORTYPE OMX_EmptyThisBuffer(OMX_HANDLETYPE hComponent, OMX_BUFFERHEADERTYPE *pBuffer);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * Stub IL core : VideoCore host interface
+ */
+#ifndef BCM_HOST_H
+#define BCM_HOST_H
+
+void bcm_host_init(void);
+void bcm_host_deinit(void);
+
+#endif
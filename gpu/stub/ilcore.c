@@ -0,0 +1,1245 @@
+/*
+ * Stub IL core : OMX core and ilclient emulation for hosts without a VideoCore
+ *
+ * Components only model what the gpu tools rely on : port definitions,
+ * state changes, tunnels, output buffer recycling and the camera to
+ * video_encode path. The camera produces frames at the port framerate and
+ * the encoder turns them into Annex-B NAL units (SPS/PPS, IDR and P slices
+ * sized from the target bitrate), so buffer handling and pacing behave as on
+ * the Pi while the payload is not decodable. With the inline vectors enabled
+ * each frame is followed by its motion vectors : sensor noise of a pixel or
+ * less, and an object of 4x3 macroblocks crossing the frame during the first
+ * 2 s of every 6 s.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bcm_host.h"
+#include "ilclient.h"
+
+#define STUB_MAX_PORTS 6
+#define STUB_MAX_BUFFERS 64
+#define STUB_MAX_EVENTS 16
+
+// =======================================================================
+// component table
+// =======================================================================
+struct stub_port_type
+{
+	OMX_DIRTYPE dir;
+	OMX_PORTDOMAINTYPE domain;
+	OMX_VIDEO_CODINGTYPE coding;
+};
+
+struct stub_component_type
+{
+	const char *name;
+	const char *role;
+	unsigned int base;
+	unsigned int nports;
+	struct stub_port_type ports[STUB_MAX_PORTS];
+};
+
+#define IN_RAW   { OMX_DirInput, OMX_PortDomainVideo, OMX_VIDEO_CodingUnused }
+#define OUT_RAW  { OMX_DirOutput, OMX_PortDomainVideo, OMX_VIDEO_CodingUnused }
+#define IN_AVC   { OMX_DirInput, OMX_PortDomainVideo, OMX_VIDEO_CodingAVC }
+#define OUT_AVC  { OMX_DirOutput, OMX_PortDomainVideo, OMX_VIDEO_CodingAVC }
+#define IN_CLK   { OMX_DirInput, OMX_PortDomainOther, OMX_VIDEO_CodingUnused }
+#define OUT_CLK  { OMX_DirOutput, OMX_PortDomainOther, OMX_VIDEO_CodingUnused }
+#define IN_IMG   { OMX_DirInput, OMX_PortDomainImage, OMX_VIDEO_CodingUnused }
+#define OUT_IMG  { OMX_DirOutput, OMX_PortDomainImage, OMX_VIDEO_CodingUnused }
+// image ports only need to know they are compressed, MJPEG stands for JPEG
+#define OUT_JPEG { OMX_DirOutput, OMX_PortDomainImage, OMX_VIDEO_CodingMJPEG }
+
+static const struct stub_component_type stub_components[] =
+{
+	{ "camera",         NULL,                  70, 4, { OUT_RAW, OUT_RAW, OUT_IMG, IN_CLK } },
+	{ "video_encode",   "video_encoder.avc",  200, 2, { IN_RAW, OUT_AVC } },
+	{ "video_decode",   "video_decoder.avc",  130, 2, { IN_AVC, OUT_RAW } },
+	{ "video_render",   "iv_renderer",         90, 1, { IN_RAW } },
+	{ "video_splitter", NULL,                 250, 5, { IN_RAW, OUT_RAW, OUT_RAW, OUT_RAW, OUT_RAW } },
+	{ "resize",         NULL,                  60, 2, { IN_RAW, OUT_RAW } },
+	{ "image_encode",   "image_encoder.jpeg", 340, 2, { IN_IMG, OUT_JPEG } },
+	{ "clock",          NULL,                  80, 6, { OUT_CLK, OUT_CLK, OUT_CLK, OUT_CLK, OUT_CLK, OUT_CLK } },
+	{ "null_sink",      NULL,                 240, 1, { IN_RAW } },
+};
+#define STUB_NB_COMPONENTS (sizeof(stub_components)/sizeof(stub_components[0]))
+
+// formats enumerated by OMX_IndexParamVideoPortFormat and OMX_IndexParamImagePortFormat
+static const OMX_COLOR_FORMATTYPE stub_raw_formats[] =
+{
+	OMX_COLOR_FormatYUV420PackedPlanar,
+	OMX_COLOR_FormatYUV420PackedSemiPlanar,
+	OMX_COLOR_Format16bitRGB565,
+	OMX_COLOR_Format24bitBGR888,
+};
+static const OMX_VIDEO_CODINGTYPE stub_video_codings[] =
+{
+	OMX_VIDEO_CodingAVC,
+	OMX_VIDEO_CodingMPEG4,
+	OMX_VIDEO_CodingH263,
+	OMX_VIDEO_CodingMJPEG,
+};
+#define STUB_NB_RAW_FORMATS (sizeof(stub_raw_formats)/sizeof(stub_raw_formats[0]))
+#define STUB_NB_VIDEO_CODINGS (sizeof(stub_video_codings)/sizeof(stub_video_codings[0]))
+
+// =======================================================================
+// component instances
+// =======================================================================
+struct stub_port
+{
+	OMX_PARAM_PORTDEFINITIONTYPE def;
+	COMPONENT_T *peer;
+	int peer_port;
+	OMX_BUFFERHEADERTYPE *headers[STUB_MAX_BUFFERS];
+	unsigned int nheaders;
+	// buffers given to the component with OMX_FillThisBuffer
+	OMX_BUFFERHEADERTYPE *queue[STUB_MAX_BUFFERS];
+	unsigned int qhead;
+	unsigned int qcount;
+};
+
+struct stub_event
+{
+	OMX_EVENTTYPE event;
+	OMX_U32 data1;
+	OMX_U32 data2;
+};
+
+struct _COMPONENT_T
+{
+	const struct stub_component_type *type;
+	ILCLIENT_T *client;
+	OMX_STATETYPE state;
+	struct stub_port port[STUB_MAX_PORTS];
+	// buffers returned by the component, waiting for ilclient_get_output_buffer
+	OMX_BUFFERHEADERTYPE *out_list[STUB_MAX_BUFFERS];
+	unsigned int out_head;
+	unsigned int out_count;
+	struct stub_event events[STUB_MAX_EVENTS];
+	unsigned int nevents;
+
+	// handles from OMX_GetHandle have their own lock and get events through callbacks
+	OMX_CALLBACKTYPE callbacks;
+	OMX_PTR app_data;
+	int own_client;
+
+	// camera
+	OMX_BOOL capturing;
+	int running;
+	pthread_t thread;
+
+	// video_encode
+	OMX_VIDEO_CONTROLRATETYPE control;
+	OMX_U32 bitrate;
+	OMX_U32 intra_period;
+	OMX_BOOL request_iframe;
+	OMX_BOOL inline_headers;
+	OMX_BOOL inline_vectors;
+	int config_sent;
+	unsigned int frame;
+	uint32_t seed;
+};
+
+struct _ILCLIENT_T
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ILCLIENT_BUFFER_CALLBACK_T fill_done;
+	void *fill_done_data;
+	ILCLIENT_BUFFER_CALLBACK_T empty_done;
+	void *empty_done_data;
+};
+
+static struct stub_port *stub_get_port(COMPONENT_T *comp, OMX_U32 index)
+{
+	if (index < comp->type->base || index >= comp->type->base + comp->type->nports)
+		return NULL;
+	return &comp->port[index - comp->type->base];
+}
+
+static void stub_post_event(COMPONENT_T *comp, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2)
+{
+	if (comp->nevents < STUB_MAX_EVENTS)
+	{
+		comp->events[comp->nevents].event = event;
+		comp->events[comp->nevents].data1 = data1;
+		comp->events[comp->nevents].data2 = data2;
+		comp->nevents++;
+		pthread_cond_broadcast(&comp->client->cond);
+	}
+}
+
+static uint64_t stub_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stub_set_ticks(OMX_TICKS *ticks, uint64_t us)
+{
+#ifdef OMX_SKIP64BIT
+	ticks->nLowPart = (OMX_U32)us;
+	ticks->nHighPart = (OMX_U32)(us >> 32);
+#else
+	*ticks = us;
+#endif
+}
+
+// raw frames are stored with the VideoCore alignment
+static void stub_update_buffer_size(struct stub_port *port)
+{
+	OMX_VIDEO_PORTDEFINITIONTYPE *video = &port->def.format.video;
+
+	if (port->def.eDomain != OMX_PortDomainVideo || video->eCompressionFormat != OMX_VIDEO_CodingUnused)
+		return;
+	video->nStride = (video->nFrameWidth + 31) & ~31;
+	video->nSliceHeight = (video->nFrameHeight + 15) & ~15;
+	port->def.nBufferSize = video->nStride * video->nSliceHeight * 3 / 2;
+}
+
+// =======================================================================
+// camera -> video_encode
+// =======================================================================
+static uint8_t stub_random_byte(COMPONENT_T *enc)
+{
+	enc->seed = enc->seed * 1103515245 + 12345;
+	// never 0, so that the payload does not contain start codes
+	return (uint8_t)(enc->seed >> 16) | 0x01;
+}
+
+// wait for a buffer given by OMX_FillThisBuffer, called with the lock held
+static OMX_BUFFERHEADERTYPE *stub_wait_buffer(COMPONENT_T *camera, COMPONENT_T *enc, struct stub_port *port)
+{
+	OMX_BUFFERHEADERTYPE *buf;
+
+	while (port->qcount == 0)
+	{
+		if (!camera->running || enc->state != OMX_StateExecuting || !port->def.bEnabled)
+			return NULL;
+		pthread_cond_wait(&enc->client->cond, &enc->client->lock);
+	}
+	buf = port->queue[port->qhead];
+	port->qhead = (port->qhead + 1) % STUB_MAX_BUFFERS;
+	port->qcount--;
+	return buf;
+}
+
+static void stub_deliver(COMPONENT_T *enc, OMX_BUFFERHEADERTYPE *buf)
+{
+	ILCLIENT_T *client = enc->client;
+
+	enc->out_list[(enc->out_head + enc->out_count) % STUB_MAX_BUFFERS] = buf;
+	enc->out_count++;
+	pthread_cond_broadcast(&client->cond);
+	if (client->fill_done)
+	{
+		pthread_mutex_unlock(&client->lock);
+		client->fill_done(client->fill_done_data, enc);
+		pthread_mutex_lock(&client->lock);
+	}
+}
+
+// write one NAL unit, split over as many output buffers as needed
+static int stub_output_nal(COMPONENT_T *camera, COMPONENT_T *enc, const uint8_t *head, unsigned int headlen, unsigned int size, OMX_U32 flags, uint64_t ts)
+{
+	struct stub_port *port = stub_get_port(enc, enc->type->base + 1);
+	unsigned int pos = 0;
+
+	while (pos < size)
+	{
+		OMX_BUFFERHEADERTYPE *buf = stub_wait_buffer(camera, enc, port);
+		unsigned int len;
+
+		if (buf == NULL)
+			return -1;
+		buf->nOffset = 0;
+		buf->nFilledLen = 0;
+		buf->nFlags = 0;
+		stub_set_ticks(&buf->nTimeStamp, ts);
+		for (len = 0; len < buf->nAllocLen && pos < size; len++, pos++)
+			buf->pBuffer[len] = (pos < headlen) ? head[pos] : stub_random_byte(enc);
+		buf->nFilledLen = len;
+		if (pos == size)
+			buf->nFlags = flags;
+		stub_deliver(enc, buf);
+	}
+	return 0;
+}
+
+// one entry per macroblock and a padding column, after the frame
+static int stub_output_vectors(COMPONENT_T *camera, COMPONENT_T *enc, OMX_U32 framerate, uint64_t ts)
+{
+	struct stub_port *port = stub_get_port(enc, enc->type->base + 1);
+	unsigned int cols = (port->def.format.video.nFrameWidth + 15) / 16;
+	unsigned int rows = (port->def.format.video.nFrameHeight + 15) / 16;
+	unsigned int fps = (framerate >> 16) ? (framerate >> 16) : 1;
+	unsigned int cycle = enc->frame % (6 * fps);
+	unsigned int size = (cols + 1) * rows * 4;
+	int crossing = cycle < 2 * fps;
+	unsigned int left = cycle * (cols + 4) / (2 * fps);
+	unsigned int top = rows / 3;
+	OMX_BUFFERHEADERTYPE *buf = stub_wait_buffer(camera, enc, port);
+	unsigned int col, row;
+
+	if (buf == NULL)
+		return -1;
+	if (size > buf->nAllocLen)
+		size = 0;
+	for (row = 0; row < rows && size; row++)
+	{
+		for (col = 0; col <= cols; col++)
+		{
+			uint8_t *v = buf->pBuffer + (row * (cols + 1) + col) * 4;
+			int object = crossing && col + 4 > left && col <= left && row >= top && row < top + 3;
+			unsigned int sad = object ? 800 + stub_random_byte(enc) * 2 : stub_random_byte(enc);
+
+			v[0] = object ? 8 : (stub_random_byte(enc) % 3) - 1;
+			v[1] = object ? 1 : (stub_random_byte(enc) % 3) - 1;
+			v[2] = sad & 0xff;
+			v[3] = sad >> 8;
+		}
+	}
+	buf->nOffset = 0;
+	buf->nFilledLen = size;
+	buf->nFlags = OMX_BUFFERFLAG_CODECSIDEINFO;
+	stub_set_ticks(&buf->nTimeStamp, ts);
+	stub_deliver(enc, buf);
+	return 0;
+}
+
+static int stub_encode_frame(COMPONENT_T *camera, COMPONENT_T *enc, uint64_t ts)
+{
+	static const uint8_t sps[] = { 0, 0, 0, 1, 0x27, 0x64, 0x00, 0x28, 0xac, 0x2b, 0x40, 0x28, 0x02, 0xdd, 0x08 };
+	static const uint8_t pps[] = { 0, 0, 0, 1, 0x28, 0xee, 0x02, 0x5c, 0xb0 };
+	static const uint8_t idr[] = { 0, 0, 0, 1, 0x25, 0x88 };
+	static const uint8_t slice[] = { 0, 0, 0, 1, 0x21, 0x9a };
+	struct stub_port *out = stub_get_port(enc, enc->type->base + 1);
+	OMX_U32 framerate = out->def.format.video.xFramerate ? out->def.format.video.xFramerate : (30 << 16);
+	unsigned int intra = enc->intra_period ? enc->intra_period : 60;
+	uint64_t average = (uint64_t)enc->bitrate / 8 * 65536 / framerate;
+	int key = (enc->frame % intra == 0) || enc->request_iframe;
+	uint64_t size;
+
+	if (!enc->config_sent || (key && enc->inline_headers))
+	{
+		if (stub_output_nal(camera, enc, sps, sizeof(sps), sizeof(sps), OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_ENDOFFRAME, ts) < 0)
+			return -1;
+		if (stub_output_nal(camera, enc, pps, sizeof(pps), sizeof(pps), OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_ENDOFFRAME, ts) < 0)
+			return -1;
+		enc->config_sent = 1;
+	}
+
+	// an IDR costs 4 P frames, spread so that the average matches the bitrate, +/-12%
+	size = average * intra / (intra + 3);
+	if (key)
+		size *= 4;
+	size = size * (112 - (stub_random_byte(enc) % 25)) / 100;
+	if (size < sizeof(idr) + 1)
+		size = sizeof(idr) + 1;
+
+	enc->request_iframe = OMX_FALSE;
+	if (key)
+	{
+		if (stub_output_nal(camera, enc, idr, sizeof(idr), size, OMX_BUFFERFLAG_SYNCFRAME | OMX_BUFFERFLAG_ENDOFFRAME, ts) < 0)
+			return -1;
+	}
+	else if (stub_output_nal(camera, enc, slice, sizeof(slice), size, OMX_BUFFERFLAG_ENDOFFRAME, ts) < 0)
+		return -1;
+	if (enc->inline_vectors && stub_output_vectors(camera, enc, framerate, ts) < 0)
+		return -1;
+	enc->frame++;
+	return 0;
+}
+
+static void *stub_camera_thread(void *arg)
+{
+	COMPONENT_T *camera = arg;
+	ILCLIENT_T *client = camera->client;
+	struct stub_port *video = stub_get_port(camera, camera->type->base + 1);
+	struct timespec next;
+	uint64_t period_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&client->lock);
+	while (camera->running)
+	{
+		OMX_U32 framerate = video->def.format.video.xFramerate ? video->def.format.video.xFramerate : (30 << 16);
+		COMPONENT_T *enc = video->peer;
+		uint64_t ts;
+
+		period_ns = 1000000000ULL * 65536 / framerate;
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000)
+		{
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		// exposure
+		pthread_mutex_unlock(&client->lock);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+		ts = stub_now_us();
+		pthread_mutex_lock(&client->lock);
+
+		if (camera->capturing && video->def.bEnabled && enc && enc->state == OMX_StateExecuting)
+		{
+			// encoding latency, a quarter of the frame period
+			pthread_mutex_unlock(&client->lock);
+			usleep(period_ns / 4000);
+			pthread_mutex_lock(&client->lock);
+			stub_encode_frame(camera, enc, ts);
+		}
+
+		// the sensor does not wait, frames are dropped while the output is stalled
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			while ((now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec) > (int64_t)period_ns)
+			{
+				next.tv_nsec += period_ns;
+				while (next.tv_nsec >= 1000000000)
+				{
+					next.tv_nsec -= 1000000000;
+					next.tv_sec++;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+	return NULL;
+}
+
+// =======================================================================
+// OMX core
+// =======================================================================
+void bcm_host_init(void)
+{
+}
+
+void bcm_host_deinit(void)
+{
+}
+
+OMX_ERRORTYPE OMX_Init(void)
+{
+	return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_Deinit(void)
+{
+	return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_ComponentNameEnum(OMX_STRING cComponentName, OMX_U32 nNameLength, OMX_U32 nIndex)
+{
+	if (nIndex >= STUB_NB_COMPONENTS)
+		return OMX_ErrorNoMore;
+	snprintf(cComponentName, nNameLength, "OMX.broadcom.%s", stub_components[nIndex].name);
+	return OMX_ErrorNone;
+}
+
+static const struct stub_component_type *stub_find_type(const char *name)
+{
+	unsigned int i;
+
+	if (strncmp(name, "OMX.broadcom.", 13) == 0)
+		name += 13;
+	for (i = 0; i < STUB_NB_COMPONENTS; i++)
+	{
+		if (strcmp(stub_components[i].name, name) == 0)
+			return &stub_components[i];
+	}
+	return NULL;
+}
+
+OMX_ERRORTYPE OMX_GetRolesOfComponent(OMX_STRING compName, OMX_U32 *pNumRoles, OMX_U8 **roles)
+{
+	const struct stub_component_type *type = stub_find_type(compName);
+
+	if (type == NULL)
+		return OMX_ErrorComponentNotFound;
+	if (roles && type->role && *pNumRoles > 0)
+		strncpy((char *)roles[0], type->role, OMX_MAX_STRINGNAME_SIZE);
+	*pNumRoles = type->role ? 1 : 0;
+	return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE stub_parameter(COMPONENT_T *comp, OMX_INDEXTYPE index, OMX_PTR data, int set)
+{
+	switch (index)
+	{
+		case OMX_IndexParamPortDefinition:
+		{
+			OMX_PARAM_PORTDEFINITIONTYPE *def = data;
+			struct stub_port *port = stub_get_port(comp, def->nPortIndex);
+			if (port == NULL)
+				return OMX_ErrorBadPortIndex;
+			if (!set)
+			{
+				*def = port->def;
+				return OMX_ErrorNone;
+			}
+			if (def->nBufferCountActual < port->def.nBufferCountMin || def->nBufferCountActual > STUB_MAX_BUFFERS)
+				return OMX_ErrorBadParameter;
+			port->def.nBufferCountActual = def->nBufferCountActual;
+			port->def.format.video = def->format.video;
+			if (port->def.format.video.eCompressionFormat != OMX_VIDEO_CodingUnused && def->nBufferSize > 0)
+				port->def.nBufferSize = def->nBufferSize;
+			stub_update_buffer_size(port);
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamAudioInit:
+		case OMX_IndexParamImageInit:
+		case OMX_IndexParamVideoInit:
+		case OMX_IndexParamOtherInit:
+		{
+			OMX_PORT_PARAM_TYPE *ports = data;
+			OMX_PORTDOMAINTYPE domain = (index == OMX_IndexParamAudioInit) ? OMX_PortDomainAudio :
+			                            (index == OMX_IndexParamImageInit) ? OMX_PortDomainImage :
+			                            (index == OMX_IndexParamVideoInit) ? OMX_PortDomainVideo : OMX_PortDomainOther;
+			unsigned int i;
+			if (set)
+				return OMX_ErrorIncorrectStateOperation;
+			ports->nPorts = 0;
+			ports->nStartPortNumber = 0;
+			for (i = 0; i < comp->type->nports; i++)
+			{
+				if (comp->type->ports[i].domain != domain)
+					continue;
+				if (ports->nPorts == 0)
+					ports->nStartPortNumber = comp->type->base + i;
+				ports->nPorts++;
+			}
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamVideoPortFormat:
+		{
+			OMX_VIDEO_PARAM_PORTFORMATTYPE *format = data;
+			struct stub_port *port = stub_get_port(comp, format->nPortIndex);
+			if (port == NULL || port->def.eDomain != OMX_PortDomainVideo)
+				return OMX_ErrorBadPortIndex;
+			if (set)
+			{
+				port->def.format.video.eCompressionFormat = format->eCompressionFormat;
+				port->def.format.video.eColorFormat = format->eColorFormat;
+				if (format->xFramerate)
+					port->def.format.video.xFramerate = format->xFramerate;
+			}
+			else
+			{
+				const struct stub_port_type *ptype = &comp->type->ports[format->nPortIndex - comp->type->base];
+				if (ptype->coding != OMX_VIDEO_CodingUnused)
+				{
+					if (format->nIndex >= STUB_NB_VIDEO_CODINGS)
+						return OMX_ErrorNoMore;
+					format->eCompressionFormat = stub_video_codings[format->nIndex];
+					format->eColorFormat = OMX_COLOR_FormatUnused;
+				}
+				else
+				{
+					if (format->nIndex >= STUB_NB_RAW_FORMATS)
+						return OMX_ErrorNoMore;
+					format->eCompressionFormat = OMX_VIDEO_CodingUnused;
+					format->eColorFormat = stub_raw_formats[format->nIndex];
+				}
+				format->xFramerate = port->def.format.video.xFramerate;
+			}
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamImagePortFormat:
+		{
+			OMX_IMAGE_PARAM_PORTFORMATTYPE *format = data;
+			struct stub_port *port = stub_get_port(comp, format->nPortIndex);
+			if (port == NULL || port->def.eDomain != OMX_PortDomainImage)
+				return OMX_ErrorBadPortIndex;
+			if (set)
+				return OMX_ErrorNone;
+			if (comp->type->ports[format->nPortIndex - comp->type->base].coding != OMX_VIDEO_CodingUnused)
+			{
+				if (format->nIndex > 0)
+					return OMX_ErrorNoMore;
+				format->eCompressionFormat = OMX_IMAGE_CodingJPEG;
+				format->eColorFormat = OMX_COLOR_FormatUnused;
+			}
+			else
+			{
+				if (format->nIndex >= STUB_NB_RAW_FORMATS)
+					return OMX_ErrorNoMore;
+				format->eCompressionFormat = OMX_IMAGE_CodingUnused;
+				format->eColorFormat = stub_raw_formats[format->nIndex];
+			}
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamVideoBitrate:
+		{
+			OMX_VIDEO_PARAM_BITRATETYPE *bitrate = data;
+			if (set)
+			{
+				comp->control = bitrate->eControlRate;
+				comp->bitrate = bitrate->nTargetBitrate;
+			}
+			else
+			{
+				bitrate->eControlRate = comp->control;
+				bitrate->nTargetBitrate = comp->bitrate;
+			}
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamCameraDeviceNumber:
+		{
+			OMX_PARAM_U32TYPE *device = data;
+			if (set)
+				stub_post_event(comp, OMX_EventParamOrConfigChanged, OMX_ALL, OMX_IndexParamCameraDeviceNumber);
+			else
+				device->nU32 = 0;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamCameraDevicesPresent:
+		{
+			OMX_PARAM_U32TYPE *present = data;
+			if (set)
+				return OMX_ErrorIncorrectStateOperation;
+			present->nU32 = 1;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamBrcmVideoAVCInlineHeaderEnable:
+		{
+			OMX_CONFIG_PORTBOOLEANTYPE *enable = data;
+			if (set)
+				comp->inline_headers = enable->bEnabled;
+			else
+				enable->bEnabled = comp->inline_headers;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexParamBrcmVideoAVCInlineVectorsEnable:
+		{
+			OMX_CONFIG_PORTBOOLEANTYPE *enable = data;
+			if (set)
+				comp->inline_vectors = enable->bEnabled;
+			else
+				enable->bEnabled = comp->inline_vectors;
+			return OMX_ErrorNone;
+		}
+		default:
+			return OMX_ErrorUnsupportedIndex;
+	}
+}
+
+static OMX_ERRORTYPE stub_config(COMPONENT_T *comp, OMX_INDEXTYPE index, OMX_PTR data, int set)
+{
+	switch (index)
+	{
+		case OMX_IndexConfigRequestCallback:
+			return OMX_ErrorNone;
+		case OMX_IndexConfigPortCapturing:
+		{
+			OMX_CONFIG_PORTBOOLEANTYPE *capture = data;
+			if (set)
+				comp->capturing = capture->bEnabled;
+			else
+				capture->bEnabled = comp->capturing;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexConfigVideoBitrate:
+		{
+			OMX_VIDEO_CONFIG_BITRATETYPE *bitrate = data;
+			if (set)
+				comp->bitrate = bitrate->nEncodeBitrate;
+			else
+				bitrate->nEncodeBitrate = comp->bitrate;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexConfigVideoFramerate:
+		{
+			OMX_CONFIG_FRAMERATETYPE *framerate = data;
+			struct stub_port *port = stub_get_port(comp, framerate->nPortIndex);
+			if (port == NULL)
+				return OMX_ErrorBadPortIndex;
+			if (set)
+				port->def.format.video.xFramerate = framerate->xEncodeFramerate;
+			else
+				framerate->xEncodeFramerate = port->def.format.video.xFramerate;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexConfigBrcmVideoIntraPeriod:
+		{
+			OMX_PARAM_U32TYPE *period = data;
+			if (set)
+				comp->intra_period = period->nU32;
+			else
+				period->nU32 = comp->intra_period;
+			return OMX_ErrorNone;
+		}
+		case OMX_IndexConfigBrcmVideoRequestIFrame:
+		{
+			OMX_CONFIG_PORTBOOLEANTYPE *request = data;
+			if (set)
+				comp->request_iframe = request->bEnabled;
+			else
+				request->bEnabled = comp->request_iframe;
+			return OMX_ErrorNone;
+		}
+		default:
+			return OMX_ErrorUnsupportedIndex;
+	}
+}
+
+OMX_ERRORTYPE OMX_GetParameter(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nParamIndex, OMX_PTR pComponentParameterStructure)
+{
+	COMPONENT_T *comp = hComponent;
+	OMX_ERRORTYPE err;
+
+	pthread_mutex_lock(&comp->client->lock);
+	err = stub_parameter(comp, nParamIndex, pComponentParameterStructure, 0);
+	pthread_mutex_unlock(&comp->client->lock);
+	return err;
+}
+
+OMX_ERRORTYPE OMX_SetParameter(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_PTR pComponentParameterStructure)
+{
+	COMPONENT_T *comp = hComponent;
+	OMX_ERRORTYPE err;
+
+	pthread_mutex_lock(&comp->client->lock);
+	err = stub_parameter(comp, nIndex, pComponentParameterStructure, 1);
+	pthread_mutex_unlock(&comp->client->lock);
+	return err;
+}
+
+OMX_ERRORTYPE OMX_GetConfig(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_PTR pComponentConfigStructure)
+{
+	COMPONENT_T *comp = hComponent;
+	OMX_ERRORTYPE err;
+
+	pthread_mutex_lock(&comp->client->lock);
+	err = stub_config(comp, nIndex, pComponentConfigStructure, 0);
+	pthread_mutex_unlock(&comp->client->lock);
+	return err;
+}
+
+OMX_ERRORTYPE OMX_SetConfig(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_PTR pComponentConfigStructure)
+{
+	COMPONENT_T *comp = hComponent;
+	OMX_ERRORTYPE err;
+
+	pthread_mutex_lock(&comp->client->lock);
+	err = stub_config(comp, nIndex, pComponentConfigStructure, 1);
+	pthread_mutex_unlock(&comp->client->lock);
+	return err;
+}
+
+OMX_ERRORTYPE OMX_FillThisBuffer(OMX_HANDLETYPE hComponent, OMX_BUFFERHEADERTYPE *pBuffer)
+{
+	COMPONENT_T *comp = hComponent;
+	struct stub_port *port;
+	OMX_ERRORTYPE err = OMX_ErrorNone;
+
+	pthread_mutex_lock(&comp->client->lock);
+	port = stub_get_port(comp, pBuffer->nOutputPortIndex);
+	if (port == NULL || port->def.eDir != OMX_DirOutput)
+		err = OMX_ErrorBadPortIndex;
+	else if (!port->def.bEnabled || port->qcount >= STUB_MAX_BUFFERS)
+		err = OMX_ErrorIncorrectStateOperation;
+	else
+	{
+		port->queue[(port->qhead + port->qcount) % STUB_MAX_BUFFERS] = pBuffer;
+		port->qcount++;
+		pthread_cond_broadcast(&comp->client->cond);
+	}
+	pthread_mutex_unlock(&comp->client->lock);
+	return err;
+}
+
+OMX_ERRORTYPE OMX_EmptyThisBuffer(OMX_HANDLETYPE hComponent, OMX_BUFFERHEADERTYPE *pBuffer)
+{
+	return OMX_ErrorNotImplemented;
+}
+
+// =======================================================================
+// ilclient
+// =======================================================================
+ILCLIENT_T *ilclient_init(void)
+{
+	ILCLIENT_T *client = calloc(1, sizeof(*client));
+
+	if (client)
+	{
+		pthread_mutex_init(&client->lock, NULL);
+		pthread_cond_init(&client->cond, NULL);
+	}
+	return client;
+}
+
+void ilclient_destroy(ILCLIENT_T *handle)
+{
+	pthread_cond_destroy(&handle->cond);
+	pthread_mutex_destroy(&handle->lock);
+	free(handle);
+}
+
+void ilclient_set_fill_buffer_done_callback(ILCLIENT_T *handle, ILCLIENT_BUFFER_CALLBACK_T func, void *userdata)
+{
+	handle->fill_done = func;
+	handle->fill_done_data = userdata;
+}
+
+void ilclient_set_empty_buffer_done_callback(ILCLIENT_T *handle, ILCLIENT_BUFFER_CALLBACK_T func, void *userdata)
+{
+	handle->empty_done = func;
+	handle->empty_done_data = userdata;
+}
+
+static COMPONENT_T *stub_create(ILCLIENT_T *client, const struct stub_component_type *type, ILCLIENT_CREATE_FLAGS_T flags)
+{
+	COMPONENT_T *c = calloc(1, sizeof(*c));
+	unsigned int i;
+
+	if (c == NULL)
+		return NULL;
+	c->type = type;
+	c->client = client;
+	c->state = OMX_StateLoaded;
+	c->control = OMX_Video_ControlRateVariable;
+	c->bitrate = 10000000;
+	c->seed = type->base;
+	for (i = 0; i < type->nports; i++)
+	{
+		OMX_PARAM_PORTDEFINITIONTYPE *def = &c->port[i].def;
+		def->nSize = sizeof(*def);
+		def->nVersion.nVersion = OMX_VERSION;
+		def->nPortIndex = type->base + i;
+		def->eDir = type->ports[i].dir;
+		def->eDomain = type->ports[i].domain;
+		def->bEnabled = (flags & ILCLIENT_DISABLE_ALL_PORTS) ? OMX_FALSE : OMX_TRUE;
+		def->nBufferCountMin = 1;
+		def->nBufferCountActual = (type->ports[i].coding == OMX_VIDEO_CodingUnused) ? 3 : 1;
+		def->nBufferAlignment = 16;
+		def->format.video.nFrameWidth = 640;
+		def->format.video.nFrameHeight = 480;
+		def->format.video.xFramerate = 30 << 16;
+		def->format.video.eCompressionFormat = type->ports[i].coding;
+		def->format.video.eColorFormat = (type->ports[i].coding == OMX_VIDEO_CodingUnused) ? OMX_COLOR_FormatYUV420PackedPlanar : OMX_COLOR_FormatUnused;
+		def->nBufferSize = 65536;
+		stub_update_buffer_size(&c->port[i]);
+	}
+	return c;
+}
+
+int ilclient_create_component(ILCLIENT_T *handle, COMPONENT_T **comp, char *name, ILCLIENT_CREATE_FLAGS_T flags)
+{
+	const struct stub_component_type *type = stub_find_type(name);
+
+	*comp = NULL;
+	if (type == NULL)
+		return -1;
+	*comp = stub_create(handle, type, flags);
+	return *comp ? 0 : -1;
+}
+
+OMX_HANDLETYPE ilclient_get_handle(COMPONENT_T *comp)
+{
+	return comp;
+}
+
+int ilclient_change_component_state(COMPONENT_T *comp, OMX_STATETYPE state)
+{
+	ILCLIENT_T *client = comp->client;
+	int join = 0;
+
+	pthread_mutex_lock(&client->lock);
+	if (comp->state == state)
+	{
+		pthread_mutex_unlock(&client->lock);
+		return 0;
+	}
+	if (strcmp(comp->type->name, "camera") == 0)
+	{
+		if (state == OMX_StateExecuting)
+		{
+			comp->running = 1;
+			if (pthread_create(&comp->thread, NULL, stub_camera_thread, comp) != 0)
+			{
+				comp->running = 0;
+				pthread_mutex_unlock(&client->lock);
+				return -1;
+			}
+		}
+		else if (comp->running)
+		{
+			comp->running = 0;
+			join = 1;
+		}
+	}
+	if (state != OMX_StateExecuting)
+		comp->config_sent = 0;
+	comp->state = state;
+	stub_post_event(comp, OMX_EventCmdComplete, OMX_CommandStateSet, state);
+	pthread_cond_broadcast(&client->cond);
+	pthread_mutex_unlock(&client->lock);
+
+	if (join)
+		pthread_join(comp->thread, NULL);
+	return 0;
+}
+
+void ilclient_state_transition(COMPONENT_T *list[], OMX_STATETYPE state)
+{
+	int i;
+
+	for (i = 0; list[i]; i++)
+		ilclient_change_component_state(list[i], state);
+}
+
+static void stub_free_buffers(COMPONENT_T *comp, struct stub_port *port, ILCLIENT_FREE_T ilclient_free, void *userdata)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < port->nheaders; i++)
+	{
+		OMX_BUFFERHEADERTYPE *buf = port->headers[i];
+		if (ilclient_free)
+			ilclient_free(userdata, buf->pBuffer);
+		else
+			free(buf->pBuffer);
+		// forget it in the list of returned buffers
+		for (j = 0; j < comp->out_count; j++)
+		{
+			if (comp->out_list[(comp->out_head + j) % STUB_MAX_BUFFERS] == buf)
+				comp->out_list[(comp->out_head + j) % STUB_MAX_BUFFERS] = NULL;
+		}
+		free(buf);
+	}
+	port->nheaders = 0;
+	port->qcount = 0;
+	port->def.bPopulated = OMX_FALSE;
+}
+
+void ilclient_cleanup_components(COMPONENT_T *list[])
+{
+	int i;
+	unsigned int p;
+
+	for (i = 0; list[i]; i++)
+	{
+		ilclient_change_component_state(list[i], OMX_StateLoaded);
+		for (p = 0; p < list[i]->type->nports; p++)
+			stub_free_buffers(list[i], &list[i]->port[p], NULL, NULL);
+		free(list[i]);
+	}
+}
+
+void ilclient_enable_port(COMPONENT_T *comp, int portIndex)
+{
+	struct stub_port *port = stub_get_port(comp, portIndex);
+
+	if (port)
+	{
+		pthread_mutex_lock(&comp->client->lock);
+		port->def.bEnabled = OMX_TRUE;
+		pthread_cond_broadcast(&comp->client->cond);
+		pthread_mutex_unlock(&comp->client->lock);
+	}
+}
+
+void ilclient_disable_port(COMPONENT_T *comp, int portIndex)
+{
+	struct stub_port *port = stub_get_port(comp, portIndex);
+
+	if (port)
+	{
+		pthread_mutex_lock(&comp->client->lock);
+		port->def.bEnabled = OMX_FALSE;
+		port->qcount = 0;
+		pthread_cond_broadcast(&comp->client->cond);
+		pthread_mutex_unlock(&comp->client->lock);
+	}
+}
+
+int ilclient_enable_port_buffers(COMPONENT_T *comp, int portIndex, ILCLIENT_MALLOC_T ilclient_malloc, ILCLIENT_FREE_T ilclient_free, void *userdata)
+{
+	struct stub_port *port = stub_get_port(comp, portIndex);
+	unsigned int i;
+
+	if (port == NULL || port->nheaders > 0)
+		return -1;
+	pthread_mutex_lock(&comp->client->lock);
+	for (i = 0; i < port->def.nBufferCountActual; i++)
+	{
+		OMX_BUFFERHEADERTYPE *buf = calloc(1, sizeof(*buf));
+		void *data = NULL;
+
+		if (buf)
+		{
+			if (ilclient_malloc)
+				data = ilclient_malloc(userdata, port->def.nBufferSize, port->def.nBufferAlignment, "stub buffer");
+			else if (posix_memalign(&data, port->def.nBufferAlignment, port->def.nBufferSize) != 0)
+				data = NULL;
+		}
+		if (data == NULL)
+		{
+			free(buf);
+			stub_free_buffers(comp, port, ilclient_free, userdata);
+			pthread_mutex_unlock(&comp->client->lock);
+			return -1;
+		}
+		buf->nSize = sizeof(*buf);
+		buf->nVersion.nVersion = OMX_VERSION;
+		buf->pBuffer = data;
+		buf->nAllocLen = port->def.nBufferSize;
+		if (port->def.eDir == OMX_DirOutput)
+		{
+			buf->nOutputPortIndex = portIndex;
+			// output buffers start in the client list, ready for OMX_FillThisBuffer
+			comp->out_list[(comp->out_head + comp->out_count) % STUB_MAX_BUFFERS] = buf;
+			comp->out_count++;
+		}
+		else
+		{
+			buf->nInputPortIndex = portIndex;
+		}
+		port->headers[port->nheaders++] = buf;
+	}
+	port->def.bEnabled = OMX_TRUE;
+	port->def.bPopulated = OMX_TRUE;
+	pthread_mutex_unlock(&comp->client->lock);
+	return 0;
+}
+
+void ilclient_disable_port_buffers(COMPONENT_T *comp, int portIndex, OMX_BUFFERHEADERTYPE *bufferList, ILCLIENT_FREE_T ilclient_free, void *userdata)
+{
+	struct stub_port *port = stub_get_port(comp, portIndex);
+
+	if (port == NULL)
+		return;
+	pthread_mutex_lock(&comp->client->lock);
+	port->def.bEnabled = OMX_FALSE;
+	stub_free_buffers(comp, port, ilclient_free, userdata);
+	pthread_cond_broadcast(&comp->client->cond);
+	pthread_mutex_unlock(&comp->client->lock);
+}
+
+OMX_BUFFERHEADERTYPE *ilclient_get_output_buffer(COMPONENT_T *comp, int portIndex, int block)
+{
+	OMX_BUFFERHEADERTYPE *buf = NULL;
+
+	pthread_mutex_lock(&comp->client->lock);
+	for (;;)
+	{
+		unsigned int i;
+		for (i = 0; i < comp->out_count && buf == NULL; i++)
+		{
+			OMX_BUFFERHEADERTYPE *candidate = comp->out_list[(comp->out_head + i) % STUB_MAX_BUFFERS];
+			if (candidate && candidate->nOutputPortIndex == (OMX_U32)portIndex)
+				buf = candidate;
+		}
+		if (buf)
+		{
+			// remove it, keeping the order of the other buffers
+			for (i--; i > 0; i--)
+				comp->out_list[(comp->out_head + i) % STUB_MAX_BUFFERS] = comp->out_list[(comp->out_head + i - 1) % STUB_MAX_BUFFERS];
+			comp->out_head = (comp->out_head + 1) % STUB_MAX_BUFFERS;
+			comp->out_count--;
+			break;
+		}
+		// drop the entries of freed buffers
+		while (comp->out_count > 0 && comp->out_list[comp->out_head] == NULL)
+		{
+			comp->out_head = (comp->out_head + 1) % STUB_MAX_BUFFERS;
+			comp->out_count--;
+		}
+		if (!block)
+			break;
+		pthread_cond_wait(&comp->client->cond, &comp->client->lock);
+	}
+	pthread_mutex_unlock(&comp->client->lock);
+	return buf;
+}
+
+int ilclient_setup_tunnel(TUNNEL_T *tunnel, unsigned int portStream, int timeout)
+{
+	struct stub_port *source = stub_get_port(tunnel->source, tunnel->source_port);
+	struct stub_port *sink = stub_get_port(tunnel->sink, tunnel->sink_port);
+
+	if (source == NULL || source->def.eDir != OMX_DirOutput)
+		return -1;
+	if (sink == NULL || sink->def.eDir != OMX_DirInput)
+		return -2;
+	pthread_mutex_lock(&tunnel->source->client->lock);
+	source->peer = tunnel->sink;
+	source->peer_port = tunnel->sink_port;
+	sink->peer = tunnel->source;
+	sink->peer_port = tunnel->source_port;
+	sink->def.format.video = source->def.format.video;
+	stub_update_buffer_size(sink);
+	source->def.bEnabled = OMX_TRUE;
+	sink->def.bEnabled = OMX_TRUE;
+	pthread_mutex_unlock(&tunnel->source->client->lock);
+	return 0;
+}
+
+void ilclient_disable_tunnel(TUNNEL_T *tunnel)
+{
+	ilclient_disable_port(tunnel->source, tunnel->source_port);
+	ilclient_disable_port(tunnel->sink, tunnel->sink_port);
+}
+
+int ilclient_enable_tunnel(TUNNEL_T *tunnel)
+{
+	ilclient_enable_port(tunnel->source, tunnel->source_port);
+	ilclient_enable_port(tunnel->sink, tunnel->sink_port);
+	return 0;
+}
+
+void ilclient_teardown_tunnels(TUNNEL_T *tunnels)
+{
+	for (; tunnels->source; tunnels++)
+	{
+		struct stub_port *source = stub_get_port(tunnels->source, tunnels->source_port);
+		struct stub_port *sink = stub_get_port(tunnels->sink, tunnels->sink_port);
+
+		pthread_mutex_lock(&tunnels->source->client->lock);
+		if (source)
+			source->peer = NULL;
+		if (sink)
+			sink->peer = NULL;
+		pthread_mutex_unlock(&tunnels->source->client->lock);
+	}
+}
+
+int ilclient_wait_for_event(COMPONENT_T *comp, OMX_EVENTTYPE event, OMX_U32 nData1, int ignore1, OMX_U32 nData2, int ignore2, int event_flag, int suspend)
+{
+	ILCLIENT_T *client = comp->client;
+	struct timespec deadline;
+	int ret = -1;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (suspend > 0)
+	{
+		deadline.tv_sec += suspend / 1000;
+		deadline.tv_nsec += (suspend % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+	}
+
+	pthread_mutex_lock(&client->lock);
+	for (;;)
+	{
+		unsigned int i;
+		for (i = 0; i < comp->nevents; i++)
+		{
+			struct stub_event *ev = &comp->events[i];
+			if ((ev->event == event && (ignore1 || ev->data1 == nData1) && (ignore2 || ev->data2 == nData2))
+			    || (ev->event == OMX_EventError && (event_flag & ILCLIENT_EVENT_ERROR)))
+			{
+				ret = (ev->event == event) ? 0 : -2;
+				memmove(ev, ev + 1, (comp->nevents - i - 1) * sizeof(*ev));
+				comp->nevents--;
+				break;
+			}
+		}
+		if (ret != -1 || suspend == 0)
+			break;
+		if (suspend == VCOS_SUSPEND)
+			pthread_cond_wait(&client->cond, &client->lock);
+		else if (pthread_cond_timedwait(&client->cond, &client->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&client->lock);
+	return ret;
+}
+
+// =======================================================================
+// OMX core handles
+// =======================================================================
+static void stub_notify(COMPONENT_T *comp, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2)
+{
+	if (comp->callbacks.EventHandler)
+		comp->callbacks.EventHandler(comp, comp->app_data, event, data1, data2, NULL);
+}
+
+OMX_ERRORTYPE OMX_GetHandle(OMX_HANDLETYPE *pHandle, OMX_STRING cComponentName, OMX_PTR pAppData, OMX_CALLBACKTYPE *pCallBacks)
+{
+	const struct stub_component_type *type = stub_find_type(cComponentName);
+	ILCLIENT_T *client;
+	COMPONENT_T *comp;
+
+	*pHandle = NULL;
+	if (type == NULL)
+		return OMX_ErrorComponentNotFound;
+	client = ilclient_init();
+	if (client == NULL)
+		return OMX_ErrorInsufficientResources;
+	comp = stub_create(client, type, ILCLIENT_FLAGS_NONE);
+	if (comp == NULL)
+	{
+		ilclient_destroy(client);
+		return OMX_ErrorInsufficientResources;
+	}
+	comp->own_client = 1;
+	comp->app_data = pAppData;
+	if (pCallBacks)
+		comp->callbacks = *pCallBacks;
+	*pHandle = comp;
+	return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_FreeHandle(OMX_HANDLETYPE hComponent)
+{
+	COMPONENT_T *comp = hComponent;
+	ILCLIENT_T *client = comp->client;
+	int own_client = comp->own_client;
+	unsigned int p;
+
+	ilclient_change_component_state(comp, OMX_StateLoaded);
+	pthread_mutex_lock(&client->lock);
+	for (p = 0; p < comp->type->nports; p++)
+		stub_free_buffers(comp, &comp->port[p], NULL, NULL);
+	pthread_mutex_unlock(&client->lock);
+	free(comp);
+	if (own_client)
+		ilclient_destroy(client);
+	return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_SendCommand(OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE Cmd, OMX_U32 nParam1, OMX_PTR pCmdData)
+{
+	COMPONENT_T *comp = hComponent;
+	unsigned int p, found = 0;
+
+	switch (Cmd)
+	{
+		case OMX_CommandStateSet:
+			if (ilclient_change_component_state(comp, (OMX_STATETYPE)nParam1) != 0)
+				return OMX_ErrorInsufficientResources;
+			stub_notify(comp, OMX_EventCmdComplete, Cmd, nParam1);
+			return OMX_ErrorNone;
+		case OMX_CommandPortDisable:
+		case OMX_CommandPortEnable:
+		case OMX_CommandFlush:
+			for (p = 0; p < comp->type->nports; p++)
+			{
+				OMX_U32 index = comp->type->base + p;
+				if (nParam1 != OMX_ALL && nParam1 != index)
+					continue;
+				if (Cmd == OMX_CommandPortDisable)
+					ilclient_disable_port(comp, index);
+				else if (Cmd == OMX_CommandPortEnable)
+					ilclient_enable_port(comp, index);
+				stub_notify(comp, OMX_EventCmdComplete, Cmd, index);
+				found++;
+			}
+			return found ? OMX_ErrorNone : OMX_ErrorBadPortIndex;
+		default:
+			return OMX_ErrorNotImplemented;
+	}
+}
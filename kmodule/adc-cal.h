@@ -0,0 +1,166 @@
+/*
+ * Calibration tables shared by the ADC drivers
+ *
+ * Each channel has a table indexed by the raw converter code (8 or 10 bits)
+ * giving the input in millivolts as signed 16 bits, offset, gain and any
+ * linearization folded in, so a calibrated sample is one lookup. The tables
+ * start from the nominal transfer function, code * vref / 2^bits with the
+ * codes of the differential inputs in two's complement.
+ *
+ * While enabled ('Calibration Switch') the meter, the decimation and the PCM
+ * carry millivolts instead of the converter full scale. The tables are the
+ * 'calibration' binary attribute of the device : channels x 2^bits little
+ * endian s16, channel 0 first. A write is staged over the tables in use and
+ * replaces them at each channel it completes, a write at the offset of one
+ * channel replaces that channel alone. adc-cal.py builds the tables from
+ * offsets, gains and measured points.
+ */
+#ifndef ADC_CAL_H
+#define ADC_CAL_H
+
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+
+#define ADC_CAL_BITS	16	/* resolution given to the decimation when enabled */
+
+struct adc_cal {
+	unsigned int	channels;
+	unsigned int	bits;
+	int		enabled;
+	s16		*lut;		/* channels << bits, in use */
+	s16		*staging;	/* the write in progress */
+	size_t		staged;		/* end of the write in progress, 0 when none */
+	struct mutex	write_lock;
+	spinlock_t	lock;		/* lut against the lookups */
+};
+
+static inline size_t adc_cal_size(const struct adc_cal *cal)
+{
+	return (cal->channels << cal->bits) * sizeof(s16);
+}
+
+/* resolution of the samples out of the driver, converter codes or millivolts */
+static inline unsigned int adc_cal_bits(const struct adc_cal *cal)
+{
+	return cal->enabled ? ADC_CAL_BITS : cal->bits;
+}
+
+/* nominal tables, the channels in 'signed_mask' read two's complement codes */
+static inline int adc_cal_init(struct adc_cal *cal, struct device *dev, unsigned int channels,
+			       unsigned int bits, int vref_mv, unsigned long signed_mask)
+{
+	unsigned int c, code;
+
+	memset(cal, 0, sizeof(*cal));
+	mutex_init(&cal->write_lock);
+	spin_lock_init(&cal->lock);
+	cal->channels = channels;
+	cal->bits = bits;
+
+	cal->lut = devm_kcalloc(dev, channels << bits, sizeof(s16), GFP_KERNEL);
+	cal->staging = devm_kcalloc(dev, channels << bits, sizeof(s16), GFP_KERNEL);
+	if (!cal->lut || !cal->staging)
+		return -ENOMEM;
+
+	for (c = 0; c < channels; c++)
+		for (code = 0; code < (1 << bits); code++) {
+			s32 v = code;
+
+			if ((signed_mask & BIT(c)) && code >= (1 << (bits - 1)))
+				v -= 1 << bits;
+			cal->lut[(c << bits) + code] = clamp_t(s32, DIV_ROUND_CLOSEST(v * vref_mv, 1 << bits),
+							       -32768, 32767);
+		}
+	return 0;
+}
+
+/* one frame of raw codes to millivolts */
+static inline void adc_cal_frame(struct adc_cal *cal, const u16 *code, s16 *mv)
+{
+	unsigned int mask = (1 << cal->bits) - 1;
+	unsigned long flags;
+	unsigned int c;
+
+	spin_lock_irqsave(&cal->lock, flags);
+	for (c = 0; c < cal->channels; c++)
+		mv[c] = cal->lut[(c << cal->bits) + (code[c] & mask)];
+	spin_unlock_irqrestore(&cal->lock, flags);
+}
+
+// =======================
+// device attribute
+// =======================
+static inline ssize_t adc_cal_read(struct adc_cal *cal, char *buf, loff_t off, size_t count)
+{
+	size_t size = adc_cal_size(cal);
+
+	if (off >= size)
+		return 0;
+	count = min_t(size_t, count, size - off);
+	mutex_lock(&cal->write_lock);
+	memcpy(buf, (char *)cal->lut + off, count);
+	mutex_unlock(&cal->write_lock);
+	return count;
+}
+
+static inline ssize_t adc_cal_write(struct adc_cal *cal, const char *buf, loff_t off, size_t count)
+{
+	size_t size = adc_cal_size(cal);
+	size_t channel = size / cal->channels;
+	unsigned long flags;
+	s16 *old;
+
+	if (off >= size)
+		return -ENOSPC;
+	count = min_t(size_t, count, size - off);
+
+	mutex_lock(&cal->write_lock);
+	/* sysfs splits a write in pages, anything else starts from the tables in use */
+	if (!cal->staged || off != cal->staged)
+		memcpy(cal->staging, cal->lut, size);
+	memcpy((char *)cal->staging + off, buf, count);
+	cal->staged = off + count;
+	/* only whole channels go in use */
+	if (cal->staged % channel == 0) {
+		spin_lock_irqsave(&cal->lock, flags);
+		old = cal->lut;
+		cal->lut = cal->staging;
+		cal->staging = old;
+		spin_unlock_irqrestore(&cal->lock, flags);
+		/* the next page copies the tables just swapped in */
+		cal->staged = 0;
+	}
+	mutex_unlock(&cal->write_lock);
+	return count;
+}
+
+#define ADC_CAL_ATTRS(to_cal, size)							\
+static ssize_t calibration_read(struct file *filp, struct kobject *kobj,		\
+				struct bin_attribute *attr, char *buf,			\
+				loff_t off, size_t count)				\
+{											\
+	return adc_cal_read(to_cal(container_of(kobj, struct device, kobj)),		\
+			    buf, off, count);						\
+}											\
+static ssize_t calibration_write(struct file *filp, struct kobject *kobj,		\
+				 struct bin_attribute *attr, char *buf,			\
+				 loff_t off, size_t count)				\
+{											\
+	return adc_cal_write(to_cal(container_of(kobj, struct device, kobj)),		\
+			     buf, off, count);						\
+}											\
+static BIN_ATTR_RW(calibration, size);							\
+static struct bin_attribute *adc_cal_bin_attrs[] = {					\
+	&bin_attr_calibration,								\
+	NULL										\
+};											\
+static const struct attribute_group adc_cal_group = {					\
+	.bin_attrs = adc_cal_bin_attrs,							\
+}
+
+#endif
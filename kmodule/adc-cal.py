@@ -0,0 +1,73 @@
+#!/usr/bin/python
+# Calibration tables of the ADC drivers (adc-cal.h) : one s16 millivolts
+# value per code and per channel, written to the 'calibration' attribute
+#   ./adc-cal.py -b 10 -o 0:-12 -g 0:1.004 > cal.bin
+#   sudo cp cal.bin /sys/bus/spi/devices/spi0.0/calibration
+
+from __future__ import division
+import sys
+import math
+import struct
+import argparse
+
+def per_channel(values, channels, default, convert):
+    table = [default] * channels
+    for value in values or []:
+        chan, _, v = value.partition(':')
+        table[int(chan)] = convert(v)
+    return table
+
+# measured points "code millivolts" per line, linear between them
+def load_points(filename):
+    points = []
+    with open(filename) as f:
+        for line in f:
+            fields = line.split('#')[0].split()
+            if len(fields) >= 2:
+                points.append((int(fields[0], 0), float(fields[1])))
+    return sorted(points)
+
+def interpolate(points, code):
+    if code <= points[0][0]:
+        (c0, v0), (c1, v1) = points[0], points[min(1, len(points) - 1)]
+    elif code >= points[-1][0]:
+        (c0, v0), (c1, v1) = points[max(0, len(points) - 2)], points[-1]
+    else:
+        i = next(i for i in range(1, len(points)) if points[i][0] >= code)
+        (c0, v0), (c1, v1) = points[i - 1], points[i]
+    if c1 == c0:
+        return v0
+    return v0 + (v1 - v0) * (code - c0) / (c1 - c0)
+
+def main():
+    parser = argparse.ArgumentParser(description='Build ADC calibration tables')
+    parser.add_argument('-b', '--bits', type=int, default=10, help='converter resolution (10 MCP3002, 8 PCF8591)')
+    parser.add_argument('-c', '--channels', type=int, default=2)
+    parser.add_argument('-v', '--vref', type=float, default=3300, help='reference voltage in mV')
+    parser.add_argument('-s', '--signed', type=int, action='append', default=[], help='channel with two\'s complement codes')
+    parser.add_argument('-o', '--offset', action='append', help='chan:mV added after the gain')
+    parser.add_argument('-g', '--gain', action='append', help='chan:factor')
+    parser.add_argument('-p', '--points', action='append', help='chan:file of measured "code mV" lines')
+    args = parser.parse_args()
+
+    offset = per_channel(args.offset, args.channels, 0.0, float)
+    gain = per_channel(args.gain, args.channels, 1.0, float)
+    points = per_channel(args.points, args.channels, None, load_points)
+
+    out = bytearray()
+    for chan in range(args.channels):
+        for code in range(1 << args.bits):
+            if points[chan]:
+                mv = interpolate(points[chan], code)
+            else:
+                v = code
+                if chan in args.signed and code >= 1 << (args.bits - 1):
+                    v -= 1 << args.bits
+                mv = v * args.vref / (1 << args.bits)
+            mv = int(math.floor(mv * gain[chan] + offset[chan] + 0.5))
+            out += struct.pack('<h', max(-32768, min(32767, mv)))
+    # python 2 writes bytes to stdout itself
+    getattr(sys.stdout, "buffer", sys.stdout).write(out)
+
+if __name__ == '__main__':
+    main()
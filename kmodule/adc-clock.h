@@ -0,0 +1,270 @@
+/*
+ * Sample clock tracking shared by the ADC drivers
+ *
+ * The acquisition path reports each converted block with the CLOCK_MONOTONIC
+ * time of its first conversion. The frame counter since the acquisition start
+ * against these times gives the actual sample clock : the ratio is taken over
+ * a sliding span of 32 to 64 s, so the estimate follows the thermal drift of
+ * the clock while the timing jitter of one block weighs less than 1 ppm. The
+ * residual of each block against the estimate is averaged into the jitter.
+ *
+ * The PCM side keeps the position of its next frame (frames since the stream
+ * start and since the acquisition start) with the monotonic time of the first
+ * conversion entering it, get_time_info reports this pair as a LINK (stream
+ * counter) or LINK_ABSOLUTE (acquisition counter) audio timestamp.
+ *
+ *   Sample Clock Rate   : estimated rate in mHz, 0 until 1 s is measured
+ *   Sample Clock Drift  : (estimated - nominal) / nominal in ppb
+ *   Sample Clock Jitter : mean absolute timing residual in ns
+ */
+#ifndef ADC_CLOCK_H
+#define ADC_CLOCK_H
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+
+#include <sound/core.h>
+#include <sound/control.h>
+#include <sound/pcm.h>
+
+#define ADC_CLOCK_MIN_SPAN	(1LL * NSEC_PER_SEC)
+#define ADC_CLOCK_SPAN		(64LL * NSEC_PER_SEC)
+#define ADC_CLOCK_JITTER_SHIFT	4
+
+enum {
+	ADC_CLOCK_RATE,
+	ADC_CLOCK_DRIFT,
+	ADC_CLOCK_JITTER,
+	ADC_CLOCK_NB_CTL
+};
+
+struct adc_clock_point {
+	u64		frame;
+	ktime_t		time;
+};
+
+struct adc_clock {
+	unsigned int		rate;		/* nominal, Hz */
+
+	/* only touched by the acquisition path */
+	int			started;
+	u64			frames;		/* frames since the acquisition start */
+	struct adc_clock_point	anchor;		/* start of the span */
+	struct adc_clock_point	mid;		/* next start, half a span later */
+
+	/* published estimate */
+	spinlock_t		lock;
+	u32			rate_mhz;
+	s32			drift_ppb;
+	u32			jitter_ns;
+};
+
+/* position of the next PCM frame */
+struct adc_tstamp {
+	u64			frames;		/* since the stream start */
+	u64			position;	/* since the acquisition start */
+	ktime_t			time;		/* monotonic time of its first conversion */
+};
+
+static const char * const adc_clock_names[ADC_CLOCK_NB_CTL] = {
+	[ADC_CLOCK_RATE]	= "Sample Clock Rate",
+	[ADC_CLOCK_DRIFT]	= "Sample Clock Drift",
+	[ADC_CLOCK_JITTER]	= "Sample Clock Jitter",
+};
+
+/* a new acquisition, the estimate of the previous one is kept until replaced */
+static inline void adc_clock_start(struct adc_clock *c)
+{
+	c->started = 0;
+	c->frames = 0;
+}
+
+/* frame period from the estimate, or the nominal one */
+static inline u64 adc_clock_frame_ns(struct adc_clock *c)
+{
+	u32 rate_mhz = READ_ONCE(c->rate_mhz);
+
+	if (rate_mhz)
+		return div_u64(1000ULL * NSEC_PER_SEC, rate_mhz);
+	return div_u64(NSEC_PER_SEC, c->rate);
+}
+
+/* frames not converted (lost blocks), the counter keeps following the time */
+static inline void adc_clock_skip(struct adc_clock *c, unsigned int frames)
+{
+	c->frames += frames;
+}
+
+/* one block of 'frames' conversions, the first one at 'first' */
+static inline void adc_clock_block(struct adc_clock *c, ktime_t first, unsigned int frames)
+{
+	unsigned long flags;
+	u64 n;
+	s64 span;
+	u32 rate_mhz;
+	s64 resid;
+
+	if (!c->started) {
+		c->started = 1;
+		c->anchor.frame = c->frames;
+		c->anchor.time = first;
+		c->mid = c->anchor;
+		c->frames += frames;
+		return;
+	}
+
+	n = c->frames - c->anchor.frame;
+	span = ktime_to_ns(ktime_sub(first, c->anchor.time));
+	if (span >= ADC_CLOCK_MIN_SPAN) {
+		spin_lock_irqsave(&c->lock, flags);
+		/* residual against the previous estimate, before it moves */
+		if (c->rate_mhz) {
+			resid = span - (s64)div_u64(n * 1000 * NSEC_PER_SEC, c->rate_mhz);
+			c->jitter_ns += ((s64)abs(resid) - (s64)c->jitter_ns) >> ADC_CLOCK_JITTER_SHIFT;
+		}
+		rate_mhz = div64_u64(n * 1000 * NSEC_PER_SEC, span);
+		c->rate_mhz = rate_mhz;
+		c->drift_ppb = div_s64(((s64)rate_mhz - (s64)c->rate * 1000) * 1000000, c->rate);
+		spin_unlock_irqrestore(&c->lock, flags);
+	}
+
+	/* slide the span : the middle point becomes the anchor */
+	if (ktime_to_ns(ktime_sub(first, c->mid.time)) >= ADC_CLOCK_SPAN / 2) {
+		c->anchor = c->mid;
+		c->mid.frame = c->frames;
+		c->mid.time = first;
+	}
+	c->frames += frames;
+}
+
+static inline void adc_tstamp_reset(struct adc_tstamp *ts)
+{
+	ts->frames = 0;
+	ts->position = 0;
+	ts->time = ktime_set(0, 0);
+}
+
+/* the next PCM frame starts with the conversion of acquisition frame 'position' at 'time' */
+static inline void adc_tstamp_set(struct adc_tstamp *ts, u64 position, ktime_t time)
+{
+	ts->position = position;
+	ts->time = time;
+}
+
+/*
+ * get_time_info body, 'ts' is a copy taken under the driver lock. Only the
+ * link types are provided, the core falls back to its own timestamp otherwise.
+ */
+static inline int adc_clock_time_info(struct adc_clock *c, const struct adc_tstamp *ts,
+				      struct snd_pcm_substream *substream,
+				      struct timespec *system_ts, struct timespec *audio_ts,
+				      struct snd_pcm_audio_tstamp_config *config,
+				      struct snd_pcm_audio_tstamp_report *report)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct timespec now;
+	u64 frames;
+	unsigned int rate;
+	u32 rem;
+	s64 ns;
+
+	switch (config->type_requested) {
+	case SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK:
+		frames = ts->frames;
+		rate = runtime->rate;
+		break;
+	case SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_ABSOLUTE:
+		frames = ts->position;
+		rate = c->rate;
+		break;
+	default:
+		report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+	if (!ktime_to_ns(ts->time)) {
+		/* nothing converted yet */
+		report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	/* the link counter as time, in the nominal rate */
+	audio_ts->tv_sec = div_u64_rem(frames, rate, &rem);
+	audio_ts->tv_nsec = div_u64((u64)rem * NSEC_PER_SEC, rate);
+
+	/* the monotonic time moved to the clock selected by the application */
+	snd_pcm_gettime(runtime, &now);
+	ns = timespec_to_ns(&now) + ktime_to_ns(ktime_sub(ts->time, ktime_get()));
+	*system_ts = ns_to_timespec(ns);
+
+	report->actual_type = config->type_requested;
+	report->accuracy_report = 1;
+	report->accuracy = READ_ONCE(c->jitter_ns);
+	return 0;
+}
+
+static int adc_clock_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	switch (kcontrol->private_value) {
+	case ADC_CLOCK_DRIFT:
+		uinfo->value.integer.min = -1000000000;
+		uinfo->value.integer.max = 1000000000;
+		break;
+	default:
+		uinfo->value.integer.min = 0;
+		uinfo->value.integer.max = 0x7fffffff;
+		break;
+	}
+	return 0;
+}
+
+static int adc_clock_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct adc_clock *c = snd_kcontrol_chip(kcontrol);
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	switch (kcontrol->private_value) {
+	case ADC_CLOCK_RATE:
+		ucontrol->value.integer.value[0] = c->rate_mhz;
+		break;
+	case ADC_CLOCK_DRIFT:
+		ucontrol->value.integer.value[0] = c->rate_mhz ? c->drift_ppb : 0;
+		break;
+	case ADC_CLOCK_JITTER:
+		ucontrol->value.integer.value[0] = c->jitter_ns;
+		break;
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+	return 0;
+}
+
+static inline int adc_clock_new(struct adc_clock *c, struct snd_card *card, unsigned int rate)
+{
+	struct snd_kcontrol_new knew = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_MIXER,
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info	= adc_clock_info,
+		.get	= adc_clock_get,
+	};
+	int i;
+	int retval;
+
+	spin_lock_init(&c->lock);
+	c->rate = rate;
+	adc_clock_start(c);
+
+	for (i = 0; i < ADC_CLOCK_NB_CTL; i++) {
+		knew.name = adc_clock_names[i];
+		knew.private_value = i;
+		retval = snd_ctl_add(card, snd_ctl_new1(&knew, c));
+		if (retval < 0)
+			return retval;
+	}
+	return 0;
+}
+
+#endif
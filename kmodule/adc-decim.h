@@ -0,0 +1,98 @@
+/*
+ * CIC decimation shared by the ADC drivers
+ *
+ * Third order CIC (differential delay 1) with a power of 2 ratio up to 64.
+ * The converter codes enter as integers, the integrators and combs wrap in
+ * 32 bits which is exact as long as in_bits + 3 * log2(ratio) <= 32 (28 bits
+ * for the 10 bits MCP3002 at ratio 64). The ratio is limited accordingly, the
+ * 16 bits calibrated samples stop at 32. The output keeps the fractional bits
+ * gained by the averaging : the gain ratio^3 is removed by a shift that stops
+ * at the signed 16 bits scale instead of the converter scale, so a slow 10 bits
+ * channel decimated by 64 carries 13 significant bits in S16.
+ *
+ * The CIC response droops towards rate/ratio/2, fine for the slow sensors it
+ * is meant for, a compensation FIR is not applied.
+ */
+#ifndef ADC_DECIM_H
+#define ADC_DECIM_H
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#define ADC_DECIM_MAX_CHAN	4
+#define ADC_DECIM_ORDER		3
+#define ADC_DECIM_MAX_LOG2	6	/* ratio 64 */
+
+static const char * const adc_decim_texts[ADC_DECIM_MAX_LOG2 + 1] = {
+	"1", "2", "4", "8", "16", "32", "64"
+};
+
+struct adc_decim {
+	unsigned int	channels;
+	unsigned int	in_bits;	/* converter resolution */
+	unsigned int	log2_ratio;
+	unsigned int	phase;
+	u32		integ[ADC_DECIM_MAX_CHAN][ADC_DECIM_ORDER];
+	u32		comb[ADC_DECIM_MAX_CHAN][ADC_DECIM_ORDER];
+};
+
+/* largest ratio keeping the integrators exact in 32 bits */
+static inline unsigned int adc_decim_max_log2(unsigned int in_bits)
+{
+	return min_t(unsigned int, (32 - in_bits) / ADC_DECIM_ORDER, ADC_DECIM_MAX_LOG2);
+}
+
+static inline void adc_decim_init(struct adc_decim *d, unsigned int channels, unsigned int in_bits,
+				  unsigned int log2_ratio)
+{
+	memset(d, 0, sizeof(*d));
+	d->channels = min_t(unsigned int, channels, ADC_DECIM_MAX_CHAN);
+	d->in_bits = in_bits;
+	d->log2_ratio = min_t(unsigned int, log2_ratio, adc_decim_max_log2(in_bits));
+}
+
+static inline unsigned int adc_decim_ratio(const struct adc_decim *d)
+{
+	return 1 << d->log2_ratio;
+}
+
+/*
+ * Push one frame of signed codes (in_bits), returns 1 when 'out' holds a
+ * decimated frame in signed 16 bits.
+ */
+static inline int adc_decim_push(struct adc_decim *d, const s32 *in, s16 *out)
+{
+	int shift = ADC_DECIM_ORDER * d->log2_ratio - (16 - d->in_bits);
+	unsigned int c, i;
+
+	for (c = 0; c < d->channels; c++) {
+		d->integ[c][0] += (u32)in[c];
+		for (i = 1; i < ADC_DECIM_ORDER; i++)
+			d->integ[c][i] += d->integ[c][i - 1];
+	}
+	if (++d->phase < adc_decim_ratio(d))
+		return 0;
+	d->phase = 0;
+
+	for (c = 0; c < d->channels; c++) {
+		u32 v = d->integ[c][ADC_DECIM_ORDER - 1];
+		s32 y;
+
+		for (i = 0; i < ADC_DECIM_ORDER; i++) {
+			u32 prev = d->comb[c][i];
+
+			d->comb[c][i] = v;
+			v -= prev;
+		}
+		y = (s32)v;
+		/* round to nearest, the gain is ratio^3, the target scale 2^(16 - in_bits) */
+		if (shift > 0)
+			y = (y + (1 << (shift - 1))) >> shift;
+		else
+			y <<= -shift;
+		out[c] = clamp_t(s32, y, -32768, 32767);
+	}
+	return 1;
+}
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * Level metering shared by the ADC drivers
+ *
+ * The acquisition path feeds every frame (signed 16 bits scale), the window
+ * sums are kept in fixed point : 64 bits sum of squares and 16 bits extrema
+ * per channel. At the end of each window RMS, peak, min and max are published
+ * and a control event is sent, the controls only read the published values so
+ * that a level costs a few bytes to userspace whatever the rate.
+ *
+ *   Meter Switch : keep the acquisition running without any PCM stream
+ *   Meter Window : window in ms
+ *   Meter RMS, Meter Peak, Meter Min, Meter Max : one value per channel
+ */
+#ifndef ADC_METER_H
+#define ADC_METER_H
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+
+#include <sound/core.h>
+#include <sound/control.h>
+
+#define ADC_METER_MAX_CHAN	4
+#define ADC_METER_WINDOW_MIN	1	/* ms */
+#define ADC_METER_WINDOW_MAX	10000
+#define ADC_METER_WINDOW_DEF	100
+
+enum {
+	ADC_METER_RMS,
+	ADC_METER_PEAK,
+	ADC_METER_MIN,
+	ADC_METER_MAX,
+	ADC_METER_NB_VALUE,
+	ADC_METER_SWITCH = ADC_METER_NB_VALUE,
+	ADC_METER_WINDOW,
+	ADC_METER_NB_CTL
+};
+
+struct adc_meter {
+	struct snd_card		*card;
+	unsigned int		channels;
+	unsigned int		rate;
+	int			enabled;
+	unsigned int		window_ms;
+	unsigned int		window;		/* frames */
+
+	/* current window, only touched by the acquisition path */
+	unsigned int		count;
+	u64			sum_sq[ADC_METER_MAX_CHAN];
+	s16			lo[ADC_METER_MAX_CHAN];
+	s16			hi[ADC_METER_MAX_CHAN];
+
+	/* last complete window */
+	spinlock_t		lock;
+	int			value[ADC_METER_NB_VALUE][ADC_METER_MAX_CHAN];
+	struct snd_kcontrol	*notify;
+
+	/* start or stop the acquisition when the switch changes */
+	void			(*enable)(void *priv, int on);
+	void			*priv;
+};
+
+static const char * const adc_meter_names[ADC_METER_NB_CTL] = {
+	[ADC_METER_RMS]		= "Meter RMS",
+	[ADC_METER_PEAK]	= "Meter Peak",
+	[ADC_METER_MIN]		= "Meter Min",
+	[ADC_METER_MAX]		= "Meter Max",
+	[ADC_METER_SWITCH]	= "Meter Switch",
+	[ADC_METER_WINDOW]	= "Meter Window",
+};
+
+static inline void adc_meter_set_window(struct adc_meter *m, unsigned int ms)
+{
+	m->window_ms = ms;
+	m->window = max_t(unsigned int, 1, div_u64((u64)m->rate * ms, 1000));
+}
+
+static inline void adc_meter_publish(struct adc_meter *m)
+{
+	unsigned long flags;
+	unsigned int c;
+
+	spin_lock_irqsave(&m->lock, flags);
+	for (c = 0; c < m->channels; c++) {
+		m->value[ADC_METER_RMS][c] = int_sqrt(div_u64(m->sum_sq[c], m->count));
+		m->value[ADC_METER_PEAK][c] = max(-(int)m->lo[c], (int)m->hi[c]);
+		m->value[ADC_METER_MIN][c] = m->lo[c];
+		m->value[ADC_METER_MAX][c] = m->hi[c];
+	}
+	spin_unlock_irqrestore(&m->lock, flags);
+	m->count = 0;
+
+	if (m->notify)
+		snd_ctl_notify(m->card, SNDRV_CTL_EVENT_MASK_VALUE, &m->notify->id);
+}
+
+/* one frame of m->channels samples, atomic context is fine */
+static inline void adc_meter_feed(struct adc_meter *m, const s16 *frame)
+{
+	unsigned int c;
+
+	if (m->count == 0) {
+		for (c = 0; c < m->channels; c++) {
+			m->sum_sq[c] = 0;
+			m->lo[c] = frame[c];
+			m->hi[c] = frame[c];
+		}
+	}
+	for (c = 0; c < m->channels; c++) {
+		s32 v = frame[c];
+
+		m->sum_sq[c] += (u32)(v * v);
+		if (v < m->lo[c])
+			m->lo[c] = v;
+		if (v > m->hi[c])
+			m->hi[c] = v;
+	}
+	if (++m->count >= m->window)
+		adc_meter_publish(m);
+}
+
+static int adc_meter_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	struct adc_meter *m = snd_kcontrol_chip(kcontrol);
+
+	switch (kcontrol->private_value) {
+	case ADC_METER_SWITCH:
+		return snd_ctl_boolean_mono_info(kcontrol, uinfo);
+	case ADC_METER_WINDOW:
+		uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+		uinfo->count = 1;
+		uinfo->value.integer.min = ADC_METER_WINDOW_MIN;
+		uinfo->value.integer.max = ADC_METER_WINDOW_MAX;
+		return 0;
+	default:
+		uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+		uinfo->count = m->channels;
+		uinfo->value.integer.min = (kcontrol->private_value < ADC_METER_MIN) ? 0 : -32768;
+		uinfo->value.integer.max = 32768;
+		return 0;
+	}
+}
+
+static int adc_meter_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct adc_meter *m = snd_kcontrol_chip(kcontrol);
+	unsigned long flags;
+	unsigned int c;
+
+	switch (kcontrol->private_value) {
+	case ADC_METER_SWITCH:
+		ucontrol->value.integer.value[0] = m->enabled;
+		break;
+	case ADC_METER_WINDOW:
+		ucontrol->value.integer.value[0] = m->window_ms;
+		break;
+	default:
+		spin_lock_irqsave(&m->lock, flags);
+		for (c = 0; c < m->channels; c++)
+			ucontrol->value.integer.value[c] = m->value[kcontrol->private_value][c];
+		spin_unlock_irqrestore(&m->lock, flags);
+		break;
+	}
+	return 0;
+}
+
+static int adc_meter_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct adc_meter *m = snd_kcontrol_chip(kcontrol);
+	long value = ucontrol->value.integer.value[0];
+
+	switch (kcontrol->private_value) {
+	case ADC_METER_SWITCH:
+		value = !!value;
+		if (value == m->enabled)
+			return 0;
+		m->enabled = value;
+		if (m->enable)
+			m->enable(m->priv, value);
+		return 1;
+	case ADC_METER_WINDOW:
+		if (value < ADC_METER_WINDOW_MIN || value > ADC_METER_WINDOW_MAX)
+			return -EINVAL;
+		if (value == m->window_ms)
+			return 0;
+		/* the acquisition path picks the new size at its next frame */
+		adc_meter_set_window(m, value);
+		return 1;
+	default:
+		return -EPERM;
+	}
+}
+
+static inline int adc_meter_new(struct adc_meter *m, struct snd_card *card, unsigned int channels,
+				unsigned int rate, void (*enable)(void *priv, int on), void *priv)
+{
+	struct snd_kcontrol_new knew = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_MIXER,
+		.info	= adc_meter_info,
+		.get	= adc_meter_get,
+		.put	= adc_meter_put,
+	};
+	struct snd_kcontrol *kctl;
+	int i;
+	int retval;
+
+	spin_lock_init(&m->lock);
+	m->card = card;
+	m->channels = min_t(unsigned int, channels, ADC_METER_MAX_CHAN);
+	m->rate = rate;
+	m->enable = enable;
+	m->priv = priv;
+	adc_meter_set_window(m, ADC_METER_WINDOW_DEF);
+
+	for (i = 0; i < ADC_METER_NB_CTL; i++) {
+		knew.name = adc_meter_names[i];
+		knew.private_value = i;
+		knew.access = (i < ADC_METER_NB_VALUE)
+			? SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE
+			: SNDRV_CTL_ELEM_ACCESS_READWRITE;
+		kctl = snd_ctl_new1(&knew, m);
+		retval = snd_ctl_add(card, kctl);
+		if (retval < 0)
+			return retval;
+		/* one event per window, on the RMS control */
+		if (i == ADC_METER_RMS)
+			m->notify = kctl;
+	}
+	return 0;
+}
+
+#endif
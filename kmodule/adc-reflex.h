@@ -0,0 +1,377 @@
+/*
+ * Threshold reflex shared by the ADC drivers
+ *
+ * Each channel compares its frames (the meter scale : signed 16 bits, or
+ * millivolts with the calibration) to a level with a hysteresis : 'Above'
+ * trips at the level and releases under level - hysteresis, 'Below' trips at
+ * the level and releases over level + hysteresis. While tripped the GPIO line
+ * of the channel is driven to its active value, a line shared by several
+ * channels is active while any of them is tripped.
+ *
+ * The acquisition path only records the transitions (stamped with the time
+ * of the frame), the lines are written by adc_reflex_apply() from the
+ * acquisition thread once the driver lock is dropped : one bus transaction
+ * for a MCP23008 line (gpio-mcp23008 keeps its OLAT write prepared). The
+ * reaction is bounded by the acquisition block plus this transaction, and
+ * every transition sends an event on 'Reflex State'.
+ *
+ *   Reflex Mode : Off, Above or Below per channel, an armed channel keeps the
+ *                 acquisition running without PCM stream
+ *   Reflex Level, Reflex Hysteresis : per channel
+ *   Reflex GPIO : line number per channel, -1 for none, requested as output
+ *   Reflex Active : value of the line while tripped, per channel
+ *   Reflex State, Reflex Time, Reflex Count : tripped, CLOCK_MONOTONIC ns of
+ *                 the last transition and trips per channel
+ */
+#ifndef ADC_REFLEX_H
+#define ADC_REFLEX_H
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/gpio.h>
+
+#include <sound/core.h>
+#include <sound/control.h>
+
+#define ADC_REFLEX_MAX_CHAN	4
+#define ADC_REFLEX_GPIO_MAX	1023
+
+enum {
+	ADC_REFLEX_MODE,
+	ADC_REFLEX_LEVEL,
+	ADC_REFLEX_HYSTERESIS,
+	ADC_REFLEX_GPIO,
+	ADC_REFLEX_ACTIVE,
+	ADC_REFLEX_NB_PARAM,
+	ADC_REFLEX_STATE = ADC_REFLEX_NB_PARAM,
+	ADC_REFLEX_TIME,
+	ADC_REFLEX_COUNT,
+	ADC_REFLEX_NB_CTL
+};
+
+enum {
+	ADC_REFLEX_OFF,
+	ADC_REFLEX_ABOVE,
+	ADC_REFLEX_BELOW,
+};
+
+static const struct {
+	const char	*name;
+	int		min;
+	int		max;
+	int		def;
+} adc_reflex_params[ADC_REFLEX_NB_CTL] = {
+	[ADC_REFLEX_MODE]	= { "Reflex Mode",		0, 2,			ADC_REFLEX_OFF },
+	[ADC_REFLEX_LEVEL]	= { "Reflex Level",		-32768, 32767,		16384 },
+	[ADC_REFLEX_HYSTERESIS]	= { "Reflex Hysteresis",	0, 32767,		512 },
+	[ADC_REFLEX_GPIO]	= { "Reflex GPIO",		-1, ADC_REFLEX_GPIO_MAX, -1 },
+	[ADC_REFLEX_ACTIVE]	= { "Reflex Active",		0, 1,			1 },
+	[ADC_REFLEX_STATE]	= { "Reflex State",		0, 1,			0 },
+	[ADC_REFLEX_TIME]	= { "Reflex Time",		0, 0,			0 },
+	[ADC_REFLEX_COUNT]	= { "Reflex Count",		0, INT_MAX,		0 },
+};
+
+struct adc_reflex {
+	struct snd_card		*card;
+	unsigned int		channels;
+	int			param[ADC_REFLEX_NB_PARAM][ADC_REFLEX_MAX_CHAN];
+	int			armed;		/* a channel is not off */
+
+	/* state, changed by the acquisition path at the transitions */
+	spinlock_t		lock;
+	int			tripped[ADC_REFLEX_MAX_CHAN];
+	ktime_t			time[ADC_REFLEX_MAX_CHAN];
+	unsigned int		count[ADC_REFLEX_MAX_CHAN];
+	unsigned long		pending;	/* channels with a transition to apply */
+	struct snd_kcontrol	*notify;
+
+	/* requested lines, written in process context only */
+	struct mutex		gpio_lock;
+	int			gpio[ADC_REFLEX_MAX_CHAN];
+
+	/* start or stop the acquisition when the reflex is armed or disarmed */
+	void			(*enable)(void *priv, int on);
+	void			*priv;
+};
+
+/* one frame of r->channels samples at 'time', under the acquisition lock */
+static inline void adc_reflex_feed(struct adc_reflex *r, const s16 *frame, ktime_t time)
+{
+	unsigned int c;
+
+	if (!r->armed)
+		return;
+	for (c = 0; c < r->channels; c++) {
+		int mode = r->param[ADC_REFLEX_MODE][c];
+		int level = r->param[ADC_REFLEX_LEVEL][c];
+		int hyst = r->param[ADC_REFLEX_HYSTERESIS][c];
+		int v = frame[c];
+		int trip;
+
+		if (mode == ADC_REFLEX_ABOVE)
+			trip = r->tripped[c] ? v >= level - hyst : v >= level;
+		else if (mode == ADC_REFLEX_BELOW)
+			trip = r->tripped[c] ? v <= level + hyst : v <= level;
+		else
+			continue;
+		if (trip == r->tripped[c])
+			continue;
+
+		spin_lock(&r->lock);
+		r->tripped[c] = trip;
+		r->time[c] = time;
+		if (trip)
+			r->count[c]++;
+		r->pending |= BIT(c);
+		spin_unlock(&r->lock);
+	}
+}
+
+/* value of the line of channel 'c', active while a channel sharing it is tripped */
+static inline int adc_reflex_line_value(struct adc_reflex *r, unsigned int c)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->channels; i++)
+		if (r->gpio[i] == r->gpio[c] && r->tripped[i])
+			return r->param[ADC_REFLEX_ACTIVE][c];
+	return !r->param[ADC_REFLEX_ACTIVE][c];
+}
+
+/* the line of channel 'c' with gpio_lock held, sleeps on an I2C expander */
+static inline void adc_reflex_write(struct adc_reflex *r, unsigned int c)
+{
+	if (r->gpio[c] >= 0)
+		gpio_set_value_cansleep(r->gpio[c], adc_reflex_line_value(r, c));
+}
+
+/* the pending transitions to the lines, from the acquisition thread without lock */
+static inline void adc_reflex_apply(struct adc_reflex *r)
+{
+	unsigned long pending;
+	unsigned long flags;
+	unsigned int c;
+
+	if (!READ_ONCE(r->pending))
+		return;
+	spin_lock_irqsave(&r->lock, flags);
+	pending = r->pending;
+	r->pending = 0;
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	mutex_lock(&r->gpio_lock);
+	for (c = 0; c < r->channels; c++)
+		if (pending & BIT(c))
+			adc_reflex_write(r, c);
+	mutex_unlock(&r->gpio_lock);
+
+	if (r->notify)
+		snd_ctl_notify(r->card, SNDRV_CTL_EVENT_MASK_VALUE, &r->notify->id);
+}
+
+/* 'gpio' for channel 'c', the lines are requested once whatever the channels sharing them */
+static inline int adc_reflex_set_gpio(struct adc_reflex *r, unsigned int c, int gpio)
+{
+	int old = r->gpio[c];
+	int shared = 0;
+	unsigned int i;
+	int retval;
+
+	for (i = 0; i < r->channels; i++) {
+		if (i != c && r->gpio[i] == gpio)
+			shared = 1;
+	}
+	if (gpio >= 0 && !shared) {
+		if (!gpio_is_valid(gpio))
+			return -EINVAL;
+		retval = gpio_request(gpio, "adc-reflex");
+		if (retval < 0)
+			return retval;
+	}
+	r->gpio[c] = gpio;
+	if (gpio >= 0) {
+		retval = gpio_direction_output(gpio, adc_reflex_line_value(r, c));
+		if (retval < 0) {
+			r->gpio[c] = old;
+			if (!shared)
+				gpio_free(gpio);
+			return retval;
+		}
+	}
+
+	for (i = 0; i < r->channels; i++) {
+		if (r->gpio[i] == old)
+			break;
+	}
+	if (old >= 0 && i == r->channels)
+		gpio_free(old);
+	return 0;
+}
+
+static int adc_reflex_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	static const char * const modes[] = { "Off", "Above", "Below" };
+	struct adc_reflex *r = snd_kcontrol_chip(kcontrol);
+	int id = kcontrol->private_value;
+
+	switch (id) {
+	case ADC_REFLEX_MODE:
+		return snd_ctl_enum_info(uinfo, r->channels, ARRAY_SIZE(modes), modes);
+	case ADC_REFLEX_TIME:
+		uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER64;
+		uinfo->count = r->channels;
+		uinfo->value.integer64.min = 0;
+		uinfo->value.integer64.max = LLONG_MAX;
+		return 0;
+	default:
+		uinfo->type = (adc_reflex_params[id].max == 1 && adc_reflex_params[id].min == 0)
+			? SNDRV_CTL_ELEM_TYPE_BOOLEAN : SNDRV_CTL_ELEM_TYPE_INTEGER;
+		uinfo->count = r->channels;
+		uinfo->value.integer.min = adc_reflex_params[id].min;
+		uinfo->value.integer.max = adc_reflex_params[id].max;
+		return 0;
+	}
+}
+
+static int adc_reflex_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct adc_reflex *r = snd_kcontrol_chip(kcontrol);
+	int id = kcontrol->private_value;
+	unsigned long flags;
+	unsigned int c;
+
+	spin_lock_irqsave(&r->lock, flags);
+	for (c = 0; c < r->channels; c++) {
+		switch (id) {
+		case ADC_REFLEX_MODE:
+			ucontrol->value.enumerated.item[c] = r->param[id][c];
+			break;
+		case ADC_REFLEX_STATE:
+			ucontrol->value.integer.value[c] = r->tripped[c];
+			break;
+		case ADC_REFLEX_TIME:
+			ucontrol->value.integer64.value[c] = ktime_to_ns(r->time[c]);
+			break;
+		case ADC_REFLEX_COUNT:
+			ucontrol->value.integer.value[c] = r->count[c];
+			break;
+		default:
+			ucontrol->value.integer.value[c] = r->param[id][c];
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+	return 0;
+}
+
+static int adc_reflex_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct adc_reflex *r = snd_kcontrol_chip(kcontrol);
+	int id = kcontrol->private_value;
+	unsigned long flags;
+	unsigned int c;
+	int armed = 0;
+	int changed = 0;
+	int retval = 0;
+
+	if (id >= ADC_REFLEX_NB_PARAM)
+		return -EPERM;
+
+	mutex_lock(&r->gpio_lock);
+	for (c = 0; c < r->channels; c++) {
+		int value = (id == ADC_REFLEX_MODE) ? ucontrol->value.enumerated.item[c]
+						    : ucontrol->value.integer.value[c];
+
+		if (value < adc_reflex_params[id].min || value > adc_reflex_params[id].max) {
+			retval = -EINVAL;
+			break;
+		}
+		if (value == r->param[id][c])
+			continue;
+		changed = 1;
+
+		if (id == ADC_REFLEX_GPIO) {
+			retval = adc_reflex_set_gpio(r, c, value);
+			if (retval < 0)
+				break;
+		}
+		spin_lock_irqsave(&r->lock, flags);
+		r->param[id][c] = value;
+		/* a new mode starts released */
+		if (id == ADC_REFLEX_MODE)
+			r->tripped[c] = 0;
+		spin_unlock_irqrestore(&r->lock, flags);
+		if (id == ADC_REFLEX_MODE || id == ADC_REFLEX_ACTIVE)
+			adc_reflex_write(r, c);
+	}
+	mutex_unlock(&r->gpio_lock);
+
+	if (id == ADC_REFLEX_MODE) {
+		for (c = 0; c < r->channels; c++)
+			armed |= (r->param[ADC_REFLEX_MODE][c] != ADC_REFLEX_OFF);
+		if (armed != r->armed) {
+			r->armed = armed;
+			if (r->enable)
+				r->enable(r->priv, armed);
+		}
+	}
+	return retval < 0 ? retval : changed;
+}
+
+static inline int adc_reflex_new(struct adc_reflex *r, struct snd_card *card, unsigned int channels,
+				 void (*enable)(void *priv, int on), void *priv)
+{
+	struct snd_kcontrol_new knew = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_MIXER,
+		.info	= adc_reflex_info,
+		.get	= adc_reflex_get,
+		.put	= adc_reflex_put,
+	};
+	struct snd_kcontrol *kctl;
+	unsigned int c;
+	int i;
+	int retval;
+
+	spin_lock_init(&r->lock);
+	mutex_init(&r->gpio_lock);
+	r->card = card;
+	r->channels = min_t(unsigned int, channels, ADC_REFLEX_MAX_CHAN);
+	r->enable = enable;
+	r->priv = priv;
+	for (i = 0; i < ADC_REFLEX_NB_PARAM; i++)
+		for (c = 0; c < r->channels; c++)
+			r->param[i][c] = adc_reflex_params[i].def;
+	for (c = 0; c < r->channels; c++)
+		r->gpio[c] = -1;
+
+	for (i = 0; i < ADC_REFLEX_NB_CTL; i++) {
+		knew.name = adc_reflex_params[i].name;
+		knew.private_value = i;
+		knew.access = (i < ADC_REFLEX_NB_PARAM)
+			? SNDRV_CTL_ELEM_ACCESS_READWRITE
+			: SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE;
+		kctl = snd_ctl_new1(&knew, r);
+		retval = snd_ctl_add(card, kctl);
+		if (retval < 0)
+			return retval;
+		/* one event per transition, on the state control */
+		if (i == ADC_REFLEX_STATE)
+			r->notify = kctl;
+	}
+	return 0;
+}
+
+/* the lines are released as they are, the acquisition is stopped */
+static inline void adc_reflex_free(struct adc_reflex *r)
+{
+	unsigned int c;
+
+	mutex_lock(&r->gpio_lock);
+	for (c = 0; c < r->channels; c++)
+		adc_reflex_set_gpio(r, c, -1);
+	mutex_unlock(&r->gpio_lock);
+}
+
+#endif
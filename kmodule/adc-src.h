@@ -0,0 +1,280 @@
+/*
+ * Sample rate conversion shared by the ADC drivers
+ *
+ * The PCM offers the standard rates (8000, 16000, 22050, 44100, 48000) next
+ * to the acquisition rate, a client asking for one of them gets the frames
+ * converted here instead of by the plug layer.
+ *
+ * Polyphase FIR in fixed point : the prototype is a Kaiser windowed sinc
+ * (beta 8, 8 zero crossings each side, cut at 0.9 of the lower Nyquist)
+ * tabulated once below. At hw_params it is sampled into 64 phases of
+ * 16 taps, stretched to up to 128 taps when decimating (at most 8 input
+ * frames per output), each phase normalized to unity gain in Q15. An output
+ * is the dot product of the history with the two phases around its fractional
+ * position, linearly interpolated, so any ratio works with the same table.
+ * The response is flat to 0.6 of the lower Nyquist, -0.8 dB at 0.75, and the
+ * interpolation noise stays around -80 dB.
+ *
+ * The output lags the input by taps / 2 acquisition frames, adc_src_delay()
+ * gives it for the timestamps.
+ */
+#ifndef ADC_SRC_H
+#define ADC_SRC_H
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+
+#include <sound/pcm.h>
+
+#define ADC_SRC_MAX_CHAN	4
+#define ADC_SRC_ZC		8	/* zero crossings each side of the prototype */
+#define ADC_SRC_OS		32	/* prototype points per zero crossing */
+#define ADC_SRC_PHASES		64
+#define ADC_SRC_MAX_DOWN	8	/* input frames per output */
+#define ADC_SRC_NB_RATES	5
+
+static const unsigned int adc_src_std_rates[ADC_SRC_NB_RATES] = {
+	8000, 16000, 22050, 44100, 48000
+};
+
+/* windowed sinc, Q15, from 0 to ADC_SRC_ZC every 1 / ADC_SRC_OS */
+static const s16 adc_src_proto[ADC_SRC_ZC * ADC_SRC_OS + 1] = {
+	 32767,  32723,  32589,  32368,  32060,  31666,  31189,  30632,
+	 29996,  29285,  28504,  27655,  26743,  25772,  24748,  23676,
+	 22560,  21407,  20221,  19008,  17775,  16526,  15269,  14007,
+	 12748,  11496,  10257,   9037,   7840,   6671,   5534,   4435,
+	  3377,   2364,   1399,    485,   -375,  -1179,  -1925,  -2611,
+	 -3237,  -3800,  -4302,  -4741,  -5119,  -5435,  -5691,  -5889,
+	 -6029,  -6114,  -6146,  -6127,  -6060,  -5948,  -5794,  -5601,
+	 -5373,  -5112,  -4823,  -4509,  -4173,  -3820,  -3452,  -3073,
+	 -2686,  -2296,  -1905,  -1516,  -1132,   -756,   -391,    -38,
+	   299,    619,    920,   1200,   1459,   1694,   1906,   2093,
+	  2255,   2392,   2503,   2590,   2652,   2689,   2704,   2695,
+	  2666,   2616,   2546,   2460,   2356,   2239,   2108,   1965,
+	  1813,   1653,   1486,   1314,   1139,    962,    786,    610,
+	   438,    269,    105,    -52,   -201,   -343,   -475,   -597,
+	  -709,   -810,   -900,   -979,  -1046,  -1101,  -1144,  -1177,
+	 -1197,  -1208,  -1207,  -1197,  -1177,  -1149,  -1112,  -1068,
+	 -1017,   -960,   -898,   -831,   -760,   -687,   -612,   -535,
+	  -457,   -380,   -303,   -228,   -154,    -83,    -15,     50,
+	   111,    168,    221,    269,    312,    351,    384,    412,
+	   435,    454,    467,    476,    480,    480,    476,    468,
+	   456,    441,    423,    403,    380,    355,    329,    301,
+	   273,    244,    214,    184,    155,    126,     97,     70,
+	    44,     19,     -5,    -27,    -48,    -66,    -83,    -98,
+	  -111,   -122,   -132,   -139,   -145,   -149,   -152,   -153,
+	  -152,   -150,   -147,   -143,   -137,   -131,   -124,   -117,
+	  -109,   -100,    -91,    -82,    -73,    -64,    -55,    -47,
+	   -38,    -30,    -22,    -15,     -8,     -2,      4,      9,
+	    14,     18,     21,     24,     27,     29,     30,     31,
+	    32,     32,     32,     31,     30,     29,     28,     27,
+	    25,     23,     21,     20,     18,     16,     14,     12,
+	    10,      9,      7,      6,      5,      3,      2,      1,
+	     1,      0,     -1,     -1,     -1,     -2,     -2,     -2,
+	    -2,
+};
+
+struct adc_src {
+	unsigned int	channels;
+	unsigned int	in_rate;
+	unsigned int	out_rate;
+	unsigned int	taps;		/* even, 0 when the rates are the same */
+	s16		*coef;		/* (ADC_SRC_PHASES + 1) x taps, oldest frame first */
+	s16		*hist;		/* channels x 2 taps, each frame stored twice */
+	unsigned int	pos;		/* newest frame in the history */
+	int		primed;
+	u64		step;		/* input frames per output, 32.32 */
+	u64		next;		/* next output after the newest input, 32.32 */
+};
+
+/* the rates offered by the PCM, the acquisition rate first */
+struct adc_src_rates {
+	unsigned int				list[ADC_SRC_NB_RATES + 1];
+	struct snd_pcm_hw_constraint_list	constraint;
+};
+
+static inline int adc_src_active(const struct adc_src *s)
+{
+	return s->taps != 0;
+}
+
+static inline int adc_src_supported(unsigned int in_rate, unsigned int out_rate)
+{
+	return in_rate && out_rate && in_rate <= ADC_SRC_MAX_DOWN * out_rate;
+}
+
+/* prototype at 'u' (Q16, zero crossings), linearly interpolated */
+static inline s32 adc_src_proto_at(u64 u)
+{
+	u64 x = u * ADC_SRC_OS;
+	unsigned int i = x >> 16;
+	s32 frac = x & 0xFFFF;
+
+	if (i >= ADC_SRC_ZC * ADC_SRC_OS)
+		return 0;
+	return adc_src_proto[i] + (((adc_src_proto[i + 1] - adc_src_proto[i]) * frac) >> 16);
+}
+
+static inline void adc_src_free(struct adc_src *s)
+{
+	kfree(s->coef);
+	kfree(s->hist);
+	s->coef = NULL;
+	s->hist = NULL;
+	s->taps = 0;
+}
+
+static inline void adc_src_reset(struct adc_src *s)
+{
+	s->pos = 0;
+	s->primed = 0;
+	/* the first input gives the first output */
+	s->next = 1ULL << 32;
+}
+
+/*
+ * Tables for in_rate -> out_rate, no conversion when they are the same. Sleeps,
+ * a running stream swaps a new struct under its lock.
+ */
+static inline int adc_src_init(struct adc_src *s, unsigned int channels, unsigned int in_rate,
+			       unsigned int out_rate)
+{
+	u32 scale;	/* Q16, output over input bandwidth */
+	unsigned int p, j;
+
+	memset(s, 0, sizeof(*s));
+	s->channels = min_t(unsigned int, channels, ADC_SRC_MAX_CHAN);
+	s->in_rate = in_rate;
+	s->out_rate = out_rate;
+	adc_src_reset(s);
+	if (in_rate == out_rate)
+		return 0;
+	if (!adc_src_supported(in_rate, out_rate))
+		return -EINVAL;
+
+	scale = (in_rate > out_rate) ? div_u64((u64)out_rate << 16, in_rate) : 1 << 16;
+	s->taps = 2 * DIV_ROUND_UP(ADC_SRC_ZC << 16, scale);
+	s->step = div_u64((u64)in_rate << 32, out_rate);
+	s->coef = kcalloc((ADC_SRC_PHASES + 1) * s->taps, sizeof(s16), GFP_KERNEL);
+	s->hist = kcalloc(s->channels * 2 * s->taps, sizeof(s16), GFP_KERNEL);
+	if (!s->coef || !s->hist) {
+		adc_src_free(s);
+		return -ENOMEM;
+	}
+
+	for (p = 0; p <= ADC_SRC_PHASES; p++) {
+		s16 *c = &s->coef[p * s->taps];
+		s32 v[2 * ADC_SRC_ZC * ADC_SRC_MAX_DOWN];
+		s64 sum = 0;
+		s32 total = 0;
+
+		/* tap j holds the frame (taps - 1 - j) before the newest one */
+		for (j = 0; j < s->taps; j++) {
+			s64 x = ((s64)p << 16) / ADC_SRC_PHASES
+				+ ((s64)(s->taps - 1 - j) - s->taps / 2) * 65536;
+
+			v[j] = adc_src_proto_at(((u64)(x < 0 ? -x : x) * scale) >> 16);
+			sum += v[j];
+		}
+		/* unity gain, the rounding left on the middle tap */
+		for (j = 0; j < s->taps; j++) {
+			c[j] = div64_s64((s64)v[j] * 32768, sum);
+			total += c[j];
+		}
+		c[s->taps / 2] += 32768 - total;
+	}
+	return 0;
+}
+
+/* frames of lag of the output, in input frames */
+static inline unsigned int adc_src_delay(const struct adc_src *s)
+{
+	return s->taps / 2;
+}
+
+static inline void adc_src_push(struct adc_src *s, const s16 *in)
+{
+	unsigned int c, j;
+
+	if (!s->primed) {
+		/* start from the first value instead of a step from zero */
+		for (c = 0; c < s->channels; c++)
+			for (j = 0; j < 2 * s->taps; j++)
+				s->hist[c * 2 * s->taps + j] = in[c];
+		s->primed = 1;
+	} else {
+		s->pos = (s->pos + 1) % s->taps;
+		for (c = 0; c < s->channels; c++) {
+			s->hist[c * 2 * s->taps + s->pos] = in[c];
+			s->hist[c * 2 * s->taps + s->pos + s->taps] = in[c];
+		}
+	}
+	s->next -= 1ULL << 32;
+}
+
+static inline s64 adc_src_dot(const s16 *x, const s16 *c, unsigned int taps)
+{
+	s64 acc = 0;
+	unsigned int j;
+
+	for (j = 0; j < taps; j++)
+		acc += (s32)x[j] * c[j];
+	return acc;
+}
+
+/* returns 1 while an output frame is due before the next input */
+static inline int adc_src_pull(struct adc_src *s, s16 *out)
+{
+	u32 frac = (u32)s->next;
+	unsigned int p = frac >> (32 - 6);		/* ADC_SRC_PHASES = 2^6 */
+	s32 w = (frac >> (32 - 6 - 15)) & 0x7FFF;	/* Q15 between p and p + 1 */
+	const s16 *c0 = &s->coef[p * s->taps];
+	const s16 *c1 = c0 + s->taps;
+	unsigned int c;
+
+	if (s->next >> 32)
+		return 0;
+	for (c = 0; c < s->channels; c++) {
+		/* oldest frame first, the newest at pos + taps */
+		const s16 *x = &s->hist[c * 2 * s->taps + s->pos + 1];
+		s64 y0 = adc_src_dot(x, c0, s->taps);
+		s64 y1 = adc_src_dot(x, c1, s->taps);
+		s64 y = y0 + (((y1 - y0) * w) >> 15);
+
+		out[c] = clamp_t(s64, (y + (1 << 14)) >> 15, -32768, 32767);
+	}
+	s->next += s->step;
+	return 1;
+}
+
+/*
+ * Offer the acquisition rate and, with 'enable', the standard rates it can be
+ * converted to. Called from open, 'r' lives as long as the substream.
+ */
+static inline int adc_src_constraint(struct snd_pcm_runtime *runtime, struct adc_src_rates *r,
+				     unsigned int rate, int enable)
+{
+	unsigned int n = 0;
+	unsigned int i;
+
+	r->list[n++] = rate;
+	for (i = 0; enable && i < ADC_SRC_NB_RATES; i++)
+		if (adc_src_std_rates[i] != rate && adc_src_supported(rate, adc_src_std_rates[i]))
+			r->list[n++] = adc_src_std_rates[i];
+
+	runtime->hw.rates = SNDRV_PCM_RATE_CONTINUOUS;
+	runtime->hw.rate_min = rate;
+	runtime->hw.rate_max = rate;
+	for (i = 0; i < n; i++) {
+		runtime->hw.rate_min = min(runtime->hw.rate_min, r->list[i]);
+		runtime->hw.rate_max = max(runtime->hw.rate_max, r->list[i]);
+	}
+	r->constraint.count = n;
+	r->constraint.list = r->list;
+	r->constraint.mask = 0;
+	return snd_pcm_hw_constraint_list(runtime, 0, SNDRV_PCM_HW_PARAM_RATE, &r->constraint);
+}
+
+#endif
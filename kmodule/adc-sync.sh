@@ -0,0 +1,24 @@
+#!/bin/bash
+
+SPI=spi0.0
+I2C=i2c-1
+
+case $1 in
+start)
+	sudo modprobe -v snd-adc-sync
+	if [ -e /sys/bus/spi/devices/$SPI/driver ]; then
+		echo $SPI | sudo tee /sys/bus/spi/devices/$SPI/driver/unbind
+	fi
+	echo snd_adc_sync | sudo tee /sys/bus/spi/devices/$SPI/driver_override
+	echo $SPI | sudo tee /sys/bus/spi/drivers/snd_adc_sync/bind
+	echo "adc-sync-pcf8591 0x48" | sudo tee /sys/bus/i2c/devices/$I2C/new_device
+	;;
+stop)
+	echo 0x48  | sudo tee /sys/bus/i2c/devices/$I2C/delete_device
+	echo | sudo tee /sys/bus/spi/devices/$SPI/driver_override
+	sudo modprobe -rv snd-adc-sync
+	;;
+*)
+	echo "Usage $0 (start|stop)"
+	;;
+esac
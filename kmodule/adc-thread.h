@@ -0,0 +1,251 @@
+/*
+ * Acquisition thread shared by the ADC drivers
+ *
+ * One named kthread per device, its scheduling policy, priority and CPU
+ * mask come from the module parameters and can be changed at run time
+ * through the device attributes :
+ *
+ *   sched_policy   : other, fifo or rr
+ *   sched_priority : 1-99 for fifo and rr, ignored for other
+ *   cpu_mask       : CPU list (0-3, 2, ...), empty for all the CPUs
+ *
+ * The driver instantiates the attributes with ADC_THREAD_ATTRS(), giving the
+ * function that finds the thread from the struct device.
+ */
+#ifndef ADC_THREAD_H
+#define ADC_THREAD_H
+
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/string.h>
+
+struct adc_thread {
+	struct task_struct	*task;
+	wait_queue_head_t	wait;	/* the thread sleeps here when idle */
+	struct mutex		lock;	/* settings */
+	int			policy;
+	int			priority;
+	struct cpumask		mask;
+};
+
+static const char * const adc_thread_policies[] = {
+	[SCHED_NORMAL]	= "other",
+	[SCHED_FIFO]	= "fifo",
+	[SCHED_RR]	= "rr",
+};
+
+static inline int adc_thread_parse_policy(const char *buf)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(adc_thread_policies); i++)
+		if (sysfs_streq(buf, adc_thread_policies[i]))
+			return i;
+	return -EINVAL;
+}
+
+static inline int adc_thread_parse_mask(const char *buf, struct cpumask *mask)
+{
+	int retval;
+
+	if (!buf || sysfs_streq(buf, "")) {
+		cpumask_copy(mask, cpu_possible_mask);
+		return 0;
+	}
+	retval = cpulist_parse(buf, mask);
+	if (retval)
+		return retval;
+	if (!cpumask_intersects(mask, cpu_online_mask))
+		return -EINVAL;
+	return 0;
+}
+
+/* settings to the running thread, t->lock held */
+static inline int adc_thread_apply(struct adc_thread *t)
+{
+	struct sched_param param = {
+		.sched_priority = (t->policy == SCHED_NORMAL) ? 0 : t->priority,
+	};
+	int retval;
+
+	if (!t->task)
+		return 0;
+	retval = sched_setscheduler(t->task, t->policy, &param);
+	if (retval)
+		return retval;
+	return set_cpus_allowed_ptr(t->task, &t->mask);
+}
+
+static inline int adc_thread_init(struct adc_thread *t, const char *policy, int priority,
+				  const char *mask)
+{
+	init_waitqueue_head(&t->wait);
+	mutex_init(&t->lock);
+	t->task = NULL;
+
+	t->policy = adc_thread_parse_policy(policy);
+	if (t->policy < 0)
+		return t->policy;
+	if (priority < 1 || priority > MAX_RT_PRIO - 1)
+		return -EINVAL;
+	t->priority = priority;
+	return adc_thread_parse_mask(mask, &t->mask);
+}
+
+static inline int adc_thread_start(struct adc_thread *t, int (*fn)(void *data), void *data,
+				   const char *name)
+{
+	struct task_struct *task;
+	int retval;
+
+	task = kthread_create(fn, data, "%s", name);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	mutex_lock(&t->lock);
+	t->task = task;
+	retval = adc_thread_apply(t);
+	mutex_unlock(&t->lock);
+	if (retval) {
+		kthread_stop(task);
+		t->task = NULL;
+		return retval;
+	}
+	wake_up_process(task);
+	return 0;
+}
+
+static inline void adc_thread_stop(struct adc_thread *t)
+{
+	if (t->task)
+		kthread_stop(t->task);
+	t->task = NULL;
+}
+
+// =======================
+// device attributes
+// =======================
+static inline ssize_t adc_thread_policy_show(struct adc_thread *t, char *buf)
+{
+	return sprintf(buf, "%s\n", adc_thread_policies[t->policy]);
+}
+
+static inline ssize_t adc_thread_policy_store(struct adc_thread *t, const char *buf, size_t count)
+{
+	int policy = adc_thread_parse_policy(buf);
+	int old;
+	int retval;
+
+	if (policy < 0)
+		return policy;
+	mutex_lock(&t->lock);
+	old = t->policy;
+	t->policy = policy;
+	retval = adc_thread_apply(t);
+	if (retval)
+		t->policy = old;
+	mutex_unlock(&t->lock);
+	return retval ? retval : count;
+}
+
+static inline ssize_t adc_thread_priority_show(struct adc_thread *t, char *buf)
+{
+	return sprintf(buf, "%d\n", t->priority);
+}
+
+static inline ssize_t adc_thread_priority_store(struct adc_thread *t, const char *buf, size_t count)
+{
+	int priority;
+	int old;
+	int retval;
+
+	retval = kstrtoint(buf, 0, &priority);
+	if (retval)
+		return retval;
+	if (priority < 1 || priority > MAX_RT_PRIO - 1)
+		return -EINVAL;
+	mutex_lock(&t->lock);
+	old = t->priority;
+	t->priority = priority;
+	retval = adc_thread_apply(t);
+	if (retval)
+		t->priority = old;
+	mutex_unlock(&t->lock);
+	return retval ? retval : count;
+}
+
+static inline ssize_t adc_thread_mask_show(struct adc_thread *t, char *buf)
+{
+	return sprintf(buf, "%*pbl\n", cpumask_pr_args(&t->mask));
+}
+
+static inline ssize_t adc_thread_mask_store(struct adc_thread *t, const char *buf, size_t count)
+{
+	struct cpumask mask;
+	struct cpumask old;
+	int retval;
+
+	retval = adc_thread_parse_mask(buf, &mask);
+	if (retval)
+		return retval;
+	mutex_lock(&t->lock);
+	old = t->mask;
+	t->mask = mask;
+	retval = adc_thread_apply(t);
+	if (retval)
+		t->mask = old;
+	mutex_unlock(&t->lock);
+	return retval ? retval : count;
+}
+
+#define ADC_THREAD_ATTRS(to_thread)							\
+static ssize_t sched_policy_show(struct device *dev, struct device_attribute *attr,	\
+				 char *buf)						\
+{											\
+	return adc_thread_policy_show(to_thread(dev), buf);				\
+}											\
+static ssize_t sched_policy_store(struct device *dev, struct device_attribute *attr,	\
+				  const char *buf, size_t count)			\
+{											\
+	return adc_thread_policy_store(to_thread(dev), buf, count);			\
+}											\
+static ssize_t sched_priority_show(struct device *dev, struct device_attribute *attr,	\
+				   char *buf)						\
+{											\
+	return adc_thread_priority_show(to_thread(dev), buf);				\
+}											\
+static ssize_t sched_priority_store(struct device *dev, struct device_attribute *attr,	\
+				    const char *buf, size_t count)			\
+{											\
+	return adc_thread_priority_store(to_thread(dev), buf, count);			\
+}											\
+static ssize_t cpu_mask_show(struct device *dev, struct device_attribute *attr,	\
+			     char *buf)							\
+{											\
+	return adc_thread_mask_show(to_thread(dev), buf);				\
+}											\
+static ssize_t cpu_mask_store(struct device *dev, struct device_attribute *attr,	\
+			      const char *buf, size_t count)				\
+{											\
+	return adc_thread_mask_store(to_thread(dev), buf, count);			\
+}											\
+static DEVICE_ATTR_RW(sched_policy);							\
+static DEVICE_ATTR_RW(sched_priority);							\
+static DEVICE_ATTR_RW(cpu_mask);							\
+static struct attribute *adc_thread_attrs[] = {						\
+	&dev_attr_sched_policy.attr,							\
+	&dev_attr_sched_priority.attr,							\
+	&dev_attr_cpu_mask.attr,							\
+	NULL										\
+};											\
+static const struct attribute_group adc_thread_group = {				\
+	.attrs = adc_thread_attrs,							\
+}
+
+#endif
@@ -1,5 +1,19 @@
 /*
  * MCP23008 I2C/GPIO gpio expander driver
+ *
+ * Setting an output is a single I2C write of OLAT prepared at probe, so a
+ * line driven from an ADC reflex (adc-reflex.h) costs one bus transaction.
+ *
+ * Counting mode : the lines of 'counter_mask' interrupt on change, the
+ * interrupt thread reads INTF, INTCAP and GPIO in one sequential read and
+ * counts the edges of 'counter_edge' (rising, falling or both) : the ones
+ * latched in INTCAP at the time stamped by the hard handler, the ones since
+ * at the time of the read. A line flagged in INTF but captured at its
+ * previous level went and came back, both edges are counted. 'counters'
+ * gives per line the count, the CLOCK_MONOTONIC ns of the last edge and the
+ * frequency over the last MCP_COUNT_HISTORY edges, decaying while no edge
+ * comes. The bus is only used at the edges, without interrupt line (client
+ * irq) INTF is polled every p_poll_us instead.
  */
 #ifndef CONFIG_I2C
 #error CONFIG_I2C not defined
@@ -14,11 +28,19 @@
 #include <linux/gpio.h>
 #include <linux/i2c.h>
 #include <linux/slab.h>
+#include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <asm/byteorder.h>
 
 static long int p_base = 0;
 module_param (p_base, long,S_IRUGO);
 
+static int p_poll_us = 1000;
+module_param (p_poll_us, int,S_IRUGO);
+MODULE_PARM_DESC(p_poll_us, "INTF polling period in us of the counters without interrupt line");
+
 /**
  * MCP types supported by driver
  */
@@ -45,13 +67,27 @@ module_param (p_base, long,S_IRUGO);
 #define MCP_GPIO	0x09
 #define MCP_OLAT	0x0a
 
+#define MCP_NB_LINE		8
+#define MCP_COUNT_HISTORY	16	/* edges of the frequency estimate */
+#define MCP_EDGE_RISING		1
+#define MCP_EDGE_FALLING	2
+
 struct mcp23s08;
 
+struct mcp23008_counter {
+	u64			count;
+	ktime_t			edges[MCP_COUNT_HISTORY];	/* last edges, ring */
+	unsigned int		head;
+	unsigned int		n;
+};
+
 struct mcp23s08_ops {
 	int	(*read)(struct mcp23s08 *mcp, unsigned reg);
 	int	(*write)(struct mcp23s08 *mcp, unsigned reg, unsigned val);
 	int	(*read_regs)(struct mcp23s08 *mcp, unsigned reg,
 			     u16 *vals, unsigned n);
+	int	(*write_olat)(struct mcp23s08 *mcp, unsigned val);
+	int	(*read_intf)(struct mcp23s08 *mcp, u8 *vals);
 };
 
 struct mcp23s08 {
@@ -65,6 +101,24 @@ struct mcp23s08 {
 
 	const struct mcp23s08_ops	*ops;
 	void			*data; /* ops specific data */
+
+	/* OLAT write, only the value changes */
+	struct i2c_msg		olat_msg;
+	u8			olat_buf[2];
+
+	/* counting mode, the counters are protected by lock */
+	u8			count_mask;
+	u8			count_edge;
+	u8			count_state;	/* levels of the counted lines */
+	struct mcp23008_counter	counters[MCP_NB_LINE];
+	int			irq;
+	ktime_t			irq_time;	/* stamped by the hard handler */
+	struct task_struct	*poll_task;
+
+	/* INTF, INTCAP and GPIO sequential read */
+	struct i2c_msg		intf_msg[2];
+	u8			intf_reg;
+	u8			intf_buf[3];
 };
 
 
@@ -90,12 +144,197 @@ static int mcp23008_read_regs(struct mcp23s08 *mcp, unsigned reg, u16 *vals, uns
 	return 0;
 }
 
+static int mcp23008_write_olat(struct mcp23s08 *mcp, unsigned val)
+{
+	struct i2c_client *client = mcp->data;
+	int status;
+
+	mcp->olat_buf[1] = val;
+	status = i2c_transfer(client->adapter, &mcp->olat_msg, 1);
+	if (status < 0)
+		return status;
+	return (status == 1) ? 0 : -EIO;
+}
+
+static int mcp23008_read_intf(struct mcp23s08 *mcp, u8 *vals)
+{
+	struct i2c_client *client = mcp->data;
+	int status;
+
+	status = i2c_transfer(client->adapter, mcp->intf_msg, 2);
+	if (status < 0)
+		return status;
+	if (status != 2)
+		return -EIO;
+	memcpy(vals, mcp->intf_buf, sizeof(mcp->intf_buf));
+	return 0;
+}
+
 static const struct mcp23s08_ops mcp23008_ops = {
 	.read		= mcp23008_read,
 	.write		= mcp23008_write,
 	.read_regs	= mcp23008_read_regs,
+	.write_olat	= mcp23008_write_olat,
+	.read_intf	= mcp23008_read_intf,
 };
 
+/*----------------------------------------------------------------------*/
+
+/* the counted lines from count_state to 'levels' at 'time', with lock held */
+static void mcp23008_count_edges(struct mcp23s08 *mcp, u8 levels, ktime_t time)
+{
+	u8 changed = (levels ^ mcp->count_state) & mcp->count_mask;
+	u8 edges = 0;
+	int pin;
+
+	if (mcp->count_edge & MCP_EDGE_RISING)
+		edges |= changed & levels;
+	if (mcp->count_edge & MCP_EDGE_FALLING)
+		edges |= changed & ~levels;
+
+	for (pin = 0; pin < MCP_NB_LINE; pin++) {
+		struct mcp23008_counter *c = &mcp->counters[pin];
+
+		if (!(edges & (1 << pin)))
+			continue;
+		c->count++;
+		c->edges[c->head] = time;
+		c->head = (c->head + 1) % MCP_COUNT_HISTORY;
+		if (c->n < MCP_COUNT_HISTORY)
+			c->n++;
+	}
+	mcp->count_state ^= changed;
+}
+
+/* one read of INTF, INTCAP and GPIO, 'time' is when the interrupt came */
+static int mcp23008_count_read(struct mcp23s08 *mcp, ktime_t time)
+{
+	u8 vals[3];
+	u8 intf, intcap, gpio, lost;
+	int status;
+
+	mutex_lock(&mcp->lock);
+	status = mcp->ops->read_intf(mcp, vals);
+	if (status < 0)
+		goto out;
+	intf = vals[0];
+	intcap = vals[1];
+	gpio = vals[2];
+	mcp->cache[MCP_GPIO] = gpio;
+
+	if (intf) {
+		/* changed and back before the capture */
+		lost = intf & mcp->count_mask & ~(intcap ^ mcp->count_state);
+		if (lost)
+			mcp23008_count_edges(mcp, mcp->count_state ^ lost, time);
+		mcp23008_count_edges(mcp, intcap, time);
+	}
+	mcp23008_count_edges(mcp, gpio, ktime_get());
+	status = intf;
+out:
+	mutex_unlock(&mcp->lock);
+	return status;
+}
+
+static irqreturn_t mcp23008_irq_stamp(int irq, void *data)
+{
+	struct mcp23s08 *mcp = data;
+
+	mcp->irq_time = ktime_get();
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t mcp23008_irq(int irq, void *data)
+{
+	struct mcp23s08 *mcp = data;
+
+	return (mcp23008_count_read(mcp, mcp->irq_time) > 0) ? IRQ_HANDLED : IRQ_NONE;
+}
+
+/* without interrupt line, the edges are latched between two polls */
+static int mcp23008_poll_thread(void *data)
+{
+	struct mcp23s08 *mcp = data;
+
+	while (!kthread_should_stop()) {
+		mcp23008_count_read(mcp, ktime_get());
+		usleep_range(p_poll_us, p_poll_us + p_poll_us / 8);
+	}
+	return 0;
+}
+
+/* edges per second in mHz over the last edges, the silence since the last one counts past the mean interval */
+static u64 mcp23008_counter_mhz(const struct mcp23008_counter *c, ktime_t now)
+{
+	ktime_t first, last;
+	u64 edges = c->n - 1;
+	s64 span;
+
+	if (c->n < 2)
+		return 0;
+	first = c->edges[(c->head + MCP_COUNT_HISTORY - c->n) % MCP_COUNT_HISTORY];
+	last = c->edges[(c->head + MCP_COUNT_HISTORY - 1) % MCP_COUNT_HISTORY];
+	span = ktime_to_ns(ktime_sub(last, first));
+	if (ktime_to_ns(ktime_sub(now, last)) * (s64)edges > span) {
+		edges = c->n;
+		span = ktime_to_ns(ktime_sub(now, first));
+	}
+	if (span <= 0)
+		return 0;
+	return div64_u64(edges * NSEC_PER_SEC * 1000, span);
+}
+
+/* counted lines interrupt on any change, the edges are sorted out when read */
+static int mcp23008_count_setup(struct mcp23s08 *mcp, u8 mask)
+{
+	u8 added = mask & ~mcp->count_mask;
+	int status;
+	int pin;
+
+	mutex_lock(&mcp->lock);
+	mcp->cache[MCP_IODIR] |= mask;
+	status = mcp->ops->write(mcp, MCP_IODIR, mcp->cache[MCP_IODIR]);
+	if (status < 0)
+		goto out;
+	mcp->cache[MCP_INTCON] &= ~mask;
+	status = mcp->ops->write(mcp, MCP_INTCON, mcp->cache[MCP_INTCON]);
+	if (status < 0)
+		goto out;
+	mcp->cache[MCP_GPINTEN] = mask;
+	status = mcp->ops->write(mcp, MCP_GPINTEN, mask);
+	if (status < 0)
+		goto out;
+
+	/* the current levels as reference, reading GPIO clears INTF */
+	status = mcp->ops->read(mcp, MCP_GPIO);
+	if (status < 0)
+		goto out;
+	mcp->cache[MCP_GPIO] = status;
+	mcp->count_state = status & mask;
+	for (pin = 0; pin < MCP_NB_LINE; pin++)
+		if (added & (1 << pin))
+			memset(&mcp->counters[pin], 0, sizeof(mcp->counters[pin]));
+	mcp->count_mask = mask;
+	status = 0;
+out:
+	mutex_unlock(&mcp->lock);
+	if (status < 0)
+		return status;
+
+	if (mcp->irq <= 0 && mask && !mcp->poll_task) {
+		mcp->poll_task = kthread_run(mcp23008_poll_thread, mcp, "mcp23008-%s",
+					     dev_name(mcp->chip.dev));
+		if (IS_ERR(mcp->poll_task)) {
+			status = PTR_ERR(mcp->poll_task);
+			mcp->poll_task = NULL;
+		}
+	} else if (!mask && mcp->poll_task) {
+		kthread_stop(mcp->poll_task);
+		mcp->poll_task = NULL;
+	}
+	return status;
+}
+
 static int mcp23s08_direction_input(struct gpio_chip *chip, unsigned offset)
 {
 	struct mcp23s08	*mcp = container_of(chip, struct mcp23s08, chip);
@@ -115,7 +354,7 @@ static int mcp23s08_get(struct gpio_chip *chip, unsigned offset)
 
 	mutex_lock(&mcp->lock);
 
-	/* REVISIT reading this clears any IRQ ... */
+	/* reading this clears any IRQ, the counted lines take the levels */
 	status = mcp->ops->read(mcp, MCP_GPIO);
 	if (status < 0)
 	{
@@ -124,6 +363,8 @@ static int mcp23s08_get(struct gpio_chip *chip, unsigned offset)
 	else 
 	{
 		mcp->cache[MCP_GPIO] = status;
+		if (mcp->count_mask)
+			mcp23008_count_edges(mcp, status, ktime_get());
 		status = !!(status & (1 << offset));
 	}
 	mutex_unlock(&mcp->lock);
@@ -139,7 +380,7 @@ static int __mcp23s08_set(struct mcp23s08 *mcp, unsigned mask, int value)
 	else
 		olat &= ~mask;
 	mcp->cache[MCP_OLAT] = olat;
-	return mcp->ops->write(mcp, MCP_OLAT, olat);
+	return mcp->ops->write_olat(mcp, olat);
 }
 
 static void mcp23s08_set(struct gpio_chip *chip, unsigned offset, int value)
@@ -193,6 +434,20 @@ static int mcp23s08_probe_one(struct mcp23s08 *mcp, struct device *dev,
 		mcp->ops = &mcp23008_ops;
 		mcp->chip.ngpio = 8;
 		mcp->chip.label = "mcp23008";
+		mcp->olat_buf[0] = MCP_OLAT;
+		mcp->olat_msg.addr = addr;
+		mcp->olat_msg.flags = 0;
+		mcp->olat_msg.len = sizeof(mcp->olat_buf);
+		mcp->olat_msg.buf = mcp->olat_buf;
+		mcp->intf_reg = MCP_INTF;
+		mcp->intf_msg[0].addr = addr;
+		mcp->intf_msg[0].flags = 0;
+		mcp->intf_msg[0].len = 1;
+		mcp->intf_msg[0].buf = &mcp->intf_reg;
+		mcp->intf_msg[1].addr = addr;
+		mcp->intf_msg[1].flags = I2C_M_RD;
+		mcp->intf_msg[1].len = sizeof(mcp->intf_buf);
+		mcp->intf_msg[1].buf = mcp->intf_buf;
 		break;
 
 	default:
@@ -255,12 +510,124 @@ fail:
 
 /*----------------------------------------------------------------------*/
 
+static ssize_t counter_mask_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct mcp23s08 *mcp = i2c_get_clientdata(to_i2c_client(dev));
+
+	return sprintf(buf, "0x%02x\n", mcp->count_mask);
+}
+
+static ssize_t counter_mask_store(struct device *dev, struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct mcp23s08 *mcp = i2c_get_clientdata(to_i2c_client(dev));
+	unsigned int mask;
+	int status;
+
+	status = kstrtouint(buf, 0, &mask);
+	if (status)
+		return status;
+	if (mask >= (1 << MCP_NB_LINE))
+		return -EINVAL;
+	status = mcp23008_count_setup(mcp, mask);
+	return status < 0 ? status : count;
+}
+
+static const char * const mcp23008_edges[] = {
+	[MCP_EDGE_RISING]			= "rising",
+	[MCP_EDGE_FALLING]			= "falling",
+	[MCP_EDGE_RISING | MCP_EDGE_FALLING]	= "both",
+};
+
+static ssize_t counter_edge_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct mcp23s08 *mcp = i2c_get_clientdata(to_i2c_client(dev));
+
+	return sprintf(buf, "%s\n", mcp23008_edges[mcp->count_edge]);
+}
+
+static ssize_t counter_edge_store(struct device *dev, struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct mcp23s08 *mcp = i2c_get_clientdata(to_i2c_client(dev));
+	int edge;
+
+	for (edge = MCP_EDGE_RISING; edge < ARRAY_SIZE(mcp23008_edges); edge++)
+		if (sysfs_streq(buf, mcp23008_edges[edge]))
+			break;
+	if (edge == ARRAY_SIZE(mcp23008_edges))
+		return -EINVAL;
+	mutex_lock(&mcp->lock);
+	mcp->count_edge = edge;
+	mutex_unlock(&mcp->lock);
+	return count;
+}
+
+/* one line per counted line : line count last_edge_ns frequency_hz */
+static ssize_t counters_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct mcp23s08 *mcp = i2c_get_clientdata(to_i2c_client(dev));
+	ktime_t now = ktime_get();
+	ssize_t len = 0;
+	int pin;
+
+	mutex_lock(&mcp->lock);
+	for (pin = 0; pin < MCP_NB_LINE; pin++) {
+		const struct mcp23008_counter *c = &mcp->counters[pin];
+		u64 mhz = mcp23008_counter_mhz(c, now);
+		u32 frac;
+
+		if (!(mcp->count_mask & (1 << pin)))
+			continue;
+		len += sprintf(buf + len, "%d %llu %lld %llu.%03u\n", pin,
+			       (unsigned long long)c->count,
+			       c->n ? (long long)ktime_to_ns(c->edges[(c->head + MCP_COUNT_HISTORY - 1) % MCP_COUNT_HISTORY]) : 0LL,
+			       (unsigned long long)div_u64_rem(mhz, 1000, &frac), frac);
+	}
+	mutex_unlock(&mcp->lock);
+	return len;
+}
+
+static ssize_t counter_reset_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct mcp23s08 *mcp = i2c_get_clientdata(to_i2c_client(dev));
+
+	mutex_lock(&mcp->lock);
+	memset(mcp->counters, 0, sizeof(mcp->counters));
+	mutex_unlock(&mcp->lock);
+	return count;
+}
+
+static DEVICE_ATTR_RW(counter_mask);
+static DEVICE_ATTR_RW(counter_edge);
+static DEVICE_ATTR_RO(counters);
+static DEVICE_ATTR_WO(counter_reset);
+
+static struct attribute *mcp23008_counter_attrs[] = {
+	&dev_attr_counter_mask.attr,
+	&dev_attr_counter_edge.attr,
+	&dev_attr_counters.attr,
+	&dev_attr_counter_reset.attr,
+	NULL
+};
+
+static const struct attribute_group mcp23008_counter_group = {
+	.attrs = mcp23008_counter_attrs,
+};
+
+/*----------------------------------------------------------------------*/
+
 
 static int mcp230xx_probe(struct i2c_client *client, const struct i2c_device_id *id)
 {
 	struct mcp23s08 *mcp;
 	int status;
 
+	/* the OLAT write is a plain I2C message */
+	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C))
+		return -EIO;
+
 	mcp = kzalloc(sizeof *mcp, GFP_KERNEL);
 	if (!mcp)
 		return -ENOMEM;
@@ -272,6 +639,24 @@ static int mcp230xx_probe(struct i2c_client *client, const struct i2c_device_id
 	if (status)
 		goto fail;
 
+	/* counting mode, off until counter_mask is set */
+	mcp->count_edge = MCP_EDGE_RISING;
+	mcp->irq = client->irq;
+	if (mcp->irq > 0) {
+		status = request_threaded_irq(mcp->irq, mcp23008_irq_stamp, mcp23008_irq,
+					      IRQF_ONESHOT | IRQF_TRIGGER_LOW, dev_name(&client->dev), mcp);
+		if (status) {
+			dev_warn(&client->dev, "irq %d unavailable (%d), INTF polled\n", mcp->irq, status);
+			mcp->irq = 0;
+		}
+	}
+	status = sysfs_create_group(&client->dev.kobj, &mcp23008_counter_group);
+	if (status) {
+		if (mcp->irq > 0)
+			free_irq(mcp->irq, mcp);
+		gpiochip_remove(&mcp->chip);
+		goto fail;
+	}
 
 	return 0;
 
@@ -284,8 +669,13 @@ fail:
 static int mcp230xx_remove(struct i2c_client *client)
 {
 	struct mcp23s08 *mcp = i2c_get_clientdata(client);
-	int status;
+	int status = 0;
 
+	sysfs_remove_group(&client->dev.kobj, &mcp23008_counter_group);
+	if (mcp->poll_task)
+		kthread_stop(mcp->poll_task);
+	if (mcp->irq > 0)
+		free_irq(mcp->irq, mcp);
 	gpiochip_remove(&mcp->chip);
 	kfree(mcp);
 
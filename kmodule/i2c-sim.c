@@ -0,0 +1,483 @@
+/*
+ * Simulated I2C adapter with PCF8591 and MCP23008 devices
+ *
+ * Registers an I2C adapter backed by no hardware with a "pcf8591" and a
+ * "mcp23008" client, so snd-pcf8591 (or snd-adc-sync) and gpio-mcp23008 bind
+ * as on the real bus. The adapter only does plain I2C messages, the SMBus
+ * calls of the drivers go through the emulation of the I2C core.
+ *
+ * PCF8591 : the first byte written is the control byte (AINC, AIP, channel),
+ * the next ones the DAC value. Each byte read starts a conversion and returns
+ * the previous one, as the chip does, the codes come from the deterministic
+ * waveforms of sim-dev.h indexed by the conversions of each channel. The
+ * differential modes return the two's complement difference of the inputs.
+ *
+ * MCP23008 : the first byte written is the register address, the address
+ * increments after each byte unless IOCON.SEQOP is set. Input pin n toggles
+ * every gpio_period << n us. INTF and INTCAP follow GPINTEN/INTCON/DEFVAL
+ * at each access (no interrupt line), reading GPIO or INTCAP clears INTF.
+ *
+ * The wire time at bus_khz is waited for. The bus traffic is counted in the
+ * attributes of the platform device (/sys/devices/platform/i2c-sim) :
+ * transactions (START to STOP), messages, bytes, nacks, writing reset clears
+ * them.
+ */
+
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/platform_device.h>
+#include <linux/i2c.h>
+
+#include "sim-dev.h"
+
+#define PCF8591_BITS		8
+#define PCF8591_NB_IN		4
+#define PCF8591_CONTROL_AINC	0x04
+
+#define MCP_IODIR	0x00
+#define MCP_IPOL	0x01
+#define MCP_GPINTEN	0x02
+#define MCP_DEFVAL	0x03
+#define MCP_INTCON	0x04
+#define MCP_IOCON	0x05
+#	define IOCON_SEQOP	(1 << 5)
+#define MCP_GPPU	0x06
+#define MCP_INTF	0x07
+#define MCP_INTCAP	0x08
+#define MCP_GPIO	0x09
+#define MCP_OLAT	0x0a
+#define MCP_NB_REG	11
+
+static int nr = -1;
+module_param(nr, int, 0444);
+MODULE_PARM_DESC(nr, "I2C adapter number, -1 for a dynamic one.");
+
+static int pcf8591 = 0x48;
+module_param(pcf8591, int, 0444);
+MODULE_PARM_DESC(pcf8591, "PCF8591 address, 0 for none.");
+
+static int mcp23008 = 0x20;
+module_param(mcp23008, int, 0444);
+MODULE_PARM_DESC(mcp23008, "MCP23008 address, 0 for none.");
+
+static int bus_khz = 100;
+module_param(bus_khz, int, 0444);
+MODULE_PARM_DESC(bus_khz, "Bus clock in kHz.");
+
+static char *wave = "sine";
+module_param(wave, charp, 0444);
+MODULE_PARM_DESC(wave, "PCF8591 waveform : sine, ramp, square or noise.");
+
+static int wave_period = 64;
+module_param(wave_period, int, 0444);
+MODULE_PARM_DESC(wave_period, "Waveform period in conversions, doubled at each channel.");
+
+static int amplitude = 90;
+module_param(amplitude, int, 0444);
+MODULE_PARM_DESC(amplitude, "Waveform amplitude in percent of the full scale.");
+
+static int gpio_period = 1000;
+module_param(gpio_period, int, 0444);
+MODULE_PARM_DESC(gpio_period, "MCP23008 input 0 half period in us, doubled at each pin.");
+
+static int timing = 1;
+module_param(timing, int, 0444);
+MODULE_PARM_DESC(timing, "Wait for the wire time (0 runs the bus at CPU speed).");
+
+static int sleep_min = 50;
+module_param(sleep_min, int, 0444);
+MODULE_PARM_DESC(sleep_min, "Shortest wait in us that sleeps instead of spinning.");
+
+struct i2c_sim_pcf8591 {
+	u8			control;
+	u8			aout;
+	u8			last;		/* previous conversion, sent at the next read */
+	unsigned int		chan;
+	u64			index[PCF8591_NB_IN];
+};
+
+struct i2c_sim_mcp23008 {
+	u8			reg[MCP_NB_REG];
+	u8			ptr;
+	u8			prev;		/* pins at the previous access */
+	ktime_t			start;
+};
+
+struct i2c_sim_stats {
+	atomic64_t		transactions;
+	atomic64_t		messages;
+	atomic64_t		bytes;
+	atomic64_t		nacks;
+};
+
+struct i2c_sim {
+	struct platform_device	*pdev;
+	struct i2c_adapter	adap;
+	struct i2c_client	*pcf8591_client;
+	struct i2c_client	*mcp23008_client;
+	struct sim_wave		wave;
+	struct i2c_sim_pcf8591	pcf;
+	struct i2c_sim_mcp23008	mcp;
+};
+
+static struct i2c_sim i2c_sim;
+static struct i2c_sim_stats i2c_sim_stats;
+
+// =======================
+// PCF8591
+// =======================
+static u8 i2c_sim_pcf8591_input(struct i2c_sim *s, unsigned int in)
+{
+	return sim_wave_code(&s->wave, in, s->pcf.index[in]++, PCF8591_BITS);
+}
+
+static u8 i2c_sim_pcf8591_diff(struct i2c_sim *s, unsigned int p, unsigned int n)
+{
+	s32 d = (s32)i2c_sim_pcf8591_input(s, p) - (s32)i2c_sim_pcf8591_input(s, n);
+	return (u8)clamp_t(s32, d, -128, 127);
+}
+
+/* channels of each input programming */
+static const unsigned int i2c_sim_pcf8591_nb_chan[4] = { 4, 3, 3, 2 };
+
+static u8 i2c_sim_pcf8591_convert(struct i2c_sim *s, unsigned int chan)
+{
+	switch ((s->pcf.control >> 4) & 3) {
+	case 0:
+		return i2c_sim_pcf8591_input(s, chan);
+	case 1:
+		return i2c_sim_pcf8591_diff(s, chan, 3);
+	case 2:
+		if (chan < 2)
+			return i2c_sim_pcf8591_input(s, chan);
+		return i2c_sim_pcf8591_diff(s, 2, 3);
+	default:
+		return i2c_sim_pcf8591_diff(s, 2 * chan, 2 * chan + 1);
+	}
+}
+
+static void i2c_sim_pcf8591_write(struct i2c_sim *s, const u8 *buf, unsigned int len)
+{
+	if (len == 0)
+		return;
+	s->pcf.control = buf[0];
+	s->pcf.chan = buf[0] & 3;
+	if (len > 1)
+		s->pcf.aout = buf[len - 1];
+}
+
+static void i2c_sim_pcf8591_read(struct i2c_sim *s, u8 *buf, unsigned int len)
+{
+	unsigned int nb_chan = i2c_sim_pcf8591_nb_chan[(s->pcf.control >> 4) & 3];
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = s->pcf.last;
+		s->pcf.last = i2c_sim_pcf8591_convert(s, s->pcf.chan % nb_chan);
+		if (s->pcf.control & PCF8591_CONTROL_AINC)
+			s->pcf.chan = (s->pcf.chan + 1) % nb_chan;
+	}
+}
+
+// =======================
+// MCP23008
+// =======================
+static u8 i2c_sim_mcp23008_levels(struct i2c_sim *s)
+{
+	u64 us = ktime_us_delta(ktime_get(), s->mcp.start);
+	u8 levels = 0;
+	int pin;
+
+	for (pin = 0; pin < 8; pin++)
+		if (div64_u64(us, (u64)gpio_period << pin) & 1)
+			levels |= 1 << pin;
+	return levels;
+}
+
+/* GPIO register value, interrupt flags updated */
+static u8 i2c_sim_mcp23008_gpio(struct i2c_sim *s)
+{
+	u8 *reg = s->mcp.reg;
+	u8 in = reg[MCP_IODIR];
+	u8 pins = (i2c_sim_mcp23008_levels(s) & in) | (reg[MCP_OLAT] & ~in);
+	u8 gpio = pins ^ (reg[MCP_IPOL] & in);
+	u8 en = reg[MCP_GPINTEN] & in;
+	u8 ref = (reg[MCP_INTCON] & reg[MCP_DEFVAL]) | (~reg[MCP_INTCON] & s->mcp.prev);
+	u8 changed = (pins ^ ref) & en;
+
+	if (changed && !reg[MCP_INTF]) {
+		reg[MCP_INTF] = changed;
+		reg[MCP_INTCAP] = gpio;
+	}
+	s->mcp.prev = pins;
+	return gpio;
+}
+
+static u8 i2c_sim_mcp23008_reg(struct i2c_sim *s, u8 addr)
+{
+	u8 *reg = s->mcp.reg;
+	u8 val;
+
+	switch (addr) {
+	case MCP_GPIO:
+		val = i2c_sim_mcp23008_gpio(s);
+		reg[MCP_INTF] = 0;
+		return val;
+	case MCP_INTCAP:
+		i2c_sim_mcp23008_gpio(s);
+		val = reg[MCP_INTCAP];
+		reg[MCP_INTF] = 0;
+		return val;
+	case MCP_INTF:
+		i2c_sim_mcp23008_gpio(s);
+		return reg[MCP_INTF];
+	default:
+		return reg[addr];
+	}
+}
+
+static void i2c_sim_mcp23008_next(struct i2c_sim *s)
+{
+	if (!(s->mcp.reg[MCP_IOCON] & IOCON_SEQOP))
+		s->mcp.ptr = (s->mcp.ptr + 1) % MCP_NB_REG;
+}
+
+static void i2c_sim_mcp23008_write(struct i2c_sim *s, const u8 *buf, unsigned int len)
+{
+	unsigned int i;
+
+	if (len == 0)
+		return;
+	s->mcp.ptr = buf[0] % MCP_NB_REG;
+	for (i = 1; i < len; i++) {
+		switch (s->mcp.ptr) {
+		case MCP_INTF:
+		case MCP_INTCAP:
+			break;
+		case MCP_GPIO:
+			s->mcp.reg[MCP_OLAT] = buf[i];
+			break;
+		default:
+			s->mcp.reg[s->mcp.ptr] = buf[i];
+			break;
+		}
+		i2c_sim_mcp23008_next(s);
+	}
+}
+
+static void i2c_sim_mcp23008_read(struct i2c_sim *s, u8 *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = i2c_sim_mcp23008_reg(s, s->mcp.ptr);
+		i2c_sim_mcp23008_next(s);
+	}
+}
+
+static void i2c_sim_mcp23008_reset(struct i2c_sim *s)
+{
+	memset(s->mcp.reg, 0, sizeof(s->mcp.reg));
+	s->mcp.reg[MCP_IODIR] = 0xFF;
+	s->mcp.ptr = 0;
+	s->mcp.start = ktime_get();
+	s->mcp.prev = i2c_sim_mcp23008_levels(s);
+}
+
+// =======================
+// adapter
+// =======================
+static int i2c_sim_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	struct i2c_sim *s = i2c_get_adapdata(adap);
+	ktime_t t = ktime_get();
+	int retval = num;
+	int i;
+
+	atomic64_inc(&i2c_sim_stats.transactions);
+	for (i = 0; i < num; i++) {
+		struct i2c_msg *m = &msgs[i];
+		int read = m->flags & I2C_M_RD;
+
+		atomic64_inc(&i2c_sim_stats.messages);
+
+		/* (repeated) start, address and data bytes with their ack */
+		t = ktime_add_ns(t, sim_wire_ns(1 + 9 * (1 + m->len), bus_khz * 1000));
+
+		if (pcf8591 && m->addr == pcf8591) {
+			if (read)
+				i2c_sim_pcf8591_read(s, m->buf, m->len);
+			else
+				i2c_sim_pcf8591_write(s, m->buf, m->len);
+		} else if (mcp23008 && m->addr == mcp23008) {
+			if (read)
+				i2c_sim_mcp23008_read(s, m->buf, m->len);
+			else
+				i2c_sim_mcp23008_write(s, m->buf, m->len);
+		} else {
+			atomic64_inc(&i2c_sim_stats.nacks);
+			retval = -ENXIO;
+			break;
+		}
+		atomic64_add(m->len, &i2c_sim_stats.bytes);
+	}
+
+	/* stop */
+	t = ktime_add_ns(t, sim_wire_ns(1, bus_khz * 1000));
+	if (timing)
+		sim_wait_until(t, sleep_min);
+	return retval;
+}
+
+static u32 i2c_sim_func(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm i2c_sim_algo = {
+	.master_xfer	= i2c_sim_xfer,
+	.functionality	= i2c_sim_func,
+};
+
+// =======================
+// counters
+// =======================
+SIM_COUNTER_ATTR(i2c_sim_stats, transactions);
+SIM_COUNTER_ATTR(i2c_sim_stats, messages);
+SIM_COUNTER_ATTR(i2c_sim_stats, bytes);
+SIM_COUNTER_ATTR(i2c_sim_stats, nacks);
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	atomic64_set(&i2c_sim_stats.transactions, 0);
+	atomic64_set(&i2c_sim_stats.messages, 0);
+	atomic64_set(&i2c_sim_stats.bytes, 0);
+	atomic64_set(&i2c_sim_stats.nacks, 0);
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *i2c_sim_attrs[] = {
+	&dev_attr_transactions.attr,
+	&dev_attr_messages.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_nacks.attr,
+	&dev_attr_reset.attr,
+	NULL
+};
+
+static const struct attribute_group i2c_sim_group = {
+	.attrs = i2c_sim_attrs,
+};
+
+// =======================
+// module
+// =======================
+static int __init i2c_sim_init(void)
+{
+	struct i2c_sim *s = &i2c_sim;
+	int retval;
+
+	printk("i2c_sim_init\n");
+	if (bus_khz <= 0 || gpio_period <= 0)
+		return -EINVAL;
+	retval = sim_wave_parse(&s->wave, wave, wave_period, amplitude);
+	if (retval)
+	{
+		printk("sim_wave_parse failed:%d\n", retval);
+		goto out;
+	}
+	s->pcf.last = 0x80;
+	i2c_sim_mcp23008_reset(s);
+
+	s->pdev = platform_device_register_simple("i2c-sim", -1, NULL, 0);
+	if (IS_ERR(s->pdev))
+	{
+		retval = PTR_ERR(s->pdev);
+		printk("platform_device_register_simple failed:%d\n", retval);
+		goto out;
+	}
+
+	s->adap.owner = THIS_MODULE;
+	s->adap.algo = &i2c_sim_algo;
+	s->adap.dev.parent = &s->pdev->dev;
+	s->adap.nr = nr;
+	strlcpy(s->adap.name, "i2c-sim", sizeof(s->adap.name));
+	i2c_set_adapdata(&s->adap, s);
+	retval = i2c_add_numbered_adapter(&s->adap);
+	if (retval)
+	{
+		printk("i2c_add_numbered_adapter failed:%d\n", retval);
+		goto out_pdev;
+	}
+
+	retval = sysfs_create_group(&s->pdev->dev.kobj, &i2c_sim_group);
+	if (retval)
+	{
+		printk("sysfs_create_group failed:%d\n", retval);
+		goto out_adap;
+	}
+
+	if (pcf8591) {
+		struct i2c_board_info info = { I2C_BOARD_INFO("pcf8591", pcf8591) };
+
+		s->pcf8591_client = i2c_new_device(&s->adap, &info);
+		if (!s->pcf8591_client)
+		{
+			retval = -ENODEV;
+			printk("i2c_new_device pcf8591 failed:%d\n", retval);
+			goto out_group;
+		}
+	}
+	if (mcp23008) {
+		struct i2c_board_info info = { I2C_BOARD_INFO("mcp23008", mcp23008) };
+
+		s->mcp23008_client = i2c_new_device(&s->adap, &info);
+		if (!s->mcp23008_client)
+		{
+			retval = -ENODEV;
+			printk("i2c_new_device mcp23008 failed:%d\n", retval);
+			goto out_clients;
+		}
+	}
+	printk("i2c_sim %s pcf8591:0x%02x mcp23008:0x%02x %d kHz\n", dev_name(&s->adap.dev),
+	       pcf8591, mcp23008, bus_khz);
+	goto out;
+
+out_clients:
+	if (s->pcf8591_client)
+		i2c_unregister_device(s->pcf8591_client);
+out_group:
+	sysfs_remove_group(&s->pdev->dev.kobj, &i2c_sim_group);
+out_adap:
+	i2c_del_adapter(&s->adap);
+out_pdev:
+	platform_device_unregister(s->pdev);
+out:
+	return retval;
+}
+module_init(i2c_sim_init);
+
+static void __exit i2c_sim_exit(void)
+{
+	struct i2c_sim *s = &i2c_sim;
+
+	printk("i2c_sim_exit\n");
+	if (s->mcp23008_client)
+		i2c_unregister_device(s->mcp23008_client);
+	if (s->pcf8591_client)
+		i2c_unregister_device(s->pcf8591_client);
+	sysfs_remove_group(&s->pdev->dev.kobj, &i2c_sim_group);
+	i2c_del_adapter(&s->adap);
+	platform_device_unregister(s->pdev);
+}
+module_exit(i2c_sim_exit);
+
+MODULE_AUTHOR("MPR");
+MODULE_DESCRIPTION("Simulated I2C adapter with PCF8591 and MCP23008 devices");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+# Benchmark of the ADC drivers against the simulated buses (spi-sim, i2c-sim),
+# runs without hardware : make here and in ../alsa, then
+#   ./sim-bench.sh [all|mcp3002|pcf8591|adc-sync|mcp23008] [seconds] [rate]
+# one JSON line per run on stdout, the details on stderr.
+
+KO=$(dirname $0)
+BENCH=$KO/../alsa/adc_bench
+TARGET=${1:-all}
+SECONDS_RUN=${2:-10}
+RATE=${3:-8000}
+BUS=9
+SPI=spi$BUS.0
+I2C=i2c-$BUS
+
+load() {
+	sudo insmod $KO/$1.ko "${@:2}" || exit 1
+}
+
+unload() {
+	sudo rmmod "$@" 2>/dev/null
+}
+
+wait_card() {
+	for i in $(seq 50); do
+		grep -q "$1" /proc/asound/cards && return 0
+		sleep 0.1
+	done
+	echo "card $1 not found" >&2
+	return 1
+}
+
+bench_mcp3002() {
+	load spi-sim bus_num=$BUS chips=1
+	load spi-mcp3002 rate=$RATE
+	wait_card mcp3002_${BUS}_0 && \
+		$BENCH -D hw:mcp3002_${BUS}_0 -r $RATE -c 2 -t $SECONDS_RUN -k mcp3002- -k spi$BUS -b /sys/devices/platform/spi-sim
+	unload spi_mcp3002 spi_sim
+}
+
+bench_pcf8591() {
+	load i2c-sim nr=$BUS mcp23008=0
+	load snd-pcf8591
+	wait_card snd_pcf8591 && \
+		$BENCH -D hw:snd_pcf8591 -r 8000 -c 2 -p 64 -t $SECONDS_RUN -k pcf8591- -b /sys/devices/platform/i2c-sim
+	unload snd_pcf8591 i2c_sim
+}
+
+bench_adc_sync() {
+	load spi-sim bus_num=$BUS chips=1
+	load i2c-sim nr=$BUS pcf8591=0 mcp23008=0
+	load snd-adc-sync rate=$RATE
+	echo snd_adc_sync | sudo tee /sys/bus/spi/devices/$SPI/driver_override > /dev/null
+	echo $SPI | sudo tee /sys/bus/spi/drivers/snd_adc_sync/bind > /dev/null
+	echo "adc-sync-pcf8591 0x48" | sudo tee /sys/bus/i2c/devices/$I2C/new_device > /dev/null
+	wait_card snd_adc_sync && \
+		$BENCH -D hw:snd_adc_sync -r $RATE -c 6 -t $SECONDS_RUN -k spi$BUS -b /sys/devices/platform/spi-sim
+	echo 0x48 | sudo tee /sys/bus/i2c/devices/$I2C/delete_device > /dev/null
+	unload snd_adc_sync i2c_sim spi_sim
+}
+
+# GPIO writes through sysfs, ops/s and transactions per op
+bench_mcp23008() {
+	local n=1000
+	load i2c-sim nr=$BUS pcf8591=0
+	load gpio-mcp23008 p_base=-1
+	for chip in /sys/class/gpio/gpiochip*; do
+		[ "$(cat $chip/label)" = mcp23008 ] && base=$(cat $chip/base)
+	done
+	if [ -n "$base" ]; then
+		pin=$((base + 7))
+		echo $pin | sudo tee /sys/class/gpio/export > /dev/null
+		echo out | sudo tee /sys/class/gpio/gpio$pin/direction > /dev/null
+		echo 1 | sudo tee /sys/devices/platform/i2c-sim/reset > /dev/null
+		start=$(date +%s%N)
+		sudo sh -c "for i in \$(seq $n); do echo \$((i & 1)) > /sys/class/gpio/gpio$pin/value; done"
+		end=$(date +%s%N)
+		t=$(cat /sys/devices/platform/i2c-sim/transactions)
+		echo $pin | sudo tee /sys/class/gpio/unexport > /dev/null
+		echo "{\"device\":\"mcp23008\",\"ops\":$n,\"ops_per_s\":$((n * 1000000000 / (end - start))),\"bus_transactions_per_op\":$(echo "scale=3; $t / $n" | bc)}"
+	else
+		echo "mcp23008 gpiochip not found" >&2
+	fi
+	unload gpio_mcp23008 i2c_sim
+}
+
+sudo modprobe snd-pcm
+case $TARGET in
+all)
+	bench_mcp3002
+	bench_pcf8591
+	bench_adc_sync
+	bench_mcp23008
+	;;
+mcp3002)  bench_mcp3002 ;;
+pcf8591)  bench_pcf8591 ;;
+adc-sync) bench_adc_sync ;;
+mcp23008) bench_mcp23008 ;;
+*)
+	echo "Usage $0 [all|mcp3002|pcf8591|adc-sync|mcp23008] [seconds] [rate]"
+	;;
+esac
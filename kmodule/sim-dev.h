@@ -0,0 +1,162 @@
+/*
+ * Helpers shared by the simulated buses (spi-sim, i2c-sim)
+ *
+ * Waveforms are a function of the conversion index only, so a capture is
+ * the same from one run to the other whatever the timing :
+ *
+ *   sine   : full scale sine
+ *   ramp   : sawtooth from the lowest to the highest code
+ *   square : lowest and highest code, half a period each
+ *   noise  : hash of the index, uniform over the codes
+ *
+ * The period is given in conversions and doubles at each channel, so the
+ * channels can be told apart on a capture.
+ *
+ * The wire time of each transfer is waited for (sleep above sleep_min us,
+ * spin below) so the drivers see a bus as slow as the real one, or not at all
+ * with timing=0 to measure their CPU cost alone.
+ */
+#ifndef SIM_DEV_H
+#define SIM_DEV_H
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/string.h>
+
+enum sim_wave_type {
+	SIM_WAVE_SINE,
+	SIM_WAVE_RAMP,
+	SIM_WAVE_SQUARE,
+	SIM_WAVE_NOISE,
+};
+
+static const char * const sim_wave_names[] = {
+	[SIM_WAVE_SINE]		= "sine",
+	[SIM_WAVE_RAMP]		= "ramp",
+	[SIM_WAVE_SQUARE]	= "square",
+	[SIM_WAVE_NOISE]	= "noise",
+};
+
+/* sin over a quarter period, 64 steps, 32767 full scale */
+static const s16 sim_sine_quarter[65] = {
+	    0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+	 6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+	12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+	18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+	23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+	27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+	30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+	32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+	32767,
+};
+
+struct sim_wave {
+	enum sim_wave_type	type;
+	unsigned int		period;		/* conversions, channel 0 */
+	unsigned int		amplitude;	/* percent of the full scale */
+};
+
+static inline int sim_wave_parse(struct sim_wave *w, const char *type, unsigned int period,
+				 unsigned int amplitude)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sim_wave_names); i++)
+		if (sysfs_streq(type, sim_wave_names[i]))
+			break;
+	if (i == ARRAY_SIZE(sim_wave_names) || period < 2 || amplitude > 100)
+		return -EINVAL;
+	w->type = i;
+	w->period = period;
+	w->amplitude = amplitude;
+	return 0;
+}
+
+/* sine of a phase over 256 steps */
+static inline s32 sim_sine(unsigned int phase)
+{
+	unsigned int q = phase & 0x3F;
+
+	switch ((phase >> 6) & 3) {
+	case 0:
+		return sim_sine_quarter[q];
+	case 1:
+		return sim_sine_quarter[64 - q];
+	case 2:
+		return -sim_sine_quarter[q];
+	default:
+		return -sim_sine_quarter[64 - q];
+	}
+}
+
+/* conversion 'index' of 'chan' as an unsigned code of 'bits' bits */
+static inline u32 sim_wave_code(const struct sim_wave *w, unsigned int chan, u64 index,
+				unsigned int bits)
+{
+	u64 period = (u64)w->period << chan;
+	u32 phase;
+	u32 x;
+	s32 v;
+
+	/* the phase over 2^16 */
+	phase = div64_u64((index % period) << 16, period);
+	switch (w->type) {
+	case SIM_WAVE_SINE:
+		v = sim_sine(phase >> 8);
+		break;
+	case SIM_WAVE_RAMP:
+		v = (s32)phase - 32768;
+		break;
+	case SIM_WAVE_SQUARE:
+		v = (phase < 32768) ? -32768 : 32767;
+		break;
+	default:
+		x = (u32)index * 2654435761U ^ (chan << 24);
+		x ^= x >> 15;
+		x *= 2246822519U;
+		x ^= x >> 13;
+		v = (s32)(x & 0xFFFF) - 32768;
+		break;
+	}
+	v = v * (s32)w->amplitude / 100;
+	return (u32)(v + 32768) >> (16 - bits);
+}
+
+/* the bus is busy until 't' */
+static inline void sim_wait_until(ktime_t t, unsigned int sleep_min_us)
+{
+	ktime_t now = ktime_get();
+
+	if (!ktime_before(now, t))
+		return;
+	if (ktime_us_delta(t, now) >= sleep_min_us) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&t, HRTIMER_MODE_ABS);
+		return;
+	}
+	while (ktime_before(ktime_get(), t))
+		cpu_relax();
+}
+
+/* wire time of 'bits' at 'hz' */
+static inline u64 sim_wire_ns(unsigned int bits, unsigned int hz)
+{
+	return div_u64((u64)bits * NSEC_PER_SEC, hz);
+}
+
+// =======================
+// counters, one read-only attribute each and a write-only reset
+// =======================
+#define SIM_COUNTER_ATTR(stats, name)							\
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{											\
+	return sprintf(buf, "%lld\n", (long long)atomic64_read(&(stats).name));	\
+}											\
+static DEVICE_ATTR_RO(name)
+
+#endif
@@ -0,0 +1,848 @@
+/*
+ * ALSA Driver for MCP3002 + PCF8591 synchronized capture
+ *
+ * One card for both converters, driven by one hrtimer : each tick queues
+ * the SPI message converting a block of MCP3002 frames and, in the same
+ * tick, the I2C read of the four PCF8591 inputs (auto increment). The two
+ * halves of a tick complete in any order, the last one merges the tick :
+ * the PCF8591 values are held over the MCP3002 frames of the same block,
+ * the stream is 6 channels S16_LE at the MCP3002 rate
+ *
+ *   0-1 : MCP3002 channels 0-1
+ *   2-5 : PCF8591 inputs 0-3 (four single ended), sample and hold
+ *
+ * Ticks are merged in the order they were issued, a tick whose SPI message
+ * could not be queued is lost for both converters, an I2C error keeps the
+ * held values. The master clock is tracked and timestamped with adc-clock.h.
+ *
+ * The card is created once both devices are bound :
+ *   echo snd_adc_sync > /sys/bus/spi/devices/spi0.0/driver_override
+ *   echo adc-sync-pcf8591 0x48 > /sys/bus/i2c/devices/i2c-1/new_device
+ */
+
+#include <linux/err.h>
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/i2c.h>
+
+#include <sound/initval.h>
+#include <sound/control.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+
+#include <linux/spi/spi.h>
+
+#include "adc-clock.h"
+
+#define SYNC_RATE_MIN		1000
+#define SYNC_RATE_MAX		50000
+#define SYNC_FAST_CHAN		2	/* MCP3002 */
+#define SYNC_SLOW_CHAN		4	/* PCF8591 */
+#define SYNC_NB_CHAN		(SYNC_FAST_CHAN + SYNC_SLOW_CHAN)
+#define SYNC_BLOCK_MIN		8
+#define SYNC_BLOCK_MAX		512
+#define SYNC_NB_TICK		4	/* ticks in flight, power of 2 */
+
+/* keep the burst a bit shorter than the block so messages never pile up */
+#define SYNC_BURST_MARGIN	64
+
+/* PCF8591 control : four single ended inputs, auto increment from channel 0 */
+#define PCF8591_CONTROL_AOEF	0x40
+#define PCF8591_CONTROL_AINC	0x04
+
+static int rate = 8000;
+module_param(rate, int, 0444);
+MODULE_PARM_DESC(rate, "MCP3002 sampling rate in Hz, the PCF8591 follows at one frame per tick.");
+
+static int index = SNDRV_DEFAULT_IDX1;
+module_param(index, int, 0444);
+MODULE_PARM_DESC(index, "Index value for soundcard.");
+
+struct snd_adc_sync;
+
+struct adc_sync_tick {
+	struct spi_message		msg;
+	struct spi_transfer		*xfer;
+	u8				*tx;
+	u8				*rx;
+	int				spi_ok;
+	ktime_t				done;	/* SPI completion */
+	u8				slow[SYNC_SLOW_CHAN];
+	int				slow_ok;
+	u32				seq;
+	atomic_t			busy;		/* issued, not merged yet */
+	atomic_t			pending;	/* halves still running */
+	int				ready;
+	struct snd_adc_sync		*chip;
+};
+
+struct snd_adc_sync {
+	struct snd_card			*card;
+	struct snd_pcm			*pcm;
+	struct snd_pcm_substream	*substream;
+	struct spi_device		*spi;
+	struct i2c_client		*client;
+	unsigned int			rate;
+	unsigned int			block;	/* MCP3002 frames per tick */
+	struct hrtimer			timer;
+	ktime_t				block_time;
+	int				running;
+	struct adc_sync_tick		ticks[SYNC_NB_TICK];
+	u32				seq;		/* next tick to issue */
+	u32				i2c_seq;	/* next tick to read on I2C */
+	u32				merge_seq;	/* next tick to merge */
+	struct workqueue_struct		*wq;
+	struct work_struct		i2c_work;
+	wait_queue_head_t		idle;
+	s16				hold[SYNC_SLOW_CHAN];
+	unsigned int			overruns;
+	unsigned int			i2c_errors;
+	atomic_t			lost;	/* ticks lost since the last merge */
+	snd_pcm_uframes_t		hw_ptr;
+	snd_pcm_uframes_t		period_pos;
+	struct adc_clock		clock;
+	struct adc_tstamp		ts;
+	spinlock_t			lock;
+};
+
+/* the card exists once both halves are bound */
+static DEFINE_MUTEX(adc_sync_mutex);
+static struct spi_device *adc_sync_spi;
+static struct i2c_client *adc_sync_client;
+static struct snd_card *adc_sync_card;
+
+/* MCP3002 command : start, single ended, channel, MSB first */
+static inline u8 mcp3002_cmd(int chan)
+{
+	return 0xD0 | ((chan & 1) << 5);
+}
+
+/* 10 bits code to signed 16 bits */
+static inline s16 mcp3002_decode(const u8 *rx)
+{
+	u16 code = ((rx[0] << 7) | (rx[1] >> 1)) & 0x3FF;
+	return (s16)((code - 512) * 64);
+}
+
+/* 8 bits single ended code to signed 16 bits, centered like the MCP3002 */
+static inline s16 pcf8591_decode(u8 reg)
+{
+	return (s16)((reg - 128) * 256);
+}
+
+static struct snd_pcm_hardware snd_adc_sync_capture_hw = {
+	.info		= SNDRV_PCM_INFO_INTERLEAVED |
+			  SNDRV_PCM_INFO_BLOCK_TRANSFER |
+			  SNDRV_PCM_INFO_MMAP |
+			  SNDRV_PCM_INFO_MMAP_VALID |
+			  SNDRV_PCM_INFO_HAS_LINK_ATIME |
+			  SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME,
+	.formats	= SNDRV_PCM_FMTBIT_S16_LE,
+	.rates		= SNDRV_PCM_RATE_CONTINUOUS,
+	.rate_min	= 8000,  /* Replaced by chip->rate later. */
+	.rate_max	= 50000, /* Replaced by chip->rate later. */
+	.channels_min	= SYNC_NB_CHAN,
+	.channels_max	= SYNC_NB_CHAN,
+	.buffer_bytes_max = 128 * 1024,
+	.period_bytes_min = 256,
+	.period_bytes_max = 64 * 1024,
+	.periods_min	= 2,
+	.periods_max	= 256,
+};
+
+// =======================
+// Merge
+// =======================
+static void snd_adc_sync_pcm_push(struct snd_adc_sync *chip, const s16 *frame, int *elapsed)
+{
+	struct snd_pcm_runtime *runtime = chip->substream->runtime;
+	s16 *dst = (s16 *)runtime->dma_area + chip->hw_ptr * SYNC_NB_CHAN;
+
+	memcpy(dst, frame, SYNC_NB_CHAN * sizeof(s16));
+	chip->ts.frames++;
+	if (++chip->hw_ptr >= runtime->buffer_size)
+		chip->hw_ptr = 0;
+	if (++chip->period_pos >= runtime->period_size) {
+		chip->period_pos = 0;
+		*elapsed = 1;
+	}
+}
+
+/* both halves of the tick are there, chip->lock held */
+static void snd_adc_sync_merge(struct snd_adc_sync *chip, struct adc_sync_tick *t, int *elapsed)
+{
+	int pcm = chip->running && chip->substream;
+	s16 frame[SYNC_NB_CHAN];
+	u64 frame_ns;
+	u64 pos;
+	ktime_t first;
+	unsigned int i;
+	unsigned int c;
+
+	if (t->slow_ok) {
+		for (c = 0; c < SYNC_SLOW_CHAN; c++)
+			chip->hold[c] = pcf8591_decode(t->slow[c]);
+	} else {
+		chip->i2c_errors++;
+	}
+
+	if (!t->spi_ok) {
+		adc_clock_skip(&chip->clock, chip->block);
+		return;
+	}
+
+	/* the burst lasts the block time less the margin */
+	frame_ns = adc_clock_frame_ns(&chip->clock);
+	first = ktime_sub_ns(t->done, chip->block * frame_ns - div_u64(frame_ns, SYNC_BURST_MARGIN));
+	pos = chip->clock.frames;
+	adc_clock_block(&chip->clock, first, chip->block);
+	/* the lost ticks were due after this one */
+	adc_clock_skip(&chip->clock, atomic_xchg(&chip->lost, 0) * chip->block);
+
+	if (!pcm)
+		return;
+	memcpy(&frame[SYNC_FAST_CHAN], chip->hold, sizeof(chip->hold));
+	for (i = 0; i < chip->block; i++) {
+		const u8 *rx = &t->rx[2 * SYNC_FAST_CHAN * i];
+
+		frame[0] = mcp3002_decode(rx);
+		frame[1] = mcp3002_decode(rx + 2);
+		snd_adc_sync_pcm_push(chip, frame, elapsed);
+	}
+	/* the next PCM frame starts with the next block */
+	adc_tstamp_set(&chip->ts, pos + chip->block, ktime_add_ns(first, chip->block * frame_ns));
+}
+
+/* one half of the tick is done, the last one merges the ticks in order */
+static void snd_adc_sync_half_done(struct adc_sync_tick *t)
+{
+	struct snd_adc_sync *chip = t->chip;
+	unsigned long flags;
+	int elapsed = 0;
+
+	if (!atomic_dec_and_test(&t->pending))
+		return;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	t->ready = 1;
+	for (;;) {
+		struct adc_sync_tick *m = &chip->ticks[chip->merge_seq % SYNC_NB_TICK];
+
+		if (!m->ready || m->seq != chip->merge_seq)
+			break;
+		snd_adc_sync_merge(chip, m, &elapsed);
+		m->ready = 0;
+		atomic_set(&m->busy, 0);
+		chip->merge_seq++;
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	if (elapsed)
+		snd_pcm_period_elapsed(chip->substream);
+	wake_up(&chip->idle);
+}
+
+// =======================
+// SPI half
+// =======================
+static void snd_adc_sync_spi_complete(void *context)
+{
+	struct adc_sync_tick *t = context;
+
+	t->done = ktime_get();
+	t->spi_ok = !t->msg.status;
+	if (t->msg.status)
+		dev_dbg(&t->chip->spi->dev, "spi message failed:%d\n", t->msg.status);
+	snd_adc_sync_half_done(t);
+}
+
+static void snd_adc_sync_msg_free(struct snd_adc_sync *chip)
+{
+	int i;
+
+	for (i = 0; i < SYNC_NB_TICK; i++) {
+		kfree(chip->ticks[i].xfer);
+		kfree(chip->ticks[i].tx);
+		kfree(chip->ticks[i].rx);
+		chip->ticks[i].xfer = NULL;
+		chip->ticks[i].tx = NULL;
+		chip->ticks[i].rx = NULL;
+	}
+}
+
+/* same messages as spi-mcp3002 : one transfer per conversion, spread over the block */
+static int snd_adc_sync_msg_alloc(struct snd_adc_sync *chip)
+{
+	unsigned int nxfer = chip->block * SYNC_FAST_CHAN;
+	u64 frame_ns = div_u64(NSEC_PER_SEC, chip->rate);
+	u64 wire_ns = div_u64(SYNC_FAST_CHAN * 16 * (u64)NSEC_PER_SEC, chip->spi->max_speed_hz);
+	s64 delay_ns = frame_ns - wire_ns - div_u64(frame_ns, SYNC_BURST_MARGIN);
+	s64 err = 0;
+	unsigned int j;
+	int i;
+
+	if (delay_ns < 0)
+		delay_ns = 0;
+
+	for (i = 0; i < SYNC_NB_TICK; i++) {
+		struct adc_sync_tick *t = &chip->ticks[i];
+
+		t->xfer = kcalloc(nxfer, sizeof(*t->xfer), GFP_KERNEL);
+		t->tx = kcalloc(nxfer, 2, GFP_KERNEL);
+		t->rx = kcalloc(nxfer, 2, GFP_KERNEL);
+		if (!t->xfer || !t->tx || !t->rx) {
+			snd_adc_sync_msg_free(chip);
+			return -ENOMEM;
+		}
+
+		spi_message_init(&t->msg);
+		t->msg.complete = snd_adc_sync_spi_complete;
+		t->msg.context = t;
+		t->chip = chip;
+		atomic_set(&t->busy, 0);
+		atomic_set(&t->pending, 0);
+		for (j = 0; j < nxfer; j++) {
+			t->tx[2 * j] = mcp3002_cmd(j % SYNC_FAST_CHAN);
+			t->xfer[j].tx_buf = &t->tx[2 * j];
+			t->xfer[j].rx_buf = &t->rx[2 * j];
+			t->xfer[j].len = 2;
+			t->xfer[j].cs_change = (j != nxfer - 1);
+			if (j % SYNC_FAST_CHAN == SYNC_FAST_CHAN - 1) {
+				s64 d = delay_ns + err;
+
+				t->xfer[j].delay_usecs = div_s64(d, NSEC_PER_USEC);
+				err = d - (s64)t->xfer[j].delay_usecs * NSEC_PER_USEC;
+			}
+			spi_message_add_tail(&t->xfer[j], &t->msg);
+		}
+	}
+	return 0;
+}
+
+// =======================
+// I2C half
+// =======================
+static int snd_adc_sync_pcf8591_init(struct i2c_client *client)
+{
+	u8 control = PCF8591_CONTROL_AOEF | PCF8591_CONTROL_AINC;
+	int retval;
+
+	retval = i2c_master_send(client, (char *)&control, 1);
+	if (retval < 0)
+		return retval;
+	/* this read starts the conversion of input 0 */
+	retval = i2c_smbus_read_byte(client);
+	return (retval < 0) ? retval : 0;
+}
+
+/*
+ * One read of four bytes per tick, in tick order. Each byte carries the
+ * conversion started by the previous one and auto increment walks the
+ * inputs, so the bytes are inputs 0 to 3 : input 0 was converted at the end
+ * of the previous read, the others during this one. After an error the
+ * channel is set back to 0.
+ */
+static void snd_adc_sync_i2c_work(struct work_struct *work)
+{
+	struct snd_adc_sync *chip = container_of(work, struct snd_adc_sync, i2c_work);
+
+	while (chip->i2c_seq != READ_ONCE(chip->seq)) {
+		struct adc_sync_tick *t = &chip->ticks[chip->i2c_seq % SYNC_NB_TICK];
+		int retval = i2c_master_recv(chip->client, (char *)t->slow, SYNC_SLOW_CHAN);
+
+		t->slow_ok = (retval == SYNC_SLOW_CHAN);
+		if (!t->slow_ok)
+			snd_adc_sync_pcf8591_init(chip->client);
+		chip->i2c_seq++;
+		snd_adc_sync_half_done(t);
+	}
+}
+
+// =======================
+// timer callback
+// =======================
+static enum hrtimer_restart snd_adc_sync_timer_callback(struct hrtimer *timer)
+{
+	struct snd_adc_sync *chip = container_of(timer, struct snd_adc_sync, timer);
+	struct adc_sync_tick *t = &chip->ticks[chip->seq % SYNC_NB_TICK];
+
+	if (!chip->running)
+		return HRTIMER_NORESTART;
+
+	if (atomic_read(&t->busy)) {
+		/* one of the buses did not follow, this tick is lost */
+		chip->overruns++;
+		atomic_inc(&chip->lost);
+	} else {
+		t->seq = chip->seq;
+		atomic_set(&t->busy, 1);
+		atomic_set(&t->pending, 2);
+		if (spi_async(chip->spi, &t->msg)) {
+			atomic_set(&t->pending, 0);
+			atomic_set(&t->busy, 0);
+			chip->overruns++;
+			atomic_inc(&chip->lost);
+		} else {
+			chip->seq++;
+			queue_work(chip->wq, &chip->i2c_work);
+		}
+	}
+
+	hrtimer_forward_now(timer, chip->block_time);
+	return HRTIMER_RESTART;
+}
+
+static void snd_adc_sync_wait_idle(struct snd_adc_sync *chip)
+{
+	hrtimer_cancel(&chip->timer);
+	wait_event(chip->idle, READ_ONCE(chip->merge_seq) == chip->seq);
+}
+
+// =======================
+// PCM callbacks
+// =======================
+static int snd_adc_sync_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_adc_sync *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int err;
+
+	runtime->hw = snd_adc_sync_capture_hw;
+	runtime->hw.rate_min = chip->rate;
+	runtime->hw.rate_max = chip->rate;
+
+	/* ensure buffer_size is a multiple of period_size */
+	err = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+	if (err < 0)
+		return err;
+	chip->substream = substream;
+
+	return 0;
+}
+
+static int snd_adc_sync_pcm_close(struct snd_pcm_substream *substream)
+{
+	struct snd_adc_sync *chip = snd_pcm_substream_chip(substream);
+
+	snd_adc_sync_wait_idle(chip);
+	chip->substream = NULL;
+	return 0;
+}
+
+static int snd_adc_sync_pcm_hw_params(struct snd_pcm_substream *substream,
+				      struct snd_pcm_hw_params *hw_params)
+{
+	return snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(hw_params));
+}
+
+static int snd_adc_sync_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	return snd_pcm_lib_free_pages(substream);
+}
+
+static int snd_adc_sync_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_adc_sync *chip = snd_pcm_substream_chip(substream);
+	unsigned long flags;
+
+	snd_adc_sync_wait_idle(chip);
+
+	spin_lock_irqsave(&chip->lock, flags);
+	chip->hw_ptr = 0;
+	chip->period_pos = 0;
+	adc_tstamp_reset(&chip->ts);
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	return 0;
+}
+
+static int snd_adc_sync_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct snd_adc_sync *chip = snd_pcm_substream_chip(substream);
+	int retval = 0;
+
+	spin_lock(&chip->lock);
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		chip->running = 1;
+		if (!hrtimer_active(&chip->timer)) {
+			adc_clock_start(&chip->clock);
+			atomic_set(&chip->lost, 0);
+			hrtimer_start(&chip->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+		}
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+		chip->running = 0;
+		hrtimer_try_to_cancel(&chip->timer);
+		break;
+	default:
+		dev_dbg(&chip->spi->dev, "spurious command %x\n", cmd);
+		retval = -EINVAL;
+		break;
+	}
+
+	spin_unlock(&chip->lock);
+
+	return retval;
+}
+
+static snd_pcm_uframes_t snd_adc_sync_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct snd_adc_sync *chip = snd_pcm_substream_chip(substream);
+
+	return chip->hw_ptr;
+}
+
+static int snd_adc_sync_pcm_get_time_info(struct snd_pcm_substream *substream,
+					  struct timespec *system_ts, struct timespec *audio_ts,
+					  struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+					  struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct snd_adc_sync *chip = snd_pcm_substream_chip(substream);
+	struct adc_tstamp ts;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	ts = chip->ts;
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	return adc_clock_time_info(&chip->clock, &ts, substream, system_ts, audio_ts,
+				   audio_tstamp_config, audio_tstamp_report);
+}
+
+static struct snd_pcm_ops snd_adc_sync_capture_ops = {
+	.open		= snd_adc_sync_pcm_open,
+	.close		= snd_adc_sync_pcm_close,
+	.ioctl		= snd_pcm_lib_ioctl,
+	.hw_params	= snd_adc_sync_pcm_hw_params,
+	.hw_free	= snd_adc_sync_pcm_hw_free,
+	.prepare	= snd_adc_sync_pcm_prepare,
+	.trigger	= snd_adc_sync_pcm_trigger,
+	.pointer	= snd_adc_sync_pcm_pointer,
+	.get_time_info	= snd_adc_sync_pcm_get_time_info,
+};
+// =======================
+
+static int snd_adc_sync_pcm_new(struct snd_adc_sync *chip)
+{
+	struct snd_pcm *pcm;
+	int retval;
+
+	retval = snd_pcm_new(chip->card, chip->card->shortname, 0, 0, 1, &pcm);
+	if (retval < 0)
+		goto out;
+
+	pcm->private_data = chip;
+	pcm->info_flags = SNDRV_PCM_INFO_BLOCK_TRANSFER;
+	strcpy(pcm->name, "mcp3002+pcf8591");
+	chip->pcm = pcm;
+
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_adc_sync_capture_ops);
+
+	retval = snd_pcm_lib_preallocate_pages_for_all(chip->pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+			snd_dma_continuous_data(GFP_KERNEL), 128 * 1024, 128 * 1024);
+out:
+	return retval;
+}
+
+static int snd_adc_sync_chip_init(struct snd_adc_sync *chip)
+{
+	struct spi_device *spi = chip->spi;
+	int retval;
+
+	spi->bits_per_word = 8;
+	spi->mode = SPI_MODE_0;
+	retval = spi_setup(spi);
+	if (retval)
+	{
+		printk("spi_setup failed:%d\n", retval);
+		goto out;
+	}
+
+	if (rate < SYNC_RATE_MIN || rate > SYNC_RATE_MAX
+	    || (u64)rate * SYNC_FAST_CHAN * 16 > spi->max_speed_hz)
+	{
+		printk("rate %d not supported at %u Hz\n", rate, spi->max_speed_hz);
+		retval = -EINVAL;
+		goto out;
+	}
+	chip->rate = rate;
+
+	retval = snd_adc_sync_pcf8591_init(chip->client);
+	if (retval)
+	{
+		printk("snd_adc_sync_pcf8591_init failed:%d\n", retval);
+		goto out;
+	}
+
+	/* one tick every 2ms, the I2C read of 4 bytes takes about 0.5ms at 100kHz */
+	chip->block = clamp_t(unsigned int, chip->rate / 500, SYNC_BLOCK_MIN, SYNC_BLOCK_MAX);
+	chip->block_time = ns_to_ktime(div_u64((u64)chip->block * NSEC_PER_SEC, chip->rate));
+
+	retval = snd_adc_sync_msg_alloc(chip);
+	if (retval)
+	{
+		printk("snd_adc_sync_msg_alloc failed:%d\n", retval);
+		goto out;
+	}
+
+	chip->wq = create_singlethread_workqueue(KBUILD_MODNAME);
+	if (!chip->wq)
+	{
+		snd_adc_sync_msg_free(chip);
+		retval = -ENOMEM;
+		printk("create_singlethread_workqueue failed:%d\n", retval);
+		goto out;
+	}
+	INIT_WORK(&chip->i2c_work, snd_adc_sync_i2c_work);
+
+	hrtimer_init(&chip->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	chip->timer.function = snd_adc_sync_timer_callback;
+
+	dev_info(&spi->dev, "adc-sync: rate %u Hz, %u frames and 1 PCF8591 frame per tick\n",
+		 chip->rate, chip->block);
+out:
+	return retval;
+}
+
+static int snd_adc_sync_dev_free(struct snd_device *device)
+{
+	struct snd_adc_sync *chip = device->device_data;
+
+	chip->running = 0;
+	snd_adc_sync_wait_idle(chip);
+	destroy_workqueue(chip->wq);
+	snd_adc_sync_msg_free(chip);
+	if (chip->overruns || chip->i2c_errors)
+		dev_info(&chip->spi->dev, "adc-sync: %u ticks lost, %u i2c errors\n",
+			 chip->overruns, chip->i2c_errors);
+
+	return 0;
+}
+
+static int snd_adc_sync_create(struct spi_device *spi, struct i2c_client *client,
+			       struct snd_card **rcard)
+{
+	static struct snd_device_ops ops = {
+		.dev_free	= snd_adc_sync_dev_free,
+	};
+	struct snd_card *card;
+	struct snd_adc_sync *chip;
+	int retval;
+
+	retval = snd_card_new(&spi->dev, index, KBUILD_MODNAME, THIS_MODULE,
+			      sizeof(struct snd_adc_sync), &card);
+	if (retval < 0)
+	{
+		printk("snd_card_new failed:%d\n", retval);
+		goto out;
+	}
+
+	strcpy(card->driver, KBUILD_MODNAME);
+	strcpy(card->shortname, KBUILD_MODNAME);
+	strcpy(card->longname, "MCP3002 + PCF8591 synchronized capture");
+
+	chip = card->private_data;
+	spin_lock_init(&chip->lock);
+	init_waitqueue_head(&chip->idle);
+	chip->card = card;
+	chip->spi = spi;
+	chip->client = client;
+
+	retval = snd_adc_sync_chip_init(chip);
+	if (retval)
+	{
+		printk("snd_adc_sync_chip_init failed:%d\n", retval);
+		goto out_card;
+	}
+
+	retval = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
+	if (retval)
+	{
+		destroy_workqueue(chip->wq);
+		snd_adc_sync_msg_free(chip);
+		printk("snd_device_new failed:%d\n", retval);
+		goto out_card;
+	}
+
+	retval = snd_adc_sync_pcm_new(chip);
+	if (retval)
+	{
+		printk("snd_adc_sync_pcm_new failed:%d\n", retval);
+		goto out_card;
+	}
+
+	retval = adc_clock_new(&chip->clock, card, chip->rate);
+	if (retval)
+	{
+		printk("adc_clock_new failed:%d\n", retval);
+		goto out_card;
+	}
+
+	retval = snd_card_register(card);
+	if (retval)
+	{
+		printk("snd_card_register failed:%d\n", retval);
+		goto out_card;
+	}
+
+	*rcard = card;
+	goto out;
+
+out_card:
+	snd_card_free(card);
+out:
+	return retval;
+}
+
+/* called with adc_sync_mutex, creates the card when the second half shows up */
+static int snd_adc_sync_bind(void)
+{
+	if (!adc_sync_spi || !adc_sync_client || adc_sync_card)
+		return 0;
+	return snd_adc_sync_create(adc_sync_spi, adc_sync_client, &adc_sync_card);
+}
+
+static void snd_adc_sync_unbind(void)
+{
+	if (adc_sync_card) {
+		snd_card_free(adc_sync_card);
+		adc_sync_card = NULL;
+	}
+}
+
+// =======================
+// drivers
+// =======================
+static int snd_adc_sync_spi_probe(struct spi_device *spi)
+{
+	int retval;
+
+	mutex_lock(&adc_sync_mutex);
+	if (adc_sync_spi)
+	{
+		retval = -EBUSY;
+		goto out;
+	}
+	adc_sync_spi = spi;
+	retval = snd_adc_sync_bind();
+	if (retval)
+		adc_sync_spi = NULL;
+out:
+	mutex_unlock(&adc_sync_mutex);
+	return retval;
+}
+
+static int snd_adc_sync_spi_remove(struct spi_device *spi)
+{
+	mutex_lock(&adc_sync_mutex);
+	snd_adc_sync_unbind();
+	adc_sync_spi = NULL;
+	mutex_unlock(&adc_sync_mutex);
+	return 0;
+}
+
+static int snd_adc_sync_i2c_probe(struct i2c_client *client, const struct i2c_device_id *id)
+{
+	int retval;
+
+	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE))
+		return -EIO;
+
+	mutex_lock(&adc_sync_mutex);
+	if (adc_sync_client)
+	{
+		retval = -EBUSY;
+		goto out;
+	}
+	adc_sync_client = client;
+	retval = snd_adc_sync_bind();
+	if (retval)
+		adc_sync_client = NULL;
+out:
+	mutex_unlock(&adc_sync_mutex);
+	return retval;
+}
+
+static int snd_adc_sync_i2c_remove(struct i2c_client *client)
+{
+	mutex_lock(&adc_sync_mutex);
+	snd_adc_sync_unbind();
+	adc_sync_client = NULL;
+	mutex_unlock(&adc_sync_mutex);
+	return 0;
+}
+
+static const struct spi_device_id adc_sync_spi_id[] = {
+	{ "adc-sync-mcp3002", 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(spi, adc_sync_spi_id);
+
+static struct spi_driver adc_sync_spi_driver = {
+	.driver		= {
+		.name	= KBUILD_MODNAME,
+		.owner  = THIS_MODULE
+	},
+	.id_table	= adc_sync_spi_id,
+	.probe		= snd_adc_sync_spi_probe,
+	.remove		= snd_adc_sync_spi_remove,
+};
+
+static const struct i2c_device_id adc_sync_i2c_id[] = {
+	{ "adc-sync-pcf8591", 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(i2c, adc_sync_i2c_id);
+
+static struct i2c_driver adc_sync_i2c_driver = {
+	.driver = {
+		.name	= KBUILD_MODNAME,
+	},
+	.probe		= snd_adc_sync_i2c_probe,
+	.remove		= snd_adc_sync_i2c_remove,
+	.id_table	= adc_sync_i2c_id,
+};
+
+static int __init adc_sync_init(void)
+{
+	int ret;
+
+	printk("adc_sync_init\n");
+	ret = i2c_add_driver(&adc_sync_i2c_driver);
+	if (ret < 0)
+	{
+		printk("i2c_add_driver fails :%d\n", ret);
+		return ret;
+	}
+	ret = spi_register_driver(&adc_sync_spi_driver);
+	if (ret < 0)
+	{
+		printk("spi_register_driver fails :%d\n", ret);
+		i2c_del_driver(&adc_sync_i2c_driver);
+	}
+	return ret;
+}
+module_init(adc_sync_init);
+
+static void __exit adc_sync_exit(void)
+{
+	printk("adc_sync_exit\n");
+	spi_unregister_driver(&adc_sync_spi_driver);
+	i2c_del_driver(&adc_sync_i2c_driver);
+}
+module_exit(adc_sync_exit);
+
+MODULE_AUTHOR("MPR");
+MODULE_DESCRIPTION("Synchronized capture driver for MCP3002 and PCF8591");
+MODULE_LICENSE("GPL");
+MODULE_ALIAS("spi:" KBUILD_MODNAME);
@@ -12,7 +12,8 @@
 #include <linux/soundcard.h>
 #include <linux/timer.h>
 #include <linux/delay.h>
-#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
 
 #include <asm/io.h>
 
@@ -20,6 +21,15 @@
 #include <sound/initval.h>
 #include <sound/i2c.h>
 #include <sound/pcm.h>
+#include <sound/control.h>
+
+#include "adc-meter.h"
+#include "adc-decim.h"
+#include "adc-clock.h"
+#include "adc-thread.h"
+#include "adc-src.h"
+#include "adc-cal.h"
+#include "adc-reflex.h"
 
 /* Insmod parameters */
 static int input_mode;
@@ -39,6 +49,26 @@ static char *id = KBUILD_MODNAME;
 module_param(id, charp, 0444);
 MODULE_PARM_DESC(id, "ID string for soundcard.");
 
+static char *sched_policy = "fifo";
+module_param(sched_policy, charp, 0444);
+MODULE_PARM_DESC(sched_policy, "Acquisition thread policy : other, fifo or rr.");
+
+static int sched_priority = 50;
+module_param(sched_priority, int, 0444);
+MODULE_PARM_DESC(sched_priority, "Acquisition thread priority (1-99) for fifo and rr.");
+
+static char *cpu_mask = "";
+module_param(cpu_mask, charp, 0444);
+MODULE_PARM_DESC(cpu_mask, "Acquisition thread CPU list, empty for all.");
+
+static int src = 1;
+module_param(src, int, 0444);
+MODULE_PARM_DESC(src, "Offer the standard rates through the rate conversion (0 for the sampling rate only).");
+
+static int vref = 3300;
+module_param(vref, int, 0444);
+MODULE_PARM_DESC(vref, "Reference voltage in mV of the nominal calibration tables.");
+
 /*
  * The PCF8591 control byte
  *      7    6    5    4    3    2    1    0
@@ -75,14 +105,14 @@ MODULE_PARM_DESC(id, "ID string for soundcard.");
 
 /* Conversions */
 #define REG_TO_SIGNED(reg)      (((reg) & 0x80) ? ((reg) - 256) : (reg))
+#define PCF8591_NB_CODE         256
 
-static int period = 125; // us
+/* channels read at each timer tick */
+#define PCF8591_NB_CHAN         2
+#define PCF8591_BITS            8
+#define PCF8591_RATE            8000
 
-struct my_work_t
-{
-	struct work_struct my_work;
-	struct pcf8591_data *    data;
-};
+static int period = 125; // us
 
 struct pcf8591_data 
 {
@@ -96,10 +126,29 @@ struct pcf8591_data
         u8 control;
         u8 aout;
 	
-	struct timer_list htimer;
-	struct workqueue_struct *wq;
-	struct my_work_t *work;
-	int offset;
+	/* acquisition thread, a frame each period while capturing or metering */
+	struct adc_thread thread;
+	snd_pcm_uframes_t hw_ptr;
+	snd_pcm_uframes_t period_pos;
+
+	struct adc_meter meter;
+	struct adc_decim decim;
+	struct adc_src src;
+	struct adc_src_rates src_rates;
+	int running;
+	
+	/* code to signed 16 bits, input_mode resolved once, or millivolts */
+	s16 scale[PCF8591_NB_CHAN][PCF8591_NB_CODE];
+	struct adc_cal cal;
+	struct adc_reflex reflex;
+
+	/* each tick stamped at its first conversion, the PCM position with its time */
+	struct adc_clock clock;
+	struct adc_tstamp ts;
+	spinlock_t lock;
+	/* set while a period completion is signalled outside the lock */
+	atomic_t busy;
+	wait_queue_head_t idle;
 };
   
 static void pcf8591_init_client(struct i2c_client *client)
@@ -114,7 +163,12 @@ static void pcf8591_init_client(struct i2c_client *client)
 	i2c_smbus_read_byte(client); 
 }
  
-static int pcf8591_read_channel(struct pcf8591_data *data, int channel)
+static int pcf8591_is_signed(int channel)
+{
+        return (channel == 2 && input_mode == 2) || (channel != 3 && (input_mode == 1 || input_mode == 3));
+}
+
+static u8 pcf8591_read_channel(struct pcf8591_data *data, int channel)
 {	
         u8 value = 0;
 	
@@ -128,44 +182,188 @@ static int pcf8591_read_channel(struct pcf8591_data *data, int channel)
  	value = i2c_smbus_read_byte(data->client);
         mutex_unlock(&data->update_lock);
 	
-        if ((channel == 2 && input_mode == 2) || (channel != 3 && (input_mode == 1 || input_mode == 3)))
-                 return 10 * REG_TO_SIGNED(value);
-        else
-                 return 10 * value;
+	return value;
 }
 
-static void timer_function(unsigned long ptr)
+/* meter scale : signed 16 bits, single ended inputs centered like the MCP3002 */
+static void pcf8591_scale_init(struct pcf8591_data *data)
 {
-	struct pcf8591_data *data = (struct pcf8591_data *)(ptr);	
-	queue_work(data->wq, (struct work_struct *)data->work);
+	int c, code;
 	
-	mod_timer(&data->htimer, jiffies + usecs_to_jiffies(period));
+	for (c = 0; c < PCF8591_NB_CHAN; c++)
+		for (code = 0; code < PCF8591_NB_CODE; code++)
+			data->scale[c][code] = pcf8591_is_signed(c) ? REG_TO_SIGNED(code) * 256 : (code - 128) * 256;
 }
 
-static void pcf8591_work(struct work_struct *work)
+/* the calibration starts from the nominal scale of the input mode */
+static int pcf8591_cal_init(struct pcf8591_data *data)
 {
-	struct my_work_t *my_work = (struct my_work_t *)work;
-	struct pcf8591_data *data =  my_work->data;
-	struct snd_pcm_runtime *runtime = NULL;
+	unsigned long signed_mask = 0;
+	int c;
 	
-	if (data->substream)
+	for (c = 0; c < PCF8591_NB_CHAN; c++)
+		if (pcf8591_is_signed(c))
+			signed_mask |= BIT(c);
+	return adc_cal_init(&data->cal, &data->client->dev, PCF8591_NB_CHAN, PCF8591_BITS, vref, signed_mask);
+}
+
+static int pcf8591_acq_active(struct pcf8591_data *data)
+{
+	return data->substream || data->meter.enabled || data->reflex.armed;
+}
+
+/* wake the thread, it starts a new acquisition when it was idle */
+static void pcf8591_acq_start(struct pcf8591_data *data)
+{
+	wake_up_interruptible(&data->thread.wait);
+}
+
+static void pcf8591_meter_enable(void *priv, int on)
+{
+	struct pcf8591_data *data = priv;
+
+	/* the thread goes idle by itself when nothing is left */
+	if (on)
+		pcf8591_acq_start(data);
+}
+
+/* one frame to the PCM buffer, U8 offset binary or S16, returns 1 at period end */
+static int pcf8591_pcm_push(struct pcf8591_data *data, const s16 *frame)
+{
+	struct snd_pcm_runtime *runtime = data->substream->runtime;
+	unsigned int c;
+	
+	if (runtime->format == SNDRV_PCM_FORMAT_S16_LE)
+	{
+		s16 *dst = (s16 *)runtime->dma_area + data->hw_ptr * runtime->channels;
+		for (c = 0; c < runtime->channels; c++)
+			dst[c] = frame[c];
+	}
+	else
+	{
+		u8 *dst = runtime->dma_area + data->hw_ptr * runtime->channels;
+		for (c = 0; c < runtime->channels; c++)
+			dst[c] = (frame[c] >> 8) + 128;
+	}
+	
+	data->ts.frames++;
+	if (++data->hw_ptr >= runtime->buffer_size)
+		data->hw_ptr = 0;
+	if (++data->period_pos >= runtime->period_size)
 	{
-		runtime = data->substream->runtime;
-		if (data->offset >= 128) data->offset = 0;
-		runtime->dma_area[data->offset++] = pcf8591_read_channel(data,0);
-		runtime->dma_area[data->offset++] = pcf8591_read_channel(data,1);
-		snd_pcm_period_elapsed(data->substream);
+		data->period_pos = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* one frame after the conversions, 'next' is the acquisition frame following it */
+static int pcf8591_deliver(struct pcf8591_data *data, const s16 *frame, u64 next, ktime_t time)
+{
+	/* the conversion lag is counted in decimated frames */
+	unsigned int delay = min_t(u64, adc_src_delay(&data->src) * adc_decim_ratio(&data->decim), next);
+	u64 frame_ns = adc_clock_frame_ns(&data->clock);
+	int elapsed = pcf8591_pcm_push(data, frame);
+	
+	/* the next PCM frame starts with the next tick, less the conversion lag */
+	adc_tstamp_set(&data->ts, next - delay, ktime_sub_ns(ktime_add_ns(time, frame_ns), delay * frame_ns));
+	return elapsed;
+}
+
+static void pcf8591_acquire(struct pcf8591_data *data, ktime_t first)
+{
+	struct snd_pcm_substream *substream;
+	s16 frame[PCF8591_NB_CHAN];
+	s32 code[PCF8591_NB_CHAN];
+	u16 raw[PCF8591_NB_CHAN];
+	unsigned long flags;
+	u64 pos;
+	int elapsed = 0;
+	int i;
+	
+	pos = data->clock.frames;
+	adc_clock_block(&data->clock, first, 1);
+	
+	for (i = 0; i < PCF8591_NB_CHAN; i++)
+		raw[i] = pcf8591_read_channel(data,i);
+	
+	/* the substream is cleared under the lock by close, running by trigger, the unit by the controls */
+	spin_lock_irqsave(&data->lock, flags);
+	if (data->cal.enabled)
+		adc_cal_frame(&data->cal, raw, frame);
+	else
+		for (i = 0; i < PCF8591_NB_CHAN; i++)
+			frame[i] = data->scale[i][raw[i]];
+	for (i = 0; i < PCF8591_NB_CHAN; i++)
+		code[i] = frame[i] >> (16 - data->decim.in_bits);
+	adc_meter_feed(&data->meter, frame);
+	adc_reflex_feed(&data->reflex, frame, first);
+	substream = data->substream;
+	if (substream && data->running && (!data->decim.log2_ratio || adc_decim_push(&data->decim, code, frame)))
+	{
+		if (!adc_src_active(&data->src))
+			elapsed = pcf8591_deliver(data, frame, pos + 1, first);
+		else
+		{
+			adc_src_push(&data->src, frame);
+			while (adc_src_pull(&data->src, frame))
+				elapsed |= pcf8591_deliver(data, frame, pos + 1, first);
+		}
+	}
+	if (elapsed)
+		atomic_set(&data->busy, 1);
+	spin_unlock_irqrestore(&data->lock, flags);
+	adc_reflex_apply(&data->reflex);
+	if (elapsed)
+	{
+		snd_pcm_period_elapsed(substream);
+		atomic_set(&data->busy, 0);
+		wake_up(&data->idle);
 	}
 }
 
+/* acquisition thread, sleeps until the absolute time of the next frame */
+static int pcf8591_thread(void *arg)
+{
+	struct pcf8591_data *data = arg;
+	ktime_t next = ktime_get();
+	ktime_t now;
+	
+	while (!kthread_should_stop())
+	{
+		if (!pcf8591_acq_active(data))
+		{
+			wait_event_interruptible(data->thread.wait,
+						 pcf8591_acq_active(data) || kthread_should_stop());
+			if (kthread_should_stop())
+				break;
+			adc_clock_start(&data->clock);
+			next = ktime_get();
+		}
+		
+		now = ktime_get();
+		pcf8591_acquire(data, now);
+		
+		/* a late thread resyncs instead of bursting the missed frames */
+		next = ktime_add_us(next, period);
+		now = ktime_get();
+		if (ktime_before(next, now))
+			next = now;
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout_range(&next, 0, HRTIMER_MODE_ABS);
+	}
+	return 0;
+}
+
 static struct snd_pcm_hardware snd_snd_pcf8591_capture_hw = {
-          .info = (SNDRV_PCM_INFO_INTERLEAVED  |  SNDRV_PCM_INFO_BLOCK_TRANSFER ),
-          .formats =          SNDRV_PCM_FMTBIT_U8,
-          .rates =            SNDRV_PCM_RATE_8000,
-          .rate_min =         8000,
-          .rate_max =         8000,
+          .info = (SNDRV_PCM_INFO_INTERLEAVED  |  SNDRV_PCM_INFO_BLOCK_TRANSFER |
+                   SNDRV_PCM_INFO_HAS_LINK_ATIME | SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME ),
+          .formats =          SNDRV_PCM_FMTBIT_U8 | SNDRV_PCM_FMTBIT_S16_LE,
+          .rates =            SNDRV_PCM_RATE_CONTINUOUS,
+          .rate_min =         PCF8591_RATE, /* divided by the decimation ratio */
+          .rate_max =         PCF8591_RATE,
           .channels_min =     1,
-          .channels_max =     4,
+          .channels_max =     PCF8591_NB_CHAN,
           .buffer_bytes_max = 32768,
           .period_bytes_min = 1024,
           .period_bytes_max = 32768,
@@ -177,21 +375,24 @@ static int snd_pcf8591_capture_open(struct snd_pcm_substream *substream)
 {
         struct pcf8591_data *data = snd_pcm_substream_chip(substream);
 	struct snd_pcm_runtime *runtime = substream->runtime;	
+	int err;
 	
 	printk("snd_pcf8591_capture_open data:%X substream:%X\n", (unsigned int)data, (unsigned int)substream);
-	data->substream = substream;
-	data->offset = 0;
 	
-	/* fill hardware */
+	/* fill hardware, decimated and converted frames only exist in S16 */
 	runtime->hw = snd_snd_pcf8591_capture_hw;
-	
-	/* start timer */
-	printk("snd_pcf8591_capture_open setup_timer\n");			 
-	setup_timer( &data->htimer, timer_function, (unsigned long)data);
-	if (mod_timer( &data->htimer, jiffies + usecs_to_jiffies(period))) 
+	err = adc_src_constraint(runtime, &data->src_rates, PCF8591_RATE / adc_decim_ratio(&data->decim), src);
+	if (err < 0)
 	{
-		printk("Error in mod_timer\n");	
+		printk("adc_src_constraint fails :%d\n",err);
+		return err;
 	}
+	if (data->decim.log2_ratio || data->cal.enabled)
+		runtime->hw.formats = SNDRV_PCM_FMTBIT_S16_LE;
+	data->substream = substream;
+	
+	/* start timer, it may already run for the meter */
+	pcf8591_acq_start(data);
 	
 	return 0;
 }
@@ -199,10 +400,14 @@ static int snd_pcf8591_capture_open(struct snd_pcm_substream *substream)
 static int snd_pcf8591_capture_close(struct snd_pcm_substream *substream)
 {
         struct pcf8591_data *data = snd_pcm_substream_chip(substream);
+	unsigned long flags;
 	printk("snd_pcf8591_capture_close data:%X substream:%X\n", (unsigned int)data, (unsigned int)substream);
+	spin_lock_irqsave(&data->lock, flags);
 	data->substream = NULL;	
-	
-	del_timer(&data->htimer);	
+	data->running = 0;
+	spin_unlock_irqrestore(&data->lock, flags);
+	/* the thread may still be signalling a period of this substream */
+	wait_event(data->idle, !atomic_read(&data->busy));
 	return 0;
 }
 
@@ -210,38 +415,96 @@ static int snd_pcf8591_hw_params(struct snd_pcm_substream *substream,
                                struct snd_pcm_hw_params *hw_params)
 {
         struct pcf8591_data *data = snd_pcm_substream_chip(substream);
+	int err;
 	printk("snd_pcf8591_hw_params data:%X\n", (unsigned int)data);		
 	printk("snd_pcf8591_hw_params flags:%X\n", hw_params->flags);		
 	printk("snd_pcf8591_hw_params rmask:%X\n", hw_params->rmask);		
 	printk("snd_pcf8591_hw_params cmask:%X\n", hw_params->cmask);		
 	printk("snd_pcf8591_hw_params rate:%d/%d\n", hw_params->rate_num,hw_params->rate_den);		
 	printk("snd_pcf8591_hw_params params_buffer_bytes(hw_params):%d\n", params_buffer_bytes(hw_params));		
+	
+	/* stopped, the thread does not use the conversion until the next start */
+	adc_src_free(&data->src);
+	err = adc_src_init(&data->src, PCF8591_NB_CHAN, PCF8591_RATE / adc_decim_ratio(&data->decim),
+			   params_rate(hw_params));
+	if (err < 0)
+	{
+		printk("adc_src_init fails :%d\n",err);
+		return err;
+	}
         return snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(hw_params));
 }
 
+static int snd_pcf8591_hw_free(struct snd_pcm_substream *substream)
+{
+        struct pcf8591_data *data = snd_pcm_substream_chip(substream);
+	adc_src_free(&data->src);
+        return snd_pcm_lib_free_pages(substream);
+}
+
 static int snd_pcf8591_prepare(struct snd_pcm_substream *substream)
 {
         struct pcf8591_data *data = snd_pcm_substream_chip(substream);
+	unsigned long flags;
 	printk("snd_pcf8591_prepare data:%X\n", (unsigned int)data);	
+	spin_lock_irqsave(&data->lock, flags);
+	data->hw_ptr = 0;
+	data->period_pos = 0;
+	adc_tstamp_reset(&data->ts);
+	adc_src_reset(&data->src);
+	adc_decim_init(&data->decim, PCF8591_NB_CHAN, adc_cal_bits(&data->cal), data->decim.log2_ratio);
+	spin_unlock_irqrestore(&data->lock, flags);
 	return 0;
 }
 
 static int snd_pcf8591_trigger(struct snd_pcm_substream *substream, int cmd)
 {
         struct pcf8591_data *data = snd_pcm_substream_chip(substream);
-	printk("snd_pcf8591_trigger data:%X\n", (unsigned int)data);		
-	return 0;
+	unsigned long flags;
+	int err = 0;
+	printk("snd_pcf8591_trigger data:%X cmd:%d\n", (unsigned int)data, cmd);		
+	
+	/* the thread only writes to the buffer between start and stop */
+	spin_lock_irqsave(&data->lock, flags);
+	switch (cmd)
+	{
+	case SNDRV_PCM_TRIGGER_START:
+		data->running = 1;
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+		data->running = 0;
+		break;
+	default:
+		err = -EINVAL;
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+	return err;
 }
 
 static snd_pcm_uframes_t snd_pcf8591_capture_pointer(struct snd_pcm_substream *substream)
 {
         struct pcf8591_data *data = snd_pcm_substream_chip(substream);
-	struct snd_pcm_runtime *runtime = substream->runtime;	
-	unsigned int ptr = data->offset;
 	
-//	printk("snd_pcf8591_capture_pointer data:%X offset:%d\n", (unsigned int)data, ptr);		
+//	printk("snd_pcf8591_capture_pointer data:%X hw_ptr:%d\n", (unsigned int)data, data->hw_ptr);		
 
-        return bytes_to_frames(runtime, ptr);
+        return data->hw_ptr;
+}
+
+static int snd_pcf8591_get_time_info(struct snd_pcm_substream *substream,
+                                     struct timespec *system_ts, struct timespec *audio_ts,
+                                     struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+                                     struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+        struct pcf8591_data *data = snd_pcm_substream_chip(substream);
+	struct adc_tstamp ts;
+	unsigned long flags;
+	
+	spin_lock_irqsave(&data->lock, flags);
+	ts = data->ts;
+	spin_unlock_irqrestore(&data->lock, flags);
+	
+	return adc_clock_time_info(&data->clock, &ts, substream, system_ts, audio_ts,
+				   audio_tstamp_config, audio_tstamp_report);
 }
 	
 static struct snd_pcm_ops pcm_capture_ops = {
@@ -249,15 +512,112 @@ static struct snd_pcm_ops pcm_capture_ops = {
         .close =        snd_pcf8591_capture_close,
         .ioctl =        snd_pcm_lib_ioctl,
         .hw_params =    snd_pcf8591_hw_params,
-        .hw_free =      snd_pcm_lib_free_pages,
+        .hw_free =      snd_pcf8591_hw_free,
         .prepare =      snd_pcf8591_prepare,
         .trigger =      snd_pcf8591_trigger,
         .pointer =      snd_pcf8591_capture_pointer,
+        .get_time_info = snd_pcf8591_get_time_info,
+};
+
+static int snd_pcf8591_decim_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(adc_decim_texts), adc_decim_texts);
+}
+
+static int snd_pcf8591_decim_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+        struct pcf8591_data *data = snd_kcontrol_chip(kcontrol);
+	ucontrol->value.enumerated.item[0] = data->decim.log2_ratio;
+	return 0;
+}
+
+static int snd_pcf8591_decim_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+        struct pcf8591_data *data = snd_kcontrol_chip(kcontrol);
+	unsigned int value = ucontrol->value.enumerated.item[0];
+	unsigned long flags;
+	int retval = 0;
+	
+	if (value >= ARRAY_SIZE(adc_decim_texts))
+		return -EINVAL;
+
+	spin_lock_irqsave(&data->lock, flags);
+	/* the rate of an open stream can not change */
+	if (data->substream)
+		retval = -EBUSY;
+	else if (min(value, adc_decim_max_log2(adc_cal_bits(&data->cal))) != data->decim.log2_ratio) {
+		adc_decim_init(&data->decim, PCF8591_NB_CHAN, adc_cal_bits(&data->cal), value);
+		retval = 1;
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	return retval;
+}
+
+static struct snd_kcontrol_new snd_pcf8591_decim_ctl = {
+        .iface =        SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name =         "Decimation Ratio",
+        .info =         snd_pcf8591_decim_info,
+        .get =          snd_pcf8591_decim_get,
+        .put =          snd_pcf8591_decim_put,
 };
 
+static int snd_pcf8591_cal_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+        struct pcf8591_data *data = snd_kcontrol_chip(kcontrol);
+	ucontrol->value.integer.value[0] = data->cal.enabled;
+	return 0;
+}
+
+static int snd_pcf8591_cal_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+        struct pcf8591_data *data = snd_kcontrol_chip(kcontrol);
+	int value = !!ucontrol->value.integer.value[0];
+	unsigned long flags;
+	int retval = 0;
+	
+	spin_lock_irqsave(&data->lock, flags);
+	/* the unit of an open stream can not change */
+	if (data->substream)
+		retval = -EBUSY;
+	else if (value != data->cal.enabled) {
+		data->cal.enabled = value;
+		adc_decim_init(&data->decim, PCF8591_NB_CHAN, adc_cal_bits(&data->cal), data->decim.log2_ratio);
+		retval = 1;
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	return retval;
+}
+
+static struct snd_kcontrol_new snd_pcf8591_cal_ctl = {
+        .iface =        SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name =         "Calibration Switch",
+        .info =         snd_ctl_boolean_mono_info,
+        .get =          snd_pcf8591_cal_get,
+        .put =          snd_pcf8591_cal_put,
+};
+
+/* sched_policy, sched_priority and cpu_mask attributes of the client */
+static struct adc_thread *pcf8591_thread_of(struct device *dev)
+{
+	struct pcf8591_data *data = i2c_get_clientdata(to_i2c_client(dev));
+	return &data->thread;
+}
+ADC_THREAD_ATTRS(pcf8591_thread_of);
+
+/* calibration attribute of the client */
+static struct adc_cal *pcf8591_cal_of(struct device *dev)
+{
+	struct pcf8591_data *data = i2c_get_clientdata(to_i2c_client(dev));
+	return &data->cal;
+}
+ADC_CAL_ATTRS(pcf8591_cal_of, (PCF8591_NB_CHAN * PCF8591_NB_CODE) * sizeof(s16));
+
 static int pcf8591_probe(struct i2c_client *client, const struct i2c_device_id *i2cid)
 {
 	struct pcf8591_data *data = NULL;
+	char name[TASK_COMM_LEN];
         int err = 0;
 	 
 	printk("pcf8591_probe %s %X %s\n", i2cid->name, client->addr << 1, client->adapter->name);			 
@@ -274,10 +634,26 @@ static int pcf8591_probe(struct i2c_client *client, const struct i2c_device_id *
 	} 
         i2c_set_clientdata(client, data);
         mutex_init(&data->update_lock);
+	spin_lock_init(&data->lock);
+	atomic_set(&data->busy, 0);
+	init_waitqueue_head(&data->idle);
+	err = adc_thread_init(&data->thread, sched_policy, sched_priority, cpu_mask);
+	if (err < 0)
+	{
+		printk("adc_thread_init fails :%d\n",err);
+		goto out_init;
+	}
 
         /* Initialize the PCF8591 chip */
 	printk("pcf8591_init_client %s %X\n", i2cid->name, (unsigned int)client);			 
         pcf8591_init_client(client);	
+	pcf8591_scale_init(data);
+	err = pcf8591_cal_init(data);
+	if (err < 0)
+	{
+		printk("pcf8591_cal_init fails :%d\n",err);
+		goto out_init;
+	}
 	
 	/* create the SND card */
 	printk("snd_card_create %s\n", i2cid->name);			 
@@ -285,7 +661,7 @@ static int pcf8591_probe(struct i2c_client *client, const struct i2c_device_id *
         if (err < 0)
 	{
 		printk("snd_card_create fails :%d\n",err);			 
-		return err;	 
+		goto out_init;
 	}
 	snd_card_set_id(data->card,KBUILD_MODNAME);
 	strcpy(data->card->driver, KBUILD_MODNAME);
@@ -297,7 +673,7 @@ static int pcf8591_probe(struct i2c_client *client, const struct i2c_device_id *
         if (err < 0) 
 	{
 		printk("snd_pcm_new fails :%d\n",err);			 
-                return err;
+		goto out_card;
         }
 	sprintf(data->pcm->name, "DSP");
         data->pcm->private_data = data;	
@@ -307,26 +683,57 @@ static int pcf8591_probe(struct i2c_client *client, const struct i2c_device_id *
         if (err < 0) 
 	{
 		printk("snd_pcm_lib_preallocate_pages_for_all fails :%d\n",err);			 
-                return err;
+		goto out_card;
 	}
 
-	/* create workqueue */
-	data->wq = create_singlethread_workqueue(KBUILD_MODNAME);
-        if (data->wq == NULL) 
+	/* level meter, fed at the acquisition rate */
+	err = adc_meter_new(&data->meter, data->card, PCF8591_NB_CHAN,
+			    USEC_PER_SEC / period, pcf8591_meter_enable, data);
+	if (err < 0)
 	{
-		err = -ENOMEM;
-		printk("create_singlethread_workqueue fails :%d\n",err);	
-                return err;
-        }
-	data->work = (struct my_work_t *)kmalloc(sizeof(struct my_work_t), GFP_KERNEL);
-	if (!data->work)
+		printk("adc_meter_new fails :%d\n",err);
+		goto out_card;
+	}
+
+	/* threshold reflex to a GPIO line, an armed channel keeps the acquisition */
+	err = adc_reflex_new(&data->reflex, data->card, PCF8591_NB_CHAN, pcf8591_meter_enable, data);
+	if (err < 0)
 	{
-		err = -ENOMEM;
-		printk("kmalloc fails :%d\n",err);	
-                return err;
+		printk("adc_reflex_new fails :%d\n",err);
+		goto out_card;
+	}
+
+	/* decimation, off until the ratio is set */
+	adc_decim_init(&data->decim, PCF8591_NB_CHAN, adc_cal_bits(&data->cal), 0);
+	err = snd_ctl_add(data->card, snd_ctl_new1(&snd_pcf8591_decim_ctl, data));
+	if (err < 0)
+	{
+		printk("snd_ctl_add fails :%d\n",err);
+		goto out_reflex;
+	}
+	err = snd_ctl_add(data->card, snd_ctl_new1(&snd_pcf8591_cal_ctl, data));
+	if (err < 0)
+	{
+		printk("snd_ctl_add fails :%d\n",err);
+		goto out_reflex;
+	}
+
+	/* sample clock against CLOCK_MONOTONIC, nominal as announced to the PCM */
+	err = adc_clock_new(&data->clock, data->card, PCF8591_RATE);
+	if (err < 0)
+	{
+		printk("adc_clock_new fails :%d\n",err);
+		goto out_reflex;
+	}
+
+	/* acquisition thread, idle until the capture or the meter starts */
+	snprintf(name, sizeof name, "pcf8591-%s", dev_name(&client->dev));
+	err = adc_thread_start(&data->thread, pcf8591_thread, data, name);
+	if (err < 0)
+	{
+		printk("adc_thread_start fails :%d\n",err);
+		goto out_reflex;
 	}
-	INIT_WORK( (struct work_struct *)data->work, pcf8591_work );
-	data->work->data = data;
 
 	/* register the card */
 	printk("snd_card_register %s\n", i2cid->name);			 
@@ -334,20 +741,51 @@ static int pcf8591_probe(struct i2c_client *client, const struct i2c_device_id *
         if (err < 0) 
 	{
 		printk("snd_card_register fails :%d\n",err);	
-		snd_card_free(data->card);		
-                return err;
+		goto out_thread;
         }
+
+	err = sysfs_create_group(&client->dev.kobj, &adc_thread_group);
+	if (err < 0)
+	{
+		printk("sysfs_create_group fails :%d\n",err);
+		goto out_thread;
+	}
+	err = sysfs_create_group(&client->dev.kobj, &adc_cal_group);
+	if (err < 0)
+	{
+		printk("sysfs_create_group fails :%d\n",err);
+		goto out_groups;
+	}
 	 				
         return 0; 
+
+out_groups:
+	sysfs_remove_group(&client->dev.kobj, &adc_thread_group);
+out_thread:
+	adc_thread_stop(&data->thread);
+out_reflex:
+	adc_reflex_free(&data->reflex);
+out_card:
+	snd_card_free(data->card);
+out_init:
+	mutex_destroy(&data->thread.lock);
+	mutex_destroy(&data->update_lock);
+	return err;
  }
  
  static int pcf8591_remove(struct i2c_client *client)
  {
         struct pcf8591_data *data = i2c_get_clientdata(client);
  	 
-	destroy_workqueue(data->wq);
-	kfree( (void *)data->work );
-	snd_card_disconnect(data->card);
+	sysfs_remove_group(&client->dev.kobj, &adc_cal_group);
+	sysfs_remove_group(&client->dev.kobj, &adc_thread_group);
+	data->meter.enabled = 0;
+	data->reflex.armed = 0;
+	adc_thread_stop(&data->thread);
+	adc_reflex_free(&data->reflex);
+	/* waits for the last close, the data is freed by devm right after */
+	snd_card_free(data->card);
+	mutex_destroy(&data->thread.lock);
 	mutex_destroy (&data->update_lock);
         return 0;
  }
@@ -1,5 +1,43 @@
 /*
  * ALSA Driver for MCP3002 ADC
+ *
+ * A hrtimer fires once per block and queues one SPI message converting
+ * the block, conversions are spaced with delay_usecs to follow the rate.
+ * The completion decodes the block and pushes the frames to the PCM, or
+ * through the trigger when the oscilloscope mode is enabled.
+ *
+ * Every decoded frame also feeds the level meter (adc-meter.h), the
+ * acquisition keeps running without PCM stream while 'Meter Switch' is on.
+ *
+ * With 'Decimation Ratio' above 1 the frames go through a CIC (adc-decim.h)
+ * before the PCM, which then runs at rate / ratio with the extra resolution.
+ * The PCM also offers the standard rates, converted in the kernel (adc-src.h)
+ * from this acquisition rate.
+ *
+ * 'Calibration Switch' maps the codes through the per channel tables of
+ * adc-cal.h, the frames are then millivolts instead of the full scale.
+ *
+ * Each block is stamped with the monotonic time of its first conversion, the
+ * sample clock is estimated from these stamps (adc-clock.h) and the PCM
+ * reports the time of its position as a link audio timestamp.
+ *
+ * Several MCP3002 can be bound (device tree "microchip,mcp3002" or the
+ * "mcp3002" id), one card per device. The devices sharing a SPI controller
+ * share its scheduler : one hrtimer per bus issues the blocks of every
+ * acquiring device. A lone device sends its block as one message spread over
+ * the block time, N devices send one message per frame, interleaved in turn
+ * with 1/N of the frame period each, so every device keeps evenly spaced
+ * conversions until the bus saturates. The turn rotates at each block so no
+ * device always comes last when the bus runs late.
+ *
+ * 'Reflex Mode' arms per channel thresholds (adc-reflex.h) evaluated on every
+ * decoded frame, a trip drives a GPIO line (a MCP23008 relay) from the
+ * acquisition thread right after the block, and the acquisition keeps running
+ * while a channel is armed, like with the meter.
+ *
+ * The completions only stamp the block, a kthread per device (adc-thread.h,
+ * named mcp3002-<device>) decodes it and feeds the meter and the PCM, its
+ * policy, priority and CPU mask are module parameters and device attributes.
  */
 
 #include <linux/err.h>
@@ -8,10 +46,14 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
-#include <linux/platform_device.h>
+#include <linux/slab.h>
 #include <linux/io.h>
 #include <linux/of.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/kthread.h>
 
 #include <sound/initval.h>
 #include <sound/control.h>
@@ -20,95 +62,998 @@
 
 #include <linux/spi/spi.h>
 
-#define BITRATE_MIN	 8000 /* Hardware limit? */
-#define BITRATE_TARGET	8000
-#define BITRATE_MAX	50000 /* Hardware limit. */
+#include "adc-meter.h"
+#include "adc-decim.h"
+#include "adc-src.h"
+#include "adc-cal.h"
+#include "adc-reflex.h"
+#include "adc-clock.h"
+#include "adc-thread.h"
+
+#define MCP3002_RATE_MIN	 1000
+#define MCP3002_RATE_MAX	50000 /* Hardware limit. */
+#define MCP3002_NB_CHAN		2
+#define MCP3002_BLOCK_MIN	8
+#define MCP3002_BLOCK_MAX	512
+#define MCP3002_NB_MSG		2
+#define MCP3002_HISTORY		4096	/* frames of pre-trigger history, power of 2 */
+#define MCP3002_BUS_MAX		8	/* devices sharing a SPI controller */
+
+static int rate = 8000;
+module_param(rate, int, 0444);
+MODULE_PARM_DESC(rate, "Sampling rate in Hz.");
+
+static int src = 1;
+module_param(src, int, 0444);
+MODULE_PARM_DESC(src, "Offer the standard rates through the rate conversion (0 for the sampling rate only).");
+
+static int vref = 3300;
+module_param(vref, int, 0444);
+MODULE_PARM_DESC(vref, "Reference voltage in mV of the nominal calibration tables.");
+
+static char *sched_policy = "fifo";
+module_param(sched_policy, charp, 0444);
+MODULE_PARM_DESC(sched_policy, "Acquisition thread policy : other, fifo or rr.");
+
+static int sched_priority = 50;
+module_param(sched_priority, int, 0444);
+MODULE_PARM_DESC(sched_priority, "Acquisition thread priority (1-99) for fifo and rr.");
+
+static char *cpu_mask = "";
+module_param(cpu_mask, charp, 0444);
+MODULE_PARM_DESC(cpu_mask, "Acquisition thread CPU list, empty for all.");
+
+/* keep the burst a bit shorter than the block so messages never pile up */
+#define MCP3002_BURST_MARGIN	64	/* 1/64 of the block */
+
+/*
+ * Trigger (oscilloscope mode)
+ *
+ * The frames are kept in a circular history while searching for a level
+ * crossing on the source channel, the crossing is armed once the signal
+ * went beyond the level by the hysteresis. Each trigger delivers one
+ * period made of 'pretrigger' frames of history followed by the frames
+ * after the crossing, then no trigger is searched during 'holdoff' frames.
+ */
+enum {
+	TRIG_MODE,
+	TRIG_SOURCE,
+	TRIG_LEVEL,
+	TRIG_HYSTERESIS,
+	TRIG_PRETRIGGER,
+	TRIG_HOLDOFF,
+	TRIG_NB_PARAM
+};
+
+enum {
+	TRIG_MODE_OFF,
+	TRIG_MODE_RISING,
+	TRIG_MODE_FALLING,
+};
+
+enum {
+	TRIG_STATE_IDLE,	/* waiting the signal to go beyond the hysteresis */
+	TRIG_STATE_ARMED,	/* waiting the level crossing */
+	TRIG_STATE_CAPTURE,	/* delivering the window */
+	TRIG_STATE_HOLDOFF,
+};
+
+static const struct {
+	const char	*name;
+	int		min;
+	int		max;
+	int		def;
+} mcp3002_trig_params[TRIG_NB_PARAM] = {
+	[TRIG_MODE]		= { "Trigger Mode",		0, 2,			TRIG_MODE_OFF },
+	[TRIG_SOURCE]		= { "Trigger Source",		0, MCP3002_NB_CHAN - 1,	0 },
+	[TRIG_LEVEL]		= { "Trigger Level",		-32768, 32767,		0 },
+	[TRIG_HYSTERESIS]	= { "Trigger Hysteresis",	0, 32767,		512 },
+	[TRIG_PRETRIGGER]	= { "Trigger Pretrigger",	0, MCP3002_HISTORY - 1,	0 },
+	[TRIG_HOLDOFF]		= { "Trigger Holdoff",		0, 1000000,		0 },
+};
+
+struct mcp3002_trigger {
+	int			param[TRIG_NB_PARAM];
+	int			pending[TRIG_NB_PARAM];	/* set by the controls */
+	int			dirty;		/* pending applied at the next period */
+	int			state;
+	s16			*history;	/* MCP3002_HISTORY frames */
+	unsigned int		history_pos;
+	unsigned int		history_count;
+	unsigned int		remaining;
+	unsigned int		triggers;
+};
+
+struct mcp3002_msg {
+	struct spi_message		msg;	/* the block, alone on the bus */
+	struct spi_transfer		*xfer;
+	struct spi_message		*fmsg;	/* one per frame, shared bus */
+	struct spi_transfer		*fxfer;
+	unsigned int			fshare;	/* devices the frame delays are set for */
+	atomic_t			remaining;
+	int				status;
+	unsigned int			share;	/* devices on the bus for this block */
+	int				ready;	/* completed, for the thread */
+	int				result;
+	ktime_t				done;
+	u8				*tx;
+	u8				*rx;
+	struct snd_mcp3002		*chip;
+	atomic_t			busy;
+};
+
+/* scheduler of the devices sharing a SPI controller */
+struct mcp3002_bus {
+	struct list_head		node;
+	struct spi_master		*master;
+	struct list_head		chips;
+	int				users;
+	struct hrtimer			timer;
+	ktime_t				block_time;
+	int				ticking;
+	unsigned int			turn;
+	spinlock_t			lock;
+};
+
+static LIST_HEAD(mcp3002_buses);
+static DEFINE_MUTEX(mcp3002_buses_lock);
 
 struct snd_mcp3002 {
 	struct snd_card			*card;
 	struct snd_pcm			*pcm;
 	struct snd_pcm_substream	*substream;
-	int				period;	
-	unsigned long			bitrate;
 	struct spi_device		*spi;
-	struct timer_list 		timer;
-	u8				spi_wbuffer[2];
-	u8				spi_rbuffer[2];
+	unsigned int			rate;
+	unsigned int			block;	/* frames per message */
+	ktime_t				block_time;
+	struct mcp3002_bus		*bus;
+	struct list_head		bus_node;
+	int				acq;	/* issued by the bus scheduler */
+	int				running;
+	unsigned int			next_msg;
+	unsigned int			done_msg;	/* next message for the thread */
+	struct adc_thread		thread;
+	unsigned int			overruns;
+	atomic_t			lost;	/* blocks lost since the last completion */
+	struct mcp3002_msg		msgs[MCP3002_NB_MSG];
+	wait_queue_head_t		idle;
+	snd_pcm_uframes_t		hw_ptr;
+	snd_pcm_uframes_t		period_pos;
+	struct mcp3002_trigger		trig;
+	struct adc_meter		meter;
+	struct adc_decim		decim;
+	struct adc_src			src;
+	struct adc_src_rates		src_rates;
+	struct adc_cal			cal;
+	struct adc_reflex		reflex;
+	struct adc_clock		clock;
+	struct adc_tstamp		ts;
 	spinlock_t			lock;
 };
 
-static int snd_mcp3002_write_reg(struct snd_mcp3002 *chip, u8 reg, u8 val)
+/* MCP3002 command : start, single ended, channel, MSB first */
+static inline u8 mcp3002_cmd(int chan)
+{
+	return 0xD0 | ((chan & 1) << 5);
+}
+
+#define MCP3002_BITS		10
+
+static inline u16 mcp3002_code(const u8 *rx)
 {
-	struct spi_message msg;
-	struct spi_transfer msg_xfer = {
-		.len		= 2,
-		.cs_change	= 0,
+	return ((rx[0] << 7) | (rx[1] >> 1)) & 0x3FF;
+}
+
+/* 10 bits code to signed 16 bits */
+static inline s16 mcp3002_decode(u16 code)
+{
+	return (s16)((code - 512) * 64);
+}
+
+static struct snd_pcm_hardware snd_mcp3002_capture_hw = {
+	.info		= SNDRV_PCM_INFO_INTERLEAVED |
+			  SNDRV_PCM_INFO_BLOCK_TRANSFER |
+			  SNDRV_PCM_INFO_MMAP |
+			  SNDRV_PCM_INFO_MMAP_VALID |
+			  SNDRV_PCM_INFO_HAS_LINK_ATIME |
+			  SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME,
+	.formats	= SNDRV_PCM_FMTBIT_S16_LE,
+	.rates		= SNDRV_PCM_RATE_CONTINUOUS,
+	.rate_min	= 8000,  /* Replaced by chip->rate later. */
+	.rate_max	= 50000, /* Replaced by chip->rate later. */
+	.channels_min	= 1,
+	.channels_max	= MCP3002_NB_CHAN,
+	.buffer_bytes_max = 64 * 1024,
+	.period_bytes_min = 256,
+	.period_bytes_max = 32 * 1024,
+	.periods_min	= 2,
+	.periods_max	= 256,
+};
+
+// =======================
+// PCM delivery
+// =======================
+static void snd_mcp3002_pcm_push(struct snd_mcp3002 *chip, const s16 *frame, int *elapsed)
+{
+	struct snd_pcm_runtime *runtime = chip->substream->runtime;
+	s16 *dst = (s16 *)runtime->dma_area + chip->hw_ptr * runtime->channels;
+	unsigned int c;
+
+	for (c = 0; c < runtime->channels; c++)
+		dst[c] = frame[c];
+
+	chip->ts.frames++;
+	if (++chip->hw_ptr >= runtime->buffer_size)
+		chip->hw_ptr = 0;
+	if (++chip->period_pos >= runtime->period_size) {
+		chip->period_pos = 0;
+		*elapsed = 1;
+	}
+}
+
+// =======================
+// Trigger
+// =======================
+static void snd_mcp3002_trig_reset(struct mcp3002_trigger *trig)
+{
+	trig->state = TRIG_STATE_IDLE;
+	trig->history_pos = 0;
+	trig->history_count = 0;
+	trig->remaining = 0;
+}
+
+static void snd_mcp3002_trig_apply(struct mcp3002_trigger *trig)
+{
+	memcpy(trig->param, trig->pending, sizeof(trig->param));
+	trig->dirty = 0;
+	snd_mcp3002_trig_reset(trig);
+}
+
+static int snd_mcp3002_trig_crossing(struct mcp3002_trigger *trig, s16 value)
+{
+	int level = trig->param[TRIG_LEVEL];
+	int hyst = trig->param[TRIG_HYSTERESIS];
+	int rising = (trig->param[TRIG_MODE] == TRIG_MODE_RISING);
+
+	if (trig->state == TRIG_STATE_IDLE) {
+		if (rising ? (value < level - hyst) : (value > level + hyst))
+			trig->state = TRIG_STATE_ARMED;
+		return 0;
+	}
+	return rising ? (value >= level) : (value <= level);
+}
+
+static void snd_mcp3002_trig_push(struct snd_mcp3002 *chip, const s16 *frame, int *elapsed)
+{
+	struct mcp3002_trigger *trig = &chip->trig;
+	struct snd_pcm_runtime *runtime = chip->substream->runtime;
+	unsigned int pre = trig->param[TRIG_PRETRIGGER];
+	unsigned int i;
+
+	switch (trig->state) {
+	case TRIG_STATE_CAPTURE:
+		snd_mcp3002_pcm_push(chip, frame, elapsed);
+		if (--trig->remaining == 0) {
+			trig->triggers++;
+			trig->remaining = trig->param[TRIG_HOLDOFF];
+			trig->state = trig->remaining ? TRIG_STATE_HOLDOFF : TRIG_STATE_IDLE;
+			trig->history_count = 0;
+		}
+		return;
+
+	case TRIG_STATE_HOLDOFF:
+		if (--trig->remaining == 0)
+			trig->state = TRIG_STATE_IDLE;
+		break;
+
+	default:
+		if (pre > runtime->period_size - 1)
+			pre = runtime->period_size - 1;
+		if (trig->history_count >= pre
+		    && snd_mcp3002_trig_crossing(trig, frame[trig->param[TRIG_SOURCE]])) {
+			/* window starts with the history before the crossing */
+			for (i = pre; i > 0; i--) {
+				unsigned int pos = (trig->history_pos - i) & (MCP3002_HISTORY - 1);
+				snd_mcp3002_pcm_push(chip, &trig->history[pos * MCP3002_NB_CHAN], elapsed);
+			}
+			trig->remaining = runtime->period_size - pre;
+			trig->state = TRIG_STATE_CAPTURE;
+			snd_mcp3002_trig_push(chip, frame, elapsed);
+			return;
+		}
+		break;
+	}
+
+	memcpy(&trig->history[trig->history_pos * MCP3002_NB_CHAN], frame,
+	       MCP3002_NB_CHAN * sizeof(s16));
+	trig->history_pos = (trig->history_pos + 1) & (MCP3002_HISTORY - 1);
+	if (trig->history_count < MCP3002_HISTORY)
+		trig->history_count++;
+}
+
+static int snd_mcp3002_trig_info(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_info *uinfo)
+{
+	static const char * const modes[] = { "Off", "Rising", "Falling" };
+	int id = kcontrol->private_value;
+
+	if (id == TRIG_MODE)
+		return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(modes), modes);
+
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = mcp3002_trig_params[id].min;
+	uinfo->value.integer.max = mcp3002_trig_params[id].max;
+	return 0;
+}
+
+static int snd_mcp3002_trig_get(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_mcp3002 *chip = snd_kcontrol_chip(kcontrol);
+	int id = kcontrol->private_value;
+
+	if (id == TRIG_MODE)
+		ucontrol->value.enumerated.item[0] = chip->trig.pending[id];
+	else
+		ucontrol->value.integer.value[0] = chip->trig.pending[id];
+	return 0;
+}
+
+static int snd_mcp3002_trig_put(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_mcp3002 *chip = snd_kcontrol_chip(kcontrol);
+	int id = kcontrol->private_value;
+	unsigned long flags;
+	int value;
+	int changed;
+
+	if (id == TRIG_MODE)
+		value = ucontrol->value.enumerated.item[0];
+	else
+		value = ucontrol->value.integer.value[0];
+	if (value < mcp3002_trig_params[id].min || value > mcp3002_trig_params[id].max)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	changed = (chip->trig.pending[id] != value);
+	chip->trig.pending[id] = value;
+	if (changed) {
+		/* the hw pointer only moves forward, a running period ends with the old parameters */
+		if (chip->substream && chip->period_pos)
+			chip->trig.dirty = 1;
+		else
+			snd_mcp3002_trig_apply(&chip->trig);
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	return changed;
+}
+
+static int snd_mcp3002_trig_new(struct snd_mcp3002 *chip)
+{
+	struct snd_kcontrol_new knew = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_MIXER,
+		.info	= snd_mcp3002_trig_info,
+		.get	= snd_mcp3002_trig_get,
+		.put	= snd_mcp3002_trig_put,
 	};
+	int i;
 	int retval;
 
-	spi_message_init(&msg);
+	chip->trig.history = devm_kcalloc(&chip->spi->dev, MCP3002_HISTORY * MCP3002_NB_CHAN,
+					  sizeof(s16), GFP_KERNEL);
+	if (!chip->trig.history)
+		return -ENOMEM;
+
+	for (i = 0; i < TRIG_NB_PARAM; i++) {
+		chip->trig.param[i] = chip->trig.pending[i] = mcp3002_trig_params[i].def;
+		knew.name = mcp3002_trig_params[i].name;
+		knew.private_value = i;
+		retval = snd_ctl_add(chip->card, snd_ctl_new1(&knew, chip));
+		if (retval < 0)
+			return retval;
+	}
+	snd_mcp3002_trig_reset(&chip->trig);
+	return 0;
+}
 
-	chip->spi_wbuffer[0] = reg;
-	chip->spi_wbuffer[1] = val;
+// =======================
+// Decimation
+// =======================
+static int snd_mcp3002_decim_info(struct snd_kcontrol *kcontrol,
+				  struct snd_ctl_elem_info *uinfo)
+{
+	return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(adc_decim_texts), adc_decim_texts);
+}
 
-	msg_xfer.tx_buf = chip->spi_wbuffer;
-	msg_xfer.rx_buf = chip->spi_rbuffer;
-	spi_message_add_tail(&msg_xfer, &msg);
+static int snd_mcp3002_decim_get(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_mcp3002 *chip = snd_kcontrol_chip(kcontrol);
 
-	retval = spi_sync(chip->spi, &msg);
+	ucontrol->value.enumerated.item[0] = chip->decim.log2_ratio;
+	return 0;
+}
+
+static int snd_mcp3002_decim_put(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_mcp3002 *chip = snd_kcontrol_chip(kcontrol);
+	unsigned int value = ucontrol->value.enumerated.item[0];
+	unsigned long flags;
+	int retval = 0;
+
+	if (value >= ARRAY_SIZE(adc_decim_texts))
+		return -EINVAL;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	/* the rate of an open stream can not change */
+	if (chip->substream)
+		retval = -EBUSY;
+	else if (chip->decim.log2_ratio != min(value, adc_decim_max_log2(adc_cal_bits(&chip->cal)))) {
+		adc_decim_init(&chip->decim, MCP3002_NB_CHAN, adc_cal_bits(&chip->cal), value);
+		retval = 1;
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
 
 	return retval;
 }
 
-static struct snd_pcm_hardware snd_mcp3002_playback_hw = {
-	.info		= SNDRV_PCM_INFO_INTERLEAVED |
-			  SNDRV_PCM_INFO_BLOCK_TRANSFER,
-	.formats	= SNDRV_PCM_FMTBIT_S16_BE,
-	.rates		= SNDRV_PCM_RATE_CONTINUOUS,
-	.rate_min	= 8000,  /* Replaced by chip->bitrate later. */
-	.rate_max	= 50000, /* Replaced by chip->bitrate later. */
-	.channels_min	= 1,
-	.channels_max	= 2,
-	.buffer_bytes_max = 64 * 1024 - 1,
-	.period_bytes_min = 512,
-	.period_bytes_max = 64 * 1024 - 1,
-	.periods_min	= 4,
-	.periods_max	= 1024,
-};
+static int snd_mcp3002_decim_new(struct snd_mcp3002 *chip)
+{
+	static struct snd_kcontrol_new knew = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name	= "Decimation Ratio",
+		.info	= snd_mcp3002_decim_info,
+		.get	= snd_mcp3002_decim_get,
+		.put	= snd_mcp3002_decim_put,
+	};
+
+	adc_decim_init(&chip->decim, MCP3002_NB_CHAN, adc_cal_bits(&chip->cal), 0);
+	return snd_ctl_add(chip->card, snd_ctl_new1(&knew, chip));
+}
+
+// =======================
+// Calibration
+// =======================
+static int snd_mcp3002_cal_get(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_mcp3002 *chip = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = chip->cal.enabled;
+	return 0;
+}
+
+static int snd_mcp3002_cal_put(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_mcp3002 *chip = snd_kcontrol_chip(kcontrol);
+	int value = !!ucontrol->value.integer.value[0];
+	unsigned long flags;
+	int retval = 0;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	/* the unit of an open stream can not change */
+	if (chip->substream)
+		retval = -EBUSY;
+	else if (chip->cal.enabled != value) {
+		chip->cal.enabled = value;
+		adc_decim_init(&chip->decim, MCP3002_NB_CHAN, adc_cal_bits(&chip->cal),
+			       chip->decim.log2_ratio);
+		retval = 1;
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	return retval;
+}
+
+static int snd_mcp3002_cal_new(struct snd_mcp3002 *chip)
+{
+	static struct snd_kcontrol_new knew = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name	= "Calibration Switch",
+		.info	= snd_ctl_boolean_mono_info,
+		.get	= snd_mcp3002_cal_get,
+		.put	= snd_mcp3002_cal_put,
+	};
+	int retval;
 
+	/* single ended inputs */
+	retval = adc_cal_init(&chip->cal, &chip->spi->dev, MCP3002_NB_CHAN, MCP3002_BITS, vref, 0);
+	if (retval)
+		return retval;
+	return snd_ctl_add(chip->card, snd_ctl_new1(&knew, chip));
+}
+
+// =======================
+// SPI messages
+// =======================
+/* acquisition thread : one completed block */
 /*
- * Calculate and set bitrate and divisions.
+ * One frame at the PCM rate, 'next' is the acquisition frame after it, converted
+ * at 'time'. The rate conversion output lags its input by a few frames.
  */
-static int snd_mcp3002_set_bitrate(struct snd_mcp3002 *chip)
+static void snd_mcp3002_deliver(struct snd_mcp3002 *chip, const s16 *frame, u64 next,
+				ktime_t time, u64 frame_ns, int *elapsed)
 {
-	unsigned long ssc_rate = 8000;
-	unsigned long ssc_div;
-	unsigned long ssc_div_max, ssc_div_min;
+	/* the conversion lag is counted in decimated frames */
+	unsigned int delay = min_t(u64, adc_src_delay(&chip->src) * adc_decim_ratio(&chip->decim), next);
+
+	/* the windows stay aligned on periods */
+	if (chip->trig.dirty && !chip->period_pos)
+		snd_mcp3002_trig_apply(&chip->trig);
+	if (chip->trig.param[TRIG_MODE] != TRIG_MODE_OFF) {
+		snd_mcp3002_trig_push(chip, frame, elapsed);
+		return;
+	}
+	snd_mcp3002_pcm_push(chip, frame, elapsed);
+	/* the next PCM frame starts with the next conversion */
+	adc_tstamp_set(&chip->ts, next - delay, ktime_sub_ns(time, delay * frame_ns));
+}
+
+static void snd_mcp3002_block_process(struct mcp3002_msg *m)
+{
+	struct snd_mcp3002 *chip = m->chip;
+	ktime_t done = m->done;
+	int status = m->result;
+	unsigned long flags;
+	unsigned int i;
+	int elapsed = 0;
+	int pcm;
+	s16 frame[MCP3002_NB_CHAN];
+	u64 frame_ns;
+	u64 pos;
+	ktime_t first;
+
+	if (status) {
+		dev_dbg(&chip->spi->dev, "spi message failed:%d\n", status);
+		goto out;
+	}
 
-	/* SSC clock / (bitrate * stereo * 16-bit). */
-	ssc_div = ssc_rate / (BITRATE_TARGET * 2 * 16);
-	ssc_div_min = ssc_rate / (BITRATE_MAX * 2 * 16);
-	ssc_div_max = ssc_rate / (BITRATE_MIN * 2 * 16);
+	/* the last frame took 1/share of the frame period, less the margin */
+	frame_ns = adc_clock_frame_ns(&chip->clock);
+	first = ktime_sub_ns(done, (chip->block - 1) * frame_ns + div_u64(frame_ns, m->share)
+			     - div_u64(frame_ns, MCP3002_BURST_MARGIN));
+
+	spin_lock_irqsave(&chip->lock, flags);
+	pos = chip->clock.frames;
+	adc_clock_block(&chip->clock, first, chip->block);
+	/* the lost blocks were due after this one */
+	adc_clock_skip(&chip->clock, atomic_xchg(&chip->lost, 0) * chip->block);
+
+	pcm = chip->running && chip->substream;
+	for (i = 0; i < chip->block; i++) {
+		const u8 *rx = &m->rx[2 * MCP3002_NB_CHAN * i];
+
+		u16 raw[MCP3002_NB_CHAN] = { mcp3002_code(rx), mcp3002_code(rx + 2) };
+
+		if (chip->cal.enabled)
+			adc_cal_frame(&chip->cal, raw, frame);
+		else {
+			frame[0] = mcp3002_decode(raw[0]);
+			frame[1] = mcp3002_decode(raw[1]);
+		}
+		adc_meter_feed(&chip->meter, frame);
+		adc_reflex_feed(&chip->reflex, frame, ktime_add_ns(first, i * frame_ns));
+		if (!pcm)
+			continue;
+		if (chip->decim.log2_ratio) {
+			s32 code[MCP3002_NB_CHAN] = {
+				frame[0] >> (16 - chip->decim.in_bits),
+				frame[1] >> (16 - chip->decim.in_bits),
+			};
+
+			if (!adc_decim_push(&chip->decim, code, frame))
+				continue;
+		}
+		if (!adc_src_active(&chip->src)) {
+			snd_mcp3002_deliver(chip, frame, pos + i + 1,
+					    ktime_add_ns(first, (i + 1) * frame_ns), frame_ns, &elapsed);
+			continue;
+		}
+		adc_src_push(&chip->src, frame);
+		while (adc_src_pull(&chip->src, frame))
+			snd_mcp3002_deliver(chip, frame, pos + i + 1,
+					    ktime_add_ns(first, (i + 1) * frame_ns), frame_ns, &elapsed);
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
 
-	/* ssc_div must be even. */
-	ssc_div = (ssc_div + 1) & ~1UL;
+	/* the lines first, the PCM can wait */
+	adc_reflex_apply(&chip->reflex);
+	if (elapsed)
+		snd_pcm_period_elapsed(chip->substream);
+out:
+	atomic_set(&m->busy, 0);
+	wake_up(&chip->idle);
+}
 
-	if ((ssc_rate / (ssc_div * 2 * 16)) < BITRATE_MIN) {
-		ssc_div -= 2;
-		if ((ssc_rate / (ssc_div * 2 * 16)) > BITRATE_MAX)
-			return -ENXIO;
+static int snd_mcp3002_thread(void *data)
+{
+	struct snd_mcp3002 *chip = data;
+
+	while (!kthread_should_stop()) {
+		struct mcp3002_msg *m = &chip->msgs[chip->done_msg];
+
+		wait_event_interruptible(chip->thread.wait,
+					 READ_ONCE(m->ready) || kthread_should_stop());
+		if (!READ_ONCE(m->ready))
+			continue;
+		smp_rmb();
+		m->ready = 0;
+		chip->done_msg = (chip->done_msg + 1) % MCP3002_NB_MSG;
+		snd_mcp3002_block_process(m);
 	}
+	return 0;
+}
+
+/* SPI completion : stamp the block and hand it to the thread */
+static void snd_mcp3002_block_done(struct mcp3002_msg *m, int status)
+{
+	struct snd_mcp3002 *chip = m->chip;
+
+	m->done = ktime_get();
+	m->result = status;
+	smp_wmb();
+	WRITE_ONCE(m->ready, 1);
+	wake_up(&chip->thread.wait);
+}
+
+static void snd_mcp3002_msg_complete(void *context)
+{
+	struct mcp3002_msg *m = context;
 
-	/* SSC clock / (ssc divider * 16-bit * stereo). */
-	chip->bitrate = ssc_rate / (ssc_div * 16 * 2);
+	snd_mcp3002_block_done(m, m->msg.status);
+}
 
-	dev_info(&chip->spi->dev,
-			"mcp3002: supported bitrate is %lu (%lu divider)\n",
-			chip->bitrate, ssc_div);
+/* the block is done with its last frame message */
+static void snd_mcp3002_frame_complete(void *context)
+{
+	struct mcp3002_msg *m = context;
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&m->remaining))
+		return;
+	for (i = 0; i < m->chip->block && !m->status; i++)
+		m->status = m->fmsg[i].status;
+	snd_mcp3002_block_done(m, m->status);
+}
 
+static void snd_mcp3002_msg_free(struct snd_mcp3002 *chip)
+{
+	int i;
+
+	for (i = 0; i < MCP3002_NB_MSG; i++) {
+		kfree(chip->msgs[i].xfer);
+		kfree(chip->msgs[i].fmsg);
+		kfree(chip->msgs[i].fxfer);
+		kfree(chip->msgs[i].tx);
+		kfree(chip->msgs[i].rx);
+		chip->msgs[i].xfer = NULL;
+		chip->msgs[i].fmsg = NULL;
+		chip->msgs[i].fxfer = NULL;
+		chip->msgs[i].tx = NULL;
+		chip->msgs[i].rx = NULL;
+	}
+}
+
+/*
+ * Preallocate the messages for one block : one transfer per conversion,
+ * chip select toggles between them, the delays spread the block over
+ * the block time. The same conversions are also split in one message per
+ * frame for the shared bus, their delays are set by the scheduler.
+ */
+static int snd_mcp3002_msg_alloc(struct snd_mcp3002 *chip)
+{
+	unsigned int nxfer = chip->block * MCP3002_NB_CHAN;
+	u64 frame_ns = div_u64(NSEC_PER_SEC, chip->rate);
+	u64 wire_ns = div_u64(MCP3002_NB_CHAN * 16 * (u64)NSEC_PER_SEC, chip->spi->max_speed_hz);
+	s64 delay_ns = frame_ns - wire_ns - div_u64(frame_ns, MCP3002_BURST_MARGIN);
+	s64 err = 0;
+	unsigned int j;
+	int i;
+
+	if (delay_ns < 0)
+		delay_ns = 0;
+
+	for (i = 0; i < MCP3002_NB_MSG; i++) {
+		struct mcp3002_msg *m = &chip->msgs[i];
+
+		m->xfer = kcalloc(nxfer, sizeof(*m->xfer), GFP_KERNEL);
+		m->fmsg = kcalloc(chip->block, sizeof(*m->fmsg), GFP_KERNEL);
+		m->fxfer = kcalloc(nxfer, sizeof(*m->fxfer), GFP_KERNEL);
+		m->tx = kcalloc(nxfer, 2, GFP_KERNEL);
+		m->rx = kcalloc(nxfer, 2, GFP_KERNEL);
+		if (!m->xfer || !m->fmsg || !m->fxfer || !m->tx || !m->rx) {
+			snd_mcp3002_msg_free(chip);
+			return -ENOMEM;
+		}
+
+		spi_message_init(&m->msg);
+		m->msg.complete = snd_mcp3002_msg_complete;
+		m->msg.context = m;
+		m->chip = chip;
+		atomic_set(&m->busy, 0);
+		for (j = 0; j < nxfer; j++) {
+			m->tx[2 * j] = mcp3002_cmd(j % MCP3002_NB_CHAN);
+			m->xfer[j].tx_buf = &m->tx[2 * j];
+			m->xfer[j].rx_buf = &m->rx[2 * j];
+			m->xfer[j].len = 2;
+			m->xfer[j].cs_change = (j != nxfer - 1);
+			if (j % MCP3002_NB_CHAN == MCP3002_NB_CHAN - 1) {
+				s64 d = delay_ns + err;
+
+				m->xfer[j].delay_usecs = div_s64(d, NSEC_PER_USEC);
+				err = d - (s64)m->xfer[j].delay_usecs * NSEC_PER_USEC;
+			}
+			spi_message_add_tail(&m->xfer[j], &m->msg);
+		}
+
+		for (j = 0; j < chip->block; j++) {
+			struct spi_message *f = &m->fmsg[j];
+			unsigned int k;
+
+			spi_message_init(f);
+			f->complete = snd_mcp3002_frame_complete;
+			f->context = m;
+			for (k = j * MCP3002_NB_CHAN; k < (j + 1) * MCP3002_NB_CHAN; k++) {
+				m->fxfer[k] = m->xfer[k];
+				m->fxfer[k].cs_change = (k % MCP3002_NB_CHAN != MCP3002_NB_CHAN - 1);
+				m->fxfer[k].delay_usecs = 0;
+				spi_message_add_tail(&m->fxfer[k], f);
+			}
+		}
+		m->fshare = 0;
+	}
 	return 0;
 }
 
+/* each frame message takes 1/share of the frame period */
+static void snd_mcp3002_frame_delays(struct snd_mcp3002 *chip, struct mcp3002_msg *m,
+				     unsigned int share)
+{
+	u64 slot_ns = div_u64(div_u64(NSEC_PER_SEC, chip->rate), share);
+	u64 wire_ns = div_u64(MCP3002_NB_CHAN * 16 * (u64)NSEC_PER_SEC, chip->spi->max_speed_hz);
+	s64 delay_ns = slot_ns - wire_ns - div_u64(slot_ns, MCP3002_BURST_MARGIN);
+	s64 err = 0;
+	unsigned int j;
+
+	if (m->fshare == share)
+		return;
+	if (delay_ns < 0)
+		delay_ns = 0;
+	for (j = 0; j < chip->block; j++) {
+		struct spi_transfer *x = &m->fxfer[(j + 1) * MCP3002_NB_CHAN - 1];
+		s64 d = delay_ns + err;
+
+		x->delay_usecs = div_s64(d, NSEC_PER_USEC);
+		err = d - (s64)x->delay_usecs * NSEC_PER_USEC;
+	}
+	m->fshare = share;
+}
+
+// =======================
+// bus scheduler
+// =======================
+static void snd_mcp3002_issue_block(struct snd_mcp3002 *chip)
+{
+	struct mcp3002_msg *m = &chip->msgs[chip->next_msg];
+
+	m->share = 1;
+	if (spi_async(chip->spi, &m->msg)) {
+		atomic_set(&m->busy, 0);
+		chip->overruns++;
+		atomic_inc(&chip->lost);
+	} else {
+		chip->next_msg = (chip->next_msg + 1) % MCP3002_NB_MSG;
+	}
+}
+
+/* frame i of every device, then frame i + 1, starting with device 'turn' */
+static void snd_mcp3002_issue_frames(struct snd_mcp3002 **active, unsigned int n,
+				     unsigned int turn)
+{
+	unsigned int i;
+	unsigned int k;
+	int retval;
+
+	for (k = 0; k < n; k++) {
+		struct snd_mcp3002 *chip = active[k];
+		struct mcp3002_msg *m = &chip->msgs[chip->next_msg];
+
+		snd_mcp3002_frame_delays(chip, m, n);
+		m->share = n;
+		m->status = 0;
+		atomic_set(&m->remaining, chip->block);
+	}
+
+	for (i = 0; i < active[0]->block; i++) {
+		for (k = 0; k < n; k++) {
+			struct snd_mcp3002 *chip = active[(k + turn) % n];
+			struct mcp3002_msg *m = &chip->msgs[chip->next_msg];
+
+			retval = spi_async(chip->spi, &m->fmsg[i]);
+			if (retval) {
+				/* the block is lost, it completes with the frames already queued */
+				if (!m->status) {
+					chip->overruns++;
+					atomic_inc(&chip->lost);
+				}
+				m->status = retval;
+				snd_mcp3002_frame_complete(m);
+			}
+		}
+	}
+
+	for (k = 0; k < n; k++)
+		active[k]->next_msg = (active[k]->next_msg + 1) % MCP3002_NB_MSG;
+}
+
+/* the meter or an armed reflex keep the acquisition without stream */
+static inline int snd_mcp3002_standby(struct snd_mcp3002 *chip)
+{
+	return chip->meter.enabled || chip->reflex.armed;
+}
+
+static enum hrtimer_restart snd_mcp3002_bus_tick(struct hrtimer *timer)
+{
+	struct mcp3002_bus *bus = container_of(timer, struct mcp3002_bus, timer);
+	struct snd_mcp3002 *active[MCP3002_BUS_MAX];
+	struct snd_mcp3002 *chip;
+	unsigned int n = 0;
+	unsigned int turn;
+	int acq = 0;
+
+	spin_lock(&bus->lock);
+	list_for_each_entry(chip, &bus->chips, bus_node) {
+		struct mcp3002_msg *m = &chip->msgs[chip->next_msg];
+
+		if (chip->acq && !chip->running && !snd_mcp3002_standby(chip))
+			chip->acq = 0;
+		if (!chip->acq)
+			continue;
+		acq++;
+		if (atomic_read(&m->busy)) {
+			/* the bus did not follow, this block is lost */
+			chip->overruns++;
+			atomic_inc(&chip->lost);
+			continue;
+		}
+		atomic_set(&m->busy, 1);
+		active[n++] = chip;
+	}
+	if (!acq)
+		bus->ticking = 0;
+	turn = bus->turn++;
+	spin_unlock(&bus->lock);
+
+	if (!acq)
+		return HRTIMER_NORESTART;
+
+	/* the messages are marked busy, the devices stay until they complete */
+	if (n == 1)
+		snd_mcp3002_issue_block(active[0]);
+	else if (n > 1)
+		snd_mcp3002_issue_frames(active, n, turn % n);
+
+	hrtimer_forward_now(timer, bus->block_time);
+	return HRTIMER_RESTART;
+}
+
+static int snd_mcp3002_bus_get(struct snd_mcp3002 *chip)
+{
+	struct mcp3002_bus *bus;
+	unsigned long flags;
+	int retval = 0;
+
+	mutex_lock(&mcp3002_buses_lock);
+	list_for_each_entry(bus, &mcp3002_buses, node) {
+		if (bus->master == chip->spi->master)
+			goto found;
+	}
+
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	bus->master = chip->spi->master;
+	INIT_LIST_HEAD(&bus->chips);
+	spin_lock_init(&bus->lock);
+	/* the rate is a module parameter, all the devices share the block time */
+	bus->block_time = chip->block_time;
+	hrtimer_init(&bus->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bus->timer.function = snd_mcp3002_bus_tick;
+	list_add_tail(&bus->node, &mcp3002_buses);
+
+found:
+	if (bus->users == MCP3002_BUS_MAX) {
+		retval = -EBUSY;
+		goto out;
+	}
+	bus->users++;
+	spin_lock_irqsave(&bus->lock, flags);
+	list_add_tail(&chip->bus_node, &bus->chips);
+	spin_unlock_irqrestore(&bus->lock, flags);
+	chip->bus = bus;
+out:
+	mutex_unlock(&mcp3002_buses_lock);
+	return retval;
+}
+
+static void snd_mcp3002_bus_put(struct snd_mcp3002 *chip)
+{
+	struct mcp3002_bus *bus = chip->bus;
+	unsigned long flags;
+
+	if (!bus)
+		return;
+
+	mutex_lock(&mcp3002_buses_lock);
+	spin_lock_irqsave(&bus->lock, flags);
+	list_del(&chip->bus_node);
+	spin_unlock_irqrestore(&bus->lock, flags);
+	chip->bus = NULL;
+	if (--bus->users == 0) {
+		hrtimer_cancel(&bus->timer);
+		list_del(&bus->node);
+		kfree(bus);
+	}
+	mutex_unlock(&mcp3002_buses_lock);
+}
+
+/* the acquisition runs while a stream is running, the meter is on or the reflex armed */
+static void snd_mcp3002_acq_start(struct snd_mcp3002 *chip)
+{
+	struct mcp3002_bus *bus = chip->bus;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	if (!chip->acq) {
+		adc_clock_start(&chip->clock);
+		atomic_set(&chip->lost, 0);
+		chip->acq = 1;
+	}
+	if (!bus->ticking) {
+		bus->ticking = 1;
+		hrtimer_start(&bus->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&bus->lock, flags);
+}
+
+static void snd_mcp3002_acq_stop(struct snd_mcp3002 *chip)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->bus->lock, flags);
+	chip->acq = 0;
+	spin_unlock_irqrestore(&chip->bus->lock, flags);
+}
+
+static void snd_mcp3002_wait_idle(struct snd_mcp3002 *chip)
+{
+	int i;
+
+	snd_mcp3002_acq_stop(chip);
+	for (i = 0; i < MCP3002_NB_MSG; i++)
+		wait_event(chip->idle, !atomic_read(&chip->msgs[i].busy));
+}
+
+static void snd_mcp3002_standby_enable(void *priv, int on)
+{
+	struct snd_mcp3002 *chip = priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	if (on)
+		snd_mcp3002_acq_start(chip);
+	else if (!chip->running && !snd_mcp3002_standby(chip))
+		snd_mcp3002_acq_stop(chip);
+	spin_unlock_irqrestore(&chip->lock, flags);
+}
+
 // =======================
 // PCM callbacks
 // =======================
@@ -118,13 +1063,17 @@ static int snd_mcp3002_pcm_open(struct snd_pcm_substream *substream)
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	int err;
 
+	runtime->hw = snd_mcp3002_capture_hw;
+
+	/* the acquisition rate, and the standard ones through the conversion */
+	err = adc_src_constraint(runtime, &chip->src_rates, chip->rate / adc_decim_ratio(&chip->decim), src);
+	if (err < 0)
+		return err;
+
 	/* ensure buffer_size is a multiple of period_size */
 	err = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
 	if (err < 0)
 		return err;
-	snd_mcp3002_playback_hw.rate_min = chip->bitrate;
-	snd_mcp3002_playback_hw.rate_max = chip->bitrate;
-	runtime->hw = snd_mcp3002_playback_hw;
 	chip->substream = substream;
 
 	return 0;
@@ -133,26 +1082,60 @@ static int snd_mcp3002_pcm_open(struct snd_pcm_substream *substream)
 static int snd_mcp3002_pcm_close(struct snd_pcm_substream *substream)
 {
 	struct snd_mcp3002 *chip = snd_pcm_substream_chip(substream);
+
+	snd_mcp3002_wait_idle(chip);
 	chip->substream = NULL;
+	if (snd_mcp3002_standby(chip))
+		snd_mcp3002_acq_start(chip);
 	return 0;
 }
 
 static int snd_mcp3002_pcm_hw_params(struct snd_pcm_substream *substream,
 				 struct snd_pcm_hw_params *hw_params)
 {
+	struct snd_mcp3002 *chip = snd_pcm_substream_chip(substream);
+	int err;
+
+	/* not running, the acquisition thread does not touch the conversion */
+	adc_src_free(&chip->src);
+	err = adc_src_init(&chip->src, MCP3002_NB_CHAN, chip->rate / adc_decim_ratio(&chip->decim),
+			   params_rate(hw_params));
+	if (err < 0)
+		return err;
 	return snd_pcm_lib_malloc_pages(substream,params_buffer_bytes(hw_params));
 }
 
 static int snd_mcp3002_pcm_hw_free(struct snd_pcm_substream *substream)
 {
+	struct snd_mcp3002 *chip = snd_pcm_substream_chip(substream);
+
+	adc_src_free(&chip->src);
 	return snd_pcm_lib_free_pages(substream);
 }
 
 static int snd_mcp3002_pcm_prepare(struct snd_pcm_substream *substream)
 {
 	struct snd_mcp3002 *chip = snd_pcm_substream_chip(substream);
-	chip->period = 0;
-	
+	unsigned long flags;
+
+	snd_mcp3002_wait_idle(chip);
+
+	spin_lock_irqsave(&chip->lock, flags);
+	chip->hw_ptr = 0;
+	chip->period_pos = 0;
+	/*
+	 * next_msg and done_msg are left alone : once idle every message issued
+	 * was processed so they agree, and the thread may already wait on
+	 * msgs[done_msg].
+	 */
+	snd_mcp3002_trig_apply(&chip->trig);
+	adc_decim_init(&chip->decim, MCP3002_NB_CHAN, adc_cal_bits(&chip->cal), chip->decim.log2_ratio);
+	adc_src_reset(&chip->src);
+	adc_tstamp_reset(&chip->ts);
+	if (snd_mcp3002_standby(chip))
+		snd_mcp3002_acq_start(chip);
+	spin_unlock_irqrestore(&chip->lock, flags);
+
 	return 0;
 }
 
@@ -166,15 +1149,20 @@ static int snd_mcp3002_pcm_trigger(struct snd_pcm_substream *substream,
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
+		chip->running = 1;
+		snd_mcp3002_acq_start(chip);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
+		chip->running = 0;
+		if (!snd_mcp3002_standby(chip))
+			snd_mcp3002_acq_stop(chip);
 		break;
 	default:
 		dev_dbg(&chip->spi->dev, "spurious command %x\n", cmd);
 		retval = -EINVAL;
 		break;
 	}
- 
+
 	spin_unlock(&chip->lock);
 
 	return retval;
@@ -183,15 +1171,32 @@ static int snd_mcp3002_pcm_trigger(struct snd_pcm_substream *substream,
 static snd_pcm_uframes_t snd_mcp3002_pcm_pointer(struct snd_pcm_substream *substream)
 {
 	struct snd_mcp3002 *chip = snd_pcm_substream_chip(substream);
-	struct snd_pcm_runtime *runtime = substream->runtime;
-	snd_pcm_uframes_t pos;
-	unsigned long bytes = 0;
 
-	pos = bytes_to_frames(runtime, bytes);
-	if (pos >= runtime->buffer_size)
-		pos -= runtime->buffer_size;
+	return chip->hw_ptr;
+}
 
-	return pos;
+static int snd_mcp3002_pcm_get_time_info(struct snd_pcm_substream *substream,
+					 struct timespec *system_ts, struct timespec *audio_ts,
+					 struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+					 struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct snd_mcp3002 *chip = snd_pcm_substream_chip(substream);
+	struct adc_tstamp ts;
+	unsigned long flags;
+	int trig;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	ts = chip->ts;
+	trig = chip->trig.param[TRIG_MODE];
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	/* the oscilloscope windows are not contiguous, no link time */
+	if (trig != TRIG_MODE_OFF) {
+		audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+	return adc_clock_time_info(&chip->clock, &ts, substream, system_ts, audio_ts,
+				   audio_tstamp_config, audio_tstamp_report);
 }
 
 static struct snd_pcm_ops snd_mcp3002_capture_ops = {
@@ -203,52 +1208,10 @@ static struct snd_pcm_ops snd_mcp3002_capture_ops = {
 	.prepare	= snd_mcp3002_pcm_prepare,
 	.trigger	= snd_mcp3002_pcm_trigger,
 	.pointer	= snd_mcp3002_pcm_pointer,
+	.get_time_info	= snd_mcp3002_pcm_get_time_info,
 };
 // =======================
 
-// =======================
-// timer callback
-// =======================
-static void my_timer_callback( unsigned long data )
-{
-	struct snd_mcp3002 *chip = (struct snd_mcp3002 *)data;
-	struct snd_pcm_runtime *runtime = chip->substream->runtime;
-	int offset;
-	int block_size;
-	int next_period;
-	int retval;
-	u16 value;
-
-	printk("Timer callback\n");
-	
-	spin_lock(&chip->lock);
-
-	block_size = frames_to_bytes(runtime, runtime->period_size);
-	
-	retval = snd_mcp3002_write_reg(chip, 0xD0,0);
-	if (!retval)
-	{
-		chip->period++;
-		if (chip->period == runtime->periods)
-			chip->period = 0;
-		next_period = chip->period + 1;
-		if (next_period == runtime->periods)
-			next_period = 0;
-
-		offset = block_size * next_period;
-		
-		value = ( (chip->spi_rbuffer[0]*128) | (chip->spi_rbuffer[1]>>1) );
-	}
-	
-	spin_unlock(&chip->lock);
-
-	snd_pcm_period_elapsed(chip->substream);
-
-	retval = mod_timer( &chip->timer, jiffies + msecs_to_jiffies(200) );
-	if (retval) 
-		printk("Error in mod_timer\n");	
-}
-
 static int snd_mcp3002_pcm_new(struct snd_mcp3002 *chip, int device)
 {
 	struct snd_pcm *pcm;
@@ -265,33 +1228,56 @@ static int snd_mcp3002_pcm_new(struct snd_mcp3002 *chip, int device)
 
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_mcp3002_capture_ops);
 
-	retval = snd_pcm_lib_preallocate_pages_for_all(chip->pcm, SNDRV_DMA_TYPE_DEV, NULL, 64 * 1024, 64 * 1024);
+	retval = snd_pcm_lib_preallocate_pages_for_all(chip->pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+			snd_dma_continuous_data(GFP_KERNEL), 64 * 1024, 64 * 1024);
 out:
 	return retval;
 }
 
 static int snd_mcp3002_chip_init(struct snd_mcp3002 *chip)
 {
+	struct spi_device *spi = chip->spi;
 	int retval;
 
-	retval = snd_mcp3002_set_bitrate(chip);
+	spi->bits_per_word = 8;
+	spi->mode = SPI_MODE_0;
+	retval = spi_setup(spi);
 	if (retval)
 	{
-		printk("snd_mcp3002_set_bitrate failed:%d\n", retval);
+		printk("spi_setup failed:%d\n", retval);
 		goto out;
 	}
 
-	setup_timer( &chip->timer, my_timer_callback, (unsigned long)chip );
+	if (rate < MCP3002_RATE_MIN || rate > MCP3002_RATE_MAX
+	    || (u64)rate * MCP3002_NB_CHAN * 16 > spi->max_speed_hz)
+	{
+		printk("rate %d not supported at %u Hz\n", rate, spi->max_speed_hz);
+		retval = -EINVAL;
+		goto out;
+	}
+	chip->rate = rate;
+
+	/* one message every 2ms */
+	chip->block = clamp_t(unsigned int, chip->rate / 500, MCP3002_BLOCK_MIN, MCP3002_BLOCK_MAX);
+	chip->block_time = ns_to_ktime(div_u64((u64)chip->block * NSEC_PER_SEC, chip->rate));
+
+	retval = snd_mcp3002_msg_alloc(chip);
+	if (retval)
+	{
+		printk("snd_mcp3002_msg_alloc failed:%d\n", retval);
+		goto out;
+	}
 
-	printk( "Starting timer to fire in 200ms (%ld)\n", jiffies );
-	retval = mod_timer( &chip->timer, jiffies + msecs_to_jiffies(200) );
-	if (retval) 
+	retval = snd_mcp3002_bus_get(chip);
+	if (retval)
 	{
-		printk("Error in mod_timer\n");
+		snd_mcp3002_msg_free(chip);
+		printk("snd_mcp3002_bus_get failed:%d\n", retval);
+		goto out;
 	}
-	
-	goto out;
 
+	dev_info(&spi->dev, "mcp3002: rate %u Hz, %u frames per message, %d device(s) on the bus\n",
+		 chip->rate, chip->block, chip->bus->users);
 out:
 	return retval;
 }
@@ -299,13 +1285,17 @@ out:
 static int snd_mcp3002_dev_free(struct snd_device *device)
 {
 	struct snd_mcp3002 *chip = device->device_data;
-	int retval = del_timer( &chip->timer );
-	
-	if (retval) 
-	{
-		printk("The timer is still in use...\n");
-	}
-	
+
+	chip->meter.enabled = 0;
+	chip->reflex.armed = 0;
+	snd_mcp3002_wait_idle(chip);
+	adc_thread_stop(&chip->thread);
+	adc_reflex_free(&chip->reflex);
+	snd_mcp3002_bus_put(chip);
+	snd_mcp3002_msg_free(chip);
+	if (chip->overruns)
+		dev_info(&chip->spi->dev, "mcp3002: %u blocks lost\n", chip->overruns);
+
 	return 0;
 }
 
@@ -316,11 +1306,20 @@ static int snd_mcp3002_dev_init(struct snd_card *card,
 		.dev_free	= snd_mcp3002_dev_free,
 	};
 	struct snd_mcp3002 *chip = card->private_data;
+	char name[TASK_COMM_LEN];
 	int retval;
 
 	spin_lock_init(&chip->lock);
+	init_waitqueue_head(&chip->idle);
 	chip->card = card;
-	
+
+	retval = adc_thread_init(&chip->thread, sched_policy, sched_priority, cpu_mask);
+	if (retval)
+	{
+		printk("adc_thread_init failed:%d\n", retval);
+		goto out;
+	}
+
 	retval = snd_mcp3002_chip_init(chip);
 	if (retval)
 	{
@@ -328,6 +1327,23 @@ static int snd_mcp3002_dev_init(struct snd_card *card,
 		goto out;
 	}
 
+	retval = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
+	if (retval)
+	{
+		snd_mcp3002_bus_put(chip);
+		snd_mcp3002_msg_free(chip);
+		printk("snd_device_new failed:%d\n", retval);
+		goto out;
+	}
+
+	snprintf(name, sizeof name, "mcp3002-%s", dev_name(&spi->dev));
+	retval = adc_thread_start(&chip->thread, snd_mcp3002_thread, chip, name);
+	if (retval)
+	{
+		printk("adc_thread_start failed:%d\n", retval);
+		goto out;
+	}
+
 	retval = snd_mcp3002_pcm_new(chip, 0);
 	if (retval)
 	{
@@ -335,21 +1351,75 @@ static int snd_mcp3002_dev_init(struct snd_card *card,
 		goto out;
 	}
 
-	retval = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
+	retval = snd_mcp3002_trig_new(chip);
 	if (retval)
 	{
-		printk("snd_device_new failed:%d\n", retval);
+		printk("snd_mcp3002_trig_new failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = snd_mcp3002_cal_new(chip);
+	if (retval)
+	{
+		printk("snd_mcp3002_cal_new failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = snd_mcp3002_decim_new(chip);
+	if (retval)
+	{
+		printk("snd_mcp3002_decim_new failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = adc_meter_new(&chip->meter, card, MCP3002_NB_CHAN, chip->rate,
+			       snd_mcp3002_standby_enable, chip);
+	if (retval)
+	{
+		printk("adc_meter_new failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = adc_reflex_new(&chip->reflex, card, MCP3002_NB_CHAN,
+				snd_mcp3002_standby_enable, chip);
+	if (retval)
+	{
+		printk("adc_reflex_new failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = adc_clock_new(&chip->clock, card, chip->rate);
+	if (retval)
+	{
+		printk("adc_clock_new failed:%d\n", retval);
 		goto out;
 	}
 
-	snd_card_set_dev(card, &spi->dev);
 out:
 
 	return retval;
 }
 
+static struct adc_thread *snd_mcp3002_thread_of(struct device *dev)
+{
+	struct snd_card *card = dev_get_drvdata(dev);
+	struct snd_mcp3002 *chip = card->private_data;
+
+	return &chip->thread;
+}
+ADC_THREAD_ATTRS(snd_mcp3002_thread_of);
+
+static struct adc_cal *snd_mcp3002_cal_of(struct device *dev)
+{
+	struct snd_card *card = dev_get_drvdata(dev);
+	struct snd_mcp3002 *chip = card->private_data;
+
+	return &chip->cal;
+}
+ADC_CAL_ATTRS(snd_mcp3002_cal_of, (MCP3002_NB_CHAN << MCP3002_BITS) * sizeof(s16));
+
 static int snd_mcp3002_probe(struct spi_device *spi)
-{	
+{
 	struct snd_card			*card;
 	struct snd_mcp3002		*chip;
 	int				retval;
@@ -357,9 +1427,9 @@ static int snd_mcp3002_probe(struct spi_device *spi)
 
 
 	printk("snd_mcp3002_probe\n");
-	
-	// alsa card initialization
-	snprintf(id, sizeof id, KBUILD_MODNAME);
+
+	// alsa card initialization, one card per device
+	snprintf(id, sizeof id, "mcp3002_%d_%d", spi->master->bus_num, spi->chip_select);
 	retval = snd_card_new(&spi->dev, -1, id, THIS_MODULE, sizeof(struct snd_mcp3002), &card);
 	if (retval < 0)
 	{
@@ -369,7 +1439,18 @@ static int snd_mcp3002_probe(struct spi_device *spi)
 
 	strcpy(card->driver, KBUILD_MODNAME);
 	strcpy(card->shortname, KBUILD_MODNAME);
-	strcpy(card->longname, KBUILD_MODNAME);
+	snprintf(card->longname, sizeof(card->longname), "MCP3002 at %s", dev_name(&spi->dev));
+
+	// spi initialization
+	chip = card->private_data;
+	chip->spi = spi;
+
+	retval = snd_mcp3002_dev_init(card, spi);
+	if (retval)
+	{
+		printk("snd_mcp3002_dev_init failed:%d\n", retval);
+		goto out_card;
+	}
 
 	retval = snd_card_register(card);
 	if (retval)
@@ -378,18 +1459,24 @@ static int snd_mcp3002_probe(struct spi_device *spi)
 		goto out_card;
 	}
 
-	// spi initialization
-	chip = card->private_data;
-	chip->spi = spi;
+	dev_set_drvdata(&spi->dev, card);
 
-	retval = snd_mcp3002_dev_init(card, spi);
-	if (retval) 
+	retval = sysfs_create_group(&spi->dev.kobj, &adc_thread_group);
+	if (retval)
 	{
-		printk("snd_mcp3002_dev_init failed:%d\n", retval);
+		printk("sysfs_create_group failed:%d\n", retval);
+		dev_set_drvdata(&spi->dev, NULL);
+		goto out_card;
+	}
+
+	retval = sysfs_create_group(&spi->dev.kobj, &adc_cal_group);
+	if (retval)
+	{
+		printk("sysfs_create_group failed:%d\n", retval);
+		sysfs_remove_group(&spi->dev.kobj, &adc_thread_group);
+		dev_set_drvdata(&spi->dev, NULL);
 		goto out_card;
 	}
-		
-	dev_set_drvdata(&spi->dev, card);
 
 	goto out;
 
@@ -402,22 +1489,37 @@ out:
 static int snd_mcp3002_remove(struct spi_device *spi)
 {
 	struct snd_card *card = dev_get_drvdata(&spi->dev);
-	struct snd_mcp3002 *chip = card->private_data;
 	int retval = 0;
 
 	printk("snd_mcp3002_remove\n");
-	
+
+	sysfs_remove_group(&spi->dev.kobj, &adc_cal_group);
+	sysfs_remove_group(&spi->dev.kobj, &adc_thread_group);
 	snd_card_free(card);
 	dev_set_drvdata(&spi->dev, NULL);
 
 	return retval;
 }
 
+static const struct of_device_id mcp3002_of_match[] = {
+	{ .compatible = "microchip,mcp3002" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, mcp3002_of_match);
+
+static const struct spi_device_id mcp3002_id[] = {
+	{ "mcp3002", 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(spi, mcp3002_id);
+
 static struct spi_driver mcp3002_driver = {
-	.driver		= { 
-		.name	= "spidev", 
-		.owner  = THIS_MODULE
+	.driver		= {
+		.name	= KBUILD_MODNAME,
+		.owner  = THIS_MODULE,
+		.of_match_table = of_match_ptr(mcp3002_of_match),
 	},
+	.id_table	= mcp3002_id,
 	.probe		= snd_mcp3002_probe,
 	.remove		= snd_mcp3002_remove,
 };
@@ -425,7 +1527,7 @@ static struct spi_driver mcp3002_driver = {
 static int __init mcp3002_init(void)
 {
 	int ret;
-	
+
 	printk("mcp3002_init\n");
 	ret = spi_register_driver(&mcp3002_driver);
 	if (ret <0 )
@@ -0,0 +1,510 @@
+/*
+ * ALSA Driver for MCP4802 DAC
+ *
+ * A hrtimer fires once per period, converts the period from S16 to the
+ * MCP4802 frames and queues it as one SPI message. Inside the message the
+ * updates are spaced with delay_usecs so the DAC is updated at the sample
+ * rate. Left channel goes to DAC A, right channel to DAC B.
+ */
+
+#include <linux/err.h>
+#include <linux/device.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/of.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+
+#include <sound/initval.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+
+#include <linux/spi/spi.h>
+
+#define MCP4802_RATE_MIN	8000
+#define MCP4802_RATE_MAX	48000
+#define MCP4802_PERIOD_BYTES_MAX	4096
+#define MCP4802_NB_MSG		2
+
+/* keep the burst a bit shorter than the period so messages never pile up */
+#define MCP4802_BURST_MARGIN	64	/* 1/64 of the period */
+
+static int index = SNDRV_DEFAULT_IDX1;
+module_param(index, int, 0444);
+MODULE_PARM_DESC(index, "Index value for soundcard.");
+
+struct mcp4802_msg {
+	struct spi_message		msg;
+	struct spi_transfer		*xfer;
+	u8				*tx;
+	unsigned int			nxfer;
+	struct snd_mcp4802		*chip;
+	atomic_t			busy;
+};
+
+struct snd_mcp4802 {
+	struct snd_card			*card;
+	struct snd_pcm			*pcm;
+	struct snd_pcm_substream	*substream;
+	struct spi_device		*spi;
+	struct hrtimer			timer;
+	ktime_t				period_time;
+	spinlock_t			lock;
+	int				running;
+	snd_pcm_uframes_t		hw_ptr;
+	unsigned int			next_msg;
+	unsigned int			underruns;
+	struct mcp4802_msg		msgs[MCP4802_NB_MSG];
+	wait_queue_head_t		idle;
+};
+
+/* MCP4802 frame : channel, 1x gain, active, 8 bits value left aligned on 12 */
+static inline void mcp4802_frame(u8 *tx, int chan, u8 value)
+{
+	tx[0] = 0x30 | ((chan & 1) << 7) | (value >> 4);
+	tx[1] = (value & 0xF) << 4;
+}
+
+static inline u8 s16_to_u8(s16 sample)
+{
+	return (u16)(sample + 32768) >> 8;
+}
+
+static struct snd_pcm_hardware snd_mcp4802_playback_hw = {
+	.info		= SNDRV_PCM_INFO_INTERLEAVED |
+			  SNDRV_PCM_INFO_BLOCK_TRANSFER |
+			  SNDRV_PCM_INFO_MMAP |
+			  SNDRV_PCM_INFO_MMAP_VALID,
+	.formats	= SNDRV_PCM_FMTBIT_S16_LE,
+	.rates		= SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_48000,
+	.rate_min	= MCP4802_RATE_MIN,
+	.rate_max	= MCP4802_RATE_MAX,
+	.channels_min	= 1,
+	.channels_max	= 2,
+	.buffer_bytes_max = 64 * 1024,
+	.period_bytes_min = 256,
+	.period_bytes_max = MCP4802_PERIOD_BYTES_MAX,
+	.periods_min	= 2,
+	.periods_max	= 256,
+};
+
+// =======================
+// SPI messages
+// =======================
+static void snd_mcp4802_msg_complete(void *context)
+{
+	struct mcp4802_msg *m = context;
+
+	if (m->msg.status)
+		dev_dbg(&m->chip->spi->dev, "spi message failed:%d\n", m->msg.status);
+	atomic_set(&m->busy, 0);
+	wake_up(&m->chip->idle);
+}
+
+static void snd_mcp4802_msg_free(struct snd_mcp4802 *chip)
+{
+	int i;
+
+	for (i = 0; i < MCP4802_NB_MSG; i++) {
+		kfree(chip->msgs[i].xfer);
+		kfree(chip->msgs[i].tx);
+		chip->msgs[i].xfer = NULL;
+		chip->msgs[i].tx = NULL;
+	}
+}
+
+/*
+ * Preallocate the messages for one period : two transfers per frame,
+ * chip select toggles between them to latch each DAC.
+ */
+static int snd_mcp4802_msg_alloc(struct snd_mcp4802 *chip, unsigned int frames)
+{
+	int i;
+	unsigned int j;
+
+	for (i = 0; i < MCP4802_NB_MSG; i++) {
+		struct mcp4802_msg *m = &chip->msgs[i];
+
+		m->nxfer = frames * 2;
+		m->xfer = kcalloc(m->nxfer, sizeof(*m->xfer), GFP_KERNEL);
+		m->tx = kcalloc(m->nxfer, 2, GFP_KERNEL);
+		if (!m->xfer || !m->tx) {
+			snd_mcp4802_msg_free(chip);
+			return -ENOMEM;
+		}
+
+		spi_message_init(&m->msg);
+		m->msg.complete = snd_mcp4802_msg_complete;
+		m->msg.context = m;
+		m->chip = chip;
+		atomic_set(&m->busy, 0);
+		for (j = 0; j < m->nxfer; j++) {
+			m->xfer[j].tx_buf = &m->tx[2 * j];
+			m->xfer[j].len = 2;
+			m->xfer[j].cs_change = (j != m->nxfer - 1);
+			spi_message_add_tail(&m->xfer[j], &m->msg);
+		}
+	}
+	return 0;
+}
+
+/* spread the sample period minus the wire time over the frames */
+static void snd_mcp4802_msg_pacing(struct snd_mcp4802 *chip, unsigned int rate)
+{
+	u32 speed = chip->spi->max_speed_hz;
+	u64 period_ns = div_u64(NSEC_PER_SEC, rate);
+	u64 wire_ns = div_u64(2 * 16 * (u64)NSEC_PER_SEC, speed);
+	s64 delay_ns;
+	s64 err = 0;
+	int i;
+	unsigned int j;
+
+	delay_ns = period_ns - wire_ns - div_u64(period_ns, MCP4802_BURST_MARGIN);
+	if (delay_ns < 0)
+		delay_ns = 0;
+
+	for (i = 0; i < MCP4802_NB_MSG; i++) {
+		struct mcp4802_msg *m = &chip->msgs[i];
+
+		for (j = 1; j < m->nxfer; j += 2) {
+			s64 d = delay_ns + err;
+
+			m->xfer[j].delay_usecs = div_s64(d, NSEC_PER_USEC);
+			err = d - (s64)m->xfer[j].delay_usecs * NSEC_PER_USEC;
+		}
+	}
+}
+
+/* convert one period from the ring buffer to DAC frames */
+static void snd_mcp4802_fill(struct snd_mcp4802 *chip, struct mcp4802_msg *m)
+{
+	struct snd_pcm_runtime *runtime = chip->substream->runtime;
+	const s16 *src = (const s16 *)runtime->dma_area
+			 + chip->hw_ptr * runtime->channels;
+	u8 *tx = m->tx;
+	snd_pcm_uframes_t i;
+
+	for (i = 0; i < runtime->period_size; i++) {
+		s16 left = src[0];
+		s16 right = (runtime->channels == 2) ? src[1] : src[0];
+
+		mcp4802_frame(tx, 0, s16_to_u8(left));
+		mcp4802_frame(tx + 2, 1, s16_to_u8(right));
+		tx += 4;
+		src += runtime->channels;
+	}
+}
+
+// =======================
+// timer callback
+// =======================
+static enum hrtimer_restart snd_mcp4802_timer_callback(struct hrtimer *timer)
+{
+	struct snd_mcp4802 *chip = container_of(timer, struct snd_mcp4802, timer);
+	struct snd_pcm_runtime *runtime;
+	struct mcp4802_msg *m;
+	int elapsed = 0;
+
+	spin_lock(&chip->lock);
+	if (!chip->running) {
+		spin_unlock(&chip->lock);
+		return HRTIMER_NORESTART;
+	}
+	runtime = chip->substream->runtime;
+
+	m = &chip->msgs[chip->next_msg];
+	if (atomic_read(&m->busy)) {
+		/* the bus did not follow, skip this tick */
+		chip->underruns++;
+	} else {
+		snd_mcp4802_fill(chip, m);
+		atomic_set(&m->busy, 1);
+		if (spi_async(chip->spi, &m->msg)) {
+			atomic_set(&m->busy, 0);
+			chip->underruns++;
+		} else {
+			chip->next_msg = (chip->next_msg + 1) % MCP4802_NB_MSG;
+			chip->hw_ptr += runtime->period_size;
+			if (chip->hw_ptr >= runtime->buffer_size)
+				chip->hw_ptr = 0;
+			elapsed = 1;
+		}
+	}
+	spin_unlock(&chip->lock);
+
+	if (elapsed)
+		snd_pcm_period_elapsed(chip->substream);
+
+	hrtimer_forward_now(timer, chip->period_time);
+	return HRTIMER_RESTART;
+}
+
+static void snd_mcp4802_wait_idle(struct snd_mcp4802 *chip)
+{
+	int i;
+
+	hrtimer_cancel(&chip->timer);
+	for (i = 0; i < MCP4802_NB_MSG; i++)
+		wait_event(chip->idle, !atomic_read(&chip->msgs[i].busy));
+}
+
+// =======================
+// PCM callbacks
+// =======================
+static int snd_mcp4802_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int err;
+
+	runtime->hw = snd_mcp4802_playback_hw;
+	err = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+	if (err < 0)
+		return err;
+	chip->substream = substream;
+
+	return 0;
+}
+
+static int snd_mcp4802_pcm_close(struct snd_pcm_substream *substream)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+
+	snd_mcp4802_wait_idle(chip);
+	chip->substream = NULL;
+	return 0;
+}
+
+static int snd_mcp4802_pcm_hw_params(struct snd_pcm_substream *substream,
+				     struct snd_pcm_hw_params *hw_params)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+	int err;
+
+	snd_mcp4802_wait_idle(chip);
+	snd_mcp4802_msg_free(chip);
+
+	err = snd_mcp4802_msg_alloc(chip, params_period_size(hw_params));
+	if (err < 0)
+		return err;
+	snd_mcp4802_msg_pacing(chip, params_rate(hw_params));
+
+	return snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(hw_params));
+}
+
+static int snd_mcp4802_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+
+	snd_mcp4802_wait_idle(chip);
+	snd_mcp4802_msg_free(chip);
+	return snd_pcm_lib_free_pages(substream);
+}
+
+static int snd_mcp4802_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	snd_mcp4802_wait_idle(chip);
+	chip->hw_ptr = 0;
+	chip->next_msg = 0;
+	chip->period_time = ns_to_ktime(div_u64((u64)runtime->period_size * NSEC_PER_SEC,
+						runtime->rate));
+	return 0;
+}
+
+static int snd_mcp4802_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+	int retval = 0;
+
+	spin_lock(&chip->lock);
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		chip->running = 1;
+		hrtimer_start(&chip->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+		chip->running = 0;
+		hrtimer_try_to_cancel(&chip->timer);
+		break;
+	default:
+		dev_dbg(&chip->spi->dev, "spurious command %x\n", cmd);
+		retval = -EINVAL;
+		break;
+	}
+
+	spin_unlock(&chip->lock);
+
+	return retval;
+}
+
+static snd_pcm_uframes_t snd_mcp4802_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct snd_mcp4802 *chip = snd_pcm_substream_chip(substream);
+
+	return chip->hw_ptr;
+}
+
+static struct snd_pcm_ops snd_mcp4802_playback_ops = {
+	.open		= snd_mcp4802_pcm_open,
+	.close		= snd_mcp4802_pcm_close,
+	.ioctl		= snd_pcm_lib_ioctl,
+	.hw_params	= snd_mcp4802_pcm_hw_params,
+	.hw_free	= snd_mcp4802_pcm_hw_free,
+	.prepare	= snd_mcp4802_pcm_prepare,
+	.trigger	= snd_mcp4802_pcm_trigger,
+	.pointer	= snd_mcp4802_pcm_pointer,
+};
+// =======================
+
+static int snd_mcp4802_pcm_new(struct snd_mcp4802 *chip, int device)
+{
+	struct snd_pcm *pcm;
+	int retval;
+
+	retval = snd_pcm_new(chip->card, chip->card->shortname, device, 1, 0, &pcm);
+	if (retval < 0)
+		goto out;
+
+	pcm->private_data = chip;
+	pcm->info_flags = SNDRV_PCM_INFO_BLOCK_TRANSFER;
+	strcpy(pcm->name, "mcp4802");
+	chip->pcm = pcm;
+
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_mcp4802_playback_ops);
+
+	retval = snd_pcm_lib_preallocate_pages_for_all(chip->pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+			snd_dma_continuous_data(GFP_KERNEL), 64 * 1024, 64 * 1024);
+out:
+	return retval;
+}
+
+static int snd_mcp4802_dev_free(struct snd_device *device)
+{
+	struct snd_mcp4802 *chip = device->device_data;
+
+	snd_mcp4802_wait_idle(chip);
+	snd_mcp4802_msg_free(chip);
+	if (chip->underruns)
+		dev_info(&chip->spi->dev, "mcp4802: %u periods skipped\n", chip->underruns);
+	return 0;
+}
+
+static int snd_mcp4802_dev_init(struct snd_card *card, struct spi_device *spi)
+{
+	static struct snd_device_ops ops = {
+		.dev_free	= snd_mcp4802_dev_free,
+	};
+	struct snd_mcp4802 *chip = card->private_data;
+	int retval;
+
+	spin_lock_init(&chip->lock);
+	init_waitqueue_head(&chip->idle);
+	hrtimer_init(&chip->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	chip->timer.function = snd_mcp4802_timer_callback;
+	chip->card = card;
+	chip->spi = spi;
+
+	retval = snd_mcp4802_pcm_new(chip, 0);
+	if (retval) {
+		printk("snd_mcp4802_pcm_new failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
+	if (retval) {
+		printk("snd_device_new failed:%d\n", retval);
+		goto out;
+	}
+out:
+	return retval;
+}
+
+static int snd_mcp4802_probe(struct spi_device *spi)
+{
+	struct snd_card			*card;
+	int				retval;
+
+	spi->bits_per_word = 8;
+	spi->mode = SPI_MODE_0;
+	retval = spi_setup(spi);
+	if (retval < 0) {
+		printk("spi_setup failed:%d\n", retval);
+		goto out;
+	}
+
+	retval = snd_card_new(&spi->dev, index, KBUILD_MODNAME, THIS_MODULE,
+			      sizeof(struct snd_mcp4802), &card);
+	if (retval < 0) {
+		printk("snd_card_new failed:%d\n", retval);
+		goto out;
+	}
+
+	strcpy(card->driver, KBUILD_MODNAME);
+	strcpy(card->shortname, KBUILD_MODNAME);
+	snprintf(card->longname, sizeof(card->longname), "%s at %s",
+		 KBUILD_MODNAME, dev_name(&spi->dev));
+
+	retval = snd_mcp4802_dev_init(card, spi);
+	if (retval) {
+		printk("snd_mcp4802_dev_init failed:%d\n", retval);
+		goto out_card;
+	}
+
+	retval = snd_card_register(card);
+	if (retval) {
+		printk("snd_card_register failed:%d\n", retval);
+		goto out_card;
+	}
+
+	spi_set_drvdata(spi, card);
+	goto out;
+
+out_card:
+	snd_card_free(card);
+out:
+	return retval;
+}
+
+static int snd_mcp4802_remove(struct spi_device *spi)
+{
+	struct snd_card *card = spi_get_drvdata(spi);
+
+	snd_card_free(card);
+	spi_set_drvdata(spi, NULL);
+
+	return 0;
+}
+
+static const struct of_device_id mcp4802_of_match[] = {
+	{ .compatible = "microchip,mcp4802" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, mcp4802_of_match);
+
+static const struct spi_device_id mcp4802_id[] = {
+	{ "mcp4802", 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(spi, mcp4802_id);
+
+static struct spi_driver mcp4802_driver = {
+	.driver		= {
+		.name	= "mcp4802",
+		.owner  = THIS_MODULE,
+		.of_match_table = of_match_ptr(mcp4802_of_match),
+	},
+	.probe		= snd_mcp4802_probe,
+	.remove		= snd_mcp4802_remove,
+	.id_table	= mcp4802_id,
+};
+module_spi_driver(mcp4802_driver);
+
+MODULE_AUTHOR("MPR");
+MODULE_DESCRIPTION("Sound driver for MCP4802");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,361 @@
+/*
+ * Simulated SPI controller with MCP3002 devices
+ *
+ * Registers a SPI controller backed by no hardware and one "mcp3002" device
+ * per chip select, so spi-mcp3002 binds and captures as on the real bus. The
+ * devices follow the MCP3002 bit protocol : the start bit, SGL/DIFF, ODD/SIGN
+ * and MSBF select the conversion, then a null bit and the 10 bits code are
+ * shifted out (and the LSB first copy when MSBF is 0). Chip select frames the
+ * conversions, a transfer without cs_change keeps the same conversion.
+ *
+ * The codes come from the deterministic waveforms of sim-dev.h, indexed by
+ * the conversions of each channel. The wire time (speed_hz) and delay_usecs
+ * are waited for so the capture runs at the rate the driver asks.
+ *
+ * The bus traffic is counted in the attributes of the platform device
+ * (/sys/devices/platform/spi-sim) : messages, transfers, conversions, bytes,
+ * writing reset clears them.
+ */
+
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/platform_device.h>
+
+#include <linux/spi/spi.h>
+
+#include "sim-dev.h"
+
+#define SPI_SIM_MAX_CS		2
+#define MCP3002_BITS		10
+
+static int bus_num = -1;
+module_param(bus_num, int, 0444);
+MODULE_PARM_DESC(bus_num, "SPI bus number, -1 for a dynamic one.");
+
+static int chips = 1;
+module_param(chips, int, 0444);
+MODULE_PARM_DESC(chips, "MCP3002 devices on the bus (1-2).");
+
+static int speed_hz = 1000000;
+module_param(speed_hz, int, 0444);
+MODULE_PARM_DESC(speed_hz, "Maximum clock of the devices in Hz.");
+
+static char *wave = "sine";
+module_param(wave, charp, 0444);
+MODULE_PARM_DESC(wave, "Waveform : sine, ramp, square or noise.");
+
+static int wave_period = 64;
+module_param(wave_period, int, 0444);
+MODULE_PARM_DESC(wave_period, "Waveform period in conversions, doubled at each channel.");
+
+static int amplitude = 90;
+module_param(amplitude, int, 0444);
+MODULE_PARM_DESC(amplitude, "Waveform amplitude in percent of the full scale.");
+
+static int timing = 1;
+module_param(timing, int, 0444);
+MODULE_PARM_DESC(timing, "Wait for the wire time and the delays (0 runs the bus at CPU speed).");
+
+static int sleep_min = 50;
+module_param(sleep_min, int, 0444);
+MODULE_PARM_DESC(sleep_min, "Shortest wait in us that sleeps instead of spinning.");
+
+enum mcp3002_phase {
+	MCP3002_IDLE,		/* waiting for the start bit */
+	MCP3002_CMD,		/* SGL/DIFF, ODD/SIGN, MSBF */
+	MCP3002_DATA,		/* null bit, the code, then zeros */
+};
+
+struct spi_sim_chip {
+	enum mcp3002_phase	phase;
+	unsigned int		bit;	/* in the phase */
+	u8			cmd;
+	u16			code;
+	u64			index[2];	/* conversions of each channel */
+};
+
+struct spi_sim {
+	struct spi_master	*master;
+	struct spi_device	*spi[SPI_SIM_MAX_CS];
+	struct spi_sim_chip	chip[SPI_SIM_MAX_CS];
+	struct sim_wave		wave;
+};
+
+struct spi_sim_stats {
+	atomic64_t		messages;
+	atomic64_t		transfers;
+	atomic64_t		conversions;
+	atomic64_t		bytes;
+};
+
+static struct platform_device *spi_sim_pdev;
+static struct spi_master *spi_sim_master;
+static struct spi_sim_stats spi_sim_stats;
+
+// =======================
+// MCP3002
+// =======================
+static void spi_sim_mcp3002_convert(struct spi_sim *s, struct spi_sim_chip *c)
+{
+	int sgl = c->cmd & 4;
+	int odd = (c->cmd >> 1) & 1;
+	s32 in0, in1;
+
+	if (sgl) {
+		c->code = sim_wave_code(&s->wave, odd, c->index[odd]++, MCP3002_BITS);
+	} else {
+		/* pseudo-differential, IN+ below IN- reads 0 */
+		in0 = sim_wave_code(&s->wave, 0, c->index[0]++, MCP3002_BITS);
+		in1 = sim_wave_code(&s->wave, 1, c->index[1]++, MCP3002_BITS);
+		c->code = clamp_t(s32, odd ? in1 - in0 : in0 - in1, 0, (1 << MCP3002_BITS) - 1);
+	}
+	atomic64_inc(&spi_sim_stats.conversions);
+}
+
+/* one clock, DIN sampled and DOUT returned */
+static int spi_sim_mcp3002_clock(struct spi_sim *s, struct spi_sim_chip *c, int din)
+{
+	int msbf;
+	int n;
+
+	switch (c->phase) {
+	case MCP3002_IDLE:
+		if (din) {
+			c->phase = MCP3002_CMD;
+			c->bit = 0;
+			c->cmd = 0;
+		}
+		return 0;
+	case MCP3002_CMD:
+		c->cmd = (c->cmd << 1) | din;
+		if (++c->bit == 3) {
+			spi_sim_mcp3002_convert(s, c);
+			c->phase = MCP3002_DATA;
+			c->bit = 0;
+		}
+		return 0;
+	default:
+		msbf = c->cmd & 1;
+		n = c->bit++;
+		if (n == 0)
+			return 0;	/* null bit */
+		if (n <= MCP3002_BITS)
+			return (c->code >> (MCP3002_BITS - n)) & 1;
+		if (!msbf && n < 2 * MCP3002_BITS)
+			return (c->code >> (n - MCP3002_BITS)) & 1;
+		return 0;
+	}
+}
+
+static void spi_sim_mcp3002_xfer(struct spi_sim *s, struct spi_sim_chip *c, struct spi_transfer *x)
+{
+	const u8 *tx = x->tx_buf;
+	u8 *rx = x->rx_buf;
+	unsigned int i;
+	int b;
+
+	for (i = 0; i < x->len; i++) {
+		u8 in = tx ? tx[i] : 0;
+		u8 out = 0;
+
+		for (b = 7; b >= 0; b--)
+			out |= spi_sim_mcp3002_clock(s, c, (in >> b) & 1) << b;
+		if (rx)
+			rx[i] = out;
+	}
+}
+
+static void spi_sim_deselect(struct spi_sim_chip *c)
+{
+	c->phase = MCP3002_IDLE;
+}
+
+// =======================
+// controller
+// =======================
+static int spi_sim_transfer_one_message(struct spi_master *master, struct spi_message *msg)
+{
+	struct spi_sim *s = spi_master_get_devdata(master);
+	struct spi_sim_chip *c = &s->chip[msg->spi->chip_select];
+	struct spi_transfer *x;
+	ktime_t t = ktime_get();
+	unsigned int hz;
+
+	list_for_each_entry(x, &msg->transfers, transfer_list) {
+		hz = x->speed_hz ? x->speed_hz : msg->spi->max_speed_hz;
+
+		spi_sim_mcp3002_xfer(s, c, x);
+		if (x->cs_change || list_is_last(&x->transfer_list, &msg->transfers))
+			spi_sim_deselect(c);
+
+		t = ktime_add_ns(t, sim_wire_ns(x->len * 8, hz) + (u64)x->delay_usecs * NSEC_PER_USEC);
+		if (timing)
+			sim_wait_until(t, sleep_min);
+
+		msg->actual_length += x->len;
+		atomic64_inc(&spi_sim_stats.transfers);
+		atomic64_add(x->len, &spi_sim_stats.bytes);
+	}
+	atomic64_inc(&spi_sim_stats.messages);
+
+	msg->status = 0;
+	spi_finalize_current_message(master);
+	return 0;
+}
+
+static int spi_sim_setup(struct spi_device *spi)
+{
+	if (spi->bits_per_word != 8)
+		return -EINVAL;
+	return 0;
+}
+
+// =======================
+// counters
+// =======================
+SIM_COUNTER_ATTR(spi_sim_stats, messages);
+SIM_COUNTER_ATTR(spi_sim_stats, transfers);
+SIM_COUNTER_ATTR(spi_sim_stats, conversions);
+SIM_COUNTER_ATTR(spi_sim_stats, bytes);
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	atomic64_set(&spi_sim_stats.messages, 0);
+	atomic64_set(&spi_sim_stats.transfers, 0);
+	atomic64_set(&spi_sim_stats.conversions, 0);
+	atomic64_set(&spi_sim_stats.bytes, 0);
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *spi_sim_attrs[] = {
+	&dev_attr_messages.attr,
+	&dev_attr_transfers.attr,
+	&dev_attr_conversions.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_reset.attr,
+	NULL
+};
+
+static const struct attribute_group spi_sim_group = {
+	.attrs = spi_sim_attrs,
+};
+
+// =======================
+// module
+// =======================
+static int __init spi_sim_init(void)
+{
+	struct spi_master *master;
+	struct spi_sim *s;
+	int retval;
+	int cs;
+
+	printk("spi_sim_init\n");
+	if (chips < 1 || chips > SPI_SIM_MAX_CS || speed_hz <= 0)
+		return -EINVAL;
+
+	spi_sim_pdev = platform_device_register_simple("spi-sim", -1, NULL, 0);
+	if (IS_ERR(spi_sim_pdev))
+	{
+		retval = PTR_ERR(spi_sim_pdev);
+		printk("platform_device_register_simple failed:%d\n", retval);
+		goto out;
+	}
+
+	master = spi_alloc_master(&spi_sim_pdev->dev, sizeof(struct spi_sim));
+	if (!master)
+	{
+		retval = -ENOMEM;
+		printk("spi_alloc_master failed:%d\n", retval);
+		goto out_pdev;
+	}
+	s = spi_master_get_devdata(master);
+	s->master = master;
+	retval = sim_wave_parse(&s->wave, wave, wave_period, amplitude);
+	if (retval)
+	{
+		printk("sim_wave_parse failed:%d\n", retval);
+		spi_master_put(master);
+		goto out_pdev;
+	}
+
+	master->bus_num = bus_num;
+	master->num_chipselect = SPI_SIM_MAX_CS;
+	master->mode_bits = SPI_CPOL | SPI_CPHA;
+	master->bits_per_word_mask = SPI_BPW_MASK(8);
+	master->max_speed_hz = speed_hz;
+	master->setup = spi_sim_setup;
+	master->transfer_one_message = spi_sim_transfer_one_message;
+
+	retval = spi_register_master(master);
+	if (retval)
+	{
+		printk("spi_register_master failed:%d\n", retval);
+		spi_master_put(master);
+		goto out_pdev;
+	}
+	spi_sim_master = master;
+
+	retval = sysfs_create_group(&spi_sim_pdev->dev.kobj, &spi_sim_group);
+	if (retval)
+	{
+		printk("sysfs_create_group failed:%d\n", retval);
+		goto out_master;
+	}
+
+	for (cs = 0; cs < chips; cs++) {
+		struct spi_board_info info = {
+			.modalias	= "mcp3002",
+			.max_speed_hz	= speed_hz,
+			.chip_select	= cs,
+			.mode		= SPI_MODE_0,
+		};
+
+		s->spi[cs] = spi_new_device(master, &info);
+		if (!s->spi[cs])
+		{
+			retval = -ENODEV;
+			printk("spi_new_device failed:%d\n", retval);
+			goto out_devices;
+		}
+		printk("spi_sim %s mcp3002 %s %d conversions/period\n", dev_name(&s->spi[cs]->dev),
+		       wave, wave_period);
+	}
+	goto out;
+
+out_devices:
+	while (--cs >= 0)
+		spi_unregister_device(s->spi[cs]);
+	sysfs_remove_group(&spi_sim_pdev->dev.kobj, &spi_sim_group);
+out_master:
+	spi_unregister_master(master);
+out_pdev:
+	platform_device_unregister(spi_sim_pdev);
+out:
+	return retval;
+}
+module_init(spi_sim_init);
+
+static void __exit spi_sim_exit(void)
+{
+	struct spi_sim *s = spi_master_get_devdata(spi_sim_master);
+	int cs;
+
+	printk("spi_sim_exit\n");
+	for (cs = 0; cs < chips; cs++)
+		spi_unregister_device(s->spi[cs]);
+	sysfs_remove_group(&spi_sim_pdev->dev.kobj, &spi_sim_group);
+	spi_unregister_master(spi_sim_master);
+	platform_device_unregister(spi_sim_pdev);
+}
+module_exit(spi_sim_exit);
+
+MODULE_AUTHOR("MPR");
+MODULE_DESCRIPTION("Simulated SPI controller with MCP3002 devices");
+MODULE_LICENSE("GPL");
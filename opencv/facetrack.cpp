@@ -0,0 +1,463 @@
+/*
+ * Face tracking pipeline
+ *
+ *  capture thread -> [bounded queue] -> detection thread -> [bounded queue] -> main thread (draw, display, statistics)
+ *
+ * The Haar cascade runs on the whole (downscaled) frame only every N frames or
+ * when nothing is tracked, in between each face is searched in a window around
+ * its last position at its own scale, which costs a fraction of a full scan.
+ *
+ * Frames live in a fixed pool of slots going round the queues, the grayscale
+ * and downscaled images are allocated once, so nothing is allocated per frame.
+ * With a camera the capture drops frames when the pool is exhausted to keep the
+ * latency bounded, with a video file it waits so that every frame is processed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<bool> quit(false);
+
+static void sighandler(int sig)
+{
+	quit = true;
+}
+
+static double ms(Clock::duration d)
+{
+	return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// =======================================================================
+// bounded queue
+// =======================================================================
+template <typename T> class BoundedQueue
+{
+	public:
+		BoundedQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {}
+
+		// wait for room, false once closed
+		bool push(const T & item)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notFull.wait(lock, [this] { return m_queue.size() < m_capacity || m_closed; });
+			if (m_closed)
+				return false;
+			m_queue.push_back(item);
+			m_notEmpty.notify_one();
+			return true;
+		}
+
+		// wait for an item, false once closed and drained
+		bool pop(T & item)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notEmpty.wait(lock, [this] { return !m_queue.empty() || m_closed; });
+			if (m_queue.empty())
+				return false;
+			item = m_queue.front();
+			m_queue.pop_front();
+			m_notFull.notify_one();
+			return true;
+		}
+
+		bool tryPop(T & item)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_queue.empty())
+				return false;
+			item = m_queue.front();
+			m_queue.pop_front();
+			m_notFull.notify_one();
+			return true;
+		}
+
+		void close()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_closed = true;
+			m_notEmpty.notify_all();
+			m_notFull.notify_all();
+		}
+
+	private:
+		size_t m_capacity;
+		bool m_closed;
+		std::deque<T> m_queue;
+		std::mutex m_mutex;
+		std::condition_variable m_notEmpty;
+		std::condition_variable m_notFull;
+};
+
+// =======================================================================
+// frame slots
+// =======================================================================
+struct Slot
+{
+	cv::Mat frame;
+	unsigned long index;
+	Clock::time_point captured;
+	Clock::time_point processed;
+	bool fullDetection;
+	double detectMs;
+	std::vector<cv::Rect> faces;
+};
+
+// =======================================================================
+// tracker
+// =======================================================================
+struct Track
+{
+	cv::Rect rect;
+	int missed;
+};
+
+class FaceTracker
+{
+	public:
+		FaceTracker(cv::CascadeClassifier & cascade, int detectPeriod, int downscale)
+			: m_cascade(cascade), m_detectPeriod(detectPeriod), m_downscale(downscale), m_frames(0) {}
+
+		// returns true when the full frame was scanned
+		bool process(const cv::Mat & frame, std::vector<cv::Rect> & faces)
+		{
+			bool full = (m_frames++ % m_detectPeriod == 0) || m_tracks.empty();
+
+			// buffers keep their allocation while the frame size does not change
+			cv::cvtColor(frame, m_gray, cv::COLOR_BGR2GRAY);
+			cv::equalizeHist(m_gray, m_gray);
+
+			if (full)
+				detect();
+			else
+				track();
+
+			faces.clear();
+			for (size_t i = 0; i < m_tracks.size(); i++)
+				faces.push_back(m_tracks[i].rect);
+			return full;
+		}
+
+	private:
+		void detect()
+		{
+			std::vector<cv::Rect> found;
+
+			cv::resize(m_gray, m_small, cv::Size(m_gray.cols / m_downscale, m_gray.rows / m_downscale), 0, 0, cv::INTER_AREA);
+			m_cascade.detectMultiScale(m_small, found, 1.2, 2, 0, cv::Size(20, 20));
+
+			m_tracks.clear();
+			for (size_t i = 0; i < found.size(); i++)
+			{
+				Track t;
+				t.rect = cv::Rect(found[i].x * m_downscale, found[i].y * m_downscale, found[i].width * m_downscale, found[i].height * m_downscale);
+				t.missed = 0;
+				m_tracks.push_back(t);
+			}
+		}
+
+		// search each face around its last position, at sizes close to its own
+		void track()
+		{
+			cv::Rect bounds(0, 0, m_gray.cols, m_gray.rows);
+
+			for (size_t i = 0; i < m_tracks.size(); i++)
+			{
+				Track & t = m_tracks[i];
+				cv::Rect window(t.rect.x - t.rect.width / 2, t.rect.y - t.rect.height / 2, t.rect.width * 2, t.rect.height * 2);
+				std::vector<cv::Rect> found;
+
+				window &= bounds;
+				if (window.area() == 0)
+				{
+					t.missed = MAX_MISSED;
+					continue;
+				}
+				cv::Mat roi = m_gray(window);
+				m_cascade.detectMultiScale(roi, found, 1.1, 2, 0,
+					cv::Size(t.rect.width * 3 / 4, t.rect.height * 3 / 4),
+					cv::Size(t.rect.width * 5 / 4 + 1, t.rect.height * 5 / 4 + 1));
+				if (found.empty())
+				{
+					t.missed++;
+					continue;
+				}
+				// the closest candidate to the previous position
+				cv::Point center(t.rect.x + t.rect.width / 2 - window.x, t.rect.y + t.rect.height / 2 - window.y);
+				size_t best = 0;
+				int bestDistance = -1;
+				for (size_t j = 0; j < found.size(); j++)
+				{
+					int dx = found[j].x + found[j].width / 2 - center.x;
+					int dy = found[j].y + found[j].height / 2 - center.y;
+					if (bestDistance < 0 || dx * dx + dy * dy < bestDistance)
+					{
+						best = j;
+						bestDistance = dx * dx + dy * dy;
+					}
+				}
+				t.rect = found[best] + window.tl();
+				t.missed = 0;
+			}
+
+			// forget the lost faces and the tracks that converged on the same face
+			std::vector<Track> kept;
+			for (size_t i = 0; i < m_tracks.size(); i++)
+			{
+				bool duplicate = false;
+				if (m_tracks[i].missed >= MAX_MISSED)
+					continue;
+				for (size_t j = 0; j < kept.size() && !duplicate; j++)
+					duplicate = (m_tracks[i].rect & kept[j].rect).area() * 2 > m_tracks[i].rect.area();
+				if (!duplicate)
+					kept.push_back(m_tracks[i]);
+			}
+			m_tracks.swap(kept);
+		}
+
+		static const int MAX_MISSED = 3;
+
+		cv::CascadeClassifier & m_cascade;
+		int m_detectPeriod;
+		int m_downscale;
+		unsigned long m_frames;
+		cv::Mat m_gray;
+		cv::Mat m_small;
+		std::vector<Track> m_tracks;
+};
+
+// =======================================================================
+// statistics
+// =======================================================================
+class Stats
+{
+	public:
+		Stats() : m_frames(0), m_full(0), m_fullMs(0), m_trackMs(0) {}
+
+		void add(const Slot & slot)
+		{
+			m_latency.push_back(ms(slot.processed - slot.captured));
+			m_frames++;
+			if (slot.fullDetection)
+			{
+				m_full++;
+				m_fullMs += slot.detectMs;
+			}
+			else
+			{
+				m_trackMs += slot.detectMs;
+			}
+		}
+
+		void print(FILE *out, double seconds, unsigned long dropped)
+		{
+			std::vector<double> latency(m_latency);
+			std::sort(latency.begin(), latency.end());
+			fprintf(out, "frames:%lu fps:%.1f dropped:%lu full detections:%lu (%.1f ms) tracking:%.1f ms",
+				m_frames, m_frames / seconds, dropped, m_full,
+				m_full ? m_fullMs / m_full : 0, m_frames > m_full ? m_trackMs / (m_frames - m_full) : 0);
+			if (!latency.empty())
+				fprintf(out, " latency p50:%.1f p99:%.1f max:%.1f ms",
+					latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back());
+			fprintf(out, "\n");
+		}
+
+		void reset()
+		{
+			*this = Stats();
+		}
+
+	private:
+		unsigned long m_frames;
+		unsigned long m_full;
+		double m_fullMs;
+		double m_trackMs;
+		std::vector<double> m_latency;
+};
+
+// =======================================================================
+// main
+// =======================================================================
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c cascade] [-n period] [-d downscale] [-q slots] [-W width] [-H height] [-m] [-x] [-s seconds] [input]\n"
+			"\t-n : full detection every given frames (default 10)\n"
+			"\t-d : downscale factor of the full detection (default 1)\n"
+			"\t-q : frames in flight between the stages (default 4)\n"
+			"\t-m : mirror\n"
+			"\t-x : display\n"
+			"\tinput : camera number (default 0) or video file\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	std::string cascadeFile = "haarcascade_frontalface_default.xml";
+	int detectPeriod = 10;
+	int downscale = 1;
+	int slots = 4;
+	int width = 320, height = 200;
+	bool mirror = false;
+	bool display = false;
+	int period = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:d:q:W:H:mxs:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': cascadeFile = optarg; break;
+			case 'n': detectPeriod = atoi(optarg); break;
+			case 'd': downscale = atoi(optarg); break;
+			case 'q': slots = atoi(optarg); break;
+			case 'W': width = atoi(optarg); break;
+			case 'H': height = atoi(optarg); break;
+			case 'm': mirror = true; break;
+			case 'x': display = true; break;
+			case 's': period = atoi(optarg); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (detectPeriod < 1 || downscale < 1 || slots < 2)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	std::string input = (optind < argc) ? argv[optind] : "0";
+	bool camera = !input.empty() && strspn(input.c_str(), "0123456789") == input.size();
+	cv::VideoCapture capture;
+	if (camera)
+	{
+		capture.open(atoi(input.c_str()));
+		capture.set(cv::CAP_PROP_FRAME_WIDTH, width);
+		capture.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+	}
+	else
+	{
+		capture.open(input);
+	}
+	if (!capture.isOpened())
+	{
+		fprintf(stderr, "Error opening %s\n", input.c_str());
+		return -1;
+	}
+
+	cv::CascadeClassifier cascade;
+	if (!cascade.load(cascadeFile))
+	{
+		fprintf(stderr, "Error loading %s\n", cascadeFile.c_str());
+		return -1;
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	std::vector<Slot> pool(slots);
+	BoundedQueue<Slot *> freeSlots(slots);
+	BoundedQueue<Slot *> toDetect(slots);
+	BoundedQueue<Slot *> toDisplay(slots);
+	std::atomic<unsigned long> dropped(0);
+	for (int i = 0; i < slots; i++)
+		freeSlots.push(&pool[i]);
+
+	std::thread captureThread([&]
+	{
+		cv::Mat scratch;
+		unsigned long index = 0;
+		while (!quit)
+		{
+			Slot *slot = NULL;
+			// a camera keeps running when the pipeline is behind, the frame is dropped
+			if (camera ? !freeSlots.tryPop(slot) : !freeSlots.pop(slot))
+			{
+				if (!camera || !capture.read(scratch))
+					break;
+				dropped++;
+				continue;
+			}
+			if (!capture.read(slot->frame) || slot->frame.empty())
+				break;
+			slot->captured = Clock::now();
+			slot->index = index++;
+			if (mirror)
+				cv::flip(slot->frame, slot->frame, 1);
+			if (!toDetect.push(slot))
+				break;
+		}
+		toDetect.close();
+	});
+
+	std::thread detectThread([&]
+	{
+		FaceTracker tracker(cascade, detectPeriod, downscale);
+		Slot *slot;
+		while (toDetect.pop(slot))
+		{
+			Clock::time_point start = Clock::now();
+			slot->fullDetection = tracker.process(slot->frame, slot->faces);
+			slot->processed = Clock::now();
+			slot->detectMs = ms(slot->processed - start);
+			if (!toDisplay.push(slot))
+				break;
+		}
+		toDisplay.close();
+	});
+
+	Stats total, current;
+	Clock::time_point start = Clock::now(), report = start;
+	Slot *slot;
+	while (toDisplay.pop(slot))
+	{
+		total.add(*slot);
+		current.add(*slot);
+		if (display)
+		{
+			for (size_t i = 0; i < slot->faces.size(); i++)
+			{
+				const cv::Rect & r = slot->faces[i];
+				cv::circle(slot->frame, cv::Point(r.x + r.width / 2, r.y + r.height / 2), (r.width + r.height) / 4,
+					slot->fullDetection ? cv::Scalar(128, 255, 128) : cv::Scalar(128, 128, 255), 2, 8, 0);
+			}
+			cv::imshow("facetrack", slot->frame);
+			if (cv::waitKey(1) == 0x1b)
+				quit = true;
+		}
+		freeSlots.push(slot);
+
+		Clock::time_point now = Clock::now();
+		if (period && now - report >= std::chrono::seconds(period))
+		{
+			current.print(stderr, ms(now - report) / 1000, dropped);
+			current.reset();
+			report = now;
+		}
+		if (quit)
+			break;
+	}
+
+	quit = true;
+	freeSlots.close();
+	toDetect.close();
+	toDisplay.close();
+	captureThread.join();
+	detectThread.join();
+
+	total.print(stdout, ms(Clock::now() - start) / 1000, dropped);
+	return 0;
+}